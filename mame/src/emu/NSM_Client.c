@@ -12,6 +12,7 @@
 #include "NSM_Client.h"
 
 #include "NSM_Server.h"
+#include "NSM_Delta.h"
 
 #include <assert.h>
 #include <cstdio>
@@ -27,12 +28,10 @@
 #include "osdcore.h"
 
 Client *netClient=NULL;
-Client client;
 
 Client *createGlobalClient(string _username)
 {
-    client = Client(_username);
-    netClient = &client;
+    netClient = global_alloc(Client(_username));
     return netClient;
 }
 
@@ -41,15 +40,11 @@ void deleteGlobalClient()
     if(netClient) 
     {
 	    netClient->shutdown();
+	    global_free(netClient);
     }
     netClient = NULL;
 }
 
-extern unsigned char *compressedBuffer;
-extern int compressedBufferSize;
-extern unsigned char *uncompressedBuffer;
-extern int uncompressedBufferSize;
-
 bool hasCompleteResync = false;
 
 
@@ -57,10 +52,17 @@ Client::Client(string _username)
     :
     Common(_username)
 {
-    initialSyncBuffer.reserve(1024*1024);
+    initialSyncNextChunk=0;
+    initialSyncChecksum=0;
+    initialSyncHasCheckpoint=false;
+    syncCheckSecond=-1;
+    syncHashesSecond=-1;
+    hasSyncHashes=false;
+    staleSecond=-1;
 
     rakInterface = RakNet::RakPeerInterface::GetInstance();
     rakInterface->AllowConnectionResponseIPMigration(false);
+    attachInputNotifier();
 
     /* allocate deflate state */
     strm.zalloc = Z_NULL;
@@ -70,16 +72,43 @@ Client::Client(string _username)
     initComplete=false;
     firstResync=true;
 
-    syncPtr = compressedBuffer;
-
     selfPeerID = 0;
+
+    relay=false;
+    announcedRelay=false;
+    staleVerified=false;
+
+    replaying=false;
+    hasReplayKeyframe=false;
+    replayEnded=false;
+}
+
+void Client::setSpectator(bool _relay)
+{
+    spectating=true;
+    relay=_relay;
+    if(relay)
+    {
+        //Our own spectators start from our checkpoints
+        inputHistory.enable();
+    }
 }
 
 void Client::shutdown()
 {
+    stopRecording();
+    stopMetricsExport();
+    cancelInitialSyncs();
+    replay.close();
+    replaying=false;
+
+    stopNetworkThread();
+
     // Be nice and let the server know we quit.
     rakInterface->Shutdown(300);
 
+    detachInputNotifier();
+
     // We're done with the network
     RakNet::RakPeerInterface::DestroyInstance(rakInterface);
 }
@@ -94,6 +123,7 @@ MemoryBlock Client::createMemoryBlock(int size)
     blocks.push_back(MemoryBlock(size));
     staleBlocks.push_back(MemoryBlock(size));
     syncCheckBlocks.push_back(MemoryBlock(size));
+    if(dirtyPages) dirtyPages->addBlock(blocks.back().data,size);
     return blocks.back();
 }
 
@@ -128,6 +158,7 @@ vector<MemoryBlock> Client::createMemoryBlock(unsigned char *ptr,int size)
     blocks.push_back(MemoryBlock(ptr,size));
     staleBlocks.push_back(MemoryBlock(size));
     syncCheckBlocks.push_back(MemoryBlock(size));
+    if(dirtyPages) dirtyPages->addBlock(ptr,size);
     retval.push_back(blocks.back());
     return retval;
 }
@@ -188,7 +219,9 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
     RakNet::SocketDescriptor socketDescriptor(0,0);
     socketDescriptor.port = selfPort;
     printf("Client running on port %d\n",selfPort);
-    RakNet::StartupResult retval = rakInterface->Startup(8,&socketDescriptor,1);
+    //A relay needs room for its spectators and the ones it sends on
+    int maxConnections = relay?max(8,spectatorFeed.getMaxSpectators()+8):8;
+    RakNet::StartupResult retval = rakInterface->Startup(maxConnections,&socketDescriptor,1);
     rakInterface->SetMaximumIncomingConnections(512);
     rakInterface->SetIncomingPassword("MAME",(int)strlen("MAME"));
     rakInterface->SetTimeoutTime(30000,RakNet::UNASSIGNED_SYSTEM_ADDRESS);
@@ -201,8 +234,6 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
         return false;
     }
 
-    peerInputs[1] = vector<string>();
-
     RakNet::SystemAddress sa = ConnectBlocking(hostname,port);
     if(sa==RakNet::UNASSIGNED_SYSTEM_ADDRESS)
     {
@@ -210,18 +241,20 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
         return false;
     }
 
-    {
-        char buf[4096];
-        buf[0] = ID_CLIENT_INFO;
-        strcpy(buf+1,username.c_str());
-        rakInterface->Send(buf,1+username.length()+1,HIGH_PRIORITY,RELIABLE_ORDERED,0,sa,false);
-    }
+    sendClientInfo(sa);
 
-    peerIDs[rakInterface->GetGuidFromSystemAddress(sa)] = 1;
+    //Spectators learn who plays from the roster
+    if(!spectating)
+        peerIDs[rakInterface->GetGuidFromSystemAddress(sa)] = 1;
+    serverAddress = sa;
+
+    //Where a full server or relay sent us, we go there once it hangs up
+    vector<RakNet::SystemAddress> redirects;
+    int numRedirects=0;
 
     while(initComplete==false)
     {
-        RakNet::Packet *p = rakInterface->Receive();
+        RakNet::Packet *p = receivePacket();
         if(!p)
         {
             //printf("WAITING FOR SERVER TO SEND GAME WORLD...\n");
@@ -239,7 +272,35 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
         {
             // Connection lost normally
             printf("ID_DISCONNECTION_NOTIFICATION\n");
-            if(selfPeerID==0)
+            if(spectating && p->systemAddress!=serverAddress)
+            {
+                //Whoever sent us on is done with us
+                break;
+            }
+            if(spectating && !redirects.empty())
+            {
+                if(numRedirects>=SPECTATOR_MAX_REDIRECTS)
+                {
+                    printf("Gave up after %d redirects.\n",numRedirects);
+                    return false;
+                }
+                numRedirects++;
+
+                //Spread the spectators over the relays
+                RakNet::SystemAddress relayAddress = redirects[rand()%redirects.size()];
+                redirects.clear();
+                printf("Following the redirect to %s\n",relayAddress.ToString(true));
+                sa = ConnectBlocking(relayAddress.ToString(false),relayAddress.port);
+                if(sa==RakNet::UNASSIGNED_SYSTEM_ADDRESS)
+                {
+                    printf("Could not connect to the relay!\n");
+                    return false;
+                }
+                sendClientInfo(sa);
+                serverAddress = sa;
+                break;
+            }
+            if(selfPeerID==0 && !spectating)
             {
                 printf("Disconnected because you tried to connect too late, there were no slots available, or a connection could not be made between you and another peer.\n");
             }
@@ -287,8 +348,49 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
             // Couldn't deliver a reliable packet - i.e. the other system was abnormally
             // terminated
             printf("ID_CONNECTION_LOST\n");
+            if(spectating && p->systemAddress!=serverAddress)
+                break;
             return false;
 
+        case ID_SPECTATOR_REDIRECT:
+        {
+            //[count][address\0]...
+            const unsigned char *data = GetPacketData(p);
+            const unsigned char *end = data+GetPacketSize(p);
+            int numRelays=0;
+            if(end-data>=int(sizeof(int)))
+            {
+                memcpy(&numRelays,data,sizeof(int));
+                data += sizeof(int);
+            }
+            redirects.clear();
+            for(int a=0; a<numRelays; a++)
+            {
+                const unsigned char *addressEnd = (const unsigned char*)memchr(data,0,end-data);
+                if(!addressEnd)
+                    break;
+                RakNet::SystemAddress relayAddress;
+                relayAddress.SetBinaryAddress((const char*)data);
+                redirects.push_back(relayAddress);
+                data = addressEnd+1;
+            }
+            if(redirects.empty())
+            {
+                printf("There is no room for more spectators and no relay to send us to.\n");
+                return false;
+            }
+            printf("No room for us here, %d relays to pick from\n",int(redirects.size()));
+        }
+        break;
+
+        case ID_SPECTATOR_ROSTER:
+            applySpectatorRoster(GetPacketData(p),GetPacketSize(p));
+            break;
+
+        case ID_SPECTATOR_INPUTS:
+            receiveSpectatorInputs(GetPacketData(p),GetPacketSize(p));
+            break;
+
         case ID_CONNECTION_REQUEST_ACCEPTED:
             // This tells the client they have connected
             printf("ID_CONNECTION_REQUEST_ACCEPTED to %s with GUID %s\n", p->systemAddress.ToString(true), p->guid.ToString());
@@ -320,8 +422,6 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
                 waitingForClientCatchup=true;
                 machine->osd().pauseAudio(true);
             }
-            if(peerInputs.find(peerID)==peerInputs.end())
-                peerInputs[peerID] = vector<string>();
         }
         break;
 
@@ -341,50 +441,49 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
 
         case ID_INITIAL_SYNC_PARTIAL:
         {
-            //printf("GOT PARTIAL SYNC FROM SERVER\n");
-            int curPos = (int)initialSyncBuffer.size();
-            initialSyncBuffer.resize(initialSyncBuffer.size()+GetPacketSize(p));
-            memcpy(&initialSyncBuffer[curPos],GetPacketData(p),GetPacketSize(p));
-
-            int totalSize;
-            memcpy(&totalSize,(&initialSyncBuffer[sizeof(int)]),sizeof(int));
-            initialSyncPercentComplete = initialSyncBuffer.size()*1000/totalSize;
+            //Chunks are applied as they come in
+            metrics.add(NET_COUNTER_SYNC_BYTES,p->length);
+            if(!loadInitialData(GetPacketData(p),GetPacketSize(p),machine))
+                return false;
         }
         break;
         case ID_INITIAL_SYNC_COMPLETE:
         {
             printf("GOT INITIAL SYNC FROM SERVER!\n");
-            int curPos = (int)initialSyncBuffer.size();
-            initialSyncBuffer.resize(initialSyncBuffer.size()+GetPacketSize(p));
-            memcpy(&initialSyncBuffer[curPos],GetPacketData(p),GetPacketSize(p));
-            loadInitialData(&initialSyncBuffer[0],(int)initialSyncBuffer.size(),machine);
+            metrics.add(NET_COUNTER_SYNC_BYTES,p->length);
+            if(!loadInitialData(GetPacketData(p),GetPacketSize(p),machine))
+                return false;
             initComplete=true;
         }
         break;
         case ID_CLIENT_INPUTS:
-            if(peerIDs.find(p->guid)==peerIDs.end())
-            {
-                cout << "GOT INPUTS FROM UNKNOWN USER: " << p->systemAddress.ToString() << endl;
-            }
-            else
-            {
-                if(peerInputs.find(peerIDs[p->guid])==peerInputs.end())
-                    peerInputs[peerIDs[p->guid]] = vector<string>();
-                peerInputs[peerIDs[p->guid]].push_back(string((char*)GetPacketData(p),(int)GetPacketSize(p)));
-            }
-            break;
         case ID_SERVER_INPUTS:
-        {
-            peerInputs[1].push_back(string(((char*)GetPacketData(p)),(int)GetPacketSize(p)));
-        }
-        break;
+            //Only inputs from a peer without a ring yet get here
+            receiveLongInput(p);
+            break;
         case ID_SETTINGS:
         {
             memcpy(&secondsBetweenSync,p->data+1,sizeof(int));
             char buf[4096];
             strcpy(buf,(const char*)(p->data+1+sizeof(int)));
             string s(buf,strlen(buf));
-            peerNames[1] = s;
+            if(!spectating)
+                peerNames[1] = s;
+
+            //The codecs the server may pick from for syncs
+            int maskOffset = 1+sizeof(int)+int(strlen(buf))+1;
+            if(int(p->length) >= maskOffset+int(sizeof(int)))
+            {
+                int codecMask;
+                memcpy(&codecMask,p->data+maskOffset,sizeof(int));
+                cout << "SYNC CODECS:";
+                for(int a=0; a<SYNC_CODEC_END; a++)
+                {
+                    if(codecMask&(1<<a))
+                        cout << ' ' << syncCodecName(a);
+                }
+                cout << endl;
+            }
         }
         break;
         default:
@@ -395,89 +494,148 @@ bool Client::initializeConnection(unsigned short selfPort,const char *hostname,u
 
         rakInterface->DeallocatePacket(p);
     }
+    startNetworkThread();
     return true;
 }
 
 extern attotime zeroInputMinTime;
 
-void Client::loadInitialData(unsigned char *data,int size,running_machine *machine)
-{
-    unsigned char checksum = 0;
+//Copies the input port state that is not part of the save state (inptport.c)
+extern int inputPortRollbackState(running_machine &machine,UINT8 *saveBuffer,const UINT8 *loadBuffer);
 
-    cout << "INITIAL DATA SIZE: " << size << endl;
+//Reads one value from a decompressed initial sync chunk, fails instead of
+//reading past the end of the chunk
+template<class T>
+static bool readInitialSyncValue(const unsigned char *&ptr,const unsigned char *end,T &value)
+{
+    if(end-ptr < int(sizeof(T)))
+        return false;
+    memcpy(&value,ptr,sizeof(T));
+    ptr += sizeof(T);
+    return true;
+}
 
-    int uncompressedSize;
-    memcpy(&uncompressedSize,data,sizeof(int));
-    data += sizeof(int);
+bool Client::loadInitialData(unsigned char *data,int size,running_machine *machine)
+{
+    if(size<int(INITIAL_SYNC_CHUNK_HEADER_SIZE))
+    {
+        cout << "ERROR: INITIAL SYNC CHUNK IS TOO SMALL\n";
+        return false;
+    }
 
-    int compressedSize;
-    memcpy(&compressedSize,data,sizeof(int));
-    data += sizeof(int);
+    int chunkIndex,numChunks,uncompressedSize,compressedSize;
+    memcpy(&chunkIndex,data,sizeof(int));
+    memcpy(&numChunks,data+sizeof(int),sizeof(int));
+    memcpy(&uncompressedSize,data+sizeof(int)*2,sizeof(int));
+    memcpy(&compressedSize,data+sizeof(int)*3,sizeof(int));
+    data += INITIAL_SYNC_CHUNK_HEADER_SIZE;
 
-    vector<unsigned char> uncompressedSyncBuffer(uncompressedSize + 128);
+    if(chunkIndex!=initialSyncNextChunk)
+    {
+        cout << "ERROR: GOT INITIAL SYNC CHUNK " << chunkIndex << " BUT EXPECTED " << initialSyncNextChunk << endl;
+        return false;
+    }
+    if(numChunks<=chunkIndex || uncompressedSize<0 || compressedSize<=0 ||
+       compressedSize>size-int(INITIAL_SYNC_CHUNK_HEADER_SIZE))
+    {
+        cout << "ERROR: MALFORMED HEADER ON INITIAL SYNC CHUNK " << chunkIndex << endl;
+        return false;
+    }
+    initialSyncNextChunk++;
 
-    cout << "INITIAL DATA COMPRESSED SIZE: " << compressedSize << " UNCOMPRESSED SIZE: " << uncompressedSize << endl;
+    if(int(initialSyncBuffer.size())<uncompressedSize+1)
+        initialSyncBuffer.resize(uncompressedSize+1);
+    syncPipeline.getLzmaDecoder().uncompress(&initialSyncBuffer[0],uncompressedSize,data,compressedSize);
+    const unsigned char *ptr = &initialSyncBuffer[0];
+    const unsigned char *end = ptr+uncompressedSize;
 
-    int destLen = uncompressedSize+128;
-    lzmaUncompress(&uncompressedSyncBuffer[0],destLen,data,compressedSize);
+    initialSyncPercentComplete = initialSyncNextChunk*1000/numChunks;
 
-    RakNet::BitStream initialSyncStream(&uncompressedSyncBuffer[0],uncompressedSize + 128,false);
+    if(chunkIndex==0)
+    {
+        //Chunk 0: the server's times and how many blocks will follow
+        int numBlocks,hasCheckpoint;
+        if(!readInitialSyncValue(ptr,end,startupTime) ||
+           !readInitialSyncValue(ptr,end,zeroInputMinTime) ||
+           !readInitialSyncValue(ptr,end,numBlocks) ||
+           !readInitialSyncValue(ptr,end,hasCheckpoint))
+        {
+            cout << "ERROR: INITIAL SYNC CHUNK " << chunkIndex << " IS TRUNCATED\n";
+            return false;
+        }
+        zeroInputMinTime.seconds += 2;
+        waitingForClientCatchup=true;
 
-    printf("COMPRESSED SIZE: %d\n",compressedSize);
+        cout << "LOADING " << numBlocks << " BLOCKS IN " << numChunks << " CHUNKS\n";
+        //Server and client must match on blocks
+        if(numBlocks && blocks.size() != numBlocks)
+        {
+            cout << "ERROR: CLIENT AND SERVER BLOCK COUNTS DO NOT MATCH!\n";
+        }
 
-    initialSyncStream.Read(startupTime);
+        initialSyncHasCheckpoint = (hasCheckpoint!=0);
+        initialSyncChecksum = 0;
+        staleHashes.clear();
+        return true;
+    }
 
-    initialSyncStream.Read(zeroInputMinTime);
-    zeroInputMinTime.seconds += 2;
-    waitingForClientCatchup=true;
+    if(initialSyncHasCheckpoint && chunkIndex==numChunks-2)
+    {
+        //The server's state at its last checkpoint, it can only be loaded
+        //after the soft reset
+        serverCheckpoint.assign(ptr,end);
+        cout << "GOT CHECKPOINT OF SIZE: " << uncompressedSize << endl;
+        return true;
+    }
 
-    if(getSecondsBetweenSync())
+    if(chunkIndex<numChunks-1)
     {
-        cout << "READING NUM BLOCKS\n";
-        int numBlocks;
-        initialSyncStream.Read(numBlocks);
+        //A run of blocks, xored against the blocks we started with
+        int firstBlock,numBlocks;
+        if(!readInitialSyncValue(ptr,end,firstBlock) ||
+           !readInitialSyncValue(ptr,end,numBlocks) ||
+           firstBlock<0 || numBlocks<0 || numBlocks>int(blocks.size())-firstBlock)
+        {
+            cout << "ERROR: MALFORMED BLOCK RUN IN INITIAL SYNC CHUNK " << chunkIndex << endl;
+            return false;
+        }
 
-        cout << "LOADING " << numBlocks << " BLOCKS\n";
+        for(int blockIndex=firstBlock; blockIndex<firstBlock+numBlocks; blockIndex++)
         {
-            //Server and client must match on blocks
-            if(blocks.size() != numBlocks)
+            int blockSize;
+            if(!readInitialSyncValue(ptr,end,blockSize) || blockSize != blocks[blockIndex].size)
             {
-                cout << "ERROR: CLIENT AND SERVER BLOCK COUNTS DO NOT MATCH!\n";
+                cout << "ERROR: CLIENT AND SERVER BLOCK SIZES AT INDEX " << blockIndex << " DO NOT MATCH!\n";
+                return false;
             }
-
-            for(int blockIndex=0; blockIndex<numBlocks; blockIndex++)
+            if(end-ptr < blockSize)
             {
-                //cout << "ON INDEX: " << blockIndex << " OF " << numBlocks << endl;
-                int blockSize;
-                initialSyncStream.Read(blockSize);
-
-                if(blockSize != blocks[blockIndex].size)
-                {
-                    cout << "ERROR: CLIENT AND SERVER BLOCK SIZES AT INDEX " << blockIndex << " DO NOT MATCH!\n";
-                    cout << blockSize << " != " << blocks[blockIndex].size << endl;
-                    exit(1);
-                }
-
-                //initialSyncStream.ReadBits(staleBlocks[blockIndex].data,blockSize*8);
+                cout << "ERROR: BLOCK " << blockIndex << " IN INITIAL SYNC CHUNK " << chunkIndex << " IS TRUNCATED\n";
+                return false;
+            }
 
-                cout << "BLOCK " << blockIndex << ": ";
-                for(int a=0; a<blockSize; a++)
-                {
-                    unsigned char xorValue;
-                    initialSyncStream.ReadBits(&xorValue,8);
-                    //cout << int(blocks[blockIndex].data[a] ^ xorValue) << ' ';
-                    staleBlocks[blockIndex].data[a] = blocks[blockIndex].data[a] ^ xorValue;
-                    checksum = checksum ^ staleBlocks[blockIndex].data[a];
-                }
-                cout << int(checksum) << endl;
+            unsigned char checksum = initialSyncChecksum;
+            for(int a=0; a<blockSize; a++)
+            {
+                staleBlocks[blockIndex].data[a] = blocks[blockIndex].data[a] ^ ptr[a];
+                checksum = checksum ^ staleBlocks[blockIndex].data[a];
             }
+            initialSyncChecksum = checksum;
+            ptr += blockSize;
         }
+        return true;
     }
 
+    //The last chunk: input history, checksum and nvram
+    unsigned char checksum = initialSyncChecksum;
     while(true)
     {
         int peerID;
-        initialSyncStream.Read(peerID);
+        if(!readInitialSyncValue(ptr,end,peerID))
+        {
+            cout << "ERROR: INPUT HISTORY IN INITIAL SYNC IS TRUNCATED\n";
+            return false;
+        }
         cout << "Read peer id: " << peerID << endl;
         if(peerID==-1)
         {
@@ -485,54 +643,48 @@ void Client::loadInitialData(unsigned char *data,int size,running_machine *machi
         }
 
         int numStrings;
-        initialSyncStream.Read(numStrings);
+        if(!readInitialSyncValue(ptr,end,numStrings) || numStrings<0)
+        {
+            cout << "ERROR: INPUT HISTORY IN INITIAL SYNC IS TRUNCATED\n";
+            return false;
+        }
         cout << "# strings: " << numStrings << endl;
-        vector<string> inputsToPush = peerInputs[peerID];
-        peerInputs[peerID].clear();
+        //The server's inputs go before anything that already arrived
+        deque<string> &inputs = localInputs[peerID];
+        deque<string>::iterator insertAt = inputs.begin();
         for(int a=0; a<numStrings; a++)
         {
             int strlen;
-            initialSyncStream.Read(strlen);
-
-            vector<char> buf(strlen,'\0');
-
-            if(buf.size()!=strlen)
+            if(!readInitialSyncValue(ptr,end,strlen) || strlen<0 || end-ptr<strlen)
             {
-                printf("OOPS\n");
-                exit(1);
+                cout << "ERROR: INPUT HISTORY IN INITIAL SYNC IS TRUNCATED\n";
+                return false;
             }
 
-            initialSyncStream.ReadBits((unsigned char*)(&buf[0]),strlen*8);
-            if(peerInputs.find(peerID)==peerInputs.end())
-            {
-                cout << __FILE__ << ":" << __LINE__ << " OOPS!!!!\n";
-            }
-            peerInputs[peerID].push_back(string((&buf[0]),strlen));
+            insertAt = inputs.insert(insertAt,string((const char*)ptr,strlen))+1;
 
             for(int b=0; b<strlen; b++)
             {
-                checksum = checksum ^ buf[b];
+                checksum = checksum ^ ptr[b];
             }
-        }
-        for(int c=0; c<inputsToPush.size(); c++)
-        {
-            peerInputs[peerID].push_back(inputsToPush[c]);
+            ptr += strlen;
         }
     }
     unsigned char serverChecksum;
-    initialSyncStream.Read(serverChecksum);
+    int nvramSize;
+    if(!readInitialSyncValue(ptr,end,serverChecksum) ||
+       !readInitialSyncValue(ptr,end,nvramSize) ||
+       nvramSize<0 || end-ptr<nvramSize)
+    {
+        cout << "ERROR: INITIAL SYNC TRAILER IS TRUNCATED\n";
+        return false;
+    }
     if(checksum != serverChecksum)
     {
         cout << "CHECKSUM ERROR!!!\n";
         exit(1);
     }
 
-    int syncBytes = initialSyncStream.GetReadOffset()/8;
-    cout << "LOOKING FOR NVRAM AT LOCATION: " << syncBytes << endl;
-
-    int nvramSize;
-    memcpy(&nvramSize,&uncompressedSyncBuffer[0]+syncBytes,sizeof(int));
-
     cout << "GOT NVRAM OF SIZE: " << nvramSize << endl;
 
     if(nvramSize)
@@ -541,27 +693,172 @@ void Client::loadInitialData(unsigned char *data,int size,running_machine *machi
 	    emu_file file(machine->options().nvram_directory(), OPEN_FLAG_WRITE | OPEN_FLAG_CREATE | OPEN_FLAG_CREATE_PATHS);
     	if (file.open(machine->basename(), ".nv") == FILERR_NONE) 
     	{
-    	    file.write(&uncompressedSyncBuffer[0]+syncBytes+sizeof(int),nvramSize);
+    	    file.write(ptr,nvramSize);
     	    file.close();
     	}
     }
 
     cout << "CHECKSUM: " << int(checksum) << endl;
 
+    //Don't hold on to the largest chunk for the rest of the session
+    vector<unsigned char>().swap(initialSyncBuffer);
+
     cout << "CLIENT INITIALIZED!\n";
+    return true;
 }
 
-void Client::updateSyncCheck()
+void Client::loadCheckpoint(running_machine *machine)
 {
-    printf("UPDATING SYNC CHECK\n");
+    if(serverCheckpoint.empty())
+        return;
+
+    int headerSize = sizeof(int)+sizeof(long long)+sizeof(int)*2;
+    const unsigned char *ptr = &serverCheckpoint[0];
+    int seconds,stateSize,inputStateSize;
+    long long attoseconds;
+    memcpy(&seconds,ptr,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(&attoseconds,ptr,sizeof(long long));
+    ptr += sizeof(long long);
+    memcpy(&stateSize,ptr,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(&inputStateSize,ptr,sizeof(int));
+    ptr += sizeof(int);
+
+    //The inputs before the checkpoint were not sent, so there is no way to
+    //catch up without it
+    if(
+        stateSize != int(machine->save().snapshot_size()) ||
+        inputStateSize != inputPortRollbackState(*machine,NULL,NULL) ||
+        int(serverCheckpoint.size()) != headerSize+stateSize+inputStateSize
+        )
+    {
+        cout << "ERROR: CLIENT AND SERVER STATE SIZES DO NOT MATCH!\n";
+        exit(1);
+    }
+
+    if(machine->save().load_snapshot(ptr)!=STATERR_NONE)
+    {
+        cout << "ERROR: COULD NOT LOAD THE SERVER'S CHECKPOINT\n";
+        exit(1);
+    }
+    inputPortRollbackState(*machine,NULL,ptr+stateSize);
+    printf("LOADED CHECKPOINT AT %d.%lld, REPLAYING FROM THERE\n",seconds,attoseconds);
+
+    vector<unsigned char>().swap(serverCheckpoint);
+}
+
+void Client::updateSyncCheck(int second)
+{
+    NETLOG(NETLOG_DEBUG,("UPDATING SYNC CHECK\n"));
+    static vector<pair<int,int> > dirtyRanges;
+    if(syncCheckHashes.size()!=blocks.size())
+    {
+        //Nothing is hashed yet, so every block counts as changed
+        syncCheckHashes.assign(blocks.size(),0);
+        syncCheckSecond=-1;
+    }
     for(int blockIndex=0; blockIndex<int(blocks.size()); blockIndex++)
     {
+        if(dirtyPages && syncCheckSecond>=0)
+        {
+            //Only the pages written since the last check can differ
+            dirtyPages->getDirtyRanges(blockIndex,dirtyRanges);
+            for(int a=0; a<int(dirtyRanges.size()); a++)
+            {
+                memcpy(
+                    syncCheckBlocks[blockIndex].data+dirtyRanges[a].first,
+                    blocks[blockIndex].data+dirtyRanges[a].first,
+                    dirtyRanges[a].second
+                );
+            }
+            if(!dirtyRanges.empty())
+                syncCheckHashes[blockIndex] = hashBlock64(syncCheckBlocks[blockIndex].data,syncCheckBlocks[blockIndex].size);
+            continue;
+        }
         memcpy(
             syncCheckBlocks[blockIndex].data,
             blocks[blockIndex].data,
             blocks[blockIndex].size
         );
+        syncCheckHashes[blockIndex] = hashBlock64(syncCheckBlocks[blockIndex].data,syncCheckBlocks[blockIndex].size);
+    }
+    if(dirtyPages)
+    {
+        dirtyPages->arm();
     }
+    syncCheckSecond = second;
+}
+
+void Client::checkSyncHashes()
+{
+    if(syncHashesSecond!=syncCheckSecond)
+    {
+        NETLOG(NETLOG_DEBUG,("NO SYNC CHECK FOR %d (THE LAST ONE WAS AT %d)\n",syncHashesSecond,syncCheckSecond));
+        return;
+    }
+    if(syncHashes.size()!=blocks.size())
+    {
+        cout << "ERROR: CLIENT AND SERVER BLOCK COUNTS DO NOT MATCH!\n";
+        return;
+    }
+
+    //Our state at the sync is the base the server's blocks get patched into.
+    //Stale blocks that already hold the same data are left alone.
+    bool staleHashesKnown = (staleHashes.size()==blocks.size());
+    if(!staleHashesKnown)
+        staleHashes.assign(blocks.size(),0);
+    vector<int> badBlocks;
+    int badBytes=0;
+    int totalBytes=0;
+    for(int blockIndex=0; blockIndex<int(blocks.size()); blockIndex++)
+    {
+        MemoryBlock &syncCheckBlock = syncCheckBlocks[blockIndex];
+        if(!staleHashesKnown || staleHashes[blockIndex]!=syncCheckHashes[blockIndex])
+        {
+            memcpy(staleBlocks[blockIndex].data,syncCheckBlock.data,syncCheckBlock.size);
+            staleHashes[blockIndex] = syncCheckHashes[blockIndex];
+        }
+        totalBytes += syncCheckBlock.size;
+        if(syncCheckHashes[blockIndex]!=syncHashes[blockIndex])
+        {
+            if(badBlocks.size()<50)
+            {
+                NETLOG(NETLOG_DEBUG,("BLOCK %d IS BAD\n",blockIndex));
+            }
+            badBlocks.push_back(blockIndex);
+            badBytes += syncCheckBlock.size;
+        }
+    }
+    staleSecond = syncCheckSecond;
+    staleVerified = badBlocks.empty();
+
+    if(badBlocks.empty())
+    {
+        NETLOG(NETLOG_DEBUG,("CLIENT IS CLEAN\n"));
+        return;
+    }
+
+    metrics.add(NET_COUNTER_RESYNCS);
+    printf("CLIENT IS DIRTY (%d of %d blocks, %f%% of total)\n",int(badBlocks.size()),int(blocks.size()),float(badBytes)*100.0f/max(1,totalBytes));
+    ui_popup_time(3, "You are out of sync with the server, resyncing...");
+
+    //Only this client gets the blocks back
+    int numBlocks = int(badBlocks.size());
+    RakNet::BitStream requestStream(1+sizeof(int)*(2+numBlocks));
+    unsigned char header = ID_RESYNC_REQUEST;
+    requestStream.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+    requestStream.WriteBits((const unsigned char*)&syncCheckSecond,8*sizeof(int));
+    requestStream.WriteBits((const unsigned char*)&numBlocks,8*sizeof(int));
+    requestStream.WriteBits((const unsigned char*)&badBlocks[0],8*sizeof(int)*numBlocks);
+    rakInterface->Send(
+        &requestStream,
+        HIGH_PRIORITY,
+        RELIABLE_ORDERED,
+        ORDERING_CHANNEL_SYNC,
+        serverAddress,
+        false
+    );
 }
 
 
@@ -569,18 +866,31 @@ bool printWhenCheck=false;
 
 bool Client::sync(running_machine *machine)
 {
+    if(hasSyncHashes && syncHashesSecond<=syncCheckSecond)
+    {
+        //Wait until we passed the sync ourselves before comparing
+        hasSyncHashes=false;
+        checkSyncHashes();
+        if(firstResync)
+        {
+            NETLOG(NETLOG_DEBUG,("BEGINNING VIDEO SKIP\n"));
+            firstResync=false;
+            return true;
+        }
+        return false;
+    }
+
     if(!hasCompleteResync) return false;
     hasCompleteResync=false;
 
-    bool hadToResync = resync(compressedBuffer,int(syncPtr-compressedBuffer),machine);
+    bool hadToResync = resync(syncPipeline.getReceived(),syncPipeline.getReceivedSize(),machine);
 
     //We have to return here because processing two syncs without a frame
     //in between can cause crashes
-    syncPtr = compressedBuffer;
-    if(firstResync || hadToResync)
+    syncPipeline.clearReceived();
+    if(hadToResync)
     {
-        printf("BEGINNING VIDEO SKIP\n");
-        firstResync=false;
+        NETLOG(NETLOG_DEBUG,("BEGINNING VIDEO SKIP\n"));
         return true;
     }
     else
@@ -591,25 +901,31 @@ bool Client::sync(running_machine *machine)
 
 bool Client::update(running_machine *machine)
 {
-    for(
-        map<RakNet::RakNetGUID,vector< string > >::iterator it = unknownPeerInputs.begin();
-        it != unknownPeerInputs.end();
-    )
+    if(replaying)
     {
-        if(peerIDs.find(it->first)!=peerIDs.end())
-        {
-            int ID = peerIDs[it->first];
-            for(int a=0; a<it->second.size(); a++)
-            {
-                peerInputs[ID].push_back(it->second[a]);
-            }
-            map<RakNet::RakNetGUID,vector< string > >::iterator itold = it;
-            it++;
-            unknownPeerInputs.erase(itold);
-        }
+        //Only called when the emulation is out of inputs
+        if(pumpReplay())
+            return true;
+        if(replayEnded)
+            printf("REPLAY FINISHED\n");
         else
+            printf("ERROR: THE REPLAY RAN OUT OF INPUTS BEFORE THE KEYFRAME AT %d.%lld\n",replayKeyframe.seconds,replayKeyframe.attoseconds);
+        return false;
+    }
+
+    pollNetworkPeers();
+    pumpInitialSyncs();
+
+    if(spectating)
+    {
+        dropDrainedPeers();
+        if(relay && !announcedRelay && !checkpoint.empty())
         {
-            it++;
+            //Our server may send spectators here from now on
+            announcedRelay=true;
+            unsigned char header = ID_SPECTATOR_RELAY_READY;
+            rakInterface->Send((const char*)&header,1,HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SYNC,serverAddress,false);
+            printf("READY TO RELAY\n");
         }
     }
 
@@ -622,7 +938,7 @@ bool Client::update(running_machine *machine)
 
     for(int packetCount=0;; packetCount++)
     {
-        RakNet::Packet *p = rakInterface->Receive();
+        RakNet::Packet *p = receivePacket();
         if(!p)
         {
             break;
@@ -638,6 +954,16 @@ bool Client::update(running_machine *machine)
         case ID_DISCONNECTION_NOTIFICATION:
             // Connection lost normally
             printf("ID_DISCONNECTION_NOTIFICATION\n");
+            if(spectating && p->systemAddress==serverAddress)
+            {
+                //The game we watch is gone
+                return false;
+            }
+            if(spectatorFeed.remove(p->guid))
+            {
+                printf("SPECTATOR %s LEFT\n",p->systemAddress.ToString(true));
+                break;
+            }
             if(peerIDs.find(p->guid)!=peerIDs.end())
             {
                 if(peerIDs[p->guid]==1)
@@ -648,6 +974,7 @@ bool Client::update(running_machine *machine)
                 else
                 {
                     peerIDs.erase(p->guid);
+                    retireNetworkPeer(p->guid);
                 }
             }
             break;
@@ -668,6 +995,9 @@ bool Client::update(running_machine *machine)
         case ID_REMOTE_NEW_INCOMING_CONNECTION: // Server telling the clients of another client connecting.  You can manually broadcast this in a peer to peer enviroment if you want.
             printf("ID_REMOTE_NEW_INCOMING_CONNECTION\n");
             break;
+        case ID_NEW_INCOMING_CONNECTION:
+            printf("ID_NEW_INCOMING_CONNECTION from %s\n", p->systemAddress.ToString(true));
+            break;
         case ID_CONNECTION_BANNED: // Banned from this server
             printf("We are banned from this server.\n");
             return false;
@@ -756,8 +1086,6 @@ bool Client::update(running_machine *machine)
                 waitingForClientCatchup=true;
                 machine->osd().pauseAudio(true);
             }
-            if(peerInputs.find(peerID)==peerInputs.end())
-                peerInputs[peerID] = vector<string>();
         }
         break;
 
@@ -767,65 +1095,126 @@ bool Client::update(running_machine *machine)
             if(hasCompleteResync)
             {
                 //hasCompleteResync=false;
-                //syncPtr = compressedBuffer;
+                //syncPipeline.clearReceived();
                 printf("ERROR: GOT NEW RESYNC WHILE ANOTHER RESYNC WAS ON THE QUEUE!\n");
                 return false;
             }
-            int bytesUsed = syncPtr-compressedBuffer;
-            while(bytesUsed+GetPacketSize(p) >= compressedBufferSize)
-            {
-                compressedBufferSize *= 1.5;
-		free(compressedBuffer);
-                compressedBuffer = (unsigned char*)malloc(compressedBufferSize);
-                if(!compressedBuffer)
-                {
-                    cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-                    exit(1);
-                }
-                syncPtr = compressedBuffer+bytesUsed;
-            }
-            memcpy(syncPtr,GetPacketData(p),GetPacketSize(p));
-            syncPtr += GetPacketSize(p);
+            //Appending keeps the packets that already arrived
+            metrics.add(NET_COUNTER_SYNC_BYTES,p->length);
+            syncPipeline.appendReceived(GetPacketData(p),GetPacketSize(p));
             printWhenCheck=true;
             break;
         }
-        case ID_RESYNC_COMPLETE:
+        case ID_SYNC_HASHES:
         {
-            printf("GOT COMPLETE RESYNC\n");
-            int bytesUsed = syncPtr-compressedBuffer;
-            while(bytesUsed+GetPacketSize(p) >= compressedBufferSize)
+            //Our spectators check themselves against the same hashes
+            for(int a=0; a<spectatorFeed.getNumSpectators(); a++)
             {
-                compressedBufferSize *= 1.5;
-		free(compressedBuffer);
-                compressedBuffer = (unsigned char*)malloc(compressedBufferSize);
-                if(!compressedBuffer)
-                {
-                    cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-                    exit(1);
-                }
-                syncPtr = compressedBuffer+bytesUsed;
+                rakInterface->Send((const char*)p->data,int(p->length),HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SYNC,spectatorFeed.getAddress(a),false);
+            }
+
+            //A newer set replaces one we did not get to yet
+            metrics.add(NET_COUNTER_SYNC_BYTES,p->length);
+            unsigned char *data = GetPacketData(p);
+            int size = GetPacketSize(p);
+            int numBlocks;
+            if(size<int(sizeof(int))*2)
+                break;
+            memcpy(&syncHashesSecond,data,sizeof(int));
+            memcpy(&numBlocks,data+sizeof(int),sizeof(int));
+            if(numBlocks<0 || numBlocks>(size-int(sizeof(int))*2)/int(sizeof(unsigned long long)))
+            {
+                cout << "GOT MALFORMED SYNC HASHES\n";
+                break;
             }
-            memcpy(syncPtr,GetPacketData(p),GetPacketSize(p));
-            syncPtr += GetPacketSize(p);
+            syncHashes.resize(numBlocks);
+            if(numBlocks)
+                memcpy(&syncHashes[0],data+sizeof(int)*2,sizeof(unsigned long long)*numBlocks);
+            hasSyncHashes=true;
+            break;
+        }
+        case ID_RESYNC_COMPLETE:
+        {
+            NETLOG(NETLOG_DEBUG,("GOT COMPLETE RESYNC\n"));
+            //Appending keeps the packets that already arrived
+            metrics.add(NET_COUNTER_SYNC_BYTES,p->length);
+            syncPipeline.appendReceived(GetPacketData(p),GetPacketSize(p));
             hasCompleteResync=true;
             return true;
             break;
         }
         case ID_CLIENT_INPUTS:
-            if(peerIDs.find(p->guid)==peerIDs.end() || peerInputs.find(peerIDs[p->guid])==peerInputs.end())
+        case ID_SERVER_INPUTS:
+            //Only inputs from a peer without a ring yet get here
+            receiveLongInput(p);
+            break;
+        case ID_SETTINGS:
+            memcpy(&secondsBetweenSync,p->data+1,sizeof(int));
+            break;
+        case ID_CLIENT_INFO:
+        {
+            //Only a relay takes anyone, and only spectators
+            int spectator=0;
+            int maskOffset = 1+int(strlen((const char*)(p->data+1)))+1;
+            if(int(p->length) >= maskOffset+int(sizeof(int))*2)
+                memcpy(&spectator,p->data+maskOffset+sizeof(int),sizeof(int));
+            if(!relay || !spectator)
             {
-                cout << __FILE__ << ":" << __LINE__ << " OOPS!!!!\n";
+                printf("REFUSING %s, WE ARE NOT ITS SERVER\n",p->systemAddress.ToString(true));
+                rakInterface->CloseConnection(p->systemAddress,true);
+                break;
             }
-            peerInputs[peerIDs[p->guid]].push_back(string((char*)GetPacketData(p),(int)GetPacketSize(p)));
+
+            char buf[4096];
+            buf[0] = ID_SETTINGS;
+            memcpy(buf+1,&secondsBetweenSync,sizeof(int));
+            strcpy(buf+1+sizeof(int),username.c_str());
+            int codecMask = SYNC_CODECS_SUPPORTED;
+            memcpy(buf+1+sizeof(int)+username.length()+1,&codecMask,sizeof(int));
+            rakInterface->Send(
+                buf,
+                1+sizeof(int)+username.length()+1+sizeof(int),
+                HIGH_PRIORITY,
+                RELIABLE_ORDERED,
+                ORDERING_CHANNEL_SYNC,
+                p->guid,
+                false
+            );
+            admitSpectator(p,machine);
+        }
+        break;
+        case ID_SPECTATOR_RELAY_READY:
+            printf("SPECTATOR %s CAN RELAY NOW\n",p->systemAddress.ToString(true));
+            spectatorFeed.setRelay(p->guid);
             break;
-        case ID_SERVER_INPUTS:
+        case ID_SPECTATOR_ROSTER:
+            applySpectatorRoster(GetPacketData(p),GetPacketSize(p));
+            break;
+        case ID_SPECTATOR_INPUTS:
+            receiveSpectatorInputs(GetPacketData(p),GetPacketSize(p));
+            break;
+        case ID_RESYNC_REQUEST:
         {
-            peerInputs[1].push_back(string(((char*)GetPacketData(p)),(int)GetPacketSize(p)));
+            //One of our spectators is out of sync
+            unsigned char *data = GetPacketData(p);
+            int size = GetPacketSize(p);
+            int second,numBlocks;
+            if(size<int(sizeof(int))*2)
+                break;
+            memcpy(&second,data,sizeof(int));
+            memcpy(&numBlocks,data+sizeof(int),sizeof(int));
+            if(numBlocks<0 || numBlocks>(size-int(sizeof(int))*2)/int(sizeof(int)))
+            {
+                cout << "GOT A MALFORMED RESYNC REQUEST\n";
+                break;
+            }
+            vector<int> blockIndices(numBlocks);
+            if(numBlocks)
+                memcpy(&blockIndices[0],data+sizeof(int)*2,sizeof(int)*numBlocks);
+            printf("%s IS OUT OF SYNC IN %d BLOCKS\n",p->systemAddress.ToString(true),numBlocks);
+            sendRelayBlocks(p->systemAddress,second,blockIndices);
         }
         break;
-        case ID_SETTINGS:
-            memcpy(&secondsBetweenSync,p->data+1,sizeof(int));
-            break;
         default:
             printf("GOT AN INVALID PACKET TYPE: %d\n",int(packetID));
             return false;
@@ -839,39 +1228,41 @@ bool Client::update(running_machine *machine)
 
 bool Client::resync(unsigned char *data,int size,running_machine *machine)
 {
-    int uncompressedSize,compressedSize;
+    if(size<int(RESYNC_HEADER_SIZE))
+    {
+        cout << "ERROR: RESYNC IS TOO SMALL\n";
+        return false;
+    }
+
+    int uncompressedSize,compressedSize,codec,second;
     memcpy(&uncompressedSize,data,sizeof(int));
     data += sizeof(int);
     memcpy(&compressedSize,data,sizeof(int));
     data += sizeof(int);
+    memcpy(&codec,data,sizeof(int));
+    data += sizeof(int);
+    memcpy(&second,data,sizeof(int));
+    data += sizeof(int);
 
-    if(uncompressedSize+128 >= uncompressedBufferSize)
+    if(second!=staleSecond)
     {
-        uncompressedBufferSize = uncompressedSize+256;
-	free(uncompressedBuffer);
-        uncompressedBuffer = (unsigned char*)malloc(uncompressedBufferSize);
-        if(!uncompressedBuffer)
-        {
-            cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-            exit(1);
-        }
+        //A newer sync already replaced the blocks these were meant for
+        printf("IGNORING RESYNC FOR %d, THE STALE BLOCKS ARE FROM %d\n",second,staleSecond);
+        return false;
     }
-    uLongf destLen = uncompressedBufferSize;
-    if(uncompress(uncompressedBuffer,&destLen,data,compressedSize)!=Z_OK)
+
+    if(!syncPipeline.uncompress(codec,data,compressedSize,uncompressedSize))
     {
-        cout << "ERROR: ZLIB UNCOMPRESS FAILED\n";
+        cout << "ERROR: " << syncCodecName(codec) << " UNCOMPRESS FAILED\n";
         exit(1);
     }
-    unsigned char *uncompressedPtr = uncompressedBuffer;
+    unsigned char *uncompressedPtr = syncPipeline.getUncompressed();
+    unsigned char *uncompressedEnd = uncompressedPtr+uncompressedSize;
 
-
-    //Check to see if the client is clean
-    bool clientIsClean=true;
-
-    int badByteCount=0;
-    int totalByteCount=0;
-
-    while(true)
+    //The blocks we asked for come whole, everything else already matched
+    unsigned char blockChecksum=0;
+    int numBlocks=0;
+    while(uncompressedPtr+sizeof(int)<=uncompressedEnd)
     {
         int blockIndex;
         memcpy(
@@ -883,182 +1274,36 @@ bool Client::resync(unsigned char *data,int size,running_machine *machine)
 
         if(blockIndex==-1)
         {
-            //cout << "GOT TERMINAL BLOCK INDEX\n";
             break;
         }
 
-        if(blockIndex >= int(blocks.size()) || blockIndex<0)
+        if(blockIndex >= int(blocks.size()) || blockIndex<0 || uncompressedPtr+staleBlocks[blockIndex].size>uncompressedEnd)
         {
             cout << "GOT AN INVALID BLOCK INDEX: " << blockIndex << endl;
             break;
         }
 
-        //boost::asio::read(*clientSocket,boost::asio::buffer(&clientSizeOfNextMessage, sizeof(int)));
-
-        MemoryBlock &block = blocks[blockIndex];
-        MemoryBlock &syncCheckBlock = syncCheckBlocks[blockIndex];
         MemoryBlock &staleBlock = staleBlocks[blockIndex];
-
-        //cout << "CLIENT: GOT MESSAGE FOR INDEX: " << blockIndex << endl;
-
-        //if(clientSizeOfNextMessage!=block.size)
-        //{
-        //cout << "ERROR!: SIZE MISMATCH " << clientSizeOfNextMessage
-        //<< " != " << block.size << endl;
-        //}
-
-        //cout << "BYTES READ: " << (xorBlock.size-strm.avail_out) << endl;
-        for(int a=0; a<block.size; a++)
-        {
-            totalByteCount++;
-            if(syncCheckBlock.data[a] != (uncompressedPtr[a] ^ staleBlock.data[a]))
-            {
-                badByteCount++;
-                if(badByteCount<50)
-                {
-                    printf("BLOCK %d BYTE %d IS BAD\n",blockIndex,a);
-                }
-                if(badByteCount>64)
-                    clientIsClean=false;
-                //break;
-            }
-        }
-        uncompressedPtr += block.size;
-    }
-
-    if(badByteCount*100/totalByteCount>=1) clientIsClean=false; //1% or more of the bytes are bad
-
-    if(clientIsClean)
-    {
-        printf("CLIENT IS CLEAN\n");
-        for(int a=0; a<int(blocks.size()); a++)
+        memcpy(staleBlock.data,uncompressedPtr,staleBlock.size);
+        for(int a=0; a<staleBlock.size; a++)
         {
-            memcpy(staleBlocks[a].data,syncCheckBlocks[a].data,syncCheckBlocks[a].size);
+            blockChecksum = blockChecksum ^ staleBlock.data[a];
         }
-        return false;
+        if(blockIndex<int(staleHashes.size()))
+            staleHashes[blockIndex] = hashBlock64(staleBlock.data,staleBlock.size);
+        uncompressedPtr += staleBlock.size;
+        numBlocks++;
     }
+    NETLOG(NETLOG_DEBUG,("GOT %d BLOCKS FOR %d, BLOCK CHECKSUM: %d\n",numBlocks,second,int(blockChecksum)));
+    //The blocks that matched and the ones we got are now all the server's
+    staleVerified = true;
 
     if (machine->scheduler().can_save()==false)
     {
         printf("CLIENT IS DIRTY BUT HAD ANONYMOUS TIMER SO CAN'T FIX!\n");
-        uncompressedPtr = uncompressedBuffer;
-        //unsigned char blockChecksum=0;
-        unsigned char xorChecksum=0;
-        unsigned char staleChecksum=0;
-        while(true)
-        {
-            int blockIndex;
-            memcpy(
-                &blockIndex,
-                uncompressedPtr,
-                sizeof(int)
-            );
-            uncompressedPtr += sizeof(int);
-
-            if(blockIndex==-1)
-            {
-                //cout << "GOT TERMINAL BLOCK INDEX\n";
-                break;
-            }
-
-            if(blockIndex >= int(blocks.size()) || blockIndex<0)
-            {
-                cout << "GOT AN INVALID BLOCK INDEX: " << blockIndex << endl;
-                break;
-            }
-
-            //boost::asio::read(*clientSocket,boost::asio::buffer(&clientSizeOfNextMessage, sizeof(int)));
-
-            MemoryBlock &block = blocks[blockIndex];
-            MemoryBlock &staleBlock = staleBlocks[blockIndex];
-
-            //cout << "CLIENT: GOT MESSAGE FOR INDEX: " << blockIndex << endl;
-
-            //if(clientSizeOfNextMessage!=block.size)
-            //{
-            //cout << "ERROR!: SIZE MISMATCH " << clientSizeOfNextMessage
-            //<< " != " << block.size << endl;
-            //}
-
-            //cout << "BYTES READ: " << (xorBlock.size-strm.avail_out) << endl;
-            for(int a=0; a<block.size; a++)
-            {
-                staleBlock.data[a] = uncompressedPtr[a] ^ staleBlock.data[a];
-                xorChecksum = xorChecksum ^ uncompressedPtr[a];
-                staleChecksum = staleChecksum ^ staleBlock.data[a];
-            }
-            uncompressedPtr += block.size;
-
-            //cout << "CLIENT: FINISHED GETTING MESSAGE\n";
-        }
-        printf("XOR CHECKSUM: %d\n",int(xorChecksum));
-        printf("STALE CHECKSUM: %d\n",int(staleChecksum));
         return false;
     }
 
-    printf("CLIENT IS DIRTY (%d bad blocks, %f%% of total)\n",badByteCount,float(badByteCount)*100.0f/totalByteCount);
-    ui_popup_time(3, "You are out of sync with the server, resyncing...");
-
-
-    //The client is not clean and needs to be resynced
-
-#if 1
-    uncompressedPtr = uncompressedBuffer;
-    unsigned char blockChecksum=0;
-    unsigned char xorChecksum=0;
-    unsigned char staleChecksum=0;
-    while(true)
-    {
-        int blockIndex;
-        memcpy(
-            &blockIndex,
-            uncompressedPtr,
-            sizeof(int)
-        );
-        uncompressedPtr += sizeof(int);
-
-        if(blockIndex==-1)
-        {
-            //cout << "GOT TERMINAL BLOCK INDEX\n";
-            break;
-        }
-
-        if(blockIndex >= int(blocks.size()) || blockIndex<0)
-        {
-            cout << "GOT AN INVALID BLOCK INDEX: " << blockIndex << endl;
-            break;
-        }
-
-        //boost::asio::read(*clientSocket,boost::asio::buffer(&clientSizeOfNextMessage, sizeof(int)));
-
-        MemoryBlock &block = blocks[blockIndex];
-        MemoryBlock &staleBlock = staleBlocks[blockIndex];
-
-        //cout << "CLIENT: GOT MESSAGE FOR INDEX: " << blockIndex << endl;
-
-        //if(clientSizeOfNextMessage!=block.size)
-        //{
-        //cout << "ERROR!: SIZE MISMATCH " << clientSizeOfNextMessage
-        //<< " != " << block.size << endl;
-        //}
-
-        //cout << "BYTES READ: " << (xorBlock.size-strm.avail_out) << endl;
-        for(int a=0; a<block.size; a++)
-        {
-            staleBlock.data[a] = uncompressedPtr[a] ^ staleBlock.data[a];
-            blockChecksum = blockChecksum ^ staleBlock.data[a];
-            xorChecksum = xorChecksum ^ uncompressedPtr[a];
-            staleChecksum = staleChecksum ^ staleBlock.data[a];
-        }
-        uncompressedPtr += block.size;
-
-        //cout << "CLIENT: FINISHED GETTING MESSAGE\n";
-    }
-    printf("BLOCK CHECKSUM: %d\n",int(blockChecksum));
-    printf("XOR CHECKSUM: %d\n",int(xorChecksum));
-    printf("STALE CHECKSUM: %d\n",int(staleChecksum));
-#endif
-
     revert(machine);
 
     return true;
@@ -1120,20 +1365,298 @@ int Client::getNumSessions()
 
 void Client::sendInputs(const string &inputString)
 {
-    peerInputs[selfPeerID].push_back(inputString);
-    char* dataToSend = (char*)malloc(inputString.length()+1);
-    dataToSend[0] = ID_CLIENT_INPUTS;
-    memcpy(dataToSend+1,inputString.c_str(),inputString.length());
-    //cout << "SENDING MESSAGE WITH LENGTH: " << intSize << endl;
-    rakInterface->Send(
-        dataToSend,
-        (int)(inputString.length()+1),
-        IMMEDIATE_PRIORITY,
-        RELIABLE_ORDERED,
-        ORDERING_CHANNEL_CLIENT_INPUTS,
-        RakNet::UNASSIGNED_SYSTEM_ADDRESS,
-        true
-    );
-    free(dataToSend);
+    if(spectating)
+        return;
+    localInputs[selfPeerID].push_back(inputString);
+    sendInputFrame(ID_CLIENT_INPUT_FRAMES,inputString);
+}
+
+void Client::sendClientInfo(const RakNet::SystemAddress &sa)
+{
+    char buf[4096];
+    buf[0] = ID_CLIENT_INFO;
+    strcpy(buf+1,username.c_str());
+    int codecMask = SYNC_CODECS_SUPPORTED;
+    memcpy(buf+1+username.length()+1,&codecMask,sizeof(int));
+    int spectator = spectating?1:0;
+    memcpy(buf+1+username.length()+1+sizeof(int),&spectator,sizeof(int));
+    rakInterface->Send(buf,1+username.length()+1+sizeof(int)*2,HIGH_PRIORITY,RELIABLE_ORDERED,0,sa,false);
 }
 
+void Client::applySpectatorRoster(const unsigned char *data,int size)
+{
+    std::map<RakNet::RakNetGUID,int> rosterIDs;
+    std::map<int,string> rosterNames;
+    if(!SpectatorFeed::readRoster(data,size,rosterIDs,rosterNames))
+    {
+        cout << "GOT A MALFORMED SPECTATOR ROSTER\n";
+        return;
+    }
+
+    for(
+        std::map<RakNet::RakNetGUID,int>::iterator it = peerIDs.begin();
+        it != peerIDs.end();
+        it++
+    )
+    {
+        if(rosterIDs.find(it->first)==rosterIDs.end() && !leavingPeerIDs.count(it->second))
+        {
+            printf("PLAYER %d (%s) LEFT\n",it->second,peerNames[it->second].c_str());
+            leavingPeerIDs.insert(it->second);
+        }
+    }
+    for(
+        std::map<RakNet::RakNetGUID,int>::iterator it = rosterIDs.begin();
+        it != rosterIDs.end();
+        it++
+    )
+    {
+        if(peerIDs.find(it->first)==peerIDs.end())
+            printf("PLAYER %d (%s) JOINED\n",it->second,rosterNames[it->second].c_str());
+        peerIDs[it->first] = it->second;
+        peerNames[it->second] = rosterNames[it->second];
+        leavingPeerIDs.erase(it->second);
+    }
+    dropDrainedPeers();
+}
+
+void Client::receiveSpectatorInputs(const unsigned char *data,int size)
+{
+    static vector<pair<int,string> > inputs;
+    if(!SpectatorFeed::readInputs(data,size,inputs))
+    {
+        cout << "GOT MALFORMED SPECTATOR INPUTS\n";
+        return;
+    }
+    for(int a=0; a<int(inputs.size()); a++)
+    {
+        localInputs[inputs[a].first].push_back(string());
+        localInputs[inputs[a].first].back().swap(inputs[a].second);
+    }
+}
+
+void Client::dropDrainedPeers()
+{
+    for(set<int>::iterator it = leavingPeerIDs.begin(); it != leavingPeerIDs.end(); )
+    {
+        map<int,deque<string> >::iterator inputs = localInputs.find(*it);
+        if(inputs!=localInputs.end() && !inputs->second.empty())
+        {
+            //Our server used these before the player left, so must we
+            it++;
+            continue;
+        }
+        for(
+            std::map<RakNet::RakNetGUID,int>::iterator peer = peerIDs.begin();
+            peer != peerIDs.end();
+            peer++
+        )
+        {
+            if(peer->second==*it)
+            {
+                peerIDs.erase(peer);
+                break;
+            }
+        }
+        set<int>::iterator itold = it;
+        it++;
+        leavingPeerIDs.erase(itold);
+    }
+}
+
+void Client::sendRelayBlocks(const RakNet::SystemAddress &target,int second,const vector<int> &blockIndices)
+{
+    if(second!=staleSecond || !staleVerified)
+    {
+        //The spectator will find out at the next sync
+        printf("IGNORING RESYNC REQUEST FOR %d, OUR STALE BLOCKS ARE FROM %d%s\n",second,staleSecond,staleVerified?"":" AND UNCHECKED");
+        return;
+    }
+
+    //[block index][block]...[-1], just like the server sends them
+    relayStaging.clear();
+    for(int a=0; a<int(blockIndices.size()); a++)
+    {
+        int blockIndex = blockIndices[a];
+        if(blockIndex<0 || blockIndex>=int(staleBlocks.size()))
+        {
+            cout << "GOT A RESYNC REQUEST FOR AN INVALID BLOCK INDEX: " << blockIndex << endl;
+            continue;
+        }
+        MemoryBlock &staleBlock = staleBlocks[blockIndex];
+        int pos = int(relayStaging.size());
+        relayStaging.resize(pos+sizeof(int)+staleBlock.size);
+        memcpy(&relayStaging[pos],&blockIndex,sizeof(int));
+        memcpy(&relayStaging[pos+sizeof(int)],staleBlock.data,staleBlock.size);
+    }
+    int finishIndex = -1;
+    int pos = int(relayStaging.size());
+    relayStaging.resize(pos+sizeof(int));
+    memcpy(&relayStaging[pos],&finishIndex,sizeof(int));
+
+    //Resyncs are rare and hold only the bad blocks, so the fastest codec
+    //compresses them right here
+    int codec = SYNC_CODEC_LZ4;
+    int uncompressedSize = int(relayStaging.size());
+    RakNet::TimeUS compressStart = RakNet::GetTimeUS();
+    int compressedSize = syncPipeline.compress(codec,1,&relayStaging[0],uncompressedSize);
+    metrics.record(NET_HISTOGRAM_SYNC_COMPRESS_US,(long long)(RakNet::GetTimeUS()-compressStart));
+    metrics.record(NET_HISTOGRAM_SYNC_BYTES,compressedSize);
+    metrics.record(NET_HISTOGRAM_SYNC_COMPRESSED_PERCENT,(long long)compressedSize*100/uncompressedSize);
+
+    RakNet::BitStream stream(1+RESYNC_HEADER_SIZE+compressedSize);
+    unsigned char header = ID_RESYNC_COMPLETE;
+    stream.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+    stream.WriteBits((const unsigned char*)&uncompressedSize,8*sizeof(int));
+    stream.WriteBits((const unsigned char*)&compressedSize,8*sizeof(int));
+    stream.WriteBits((const unsigned char*)&codec,8*sizeof(int));
+    stream.WriteBits((const unsigned char*)&second,8*sizeof(int));
+    stream.WriteBits(syncPipeline.getCompressed(),8*compressedSize);
+    rakInterface->Send(&stream,HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SYNC,target,false);
+    metrics.add(NET_COUNTER_SYNC_BYTES,stream.GetNumberOfBytesUsed());
+    metrics.add(NET_COUNTER_RESYNCS);
+    printf("RESYNC OF %d KB IN %d BLOCKS SENT TO %s\n",uncompressedSize/1024,int(blockIndices.size()),target.ToString(true));
+}
+
+
+bool Client::openReplay(const string &filename,int seekSeconds,running_machine *machine)
+{
+    if(!replay.open(filename,seekSeconds))
+        return false;
+    if(replay.getGameName()!=machine->basename())
+    {
+        printf("ERROR: %s IS A RECORDING OF %s, NOT %s\n",filename.c_str(),replay.getGameName().c_str(),machine->basename());
+        replay.close();
+        return false;
+    }
+
+    //A replay is a spectator that reads a file: it has no ID, sends nothing
+    //and uses the inputs the recording's host consumed
+    replaying=true;
+    spectating=true;
+    selfPeerID=0;
+    initComplete=true;
+
+    //Loaded by loadCheckpoint, like the server's checkpoint of a late joiner
+    const RecordingRecord &keyframe = replay.getKeyframe();
+    serverCheckpoint.assign(keyframe.data.begin()+2,keyframe.data.end());
+
+    const vector<RecordingRecord> &seekRecords = replay.getSeekRecords();
+    for(int a=0; a<int(seekRecords.size()); a++)
+    {
+        replayRecord = seekRecords[a];
+        applyReplayRecord(replayRecord);
+    }
+    return true;
+}
+
+void Client::applyReplayRecord(RecordingRecord &record)
+{
+    if(record.data.empty())
+        return;
+    switch(record.data[0])
+    {
+    case ID_SPECTATOR_ROSTER:
+        applySpectatorRoster(&record.data[0]+1,int(record.data.size())-1);
+        break;
+    case ID_SPECTATOR_INPUTS:
+        receiveSpectatorInputs(&record.data[0]+1,int(record.data.size())-1);
+        break;
+    case ID_RECORDING_KEYFRAME:
+        if(record.data.size()<2)
+            break;
+        replayKeyframe.seconds = record.seconds;
+        replayKeyframe.attoseconds = record.attoseconds;
+        replayKeyframe.data.swap(record.data);
+        hasReplayKeyframe=true;
+        break;
+    default:
+        printf("UNEXPECTED RECORD ID IN THE REPLAY: %d\n",int(record.data[0]));
+        break;
+    }
+}
+
+bool Client::pumpReplay()
+{
+    bool readAny=false;
+    while(!hasReplayKeyframe && !replayEnded)
+    {
+        if(!replay.next(replayRecord))
+        {
+            replayEnded=true;
+            break;
+        }
+        applyReplayRecord(replayRecord);
+        readAny=true;
+    }
+    dropDrainedPeers();
+    return readAny;
+}
+
+void Client::applyReplayKeyframe(running_machine *machine)
+{
+    pumpReplay();
+    if(!hasReplayKeyframe)
+        return;
+
+    attotime keyframeTime(replayKeyframe.seconds,replayKeyframe.attoseconds);
+    attotime now = machine->time();
+    if(now<keyframeTime)
+        return;
+    if(now!=keyframeTime)
+    {
+        printf(
+            "ERROR: THE REPLAY PASSED THE KEYFRAME AT %d.%lld WITHOUT STOPPING THERE (NOW AT %d.%lld)\n",
+            replayKeyframe.seconds,
+            replayKeyframe.attoseconds,
+            int(now.seconds),
+            (long long)now.attoseconds
+            );
+    }
+
+    if(replayKeyframe.data[1]==RECORDING_KEYFRAME_SYNC)
+    {
+        //The host's state was replaced here, so ours is too
+        serverCheckpoint.assign(replayKeyframe.data.begin()+2,replayKeyframe.data.end());
+        loadCheckpoint(machine);
+    }
+    else
+    {
+        verifyReplayKeyframe(machine);
+    }
+    hasReplayKeyframe=false;
+}
+
+void Client::verifyReplayKeyframe(running_machine *machine)
+{
+    static vector<unsigned char> state;
+    if(!saveCheckpoint(machine,state))
+    {
+        printf("COULD NOT SAVE THE STATE TO CHECK IT AGAINST THE KEYFRAME AT %d\n",replayKeyframe.seconds);
+        return;
+    }
+
+    //Skip the record's id and reason
+    const unsigned char *recorded = &replayKeyframe.data[2];
+    int recordedSize = int(replayKeyframe.data.size())-2;
+    if(recordedSize!=int(state.size()))
+    {
+        printf("REPLAY DESYNC AT %d.%lld: THE STATE IS %d BYTES, THE RECORDING HAS %d\n",replayKeyframe.seconds,replayKeyframe.attoseconds,int(state.size()),recordedSize);
+        return;
+    }
+    int firstDifference=-1;
+    int numDifferences=0;
+    for(int a=0; a<recordedSize; a++)
+    {
+        if(state[a]!=recorded[a])
+        {
+            if(firstDifference<0)
+                firstDifference=a;
+            numDifferences++;
+        }
+    }
+    if(numDifferences)
+        printf("REPLAY DESYNC AT %d.%lld: %d BYTES DIFFER, THE FIRST AT OFFSET %d\n",replayKeyframe.seconds,replayKeyframe.attoseconds,numDifferences,firstDifference);
+    else
+        printf("REPLAY MATCHES THE RECORDING AT %d.%lld\n",replayKeyframe.seconds,replayKeyframe.attoseconds);
+}
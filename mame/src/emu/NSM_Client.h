@@ -15,32 +15,134 @@ class Client : public Common
 protected:
 
 	vector<MemoryBlock> syncCheckBlocks;
+	//Hash of every sync check block, only the blocks that changed are rehashed
+	vector<unsigned long long> syncCheckHashes;
+	//Emulated second syncCheckBlocks were copied at
+	int syncCheckSecond;
+
+	//The last block hashes from the server, waiting until we reach their second
+	vector<unsigned long long> syncHashes;
+	int syncHashesSecond;
+	bool hasSyncHashes;
+
+	//Emulated second the stale blocks hold, resyncs for any other are ignored
+	int staleSecond;
+	//Hash of every stale block, empty when they were written some other way
+	vector<unsigned long long> staleHashes;
+
+	RakNet::SystemAddress serverAddress;
     vector<unsigned char> incomingMsg;
 
     bool initComplete;
 
-	unsigned char *syncPtr;
-
 	bool firstResync;
 
+	//Scratch space for the initial sync chunk being applied
 	vector<unsigned char> initialSyncBuffer;
+	int initialSyncNextChunk;
+	unsigned char initialSyncChecksum;
+	bool initialSyncHasCheckpoint;
+
+	//The server's checkpoint, applied once the machine has been reset
+	vector<unsigned char> serverCheckpoint;
 
     RakNet::TimeUS timeBeforeSync;
 
-public:
-    Client() {}
+    //Players that left while we watch, they stay until we used their inputs
+    set<int> leavingPeerIDs;
+
+    //We serve spectators of our own once we have a checkpoint to start them
+    //from, and told our server so
+    bool relay;
+    bool announcedRelay;
+
+    //The stale blocks are the server's at staleSecond (they matched its
+    //hashes or were resynced), so our spectators can be resynced from them
+    bool staleVerified;
+    vector<unsigned char> relayStaging;
+
+    //Set when we play back a session recording (-netreplay) instead of
+    //connecting
+    bool replaying;
+    SessionPlayer replay;
+    RecordingRecord replayRecord;
+
+    //The next keyframe of the recording, the records after it aren't read
+    //until the emulation gets to it
+    RecordingRecord replayKeyframe;
+    bool hasReplayKeyframe;
+    bool replayEnded;
+
+    //Queues a roster or inputs record of the recording, or holds on to a
+    //keyframe
+    void applyReplayRecord(RecordingRecord &record);
+
+    //Reads the recording up to the next keyframe, false if nothing was read
+    bool pumpReplay();
+
+    //Compares our state with a periodic keyframe
+    void verifyReplayKeyframe(running_machine *machine);
+
+    //Name, the codecs we decode and whether we only watch
+    void sendClientInfo(const RakNet::SystemAddress &sa);
+
+    //Replaces the players with the ones our server watches.  Players that
+    //left are kept until their last inputs are used.
+    void applySpectatorRoster(const unsigned char *data,int size);
+
+    //Queues the inputs our server consumed
+    void receiveSpectatorInputs(const unsigned char *data,int size);
+
+    void dropDrainedPeers();
 
+    //Answers one of our spectators' ID_RESYNC_REQUEST from the stale blocks
+    void sendRelayBlocks(const RakNet::SystemAddress &target,int second,const vector<int> &blockIndices);
+
+public:
 	Client(string _username);
 
     void shutdown();
 
+    //Watch instead of playing.  A relay also sends the game on to
+    //spectators the server has no room for.
+    void setSpectator(bool relay);
+
+    inline bool isRelay()
+    {
+        return relay;
+    }
+
+    //Plays back a session recording instead of connecting, starting from
+    //the last keyframe at or before seekSeconds
+    bool openReplay(const string &filename,int seekSeconds,running_machine *machine);
+
+    inline bool isReplaying()
+    {
+        return replaying;
+    }
+
+    //Loads or checks the recording's next keyframe once the emulation got
+    //to its time.  Called between timeslices, where it was recorded.
+    void applyReplayKeyframe(running_machine *machine);
+
 	MemoryBlock createMemoryBlock(int size);
 
 	vector<MemoryBlock> createMemoryBlock(unsigned char* ptr,int size);
 
 	bool initializeConnection(unsigned short selfPort,const char *hostname,unsigned short port,running_machine *machine);
 
-	void updateSyncCheck();
+	void updateSyncCheck(int second);
+
+	//Hash of the live state, blocks that are clean since the last sync
+	//check reuse syncCheckHashes
+	unsigned long long stateHash()
+	{
+		return hashLiveBlocks(syncCheckHashes);
+	}
+
+    //Compares the server's block hashes with ours and asks for the blocks
+    //that differ
+    void checkSyncHashes();
 
     bool sync(running_machine *machine);
 
@@ -48,8 +150,14 @@ public:
 
     bool update(running_machine *machine);
 
-    void loadInitialData(unsigned char *data,int size,running_machine *machine);
+    //Decompresses and applies one chunk of the initial sync
+    bool loadInitialData(unsigned char *data,int size,running_machine *machine);
+
+    //Loads the server's checkpoint if the initial sync had one, the inputs
+    //that follow are replayed from there instead of from the start
+    void loadCheckpoint(running_machine *machine);
 
+    //Applies the blocks the server sent after checkSyncHashes asked for them
     bool resync(unsigned char *data,int size,running_machine *machine);
 
 	void checkMatch(Server *server);
@@ -5,132 +5,716 @@
 #include "RakNetTypes.h"
 #include "BitStream.h"
 #include "PacketLogger.h"
-#include "RakNetTypes.h"
+#include "PluginInterface2.h"
+#include "InternalPacket.h"
+#include "SignaledEvent.h"
 
 #include "NSM_Common.h"
+#include "NSM_Delta.h"
+
+#include "RakSleep.h"
 
 #include "osdcore.h"
 
 #include "LzmaEnc.h"
-#include "LzmaDec.h"
 
-SRes OnProgress(void *p, UInt64 inSize, UInt64 outSize)
+int zlibGetMaxCompressedSize(int origSize)
 {
-  // Update progress bar.
-  return SZ_OK;
+    return origSize*1.01 + 256;
 }
-ICompressProgress g_ProgressCallback = { &OnProgress };
+int lzmaGetMaxCompressedSize(int origSize)
+{
+    return origSize + origSize/3 + 256 + LZMA_PROPS_SIZE;
+}
+
+//Runs on RakNet's update thread: signals the network thread as soon as a
+//datagram carrying inputs shows up, so it can sleep instead of spinning.
+class InputArrivalNotifier : public RakNet::PluginInterface2
+{
+public:
+    RakNet::SignaledEvent inputArrivalEvent;
+
+    InputArrivalNotifier()
+    {
+        inputArrivalEvent.InitEvent();
+    }
+
+    virtual ~InputArrivalNotifier()
+    {
+        inputArrivalEvent.CloseEvent();
+    }
+
+    virtual void OnInternalPacket(RakNet::InternalPacket *internalPacket, unsigned frameNumber, RakNet::SystemAddress remoteSystemAddress, RakNet::TimeMS time, int isSend)
+    {
+        if(isSend || internalPacket->data==NULL)
+            return;
+        //Only the first piece of a split packet has the id
+        if(internalPacket->splitPacketCount>0 && internalPacket->splitPacketIndex!=0)
+            return;
+        unsigned char packetID = internalPacket->data[0];
+        if(
+            packetID==ID_CLIENT_INPUTS ||
+            packetID==ID_SERVER_INPUTS ||
+            packetID==ID_CLIENT_INPUT_FRAMES ||
+            packetID==ID_SERVER_INPUT_FRAMES ||
+            packetID==ID_SPECTATOR_INPUTS
+        )
+        {
+            inputArrivalEvent.SetEvent();
+        }
+    }
+};
+
+// Copied from Multiplayer.cpp
+// If the first byte is ID_TIMESTAMP, then we want the 5th byte
+// Otherwise we want the 1st byte
+extern unsigned char GetPacketIdentifier(RakNet::Packet *p);
+extern unsigned char *GetPacketData(RakNet::Packet *p);
+extern int GetPacketSize(RakNet::Packet *p);
 
-void * AllocForLzma(void *p, size_t size)
+Common::Common(string _username)
+    :
+    secondsBetweenSync(0),
+    dirtyPages(NULL),
+    selfPeerID(0),
+    username(_username),
+    spectating(false),
+    recorder(NULL),
+    startupTime(RakNet::GetTimeUS()),
+    inputNotifier(NULL),
+    networkThread(NULL),
+    emulatedSeconds(0),
+    emulatedAttoseconds(0),
+    totalStallTime(0),
+    totalStallCount(0),
+    impairLossPercent(0),
+    impairLatencyMS(0),
+    impairJitterMS(0),
+    firstFrameTime(0),
+    frameMS(0),
+    stallStartTime(0)
 {
-    void *ptr = malloc(size);
-    if(!ptr)
+    if(username.length()>16)
+    {
+        username = username.substr(0,16);
+    }
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
     {
-        cout << "FAILED TO ALLOCATE BLOCK OF SIZE " << size/1024.0/1024.0 << " MB " << endl;
+        slotPeerIDs[a] = 0;
+        slotAckTimes[a] = 0;
+        slotRequiredMS[a] = -1;
+        slotRemoteArrival[a] = 0;
+        slotAheadMS[a] = TIME_SYNC_UNKNOWN;
     }
-    return ptr;
+    registerMetrics();
 }
-void FreeForLzma(void *p, void *address)
+
+void Common::registerMetrics()
 {
-    free(address);
+    metrics.addCounter("frames");
+    metrics.addCounter("stalls");
+    metrics.addCounter("late_inputs");
+    metrics.addCounter("sync_bytes");
+    metrics.addCounter("resyncs");
+
+    metrics.addGauge("peers");
+    metrics.addGauge("spectators");
+    metrics.addGauge("input_delay_frames");
+    metrics.addGauge("ahead_ms");
+    metrics.addGauge("speed_percent");
+    metrics.addGauge("stalls_per_minute");
+    metrics.addGauge("desyncs");
+    metrics.addGauge("hashes_checked");
+    metrics.addGauge("dropped_inputs");
+
+    metrics.addHistogram("rtt_ms");
+    metrics.addHistogram("input_lead_ms");
+    metrics.addHistogram("stall_us");
+    metrics.addHistogram("sync_build_us");
+    metrics.addHistogram("sync_compress_us");
+    metrics.addHistogram("sync_bytes");
+    metrics.addHistogram("sync_compressed_percent");
 }
-ISzAlloc SzAllocForLzma = { &AllocForLzma, &FreeForLzma };
 
-int zlibGetMaxCompressedSize(int origSize)
+void Common::attachInputNotifier()
 {
-    return origSize*1.01 + 256;
+    inputNotifier = new InputArrivalNotifier();
+    rakInterface->AttachPlugin(inputNotifier);
+    networkThread = new NetworkThread(rakInterface,&inputNotifier->inputArrivalEvent);
+    networkThread->setImpairment(impairLossPercent,impairLatencyMS,impairJitterMS);
 }
-int lzmaGetMaxCompressedSize(int origSize)
+
+void Common::detachInputNotifier()
 {
-    return origSize + origSize/3 + 256 + LZMA_PROPS_SIZE;
+    if(!inputNotifier)
+        return;
+    stopNetworkThread();
+    delete networkThread;
+    networkThread = NULL;
+    rakInterface->DetachPlugin(inputNotifier);
+    delete inputNotifier;
+    inputNotifier = NULL;
+}
+
+RakNet::Packet *Common::receivePacket()
+{
+    return networkThread->receive();
+}
+
+void Common::startNetworkThread()
+{
+    networkThread->start();
 }
 
-void lzmaCompress(
-    unsigned char* destBuf,
-    int &destSize,
-    unsigned char *srcBuf,
-    int srcSize,
-    int compressionLevel
-)
+void Common::stopNetworkThread()
 {
-    SizeT propsSize = LZMA_PROPS_SIZE;
+    if(networkThread)
+        networkThread->stop();
+}
 
-    SizeT lzmaDestSize = (SizeT)destSize;
+int Common::getSlotPeerID(int index,NetworkPeerSlot *slot)
+{
+    if(slotGUIDs[index]!=slot->guid)
+    {
+        //The slot was given to someone else since we last looked
+        slotGUIDs[index] = slot->guid;
+        slotPeerIDs[index] = 0;
+        slotAckTimes[index] = 0;
+        slotDelays[index].reset();
+        slotRequiredMS[index] = -1;
+        slotRemoteArrival[index] = 0;
+        slotAheadMS[index] = TIME_SYNC_UNKNOWN;
+    }
+    if(!slotPeerIDs[index])
+    {
+        std::map<RakNet::RakNetGUID,int>::iterator it = peerIDs.find(slot->guid);
+        if(it!=peerIDs.end())
+            slotPeerIDs[index] = it->second;
+    }
+    return slotPeerIDs[index];
+}
 
-    CLzmaEncProps props;
-    LzmaEncProps_Init(&props);
-    props.level = compressionLevel; //compression level
-    //props.dictSize = 1 << 16;
-    //props.dictSize = 1 << 24;
-    props.writeEndMark = 1; // 0 or 1
+int Common::findSlotIndex(const RakNet::RakNetGUID &guid)
+{
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(slot && slot->guid==guid)
+            return a;
+    }
+    return -1;
+}
 
-    int res = LzmaEncode(
-                  destBuf+LZMA_PROPS_SIZE, &lzmaDestSize,
-                  srcBuf, srcSize,
-                  &props, destBuf, &propsSize, props.writeEndMark,
-                  &g_ProgressCallback, &SzAllocForLzma, &SzAllocForLzma);
+void Common::pollNetworkPeers()
+{
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(!slot)
+            continue;
+        int peerID = getSlotPeerID(a,slot);
+
+        RakNet::TimeMS ackTime = slot->ackTime;
+        if(ackTime!=slotAckTimes[a])
+        {
+            slotAckTimes[a] = ackTime;
+            inputFrameSender.receivedAck(slot->guid,slot->ackSeq,ackTime);
+            int ping = rakInterface->GetLastPing(slot->guid);
+            if(ping>=0)
+                metrics.record(NET_HISTOGRAM_RTT_MS,ping);
+        }
+
+        double selfMS = emulatedSeconds*1000.0 + emulatedAttoseconds/1000000000000000.0;
+        for(NetworkTimingRecord *timing = slot->timings.front(); timing; timing = slot->timings.front())
+        {
+            slotDelays[a].addSample(timing->transitUS);
+            slotRemoteMS[a] = timing->seconds*1000.0 + timing->attoseconds/1000000000000000.0;
+            slotRemoteArrival[a] = timing->arrivalTime;
+            slot->timings.pop();
 
-    destSize = (int)lzmaDestSize + LZMA_PROPS_SIZE;
+            //How long before we need them the inputs in the packet got here
+            if(frameMS>0)
+            {
+                double leadMS = slotRemoteMS[a] + slot->peerLead*frameMS - selfMS;
+                if(leadMS<0)
+                    metrics.add(NET_COUNTER_LATE_INPUTS);
+                metrics.record(NET_HISTOGRAM_INPUT_LEAD_MS,(long long)max(0.0,leadMS));
+            }
+        }
+
+        if(!peerID)
+            continue;
+        for(NetworkHashRecord *record = slot->hashes.front(); record; record = slot->hashes.front())
+        {
+            stateHashes.addRemote(peerID,record->time,record->hash);
+            slot->hashes.pop();
+        }
+    }
+}
 
-    cout << "COMPRESSED " << srcSize << " BYTES DOWN TO " << destSize << endl;
+void Common::retireNetworkPeer(const RakNet::RakNetGUID &guid)
+{
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        if(slotGUIDs[a]==guid)
+        {
+            slotGUIDs[a] = RakNet::UNASSIGNED_RAKNET_GUID;
+            slotPeerIDs[a] = 0;
+        }
+    }
+    networkThread->retire(guid);
+}
 
-    if(res != SZ_OK || propsSize != LZMA_PROPS_SIZE)
+void Common::receiveLongInput(RakNet::Packet *p)
+{
+    int peerID = 1;
+    if(p->data[0]!=ID_SERVER_INPUTS)
     {
-        cout << "ERROR COMPRESSING DATA\n";
-        cout << res << ',' << propsSize << endl;
-        exit(1);
+        std::map<RakNet::RakNetGUID,int>::iterator it = peerIDs.find(p->guid);
+        if(it==peerIDs.end())
+        {
+            cout << "GOT INPUTS FROM UNKNOWN USER: " << p->systemAddress.ToString() << endl;
+            return;
+        }
+        peerID = it->second;
     }
+    localInputs[peerID].push_back(string((char*)GetPacketData(p),(int)GetPacketSize(p)));
 }
 
-void lzmaUncompress(
-    unsigned char* destBuf,
-    int destSize,
-    unsigned char *srcBuf,
-    int srcSize
-)
+void Common::getPendingInputs(int peerID,vector<string> &inputs)
 {
-    SizeT lzmaDestSize = (SizeT)destSize;
-    SizeT lzmaSrcSize = (SizeT)srcSize - LZMA_PROPS_SIZE;
+    if(!peerID)
+        return;
+    map<int,deque<string> >::iterator it = localInputs.find(peerID);
+    if(it!=localInputs.end())
+        inputs.insert(inputs.end(),it->second.begin(),it->second.end());
 
-    cout << "DECOMPRESSING " << srcSize << endl;
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(!slot || getSlotPeerID(a,slot)!=peerID)
+            continue;
+        for(int b=0; ; b++)
+        {
+            NetworkInputRecord *record = slot->inputs.peek(b);
+            if(!record)
+                break;
+            inputs.push_back(string(record->getData(),record->length));
+        }
+    }
+}
 
-    ELzmaStatus finishStatus;
-    int res = LzmaDecode(
-                  destBuf, &lzmaDestSize,
-                  srcBuf+LZMA_PROPS_SIZE, &lzmaSrcSize,
-                  srcBuf, LZMA_PROPS_SIZE, LZMA_FINISH_END,
-                  &finishStatus, &SzAllocForLzma);
+const string &Common::popPeerInput(int peerID)
+{
+    poppedInput.clear();
+    if(!peerID)
+        return poppedInput;
 
-    cout << "DECOMPRESSED " << srcSize << " BYTES DOWN TO " << lzmaDestSize << endl;
+    map<int,deque<string> >::iterator it = localInputs.find(peerID);
+    if(it!=localInputs.end() && !it->second.empty())
+    {
+        poppedInput.swap(it->second.front());
+        it->second.pop_front();
+    }
+    else
+    {
+        for(int a=0; a<NETWORK_MAX_PEERS; a++)
+        {
+            NetworkPeerSlot *slot = networkThread->getSlot(a);
+            if(!slot || getSlotPeerID(a,slot)!=peerID)
+                continue;
+            NetworkInputRecord *record = slot->inputs.front();
+            if(!record)
+                continue;
+            poppedInput.assign(record->getData(),record->length);
+            slot->inputs.pop();
+            break;
+        }
+    }
 
-    if(res != SZ_OK || finishStatus != LZMA_STATUS_FINISHED_WITH_MARK)
+    if(!poppedInput.empty())
     {
-        cout << "ERROR DECOMPRESSING DATA\n";
-        cout << res << ',' << finishStatus << endl;
-        exit(1);
+        if(recorder)
+            recorder->append(peerID,poppedInput);
+        inputHistory.append(peerID,poppedInput);
+        spectatorFeed.append(peerID,poppedInput);
     }
+    return poppedInput;
 }
 
-extern volatile bool memoryBlocksLocked;
+void Common::sendInputFrame(unsigned char framesPacketID,const string &inputString)
+{
+    //Chat messages are frames too, so they keep their place among the inputs
+    if(inputString.length()>INPUT_FRAME_MAX_LENGTH)
+    {
+        printf("ERROR: CAN'T SEND AN INPUT OF %d BYTES\n",int(inputString.length()));
+        return;
+    }
 
-// Copied from Multiplayer.cpp
-// If the first byte is ID_TIMESTAMP, then we want the 5th byte
-// Otherwise we want the 1st byte
-extern unsigned char GetPacketIdentifier(RakNet::Packet *p);
-extern unsigned char *GetPacketData(RakNet::Packet *p);
-extern int GetPacketSize(RakNet::Packet *p);
+    inputFrameSender.push(inputString);
+    pollNetworkPeers();
 
-Common::Common(string _username)
-    :
-    secondsBetweenSync(0),
-    selfPeerID(0),
-    username(_username),
-    startupTime(RakNet::GetTimeUS())
+    //Let everyone know what we have from them
+    vector<pair<RakNet::RakNetGUID,unsigned int> > acks;
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(!slot)
+            continue;
+        unsigned int lastSeq = slot->lastSeq;
+        if(lastSeq)
+            acks.push_back(pair<RakNet::RakNetGUID,unsigned int>(slot->guid,lastSeq));
+    }
+
+    RakNet::BitStream stream;
+    if(inputFrameSender.writeExpiredFrame(stream,framesPacketID,acks))
+    {
+        //Someone missed this frame in every redundant copy, make sure it gets there
+        sendToPlayers(
+            &stream,
+            IMMEDIATE_PRIORITY,
+            RELIABLE_ORDERED,
+            ORDERING_CHANNEL_CLIENT_INPUTS
+        );
+        stream.Reset();
+    }
+
+    inputFrameSender.writePacket(stream,framesPacketID,acks);
+
+    //The newest state hash rides along, older builds stop reading before it
+    StateHashTime hashTime;
+    unsigned long long hash;
+    bool hasHash = stateHashes.getOutgoing(hashTime,hash);
+    stream.Write(hasHash);
+    if(hasHash)
+    {
+        stream.Write(hashTime.first);
+        stream.Write(hashTime.second);
+        stream.Write(hash);
+    }
+
+    //Then when we sent this (in real and emulated time), our lead, and for
+    //every peer the delay we need from it and how far ahead of it we are
+    stream.Write(RakNet::GetTimeUS());
+    stream.Write(emulatedSeconds);
+    stream.Write(emulatedAttoseconds);
+    stream.Write((unsigned char)min(255,inputDelay.getLead()));
+    int numPeers=0;
+    int peerSlots[NETWORK_MAX_PEERS];
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(slot && slotGUIDs[a]==slot->guid)
+            peerSlots[numPeers++] = a;
+    }
+    stream.Write((unsigned char)numPeers);
+    for(int a=0; a<numPeers; a++)
+    {
+        int slotIndex = peerSlots[a];
+        stream.Write(slotGUIDs[slotIndex]);
+        stream.Write((unsigned short)(slotRequiredMS[slotIndex]<0?NETWORK_DELAY_UNKNOWN:min(NETWORK_DELAY_UNKNOWN-1,slotRequiredMS[slotIndex])));
+        stream.Write((short)slotAheadMS[slotIndex]);
+    }
+
+    sendToPlayers(
+        &stream,
+        IMMEDIATE_PRIORITY,
+        UNRELIABLE_SEQUENCED,
+        ORDERING_CHANNEL_INPUT_FRAMES
+    );
+}
+
+void Common::sendToPlayers(const char *data,int length,PacketPriority priority,PacketReliability reliability,char orderingChannel)
 {
-    if(username.length()>16)
+    if(!spectatorFeed.getNumSpectators())
     {
-        username = username.substr(0,16);
+        rakInterface->Send(data,length,priority,reliability,orderingChannel,RakNet::UNASSIGNED_SYSTEM_ADDRESS,true);
+        return;
     }
+    for(int a=0; a<rakInterface->NumberOfConnections(); a++)
+    {
+        RakNet::SystemAddress sa = rakInterface->GetSystemAddressFromIndex(a);
+        if(spectatorFeed.hasSpectator(sa))
+            continue;
+        rakInterface->Send(data,length,priority,reliability,orderingChannel,sa,false);
+    }
+}
+
+void Common::sendToPlayers(RakNet::BitStream *stream,PacketPriority priority,PacketReliability reliability,char orderingChannel)
+{
+    sendToPlayers((const char*)stream->GetData(),int(stream->GetNumberOfBytesUsed()),priority,reliability,orderingChannel);
+}
+
+void Common::admitSpectator(RakNet::Packet *p,running_machine *machine)
+{
+    //A relay can only start spectators from a checkpoint of its own
+    if(spectatorFeed.isFull() || (spectating && checkpoint.empty()))
+    {
+        vector<RakNet::SystemAddress> relays;
+        spectatorFeed.getRelays(relays);
+        printf("NO ROOM FOR SPECTATOR %s, SENDING IT TO ONE OF %d RELAYS\n",p->systemAddress.ToString(true),int(relays.size()));
+
+        //[count][address\0]...
+        RakNet::BitStream stream;
+        unsigned char header = ID_SPECTATOR_REDIRECT;
+        int numRelays = int(relays.size());
+        stream.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+        stream.WriteBits((const unsigned char*)&numRelays,8*sizeof(int));
+        for(int a=0; a<numRelays; a++)
+        {
+            const char *address = relays[a].ToString(true);
+            stream.WriteBits((const unsigned char*)address,8*int(strlen(address)+1));
+        }
+        rakInterface->Send(&stream,HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SYNC,p->systemAddress,false);
+        rakInterface->CloseConnection(p->systemAddress,true,ORDERING_CHANNEL_SYNC);
+        return;
+    }
+
+    //Everything consumed until now is in the initial sync, everything after
+    //it comes from the feed
+    flushSpectatorFeed();
+    spectatorFeed.add(p->systemAddress,p->guid);
+    printf("SPECTATOR %s JOINED (%d WATCHING FROM HERE)\n",p->systemAddress.ToString(true),spectatorFeed.getNumSpectators());
+
+    RakNet::BitStream rosterStream;
+    spectatorFeed.writeRoster(rosterStream,peerIDs,peerNames,true);
+    rakInterface->Send(&rosterStream,HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SPECTATOR,p->systemAddress,false);
+
+    initialSync(p->systemAddress,machine,true);
+}
+
+void Common::flushSpectatorFeed()
+{
+    if(!spectatorFeed.getNumSpectators())
+        return;
+
+    //The inputs go first, a spectator only lets a player go once it used
+    //everything that player sent
+    RakNet::BitStream inputStream;
+    bool hasInputs = spectatorFeed.writeInputs(inputStream);
+    RakNet::BitStream rosterStream;
+    bool hasRoster = spectatorFeed.writeRoster(rosterStream,peerIDs,peerNames,false);
+    for(int a=0; a<spectatorFeed.getNumSpectators(); a++)
+    {
+        const RakNet::SystemAddress &sa = spectatorFeed.getAddress(a);
+        if(hasInputs)
+            rakInterface->Send(&inputStream,HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SPECTATOR,sa,false);
+        if(hasRoster)
+            rakInterface->Send(&rosterStream,HIGH_PRIORITY,RELIABLE_ORDERED,ORDERING_CHANNEL_SPECTATOR,sa,false);
+    }
+}
+
+bool Common::startRecording(const string &filename,const string &gameName)
+{
+    stopRecording();
+    recorder = new SessionRecorder();
+    if(!recorder->open(filename,gameName))
+    {
+        delete recorder;
+        recorder = NULL;
+        return false;
+    }
+    return true;
+}
+
+void Common::stopRecording()
+{
+    if(!recorder)
+        return;
+    recorder->flush(emulatedSeconds,emulatedAttoseconds,peerIDs,peerNames);
+    recorder->close();
+    delete recorder;
+    recorder = NULL;
+}
+
+void Common::recordFrame(int seconds,long long attoseconds)
+{
+    if(recorder)
+        recorder->flush(seconds,attoseconds,peerIDs,peerNames);
+}
+
+void Common::setNetworkImpairment(float lossPercent,int latencyMS,int jitterMS)
+{
+    impairLossPercent = lossPercent;
+    impairLatencyMS = latencyMS;
+    impairJitterMS = jitterMS;
+}
+
+void Common::countFrame()
+{
+    if(!metrics.getCounter(NET_COUNTER_FRAMES))
+        firstFrameTime = RakNet::GetTimeUS();
+    metrics.add(NET_COUNTER_FRAMES);
+    if(metrics.isExportDue(RakNet::GetTimeMS()))
+        exportMetrics();
+}
+
+bool Common::startMetricsExport(const string &filename,int intervalMS)
+{
+    if(!metrics.openExport(filename,intervalMS))
+    {
+        printf("ERROR: COULD NOT OPEN %s FOR THE METRICS\n",filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+void Common::stopMetricsExport()
+{
+    if(!metrics.isExporting())
+        return;
+    //The last line covers the end of the session
+    exportMetrics();
+    metrics.closeExport();
+}
+
+void Common::exportMetrics()
+{
+    metrics.set(NET_GAUGE_PEERS,double(peerIDs.size()));
+    metrics.set(NET_GAUGE_SPECTATORS,spectatorFeed.getNumSpectators());
+    metrics.set(NET_GAUGE_INPUT_DELAY_FRAMES,inputDelay.getLead());
+    metrics.set(NET_GAUGE_AHEAD_MS,timeSync.getAheadMS());
+    metrics.set(NET_GAUGE_SPEED_PERCENT,timeSync.getSpeedPercent());
+    metrics.set(NET_GAUGE_STALLS_PER_MINUTE,stallMeter.getStallsPerMinute());
+    metrics.set(NET_GAUGE_DESYNCS,stateHashes.getNumDesyncs());
+    metrics.set(NET_GAUGE_HASHES_CHECKED,stateHashes.getNumChecked());
+    metrics.set(NET_GAUGE_DROPPED_INPUTS,networkThread?networkThread->getNumDroppedInputs():0);
+
+    char fields[256];
+    RakNet::TimeMS now = RakNet::GetTimeMS();
+    sprintf(
+        fields,
+        "\"time_ms\":%u,\"peer\":%d,\"emulated_seconds\":%.3f",
+        (unsigned int)now,
+        selfPeerID,
+        emulatedSeconds+emulatedAttoseconds/1000000000000000000.0
+    );
+    metrics.exportLine(now,fields);
+}
+
+void Common::recordStateHash(int seconds,long long attoseconds,unsigned long long hash)
+{
+    stateHashes.addLocal(StateHashTime(seconds,attoseconds),hash);
+}
+
+void Common::confirmStateHashes(int seconds,long long attoseconds)
+{
+    stateHashes.confirm(StateHashTime(seconds,attoseconds));
+}
+
+void Common::beginInputStall(int stalledPeerID)
+{
+    peerStallCount[stalledPeerID]++;
+    totalStallCount++;
+    metrics.add(NET_COUNTER_STALLS);
+    stallStartTime = RakNet::GetTimeUS();
+}
+
+void Common::endInputStall()
+{
+    if(!stallStartTime)
+        return;
+    metrics.record(NET_HISTOGRAM_STALL_US,(long long)(RakNet::GetTimeUS()-stallStartTime));
+    stallStartTime = 0;
+}
+
+void Common::waitForInputs(int stalledPeerID)
+{
+    RakNet::TimeUS waitStart = RakNet::GetTimeUS();
+    if(!networkThread)
+        RakSleep(0);
+    else
+        networkThread->waitForInputs(INPUT_WAIT_TIMEOUT_MS);
+    RakNet::TimeUS waited = RakNet::GetTimeUS() - waitStart;
+    peerStallTime[stalledPeerID] += waited;
+    totalStallTime += waited;
+}
+
+RakNet::TimeUS Common::getStallTime(int peerID)
+{
+    std::map<int,RakNet::TimeUS>::iterator it = peerStallTime.find(peerID);
+    if(it==peerStallTime.end())
+        return 0;
+    return it->second;
+}
+
+int Common::getStallCount(int peerID)
+{
+    std::map<int,int>::iterator it = peerStallCount.find(peerID);
+    if(it==peerStallCount.end())
+        return 0;
+    return it->second;
+}
+
+void Common::enableDirtyPageTracking()
+{
+    if(dirtyPages)
+        return;
+    if(!DirtyPageTracker::isSupported())
+    {
+        printf("DIRTY PAGE TRACKING IS NOT SUPPORTED ON THIS PLATFORM\n");
+        return;
+    }
+    if(!blocks.empty())
+    {
+        printf("ERROR: DIRTY PAGE TRACKING MUST BE ENABLED BEFORE BLOCKS ARE CREATED\n");
+        return;
+    }
+    dirtyPages = new DirtyPageTracker();
+    printf("TRACKING DIRTY PAGES (PAGE SIZE %d)\n",dirtyPages->getPageSize());
+}
+
+void Common::invalidateDirtyPages()
+{
+    if(dirtyPages)
+        dirtyPages->disarm();
+}
+
+//Copies the lines of live that differ over stale, returns true if any did
+static inline bool refreshStaleRange(const unsigned char *live,unsigned char *stale,int size)
+{
+    return xorDeltaAndUpdate(live,stale,NULL,size,NULL);
+}
+
+bool Common::refreshStaleBlock(int blockIndex)
+{
+    MemoryBlock &block = blocks[blockIndex];
+    MemoryBlock &staleBlock = staleBlocks[blockIndex];
+    if(!dirtyPages)
+    {
+        return refreshStaleRange(block.data,staleBlock.data,block.size);
+    }
+
+    static vector<pair<int,int> > dirtyRanges;
+    dirtyPages->getDirtyRanges(blockIndex,dirtyRanges);
+    bool dirty=false;
+    for(int a=0; a<int(dirtyRanges.size()); a++)
+    {
+        int offset = dirtyRanges[a].first;
+        if(refreshStaleRange(block.data+offset,staleBlock.data+offset,dirtyRanges[a].second))
+            dirty=true;
+    }
+    return dirty;
+}
+
+unsigned long long Common::hashLiveBlocks(const vector<unsigned long long> &armedHashes)
+{
+    bool reuse = dirtyPages && dirtyPages->isArmed() && armedHashes.size()==blocks.size();
+    static vector<pair<int,int> > dirtyRanges;
+    unsigned long long hash=0;
+    for(int blockIndex=0; blockIndex<int(blocks.size()); blockIndex++)
+    {
+        unsigned long long blockHash;
+        if(reuse)
+            dirtyPages->getDirtyRanges(blockIndex,dirtyRanges);
+        if(reuse && dirtyRanges.empty())
+            blockHash = armedHashes[blockIndex];
+        else
+            blockHash = hashBlock64(blocks[blockIndex].data,blocks[blockIndex].size);
+        //The multiply makes the result depend on the order
+        hash = (hash ^ blockHash) * 0x9e3779b97f4a7c15ULL;
+    }
+    return hash;
 }
 
 RakNet::SystemAddress Common::ConnectBlocking(const char *defaultAddress, unsigned short defaultPort)
@@ -150,31 +734,16 @@ RakNet::SystemAddress Common::ConnectBlocking(const char *defaultAddress, unsign
     RakNet::Packet *packet;
     while (1)
     {
-        for (packet=rakInterface->Receive(); packet; rakInterface->DeallocatePacket(packet), packet=rakInterface->Receive())
+        for (packet=receivePacket(); packet; rakInterface->DeallocatePacket(packet), packet=receivePacket())
         {
             if (packet->data[0]==ID_CONNECTION_REQUEST_ACCEPTED)
             {
                 printf("Connected!\n");
                 return packet->systemAddress;
             }
-            else if(packet->data[0]==ID_SERVER_INPUTS)
+            else if(packet->data[0]==ID_SERVER_INPUTS || packet->data[0]==ID_CLIENT_INPUTS)
             {
-                peerInputs[1].push_back(string(((char*)GetPacketData(packet)),(int)GetPacketSize(packet)));
-            }
-            else if(packet->data[0]==ID_CLIENT_INPUTS)
-            {
-                if(peerIDs.find(packet->guid)==peerIDs.end() || peerInputs.find(peerIDs[packet->guid])==peerInputs.end())
-                {
-                    if(unknownPeerInputs.find(packet->guid)==unknownPeerInputs.end())
-                    {
-                        unknownPeerInputs[packet->guid] = vector<string>();
-                    }
-                    unknownPeerInputs[packet->guid].push_back(string((char*)GetPacketData(packet),(int)GetPacketSize(packet)));
-                }
-                else
-                {
-                    peerInputs[peerIDs[packet->guid]].push_back(string((char*)GetPacketData(packet),(int)GetPacketSize(packet)));
-                }
+                receiveLongInput(packet);
             }
             else
             {
@@ -191,14 +760,85 @@ void Common::setSecondsBetweenSync(int _secondsBetweenSync)
     secondsBetweenSync = _secondsBetweenSync;
 }
 
-int Common::getLargestPing()
+void Common::setInputDelayTarget(double stallProbability,int minMS)
 {
-    int largestPing=1;
-    for(int a=0; a<rakInterface->NumberOfConnections(); a++)
+    inputDelay.setTarget(stallProbability,minMS);
+}
+
+int Common::updateInputLead(double _frameMS,int fixedLead)
+{
+    frameMS = _frameMS;
+    pollNetworkPeers();
+
+    //What each peer's inputs need to reach us, they get it with our inputs
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(!slot || slotGUIDs[a]!=slot->guid)
+            continue;
+        slotRequiredMS[a] = inputDelay.getRequiredMS(slotDelays[a],rakInterface->GetLowestPing(slot->guid));
+    }
+
+    if(fixedLead)
+        return inputDelay.fixLead(fixedLead);
+
+    //What our inputs need to reach every peer.  Until a peer has measured
+    //it, guess from the ping.
+    int requiredMS=0;
+    for(
+        std::map<RakNet::RakNetGUID,int>::iterator it = peerIDs.begin();
+        it != peerIDs.end();
+        it++
+    )
     {
-        largestPing = max(rakInterface->GetHighestPing(rakInterface->GetSystemAddressFromIndex(a)),largestPing);
+        if(it->second==selfPeerID)
+            continue;
+        int slotIndex = findSlotIndex(it->first);
+        int peerMS = -1;
+        if(slotIndex>=0)
+            peerMS = networkThread->getSlot(slotIndex)->requestedDelayMS;
+        if(peerMS<0)
+        {
+            int ping = rakInterface->GetAveragePing(it->first);
+            if(ping<0)
+                continue;
+            peerMS = INPUT_DELAY_MARGIN_MS + ping/2;
+        }
+        requiredMS = max(requiredMS,peerMS);
     }
-    return largestPing;
+    return inputDelay.update(requiredMS,frameMS);
+}
+
+void Common::updateTimeSync(int seconds,long long attoseconds)
+{
+    emulatedSeconds = seconds;
+    emulatedAttoseconds = attoseconds;
+    double selfMS = seconds*1000.0 + attoseconds/1000000000000000.0;
+    RakNet::TimeUS now = RakNet::GetTimeUS();
+
+    vector<double> peerAheadMS;
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = networkThread->getSlot(a);
+        if(!slot || slotGUIDs[a]!=slot->guid || !slotPeerIDs[a] || !slotRemoteArrival[a])
+            continue;
+
+        //Where the peer is now: where it was when it sent its last packet,
+        //plus the trip here, plus the time since
+        double sinceMS = min(double(TIME_SYNC_MAX_EXTRAPOLATION_MS),(now-slotRemoteArrival[a])/1000.0);
+        double remoteMS = slotRemoteMS[a] + rakInterface->GetLowestPing(slot->guid)/2.0 + sinceMS;
+        double aheadMS = selfMS-remoteMS;
+        slotAheadMS[a] = int(max(-32767.0,min(32767.0,aheadMS)));
+
+        //The peer measured the same thing from its side, the part of the
+        //trip we got wrong shows up in both with opposite signs
+        int theirAheadMS = slot->peerAheadMS;
+        if(theirAheadMS!=TIME_SYNC_UNKNOWN)
+            aheadMS = (aheadMS-theirAheadMS)/2.0;
+        peerAheadMS.push_back(aheadMS);
+    }
+    timeSync.update(peerAheadMS);
+    stallMeter.sample((long long)now,totalStallCount,(long long)totalStallTime);
 }
 
 bool Common::hasPeerWithID(int peerID)
@@ -228,8 +868,24 @@ string Common::getLatencyString(int peerID)
     {
         if(it->second==peerID)
         {
+            int jitterMS=0,peerLead=0;
+            int slotIndex = findSlotIndex(it->first);
+            if(slotIndex>=0)
+            {
+                jitterMS = slotDelays[slotIndex].getJitterMS(inputDelay.getStallProbability());
+                peerLead = networkThread->getSlot(slotIndex)->peerLead;
+            }
             char buf[4096];
-            sprintf(buf,"Peer %d: %d ms", peerID, rakInterface->GetHighestPing(it->first));
+            sprintf(
+                buf,
+                "Peer %d: %d ms, jitter %d ms, lead %d frames (stalled %d times, %.1f s)",
+                peerID,
+                rakInterface->GetHighestPing(it->first),
+                jitterMS,
+                peerLead,
+                getStallCount(peerID),
+                getStallTime(peerID)/1000000.0
+                );
             return string(buf);
         }
     }
@@ -256,9 +912,53 @@ string Common::getStatisticsString()
         );
         retval += string(message) + string("\n");
     }
+    {
+        char message[4096];
+        sprintf(
+            message,
+            "Desyncs: %d (%d hashes checked)\n"
+            "Input delay: %d frames\n"
+            "Ahead: %.1f ms (speed %d%%)\n"
+            "Stalls: %.1f/min, %.2f s/min\n",
+            stateHashes.getNumDesyncs(),
+            stateHashes.getNumChecked(),
+            inputDelay.getLead(),
+            timeSync.getAheadMS(),
+            timeSync.getSpeedPercent(),
+            stallMeter.getStallsPerMinute(),
+            stallMeter.getStallSecondsPerMinute()
+        );
+        retval += string(message);
+    }
     return retval;
 }
 
+string Common::getSummaryString()
+{
+    int numFrames = int(metrics.getCounter(NET_COUNTER_FRAMES));
+    double seconds = 0;
+    if(numFrames>1)
+        seconds = double(RakNet::GetTimeUS()-firstFrameTime)/1000000.0;
+    char message[4096];
+    sprintf(
+        message,
+        "peer=%d frames=%d seconds=%.2f fps=%.2f stalls=%d stallseconds=%.2f "
+        "syncbytes=%lld resyncs=%d desyncs=%d hashes=%d droppedinputs=%u",
+        selfPeerID,
+        numFrames,
+        seconds,
+        (seconds>0)?double(numFrames-1)/seconds:0.0,
+        totalStallCount,
+        double(totalStallTime)/1000000.0,
+        metrics.getCounter(NET_COUNTER_SYNC_BYTES),
+        int(metrics.getCounter(NET_COUNTER_RESYNCS)),
+        stateHashes.getNumDesyncs(),
+        stateHashes.getNumChecked(),
+        networkThread?networkThread->getNumDroppedInputs():0
+    );
+    return string(message);
+}
+
 vector<int> Common::getPeerIDs()
 {
     vector<int> retval;
@@ -275,11 +975,28 @@ vector<int> Common::getPeerIDs()
 
 int Common::getNumOtherPeers()
 {
+    if(spectating)
+        return int(peerIDs.size());
     return int(peerIDs.size())-1;
 }
 
 int Common::getOtherPeerID(int index)
 {
+    if(spectating)
+    {
+        //We aren't connected to the players, the roster says who they are
+        for(
+            std::map<RakNet::RakNetGUID,int>::iterator it = peerIDs.begin();
+            it != peerIDs.end();
+            it++, index--
+        )
+        {
+            if(!index)
+                return it->second;
+        }
+        return 0;
+    }
+
     int count=0;
     for(int a=0; a<rakInterface->NumberOfConnections(); a++)
     {
@@ -294,26 +1011,444 @@ int Common::getOtherPeerID(int index)
     return 0;
 }
 
-string Common::popInputBuffer(int clientIndex)
+const string &Common::popInputBuffer(int clientIndex)
 {
-    int peerID = getOtherPeerID(clientIndex);
-    if(peerInputs[peerID].empty())
-        return string("");
+    return popPeerInput(getOtherPeerID(clientIndex));
+}
 
-    string retval = peerInputs[peerID].front();
-    oldPeerInputs[peerID].push_back(retval);
-    peerInputs[peerID].erase(peerInputs[peerID].begin());
-    return retval;
+const string &Common::popSelfInputBuffer()
+{
+    return popPeerInput(selfPeerID);
 }
 
-string Common::popSelfInputBuffer()
+//The syncs below need the machine.  emu.h redefines delete, so it comes
+//after everything that deletes.
+#include "emu.h"
+#include "emuopts.h"
+#include "ui.h"
+
+extern attotime globalCurtime;
+extern bool waitingForClientCatchup;
+extern attotime oldInputTime;
+
+//Copies the input port state that is not part of the save state (inptport.c)
+extern int inputPortRollbackState(running_machine &machine,UINT8 *saveBuffer,const UINT8 *loadBuffer);
+
+//One independently compressed piece of the initial sync
+struct InitialSyncChunk
 {
-    int peerID = selfPeerID;
-    if(peerInputs[peerID].empty())
-        return string("");
+    vector<unsigned char> uncompressed;
+    vector<unsigned char> compressed;
+    LzmaEncoderPool *encoders;
+    osd_work_item *workItem;
 
-    string retval = peerInputs[peerID].front();
-    oldPeerInputs[peerID].push_back(retval);
-    peerInputs[peerID].erase(peerInputs[peerID].begin());
-    return retval;
+    InitialSyncChunk()
+        :
+        encoders(NULL),
+        workItem(NULL)
+    {
+    }
+};
+
+//An initial sync on its way to one peer.  The state is copied into the
+//chunks when the peer joins, workers compress them, and every update sends
+//the ones that are ready while the peer's send buffer has room.
+struct InitialSyncTransfer
+{
+    RakNet::SystemAddress target;
+    vector<InitialSyncChunk> chunks;
+    osd_work_queue *workQueue;
+    int nextChunk;
+    long long uncompressedTotal;
+    long long compressedTotal;
+    RakNet::TimeUS startTime;
+
+    InitialSyncTransfer()
+        :
+        workQueue(NULL),
+        nextChunk(0),
+        uncompressedTotal(0),
+        compressedTotal(0),
+        startTime(0)
+    {
+    }
+
+    ~InitialSyncTransfer()
+    {
+        //The workers write into the chunks, so they have to be done first
+        for(int a=0; a<int(chunks.size()); a++)
+        {
+            if(chunks[a].workItem)
+                osd_work_item_release(chunks[a].workItem);
+        }
+        if(workQueue)
+            osd_work_queue_free(workQueue);
+    }
+
+private:
+    InitialSyncTransfer(const InitialSyncTransfer &other);
+    InitialSyncTransfer &operator=(const InitialSyncTransfer &other);
+};
+
+static void appendSyncBytes(vector<unsigned char> &buffer,const void *data,int size)
+{
+    if(size<=0)
+        return;
+    int pos = int(buffer.size());
+    buffer.resize(pos+size);
+    memcpy(&buffer[pos],data,size);
+}
+
+//The client gets the stale data xored against the blocks it started with.
+//This copies the blocks as they are now, so later syncs don't change what
+//is sent.
+static void fillInitialSyncBlocks(
+    InitialSyncChunk &chunk,
+    const vector<MemoryBlock> &initialBlocks,
+    const vector<MemoryBlock> &staleBlocks,
+    int firstBlock,
+    int numBlocks,
+    unsigned char &checksum
+    )
+{
+    appendSyncBytes(chunk.uncompressed,&firstBlock,sizeof(int));
+    appendSyncBytes(chunk.uncompressed,&numBlocks,sizeof(int));
+    for(int blockIndex=firstBlock; blockIndex<firstBlock+numBlocks; blockIndex++)
+    {
+        int blockSize = initialBlocks[blockIndex].size;
+        appendSyncBytes(chunk.uncompressed,&blockSize,sizeof(int));
+        int pos = int(chunk.uncompressed.size());
+        chunk.uncompressed.resize(pos+blockSize);
+        unsigned char *out = &chunk.uncompressed[pos];
+        const unsigned char *initialData = initialBlocks[blockIndex].data;
+        const unsigned char *staleData = staleBlocks[blockIndex].data;
+        for(int a=0; a<blockSize; a++)
+        {
+            checksum ^= staleData[a];
+            out[a] = initialData[a] ^ staleData[a];
+        }
+    }
+}
+
+static void *compressInitialSyncChunk(void *param,int threadid)
+{
+    InitialSyncChunk *chunk = (InitialSyncChunk*)param;
+
+    int compressedSize = lzmaGetMaxCompressedSize(int(chunk->uncompressed.size()));
+    chunk->compressed.resize(compressedSize);
+    LzmaEncoder *encoder = chunk->encoders->acquire();
+    encoder->compress(
+        &chunk->compressed[0],
+        compressedSize,
+        &chunk->uncompressed[0],
+        int(chunk->uncompressed.size()),
+        6
+    );
+    chunk->encoders->release(encoder);
+    chunk->compressed.resize(compressedSize);
+    return NULL;
+}
+
+void Common::initialSync(const RakNet::SystemAddress &sa,running_machine *machine,bool spectator)
+{
+    unsigned char checksum = 0;
+
+    if(!spectator)
+    {
+        //We can't run until the new player's inputs come in
+        waitingForClientCatchup=true;
+        machine->osd().pauseAudio(true);
+    }
+
+    InitialSyncTransfer *transfer = global_alloc(InitialSyncTransfer);
+    transfer->target = sa;
+    transfer->startTime = RakNet::GetTimeUS();
+
+    cout << "SERVER: Sending initial snapshot\n";
+
+    //Chunk 0 holds the times and the block count, then come the blocks in
+    //groups of about INITIAL_SYNC_CHUNK_SIZE bytes, and the last chunk holds
+    //the input history, the checksum and the nvram.
+    vector<InitialSyncChunk> &chunks = transfer->chunks;
+    chunks.resize(1);
+    appendSyncBytes(chunks[0].uncompressed,&startupTime,sizeof(startupTime));
+    appendSyncBytes(chunks[0].uncompressed,&globalCurtime,sizeof(globalCurtime));
+
+    int numBlocks = getSecondsBetweenSync()?int(initialBlocks.size()):0;
+    cout << "NUMBLOCKS: " << numBlocks << endl;
+    appendSyncBytes(chunks[0].uncompressed,&numBlocks,sizeof(int));
+
+    //With a checkpoint the client starts from it and only replays the inputs
+    //since then, it comes right before the trailer
+    int hasCheckpoint = checkpoint.empty()?0:1;
+    appendSyncBytes(chunks[0].uncompressed,&hasCheckpoint,sizeof(int));
+
+    for(int blockIndex=0; blockIndex<numBlocks; )
+    {
+        int firstBlock = blockIndex;
+        int chunkBytes=0;
+        while(blockIndex<numBlocks && (blockIndex==firstBlock || chunkBytes+initialBlocks[blockIndex].size<=INITIAL_SYNC_CHUNK_SIZE))
+        {
+            chunkBytes += initialBlocks[blockIndex].size;
+            blockIndex++;
+        }
+        chunks.push_back(InitialSyncChunk());
+        fillInitialSyncBlocks(chunks.back(),initialBlocks,staleBlocks,firstBlock,blockIndex-firstBlock,checksum);
+    }
+    if(hasCheckpoint)
+    {
+        chunks.push_back(InitialSyncChunk());
+        chunks.back().uncompressed = checkpoint;
+    }
+    chunks.push_back(InitialSyncChunk());
+
+    InitialSyncChunk &trailer = chunks.back();
+    vector<int> syncPeerIDs = getPeerIDs();
+    for(int a=0; a<(int)syncPeerIDs.size(); a++)
+    {
+        int peerID = syncPeerIDs[a];
+        //A spectator gets the inputs we haven't consumed yet from the feed
+        vector<string> pendingInputs;
+        if(!spectator)
+            getPendingInputs(peerID,pendingInputs);
+        appendSyncBytes(trailer.uncompressed,&peerID,sizeof(int));
+        int numStrings = inputHistory.getNumRecords(peerID) + int(pendingInputs.size());
+        appendSyncBytes(trailer.uncompressed,&numStrings,sizeof(int));
+
+        //What we already consumed goes first so the client replays it in order
+        inputHistory.serialize(peerID,trailer.uncompressed,checksum);
+        for(int b=0; b<(int)pendingInputs.size(); b++)
+        {
+            int length = int(pendingInputs[b].length());
+            appendSyncBytes(trailer.uncompressed,&length,sizeof(int));
+            appendSyncBytes(trailer.uncompressed,pendingInputs[b].data(),length);
+
+            for(int c=0;c<length;c++)
+            {
+                checksum = checksum ^ pendingInputs[b][c];
+            }
+        }
+    }
+    int endOfInputs=-1;
+    appendSyncBytes(trailer.uncompressed,&endOfInputs,sizeof(int));
+
+    appendSyncBytes(trailer.uncompressed,&checksum,sizeof(checksum));
+    cout << "CHECKSUM: " << int(checksum) << endl;
+
+	// open the file; if it exists, call everyone to read from it
+	emu_file file(machine->options().nvram_directory(), OPEN_FLAG_READ);
+	if (file.open(machine->basename(), ".nv") == FILERR_NONE && file.size()<=1024*1024*64) //Don't bother sending huge NVRAM's
+    {
+        int nvramSize = file.size();
+        cout << "SENDING NVRAM OF SIZE: " << nvramSize << endl;
+        appendSyncBytes(trailer.uncompressed,&nvramSize,sizeof(int));
+        int pos = int(trailer.uncompressed.size());
+        trailer.uncompressed.resize(pos+nvramSize);
+        if(nvramSize)
+            file.read(&trailer.uncompressed[pos],nvramSize);
+        file.close();
+    }
+	else
+	{
+	    int dummy=0;
+        appendSyncBytes(trailer.uncompressed,&dummy,sizeof(int));
+	}
+
+    //The chunks are complete, the workers compress them while we play on
+    LzmaEncoderPool &encoders = syncPipeline.getLzmaEncoders();
+    encoders.prepare();
+    transfer->workQueue = osd_work_queue_alloc(WORK_QUEUE_FLAG_MULTI);
+    for(int a=0; a<int(chunks.size()); a++)
+    {
+        chunks[a].encoders = &encoders;
+        chunks[a].workItem = osd_work_item_queue(transfer->workQueue,compressInitialSyncChunk,&chunks[a],0);
+    }
+    initialSyncs.push_back(transfer);
+
+    oldInputTime.seconds = oldInputTime.attoseconds = 0;
+
+    printf("INITIAL SYNC PREPARED IN %d ms\n",int((RakNet::GetTimeUS()-transfer->startTime)/1000));
+    printf("INITIAL SYNC CHECKPOINT: %d KB, INPUT HISTORY: %d KB\n",int(checkpoint.size()/1024),inputHistory.getNumBytes()/1024);
+
+    //Send whatever is ready already
+    pumpInitialSyncs();
+}
+
+void Common::pumpInitialSyncs()
+{
+    for(int a=0; a<int(initialSyncs.size()); )
+    {
+        if(!sendInitialSyncChunks(*initialSyncs[a]))
+        {
+            a++;
+            continue;
+        }
+        global_free(initialSyncs[a]);
+        initialSyncs.erase(initialSyncs.begin()+a);
+    }
+}
+
+void Common::cancelInitialSyncs()
+{
+    for(int a=0; a<int(initialSyncs.size()); a++)
+    {
+        global_free(initialSyncs[a]);
+    }
+    initialSyncs.clear();
+}
+
+bool Common::sendInitialSyncChunks(InitialSyncTransfer &transfer)
+{
+    //Send the chunks in order as they finish compressing.  RakNet splits and
+    //paces each one itself, we only hold back while too much of this peer's
+    //data is still queued (so the pace follows the connection's bandwidth).
+    int numChunks = int(transfer.chunks.size());
+    while(transfer.nextChunk<numChunks)
+    {
+        RakNet::RakNetStatistics stats;
+        if(!rakInterface->GetStatistics(transfer.target,&stats))
+        {
+            printf("INITIAL SYNC TO %s ABANDONED, THE PEER IS GONE\n",transfer.target.ToString(true));
+            return true;
+        }
+        if(stats.bytesInSendBuffer[HIGH_PRIORITY]+double(stats.bytesInResendBuffer) >= INITIAL_SYNC_SEND_WINDOW)
+            return false;
+
+        int chunkIndex = transfer.nextChunk;
+        InitialSyncChunk &chunk = transfer.chunks[chunkIndex];
+        if(!osd_work_item_wait(chunk.workItem,0))
+            return false;
+        osd_work_item_release(chunk.workItem);
+        chunk.workItem = NULL;
+
+        int uncompressedSize = int(chunk.uncompressed.size());
+        int compressedSize = int(chunk.compressed.size());
+        RakNet::BitStream bitStreamPart(1+INITIAL_SYNC_CHUNK_HEADER_SIZE+compressedSize);
+        unsigned char header = (chunkIndex==numChunks-1)?ID_INITIAL_SYNC_COMPLETE:ID_INITIAL_SYNC_PARTIAL;
+        bitStreamPart.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+        bitStreamPart.WriteBits((const unsigned char*)&chunkIndex,8*sizeof(int));
+        bitStreamPart.WriteBits((const unsigned char*)&numChunks,8*sizeof(int));
+        bitStreamPart.WriteBits((const unsigned char*)&uncompressedSize,8*sizeof(int));
+        bitStreamPart.WriteBits((const unsigned char*)&compressedSize,8*sizeof(int));
+        bitStreamPart.WriteBits((const unsigned char*)&chunk.compressed[0],8*compressedSize);
+        rakInterface->Send(
+            &bitStreamPart,
+            HIGH_PRIORITY,
+            RELIABLE_ORDERED,
+            ORDERING_CHANNEL_SYNC,
+            transfer.target,
+            false
+        );
+        metrics.add(NET_COUNTER_SYNC_BYTES,bitStreamPart.GetNumberOfBytesUsed());
+        transfer.uncompressedTotal += uncompressedSize;
+        transfer.compressedTotal += compressedSize;
+        transfer.nextChunk++;
+
+        //Free the chunk as soon as RakNet has its own copy
+        vector<unsigned char>().swap(chunk.uncompressed);
+        vector<unsigned char>().swap(chunk.compressed);
+    }
+
+    printf("INITIAL UNCOMPRESSED SIZE: %d\n",int(transfer.uncompressedTotal));
+    printf("INITIAL COMPRESSED SIZE: %dKB IN %d CHUNKS\n",int(transfer.compressedTotal/1024),numChunks);
+    printf("INITIAL SYNC QUEUED IN %d ms\n",int((RakNet::GetTimeUS()-transfer.startTime)/1000));
+
+    cout << "FINISHED SENDING BLOCKS TO " << transfer.target.ToString(true) << "\n";
+    cout << "SERVER: Done with initial snapshot\n";
+    cout.flush();
+    return true;
+}
+
+bool Common::saveCheckpoint(running_machine *machine,vector<unsigned char> &out)
+{
+    if((machine->system().flags & GAME_SUPPORTS_SAVE) == 0 || !machine->scheduler().can_save())
+        return false;
+
+    attotime time = machine->time();
+    int stateSize = int(machine->save().snapshot_size());
+    int inputStateSize = inputPortRollbackState(*machine,NULL,NULL);
+    int headerSize = sizeof(int)+sizeof(long long)+sizeof(int)*2;
+    out.resize(headerSize+stateSize+inputStateSize);
+
+    unsigned char *ptr = &out[0];
+    int seconds = time.seconds;
+    long long attoseconds = time.attoseconds;
+    memcpy(ptr,&seconds,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr,&attoseconds,sizeof(long long));
+    ptr += sizeof(long long);
+    memcpy(ptr,&stateSize,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr,&inputStateSize,sizeof(int));
+    ptr += sizeof(int);
+    if(machine->save().save_snapshot(ptr)!=STATERR_NONE)
+        return false;
+    inputPortRollbackState(*machine,ptr+stateSize,NULL);
+
+    //The snapshot ran the pre-save functions, undo them like the syncs do or
+    //only the peers that capture would run them
+    machine->save().doPostLoad();
+    return true;
+}
+
+void Common::captureCheckpoint(running_machine *machine)
+{
+    if((machine->system().flags & GAME_SUPPORTS_SAVE) == 0 || !machine->scheduler().can_save())
+    {
+        //Keep the last good checkpoint and every input since it
+        return;
+    }
+
+    RakNet::TimeUS startTime = RakNet::GetTimeUS();
+
+    attotime time = machine->time();
+    int seconds = time.seconds;
+    if(!saveCheckpoint(machine,checkpoint))
+    {
+        printf("COULD NOT CHECKPOINT THE STATE, LATE JOINERS WILL REPLAY FROM THE START\n");
+        vector<unsigned char>().swap(checkpoint);
+        return;
+    }
+
+    //Reports sent before the checkpoint may be for frames after it, so keep
+    //a little more than strictly needed
+    attotime keepFrom = time;
+    if(keepFrom.seconds>=INPUT_HISTORY_MARGIN_SECONDS)
+        keepFrom.seconds -= INPUT_HISTORY_MARGIN_SECONDS;
+    else
+        keepFrom = attotime::zero;
+    inputHistory.trimBefore(keepFrom.seconds,keepFrom.attoseconds);
+
+    printf(
+        "CHECKPOINT AT %d: %d KB STATE, %d KB INPUT HISTORY IN %.2f ms\n",
+        seconds,
+        int(checkpoint.size()/1024),
+        inputHistory.getNumBytes()/1024,
+        (RakNet::GetTimeUS()-startTime)/1000.0
+        );
+}
+
+void Common::recordKeyframe(running_machine *machine,int reason)
+{
+    if(!recorder)
+        return;
+    if((machine->system().flags & GAME_SUPPORTS_SAVE) == 0)
+    {
+        printf("THIS GAME CAN'T SAVE ITS STATE, SO THE SESSION CAN'T BE RECORDED\n");
+        stopRecording();
+        return;
+    }
+
+    //Everything consumed before the keyframe goes before it, a replay never
+    //reads past a keyframe it didn't reach yet
+    attotime time = machine->time();
+    recorder->flush(time.seconds,time.attoseconds,peerIDs,peerNames);
+
+    static vector<unsigned char> keyframe;
+    if(!saveCheckpoint(machine,keyframe))
+    {
+        //An anonymous timer, a sync keyframe is retried next time
+        return;
+    }
+    recorder->addKeyframe(time.seconds,time.attoseconds,reason,keyframe);
 }
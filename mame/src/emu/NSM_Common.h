@@ -11,6 +11,9 @@
 //For RakNet::GetTimeUS
 #include "GetTime.h"
 
+//For PacketPriority and PacketReliability
+#include "PacketPriority.h"
+
 #include <algorithm>
 #include <cstdlib>
 #include <deque>
@@ -24,25 +27,57 @@
 
 #include "zlib.h"
 
+#include "NSM_DirtyPages.h"
+#include "NSM_InputDelay.h"
+#include "NSM_InputFrames.h"
+#include "NSM_InputHistory.h"
+#include "NSM_Metrics.h"
+#include "NSM_NetworkThread.h"
+#include "NSM_Recording.h"
+#include "NSM_Spectator.h"
+#include "NSM_StateHash.h"
+#include "NSM_SyncPipeline.h"
+#include "NSM_TimeSync.h"
+
 using namespace std;
 
 int zlibGetMaxCompressedSize(int origSize);
 int lzmaGetMaxCompressedSize(int origSize);
 
-void lzmaCompress(
-  unsigned char* destBuf,
-  int &destSize,
-  unsigned char *srcBuf,
-  int srcSize,
-  int compressionLevel
-  );
-
-void lzmaUncompress(
-  unsigned char* destBuf,
-  int destSize,
-  unsigned char *srcBuf,
-  int srcSize
-  );
+//What every peer measures (see Common::registerMetrics), in the order the
+//ids are registered
+enum NetplayCounter
+{
+    NET_COUNTER_FRAMES,
+    NET_COUNTER_STALLS,
+    NET_COUNTER_LATE_INPUTS,
+    NET_COUNTER_SYNC_BYTES,
+    NET_COUNTER_RESYNCS
+};
+
+enum NetplayGauge
+{
+    NET_GAUGE_PEERS,
+    NET_GAUGE_SPECTATORS,
+    NET_GAUGE_INPUT_DELAY_FRAMES,
+    NET_GAUGE_AHEAD_MS,
+    NET_GAUGE_SPEED_PERCENT,
+    NET_GAUGE_STALLS_PER_MINUTE,
+    NET_GAUGE_DESYNCS,
+    NET_GAUGE_HASHES_CHECKED,
+    NET_GAUGE_DROPPED_INPUTS
+};
+
+enum NetplayHistogram
+{
+    NET_HISTOGRAM_RTT_MS,
+    NET_HISTOGRAM_INPUT_LEAD_MS,
+    NET_HISTOGRAM_STALL_US,
+    NET_HISTOGRAM_SYNC_BUILD_US,
+    NET_HISTOGRAM_SYNC_COMPRESS_US,
+    NET_HISTOGRAM_SYNC_BYTES,
+    NET_HISTOGRAM_SYNC_COMPRESSED_PERCENT
+};
 
 enum OrderingChannelType
 {
@@ -50,6 +85,8 @@ enum OrderingChannelType
     ORDERING_CHANNEL_SERVER_INPUTS,
     ORDERING_CHANNEL_SYNC,
     ORDERING_CHANNEL_CONST_DATA,
+    ORDERING_CHANNEL_INPUT_FRAMES,
+    ORDERING_CHANNEL_SPECTATOR,
     ORDERING_CHANNEL_END
 };
 
@@ -67,11 +104,43 @@ enum CustomPacketType
     ID_HOST_ACCEPTED,
     ID_SEND_PEER_ID,
     ID_CLIENT_INFO,
+    ID_SERVER_INPUT_FRAMES,
+    ID_CLIENT_INPUT_FRAMES,
+    ID_SYNC_HASHES,
+    ID_RESYNC_REQUEST,
+    ID_SPECTATOR_ROSTER,
+    ID_SPECTATOR_INPUTS,
+    ID_SPECTATOR_REDIRECT,
+    ID_SPECTATOR_RELAY_READY,
+    //Never sent, marks the keyframes of a session recording
+    ID_RECORDING_KEYFRAME,
     ID_END
 };
 
+//The initial sync is cut into chunks of about this many bytes that are
+//compressed in parallel and applied by the client as they arrive
+#define INITIAL_SYNC_CHUNK_SIZE (1024*1024)
+
+//The server stops handing initial sync chunks to RakNet while this many
+//bytes are still waiting to be sent or acknowledged by the new peer
+#define INITIAL_SYNC_SEND_WINDOW (256*1024)
+
+//Every initial sync chunk starts with its index, the number of chunks,
+//its uncompressed size and its compressed size
+#define INITIAL_SYNC_CHUNK_HEADER_SIZE (sizeof(int)*4)
+
+//Every resync starts with its uncompressed size, compressed size, codec and
+//the emulated second of the sync it answers
+#define RESYNC_HEADER_SIZE (sizeof(int)*4)
+
 class Client;
 class Server;
+class InputArrivalNotifier;
+class running_machine;
+struct InitialSyncTransfer;
+
+//How long the input barrier sleeps when no input packet arrives
+#define INPUT_WAIT_TIMEOUT_MS (16)
 
 class MemoryBlock
 {
@@ -127,8 +196,14 @@ protected:
 
 	vector<MemoryBlock> blocks,staleBlocks;
 
+	//NULL unless -dirtypagetracking is on
+	DirtyPageTracker *dirtyPages;
+
 	z_stream strm;
 
+    //Compression state and buffers reused by every sync
+    SyncPipeline syncPipeline;
+
     int selfPeerID;
 
     std::map<RakNet::RakNetGUID,int> peerIDs;
@@ -136,19 +211,297 @@ protected:
     string username;
     std::map<int,string> peerNames;
 
-    map<int,vector< string > > peerInputs;
-    map<RakNet::RakNetGUID,vector< string > > unknownPeerInputs;
-    map<int,vector< string > > oldPeerInputs;
+    //Inputs that come from the emulation thread itself: our own, the ones
+    //an initial sync replays and the ones from peers that had no ring yet.
+    //All of them are older than what the network rings hold, so they are
+    //used first.
+    map<int,deque< string > > localInputs;
+
+    //Holds the input returned by the last pop
+    string poppedInput;
+
+    //What the emulation consumed since the last checkpoint (server and
+    //relays only)
+    InputHistory inputHistory;
+
+    //The stale blocks as they were at the first sync, the initial sync sends
+    //the stale blocks xored against them (server only)
+    vector<MemoryBlock> initialBlocks;
+
+    //The state at the last checkpoint, as the initial sync sends it:
+    //[seconds][attoseconds][state size][input port state size][state][input port state]
+    vector<unsigned char> checkpoint;
+
+    //Initial syncs still being sent, a few chunks every update
+    vector<InitialSyncTransfer*> initialSyncs;
+
+    //Spectators we send the game to ourselves
+    SpectatorFeed spectatorFeed;
+
+    //We only watch: we send no inputs and the players don't wait for us
+    bool spectating;
+
+    //NULL unless the session is being recorded (-netrecord)
+    SessionRecorder *recorder;
+
+    //Redundant, delta-encoded input frames (see NSM_InputFrames.h)
+    InputFrameSender inputFrameSender;
+
+    //Our state hashes and the ones peers sent with their input frames
+    StateHashTracker stateHashes;
 
     RakNet::TimeUS startupTime;
 
-public:
+    //Wakes the network thread when RakNet's thread receives inputs
+    InputArrivalNotifier *inputNotifier;
+
+    //Reads RakNet and decodes the inputs of every peer
+    NetworkThread *networkThread;
+
+    //What the emulation thread last saw in each network slot
+    RakNet::RakNetGUID slotGUIDs[NETWORK_MAX_PEERS];
+    int slotPeerIDs[NETWORK_MAX_PEERS];
+    RakNet::TimeMS slotAckTimes[NETWORK_MAX_PEERS];
+
+    //How late each slot's inputs reach us, and the delay we ask it for
+    InputDelayWindow slotDelays[NETWORK_MAX_PEERS];
+    int slotRequiredMS[NETWORK_MAX_PEERS];
+
+    //How far ahead our own inputs are stamped
+    InputDelayController inputDelay;
+
+    //Each slot's emulated time (in milliseconds) when its last packet was
+    //sent, when that packet arrived, and how far ahead of it we are
+    double slotRemoteMS[NETWORK_MAX_PEERS];
+    RakNet::TimeUS slotRemoteArrival[NETWORK_MAX_PEERS];
+    int slotAheadMS[NETWORK_MAX_PEERS];
+
+    //Our emulated time at the last frame
+    int emulatedSeconds;
+    long long emulatedAttoseconds;
+
+    //Nudges our speed to stay level with the peers
+    TimeSyncController timeSync;
+
+    std::map<int,RakNet::TimeUS> peerStallTime;
+    std::map<int,int> peerStallCount;
+    RakNet::TimeUS totalStallTime;
+    int totalStallCount;
+    StallMeter stallMeter;
+
+    //Given to the network thread when it is created
+    float impairLossPercent;
+    int impairLatencyMS;
+    int impairJitterMS;
+
+    //Counters, gauges and histograms for -netmetrics and getSummaryString
+    MetricsRegistry metrics;
+
+    //When the first frame was counted, and the frame length once known
+    RakNet::TimeUS firstFrameTime;
+    double frameMS;
+
+    //When the stall that is going on started
+    RakNet::TimeUS stallStartTime;
+
+    //Also creates the network thread, which isn't started yet
+    void attachInputNotifier();
+
+    //Registers the NetplayCounter, NetplayGauge and NetplayHistogram ids
+    void registerMetrics();
+
+    //Writes a line of metrics to the -netmetrics file
+    void exportMetrics();
+
+    //Sends to every connection but our spectators, they get the inputs
+    //from the feed
+    void sendToPlayers(const char *data,int length,PacketPriority priority,PacketReliability reliability,char orderingChannel);
+
+    void sendToPlayers(RakNet::BitStream *stream,PacketPriority priority,PacketReliability reliability,char orderingChannel);
+
+    //Handles a spectator's ID_CLIENT_INFO: starts sending it the game if
+    //there is room, otherwise sends it on to one of our relays
+    void admitSpectator(RakNet::Packet *p,running_machine *machine);
+
+    //Inputs and chat go out unreliable with redundancy, in one sequence
+    void sendInputFrame(unsigned char framesPacketID,const string &inputString);
+
+    void detachInputNotifier();
+
+    //The next packet that isn't an input, NULL if there is none.  The
+    //caller deallocates it.
+    RakNet::Packet *receivePacket();
+
+    //From here on RakNet is only read by the network thread
+    void startNetworkThread();
+
+    void stopNetworkThread();
+
+    //Applies the acks and state hashes the network thread received
+    void pollNetworkPeers();
+
+    //Peer ID of the slot's GUID, 0 if we don't know it yet
+    int getSlotPeerID(int index,NetworkPeerSlot *slot);
+
+    //Index of the slot that holds a peer's inputs, -1 if there is none
+    int findSlotIndex(const RakNet::RakNetGUID &guid);
+
+    //The peer left, stop reading what the network thread has from it
+    void retireNetworkPeer(const RakNet::RakNetGUID &guid);
+
+    //An input packet from a peer the network thread has no ring for yet.
+    //It is used before anything that ring gets later.
+    void receiveLongInput(RakNet::Packet *p);
+
+    //Copies the inputs from a peer that are waiting to be used
+    void getPendingInputs(int peerID,vector<string> &inputs);
+
+    //Returns the oldest waiting input from a peer, empty if there is none.
+    //The string is reused by the next pop.
+    const string &popPeerInput(int peerID);
+
+    //Lays out the machine state like a checkpoint.  False if it can't be
+    //saved right now.
+    static bool saveCheckpoint(running_machine *machine,vector<unsigned char> &out);
 
-    Common() {}
+public:
 
     Common(string _username);
 
-    int getLargestPing();
+    void enableDirtyPageTracking();
+
+    //Stops tracking until the next sync, every block is treated as dirty.
+    //Call before anything other than emulated code writes into the blocks.
+    void invalidateDirtyPages();
+
+    //Refreshes the stale copy of the parts of a block that may have changed
+    //since the last sync.  Returns true if anything did.
+    bool refreshStaleBlock(int blockIndex);
+
+    //Hashes the live blocks in order.  A block that wasn't written since the
+    //dirty page tracker was armed still holds what armedHashes[blockIndex]
+    //was computed from, so only the written blocks are hashed again.
+    unsigned long long hashLiveBlocks(const vector<unsigned long long> &armedHashes);
+
+    //Starts the initial sync of a new player or spectator.  The state is
+    //copied right away, pumpInitialSyncs sends it.  A spectator doesn't get
+    //the inputs we haven't consumed yet, the feed brings them.
+    void initialSync(const RakNet::SystemAddress &sa,running_machine *machine,bool spectator);
+
+    //Sends the compressed chunks of the initial syncs in progress while each
+    //peer's send buffer has room, never waits.  Called every update.
+    void pumpInitialSyncs();
+
+    //Drops the initial syncs in progress
+    void cancelInitialSyncs();
+
+    //Sends what it can of one initial sync, true once it is over
+    bool sendInitialSyncChunks(InitialSyncTransfer &transfer);
+
+    //Saves the machine state so late joiners can start from it, and forgets
+    //the inputs they no longer need to replay.  Call between timeslices.
+    void captureCheckpoint(running_machine *machine);
+
+    //Sends our spectators the inputs consumed since the last call (and the
+    //players, if they changed).  Called once per frame.
+    void flushSpectatorFeed();
+
+    //Records the session to filename until the peer shuts down
+    bool startRecording(const string &filename,const string &gameName);
+
+    void stopRecording();
+
+    inline bool isRecording()
+    {
+        return recorder!=NULL;
+    }
+
+    //Records the inputs consumed this frame, called once per frame
+    void recordFrame(int seconds,long long attoseconds);
+
+    //Records the state, called between timeslices
+    void recordKeyframe(running_machine *machine,int reason);
+
+    //True if the state was replaced (or recording just started), so a
+    //RECORDING_KEYFRAME_SYNC keyframe should be recorded as soon as possible
+    inline bool needsRecordingKeyframe()
+    {
+        return recorder && recorder->needsKeyframe();
+    }
+
+    inline void requestRecordingKeyframe()
+    {
+        if(recorder)
+            recorder->requestKeyframe();
+    }
+
+    //Impairs what we receive (see NetworkImpairment), call before
+    //initializeConnection
+    void setNetworkImpairment(float lossPercent,int latencyMS,int jitterMS);
+
+    //Counts a frame and writes the metrics when a line is due, called once
+    //per frame
+    void countFrame();
+
+    //Writes the metrics as a line of JSON to filename every intervalMS
+    //until the peer shuts down
+    bool startMetricsExport(const string &filename,int intervalMS);
+
+    void stopMetricsExport();
+
+    //One line of key=value pairs for soak runs (see src/tools/nsmsoak.c)
+    string getSummaryString();
+
+    //How many spectators we send the game to ourselves
+    void setSpectatorSlots(int slots)
+    {
+        spectatorFeed.setMaxSpectators(slots);
+    }
+
+    inline bool isSpectating()
+    {
+        return spectating;
+    }
+
+    //See InputDelayController::setTarget
+    void setInputDelayTarget(double stallProbability,int minMS);
+
+    //Called once per frame, returns how many frames ahead our inputs are
+    //stamped.  fixedLead is used instead of adapting when it isn't 0.
+    int updateInputLead(double frameMS,int fixedLead);
+
+    //Called once per frame with our emulated time, measures how far ahead
+    //of the peers we are
+    void updateTimeSync(int seconds,long long attoseconds);
+
+    //The throttle runs at this percentage of the normal speed
+    inline int getSpeedPercent()
+    {
+        return timeSync.getSpeedPercent();
+    }
+
+    //False while we are so far behind the peers that we shouldn't throttle
+    inline bool shouldThrottle()
+    {
+        return timeSync.shouldThrottle();
+    }
+
+    inline double getStallsPerMinute()
+    {
+        return stallMeter.getStallsPerMinute();
+    }
+
+    inline double getStallSecondsPerMinute()
+    {
+        return stallMeter.getStallSecondsPerMinute();
+    }
+
+    //Hash of our state at the frame that starts at seconds/attoseconds
+    void recordStateHash(int seconds,long long attoseconds,unsigned long long hash);
+
+    //Frames up to seconds/attoseconds won't be run again, their hashes are
+    //compared and sent from now on
+    void confirmStateHashes(int seconds,long long attoseconds);
 
     RakNet::SystemAddress ConnectBlocking(const char *defaultAddress, unsigned short defaultPort);
 
@@ -159,6 +512,13 @@ public:
 
     void setSecondsBetweenSync(int _secondsBetweenSync);
 
+    //The server checkpoints its state at every sync, or every
+    //INPUT_HISTORY_CHECKPOINT_SECONDS when syncs are off
+    int getCheckpointSeconds()
+    {
+        return secondsBetweenSync>0?secondsBetweenSync:INPUT_HISTORY_CHECKPOINT_SECONDS;
+    }
+
 	int getNumBlocks()
 	{
 		return int(blocks.size());
@@ -182,9 +542,24 @@ public:
 
     int getOtherPeerID(int a);
 
-    string popInputBuffer(int clientIndex);
+    //These return a string that is reused by the next pop
+    const string &popInputBuffer(int clientIndex);
+
+    const string &popSelfInputBuffer();
+
+    //Blocks until an input packet arrives or the timeout passes, the time
+    //spent is charged to the peer we are waiting for.
+    void waitForInputs(int stalledPeerID);
+
+    //Marks the start of a new stall on a peer (one per barrier that blocks)
+    void beginInputStall(int stalledPeerID);
+
+    //The barrier that blocked has its inputs now
+    void endInputStall();
+
+    RakNet::TimeUS getStallTime(int peerID);
 
-    string popSelfInputBuffer();
+    int getStallCount(int peerID);
 
     inline int getSelfPeerID()
     {
@@ -0,0 +1,395 @@
+#include "NSM_Delta.h"
+
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NSM_DELTA_SSE2
+#include <emmintrin.h>
+#endif
+
+//AVX2 is compiled per-function so the rest of the emulator does not need -mavx2.
+//The kernel is only used when the cpu reports support at runtime.
+#if defined(NSM_DELTA_SSE2) && defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define NSM_DELTA_AVX2
+#include <immintrin.h>
+#endif
+
+//Handles the partial line at the end of a block
+static inline bool xorDeltaTail(
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char &fold
+)
+{
+    unsigned char diff=0;
+    for(int a=0; a<size; a++)
+    {
+        diff |= live[a] ^ stale[a];
+    }
+    if(!diff)
+        return false;
+
+    for(int a=0; a<size; a++)
+    {
+        unsigned char delta = live[a] ^ stale[a];
+        if(deltaOut)
+            deltaOut[a] = delta;
+        fold ^= delta;
+    }
+    memcpy(stale,live,size);
+    return true;
+}
+
+static bool xorDeltaScalar(
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+)
+{
+    const int WORDS_PER_LINE = XOR_DELTA_LINE_SIZE/sizeof(uint64_t);
+    bool dirty=false;
+    uint64_t foldWord=0;
+    unsigned char fold=0;
+    int a=0;
+    for(; a+XOR_DELTA_LINE_SIZE<=size; a+=XOR_DELTA_LINE_SIZE)
+    {
+        uint64_t liveWords[WORDS_PER_LINE],staleWords[WORDS_PER_LINE];
+        memcpy(liveWords,live+a,XOR_DELTA_LINE_SIZE);
+        memcpy(staleWords,stale+a,XOR_DELTA_LINE_SIZE);
+        uint64_t diff=0;
+        for(int w=0; w<WORDS_PER_LINE; w++)
+        {
+            staleWords[w] ^= liveWords[w];
+            diff |= staleWords[w];
+        }
+        if(!diff) continue;
+
+        if(deltaOut)
+            memcpy(deltaOut+a,staleWords,XOR_DELTA_LINE_SIZE);
+        for(int w=0; w<WORDS_PER_LINE; w++)
+        {
+            foldWord ^= staleWords[w];
+        }
+        memcpy(stale+a,live+a,XOR_DELTA_LINE_SIZE);
+        dirty=true;
+    }
+    if(a<size && xorDeltaTail(live+a,stale+a,deltaOut?deltaOut+a:NULL,size-a,fold))
+    {
+        dirty=true;
+    }
+    if(checksum)
+    {
+        for(int b=0; b<(int)sizeof(uint64_t); b++)
+        {
+            fold ^= (unsigned char)(foldWord>>(b*8));
+        }
+        *checksum ^= fold;
+    }
+    return dirty;
+}
+
+#ifdef NSM_DELTA_SSE2
+static inline unsigned char foldBytes(const unsigned char *bytes,int count)
+{
+    unsigned char fold=0;
+    for(int a=0; a<count; a++)
+    {
+        fold ^= bytes[a];
+    }
+    return fold;
+}
+
+static bool xorDeltaSSE2(
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i foldVec = _mm_setzero_si128();
+    bool dirty=false;
+    unsigned char fold=0;
+    int a=0;
+    for(; a+XOR_DELTA_LINE_SIZE<=size; a+=XOR_DELTA_LINE_SIZE)
+    {
+        __m128i l0 = _mm_loadu_si128((const __m128i*)(live+a));
+        __m128i l1 = _mm_loadu_si128((const __m128i*)(live+a+16));
+        __m128i l2 = _mm_loadu_si128((const __m128i*)(live+a+32));
+        __m128i l3 = _mm_loadu_si128((const __m128i*)(live+a+48));
+        __m128i d0 = _mm_xor_si128(l0,_mm_loadu_si128((const __m128i*)(stale+a)));
+        __m128i d1 = _mm_xor_si128(l1,_mm_loadu_si128((const __m128i*)(stale+a+16)));
+        __m128i d2 = _mm_xor_si128(l2,_mm_loadu_si128((const __m128i*)(stale+a+32)));
+        __m128i d3 = _mm_xor_si128(l3,_mm_loadu_si128((const __m128i*)(stale+a+48)));
+        __m128i diff = _mm_or_si128(_mm_or_si128(d0,d1),_mm_or_si128(d2,d3));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(diff,zero))==0xFFFF) continue;
+
+        if(deltaOut)
+        {
+            _mm_storeu_si128((__m128i*)(deltaOut+a),d0);
+            _mm_storeu_si128((__m128i*)(deltaOut+a+16),d1);
+            _mm_storeu_si128((__m128i*)(deltaOut+a+32),d2);
+            _mm_storeu_si128((__m128i*)(deltaOut+a+48),d3);
+        }
+        foldVec = _mm_xor_si128(foldVec,_mm_xor_si128(_mm_xor_si128(d0,d1),_mm_xor_si128(d2,d3)));
+        _mm_storeu_si128((__m128i*)(stale+a),l0);
+        _mm_storeu_si128((__m128i*)(stale+a+16),l1);
+        _mm_storeu_si128((__m128i*)(stale+a+32),l2);
+        _mm_storeu_si128((__m128i*)(stale+a+48),l3);
+        dirty=true;
+    }
+    if(a<size && xorDeltaTail(live+a,stale+a,deltaOut?deltaOut+a:NULL,size-a,fold))
+    {
+        dirty=true;
+    }
+    if(checksum)
+    {
+        unsigned char foldVecBytes[16];
+        _mm_storeu_si128((__m128i*)foldVecBytes,foldVec);
+        *checksum ^= fold ^ foldBytes(foldVecBytes,16);
+    }
+    return dirty;
+}
+#endif
+
+#ifdef NSM_DELTA_AVX2
+__attribute__((target("avx2")))
+static bool xorDeltaAVX2(
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+)
+{
+    __m256i foldVec = _mm256_setzero_si256();
+    bool dirty=false;
+    unsigned char fold=0;
+    int a=0;
+    for(; a+XOR_DELTA_LINE_SIZE<=size; a+=XOR_DELTA_LINE_SIZE)
+    {
+        __m256i l0 = _mm256_loadu_si256((const __m256i*)(live+a));
+        __m256i l1 = _mm256_loadu_si256((const __m256i*)(live+a+32));
+        __m256i d0 = _mm256_xor_si256(l0,_mm256_loadu_si256((const __m256i*)(stale+a)));
+        __m256i d1 = _mm256_xor_si256(l1,_mm256_loadu_si256((const __m256i*)(stale+a+32)));
+        __m256i diff = _mm256_or_si256(d0,d1);
+        if(_mm256_testz_si256(diff,diff)) continue;
+
+        if(deltaOut)
+        {
+            _mm256_storeu_si256((__m256i*)(deltaOut+a),d0);
+            _mm256_storeu_si256((__m256i*)(deltaOut+a+32),d1);
+        }
+        foldVec = _mm256_xor_si256(foldVec,_mm256_xor_si256(d0,d1));
+        _mm256_storeu_si256((__m256i*)(stale+a),l0);
+        _mm256_storeu_si256((__m256i*)(stale+a+32),l1);
+        dirty=true;
+    }
+    if(a<size && xorDeltaTail(live+a,stale+a,deltaOut?deltaOut+a:NULL,size-a,fold))
+    {
+        dirty=true;
+    }
+    if(checksum)
+    {
+        unsigned char foldVecBytes[32];
+        _mm256_storeu_si256((__m256i*)foldVecBytes,foldVec);
+        *checksum ^= fold ^ foldBytes(foldVecBytes,32);
+    }
+    //Avoid the AVX->SSE transition penalty in the caller
+    _mm256_zeroupper();
+    return dirty;
+}
+#endif
+
+bool xorDeltaKernelSupported(XorDeltaKernelType kernel)
+{
+    switch(kernel)
+    {
+    case XOR_DELTA_KERNEL_AUTO:
+    case XOR_DELTA_KERNEL_SCALAR:
+        return true;
+#ifdef NSM_DELTA_SSE2
+    case XOR_DELTA_KERNEL_SSE2:
+        return true;
+#endif
+#ifdef NSM_DELTA_AVX2
+    case XOR_DELTA_KERNEL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2")!=0;
+#endif
+    default:
+        return false;
+    }
+}
+
+XorDeltaKernelType xorDeltaBestKernel()
+{
+    static XorDeltaKernelType bestKernel = XOR_DELTA_KERNEL_AUTO;
+    if(bestKernel==XOR_DELTA_KERNEL_AUTO)
+    {
+        if(xorDeltaKernelSupported(XOR_DELTA_KERNEL_AVX2))
+            bestKernel = XOR_DELTA_KERNEL_AVX2;
+        else if(xorDeltaKernelSupported(XOR_DELTA_KERNEL_SSE2))
+            bestKernel = XOR_DELTA_KERNEL_SSE2;
+        else
+            bestKernel = XOR_DELTA_KERNEL_SCALAR;
+    }
+    return bestKernel;
+}
+
+const char *xorDeltaKernelName(XorDeltaKernelType kernel)
+{
+    switch(kernel)
+    {
+    case XOR_DELTA_KERNEL_AUTO:
+        return "auto";
+    case XOR_DELTA_KERNEL_SCALAR:
+        return "scalar";
+    case XOR_DELTA_KERNEL_SSE2:
+        return "sse2";
+    case XOR_DELTA_KERNEL_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+bool xorDeltaAndUpdateWithKernel(
+    XorDeltaKernelType kernel,
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+)
+{
+    if(kernel==XOR_DELTA_KERNEL_AUTO)
+    {
+        kernel = xorDeltaBestKernel();
+    }
+    switch(kernel)
+    {
+#ifdef NSM_DELTA_AVX2
+    case XOR_DELTA_KERNEL_AVX2:
+        return xorDeltaAVX2(live,stale,deltaOut,size,checksum);
+#endif
+#ifdef NSM_DELTA_SSE2
+    case XOR_DELTA_KERNEL_SSE2:
+        return xorDeltaSSE2(live,stale,deltaOut,size,checksum);
+#endif
+    default:
+        return xorDeltaScalar(live,stale,deltaOut,size,checksum);
+    }
+}
+
+bool xorDeltaAndUpdate(
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+)
+{
+    return xorDeltaAndUpdateWithKernel(XOR_DELTA_KERNEL_AUTO,live,stale,deltaOut,size,checksum);
+}
+
+#define XXH_PRIME64_1 11400714785074694791ULL
+#define XXH_PRIME64_2 14029467366897019727ULL
+#define XXH_PRIME64_3 1609587929392839161ULL
+#define XXH_PRIME64_4 9650029242287828579ULL
+#define XXH_PRIME64_5 2870177450012600261ULL
+
+static inline uint64_t xxhRotl64(uint64_t value,int bits)
+{
+    return (value<<bits)|(value>>(64-bits));
+}
+
+static inline uint64_t xxhRead64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value,p,sizeof(value));
+    return value;
+}
+
+static inline uint64_t xxhRound(uint64_t acc,uint64_t input)
+{
+    acc += input*XXH_PRIME64_2;
+    acc = xxhRotl64(acc,31);
+    return acc*XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc,uint64_t value)
+{
+    acc ^= xxhRound(0,value);
+    return acc*XXH_PRIME64_1+XXH_PRIME64_4;
+}
+
+//Reads little endian words, like every machine the netplay code runs on
+unsigned long long hashBlock64(const unsigned char *data,int size)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = data+size;
+    uint64_t hash;
+
+    if(size>=32)
+    {
+        //Four independent lanes keep the multiplier busy
+        uint64_t v1 = XXH_PRIME64_1+XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0-XXH_PRIME64_1;
+        const unsigned char *limit = end-32;
+        do
+        {
+            v1 = xxhRound(v1,xxhRead64(p));
+            v2 = xxhRound(v2,xxhRead64(p+8));
+            v3 = xxhRound(v3,xxhRead64(p+16));
+            v4 = xxhRound(v4,xxhRead64(p+24));
+            p += 32;
+        }
+        while(p<=limit);
+
+        hash = xxhRotl64(v1,1)+xxhRotl64(v2,7)+xxhRotl64(v3,12)+xxhRotl64(v4,18);
+        hash = xxhMergeRound(hash,v1);
+        hash = xxhMergeRound(hash,v2);
+        hash = xxhMergeRound(hash,v3);
+        hash = xxhMergeRound(hash,v4);
+    }
+    else
+    {
+        hash = XXH_PRIME64_5;
+    }
+    hash += uint64_t(size);
+
+    for(; p+8<=end; p+=8)
+    {
+        hash ^= xxhRound(0,xxhRead64(p));
+        hash = xxhRotl64(hash,27)*XXH_PRIME64_1+XXH_PRIME64_4;
+    }
+    if(p+4<=end)
+    {
+        uint32_t word;
+        memcpy(&word,p,sizeof(word));
+        hash ^= uint64_t(word)*XXH_PRIME64_1;
+        hash = xxhRotl64(hash,23)*XXH_PRIME64_2+XXH_PRIME64_3;
+        p += 4;
+    }
+    for(; p<end; p++)
+    {
+        hash ^= uint64_t(*p)*XXH_PRIME64_5;
+        hash = xxhRotl64(hash,11)*XXH_PRIME64_1;
+    }
+
+    hash ^= hash>>33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash>>29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash>>32;
+    return hash;
+}
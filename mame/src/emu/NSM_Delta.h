@@ -0,0 +1,53 @@
+#ifndef __NSM_DELTA__
+#define __NSM_DELTA__
+
+//Size of the unit the delta kernels test for changes.  Lines that did not
+//change are never written, neither to the stale copy nor to the delta.
+#define XOR_DELTA_LINE_SIZE (64)
+
+enum XorDeltaKernelType
+{
+    XOR_DELTA_KERNEL_AUTO,
+    XOR_DELTA_KERNEL_SCALAR,
+    XOR_DELTA_KERNEL_SSE2,
+    XOR_DELTA_KERNEL_AVX2,
+    XOR_DELTA_KERNEL_END
+};
+
+//Single pass over a memory block:
+// - deltaOut (if not NULL) receives live^stale for every line that changed,
+//   the other lines are left as they were
+// - stale is refreshed with the live data for every line that changed
+// - checksum (if not NULL) is xor'ed with every byte of the delta
+//Returns true if any byte in the block changed.
+bool xorDeltaAndUpdate(
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+    );
+
+//Same as above, but forces a specific kernel (used by the benchmark)
+bool xorDeltaAndUpdateWithKernel(
+    XorDeltaKernelType kernel,
+    const unsigned char *live,
+    unsigned char *stale,
+    unsigned char *deltaOut,
+    int size,
+    unsigned char *checksum
+    );
+
+//Returns true if the kernel can run on this cpu/build
+bool xorDeltaKernelSupported(XorDeltaKernelType kernel);
+
+//The kernel that XOR_DELTA_KERNEL_AUTO resolves to
+XorDeltaKernelType xorDeltaBestKernel();
+
+const char *xorDeltaKernelName(XorDeltaKernelType kernel);
+
+//64-bit xxHash (XXH64, seed 0) of a memory block.  Syncs compare the blocks
+//of the server and the clients by these instead of sending them.
+unsigned long long hashBlock64(const unsigned char *data,int size);
+
+#endif
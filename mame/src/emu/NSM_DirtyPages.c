@@ -0,0 +1,297 @@
+#include "NSM_DirtyPages.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//Only one tracker can own the fault handler at a time (there is only ever
+//one Server or Client).
+static DirtyPageTracker *activeTracker=NULL;
+
+#ifdef _WIN32
+static PVOID faultHandlerHandle=NULL;
+
+static LONG CALLBACK dirtyPageFaultHandler(PEXCEPTION_POINTERS exceptionInfo)
+{
+    PEXCEPTION_RECORD record = exceptionInfo->ExceptionRecord;
+    if(
+        record->ExceptionCode==EXCEPTION_ACCESS_VIOLATION &&
+        record->NumberParameters>=2 &&
+        record->ExceptionInformation[0]==1 && //write
+        activeTracker &&
+        activeTracker->handleWriteFault((void*)record->ExceptionInformation[1])
+    )
+    {
+        return EXCEPTION_CONTINUE_EXECUTION;
+    }
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void installFaultHandler()
+{
+    if(!faultHandlerHandle)
+        faultHandlerHandle = AddVectoredExceptionHandler(1,dirtyPageFaultHandler);
+}
+
+static bool setPageProtection(unsigned char *start,int length,bool writable)
+{
+    DWORD oldProtect;
+    return VirtualProtect(start,length,writable?PAGE_READWRITE:PAGE_READONLY,&oldProtect)!=0;
+}
+
+static int getSystemPageSize()
+{
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    return int(systemInfo.dwPageSize);
+}
+#else
+static bool faultHandlerInstalled=false;
+static struct sigaction previousSegvAction;
+static struct sigaction previousBusAction;
+
+static void dirtyPageFaultHandler(int sig,siginfo_t *info,void *context)
+{
+    if(activeTracker && activeTracker->handleWriteFault(info->si_addr))
+    {
+        return;
+    }
+
+    //Not one of our pages, hand the fault to whoever was there before us
+    struct sigaction *previous = (sig==SIGBUS)?&previousBusAction:&previousSegvAction;
+    if((previous->sa_flags&SA_SIGINFO) && previous->sa_sigaction)
+    {
+        previous->sa_sigaction(sig,info,context);
+    }
+    else if(previous->sa_handler!=SIG_DFL && previous->sa_handler!=SIG_IGN)
+    {
+        previous->sa_handler(sig);
+    }
+    else
+    {
+        //Returning re-executes the faulting instruction with the default action
+        sigaction(sig,previous,NULL);
+    }
+}
+
+static void installFaultHandler()
+{
+    if(faultHandlerInstalled)
+        return;
+    struct sigaction action;
+    memset(&action,0,sizeof(action));
+    action.sa_sigaction = dirtyPageFaultHandler;
+    action.sa_flags = SA_SIGINFO|SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV,&action,&previousSegvAction);
+    //OS X reports protection faults as SIGBUS
+    sigaction(SIGBUS,&action,&previousBusAction);
+    faultHandlerInstalled=true;
+}
+
+static bool setPageProtection(unsigned char *start,int length,bool writable)
+{
+    return mprotect(start,length,writable?(PROT_READ|PROT_WRITE):PROT_READ)==0;
+}
+
+static int getSystemPageSize()
+{
+    return int(sysconf(_SC_PAGESIZE));
+}
+#endif
+
+static bool regionLess(const DirtyPageTracker::Region &a,const DirtyPageTracker::Region &b)
+{
+    return a.pageStart < b.pageStart;
+}
+
+DirtyPageTracker::DirtyPageTracker()
+    :
+    dirtyPages(NULL),
+    dirtyPagesSize(0),
+    pageSize(getSystemPageSize()),
+    armed(false)
+{
+}
+
+DirtyPageTracker::~DirtyPageTracker()
+{
+    disarm();
+    if(activeTracker==this)
+        activeTracker=NULL;
+    free((void*)dirtyPages);
+}
+
+bool DirtyPageTracker::isSupported()
+{
+    return getSystemPageSize()>0;
+}
+
+void DirtyPageTracker::addBlock(unsigned char *data,int size)
+{
+    if(armed)
+    {
+        disarm();
+    }
+
+    Block block;
+    block.data = data;
+    block.size = size;
+    block.numPages = 0;
+    block.firstFullPageOffset = 0;
+    block.dirtyOffset = 0;
+
+    size_t mask = size_t(pageSize)-1;
+    size_t firstPage = (size_t(data)+mask)&~mask;
+    size_t endPage = (size_t(data)+size_t(size))&~mask;
+    if(endPage>firstPage)
+    {
+        block.firstFullPageOffset = int(firstPage-size_t(data));
+        block.numPages = int((endPage-firstPage)/pageSize);
+    }
+    if(!blocks.empty())
+    {
+        block.dirtyOffset = blocks.back().dirtyOffset + blocks.back().numPages;
+    }
+    blocks.push_back(block);
+}
+
+void DirtyPageTracker::protectRegions(bool writable)
+{
+    for(int a=0; a<int(regions.size()); a++)
+    {
+        if(!setPageProtection(regions[a].pageStart,regions[a].numPages*pageSize,writable))
+        {
+            printf("ERROR: COULD NOT CHANGE PAGE PROTECTION FOR BLOCK %d\n",regions[a].blockIndex);
+        }
+    }
+}
+
+void DirtyPageTracker::arm()
+{
+    if(armed)
+    {
+        //Pages that were written since the last arm are writable again, lock them down
+        for(int a=0; a<int(regions.size()); a++)
+        {
+            const Block &block = blocks[regions[a].blockIndex];
+            for(int page=0; page<block.numPages; page++)
+            {
+                if(dirtyPages[block.dirtyOffset+page])
+                {
+                    dirtyPages[block.dirtyOffset+page]=0;
+                    setPageProtection(regions[a].pageStart+page*pageSize,pageSize,false);
+                }
+            }
+        }
+        return;
+    }
+
+    int totalPages = blocks.empty()?0:(blocks.back().dirtyOffset+blocks.back().numPages);
+    if(totalPages!=dirtyPagesSize)
+    {
+        free((void*)dirtyPages);
+        dirtyPages = (volatile unsigned char*)malloc(max(1,totalPages));
+        dirtyPagesSize = totalPages;
+    }
+    memset((void*)dirtyPages,0,max(1,totalPages));
+
+    regions.clear();
+    for(int a=0; a<int(blocks.size()); a++)
+    {
+        if(blocks[a].numPages)
+        {
+            Region region;
+            region.pageStart = blocks[a].data+blocks[a].firstFullPageOffset;
+            region.numPages = blocks[a].numPages;
+            region.blockIndex = a;
+            regions.push_back(region);
+        }
+    }
+    std::sort(regions.begin(),regions.end(),regionLess);
+
+    activeTracker = this;
+    installFaultHandler();
+    armed=true;
+    protectRegions(false);
+}
+
+void DirtyPageTracker::disarm()
+{
+    if(!armed)
+        return;
+    armed=false;
+    protectRegions(true);
+}
+
+void DirtyPageTracker::getDirtyRanges(int blockIndex,vector<pair<int,int> > &ranges)
+{
+    ranges.clear();
+    const Block &block = blocks[blockIndex];
+    if(!armed || block.numPages==0)
+    {
+        ranges.push_back(make_pair(0,block.size));
+        return;
+    }
+
+    if(block.firstFullPageOffset)
+    {
+        ranges.push_back(make_pair(0,block.firstFullPageOffset));
+    }
+    for(int page=0; page<block.numPages; page++)
+    {
+        if(!dirtyPages[block.dirtyOffset+page])
+            continue;
+        int offset = block.firstFullPageOffset + page*pageSize;
+        if(!ranges.empty() && ranges.back().first+ranges.back().second==offset)
+            ranges.back().second += pageSize;
+        else
+            ranges.push_back(make_pair(offset,pageSize));
+    }
+    int tailOffset = block.firstFullPageOffset + block.numPages*pageSize;
+    if(tailOffset<block.size)
+    {
+        if(!ranges.empty() && ranges.back().first+ranges.back().second==tailOffset)
+            ranges.back().second += block.size-tailOffset;
+        else
+            ranges.push_back(make_pair(tailOffset,block.size-tailOffset));
+    }
+}
+
+bool DirtyPageTracker::handleWriteFault(void *address)
+{
+    //Runs inside a signal handler: no allocation, no locks
+    if(!armed || regions.empty())
+        return false;
+
+    unsigned char *ptr = (unsigned char*)address;
+    int low=0;
+    int high=int(regions.size())-1;
+    while(low<high)
+    {
+        int mid = (low+high+1)/2;
+        if(regions[mid].pageStart<=ptr)
+            low=mid;
+        else
+            high=mid-1;
+    }
+    const Region &region = regions[low];
+    if(ptr<region.pageStart || ptr>=region.pageStart+size_t(region.numPages)*pageSize)
+        return false;
+
+    int page = int((ptr-region.pageStart)/pageSize);
+    dirtyPages[blocks[region.blockIndex].dirtyOffset+page]=1;
+    return setPageProtection(region.pageStart+page*pageSize,pageSize,true);
+}
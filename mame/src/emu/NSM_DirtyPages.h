@@ -0,0 +1,77 @@
+#ifndef __NSM_DIRTYPAGES__
+#define __NSM_DIRTYPAGES__
+
+#include <vector>
+#include <utility>
+
+//Records which pages of the registered memory blocks were written since the
+//tracker was last armed.  Pages that lie completely inside a block are made
+//read-only; the first write to each one faults, the fault handler marks the
+//page dirty and gives write access back.  The partial pages at the start and
+//end of a block cannot be protected without touching memory that does not
+//belong to it, so they are always reported as dirty.
+//
+//While the tracker is disarmed every block is reported as fully dirty.
+class DirtyPageTracker
+{
+public:
+    struct Region
+    {
+        unsigned char *pageStart;
+        int numPages;
+        int blockIndex;
+    };
+
+    DirtyPageTracker();
+    ~DirtyPageTracker();
+
+    static bool isSupported();
+
+    //Blocks must be added in the same order as Common::blocks
+    void addBlock(unsigned char *data,int size);
+
+    //Write-protect every trackable page and forget about previous writes
+    void arm();
+
+    //Give write access back to every page.  Must be called before anything
+    //outside of user space (e.g. a read() syscall) writes into a block.
+    void disarm();
+
+    inline bool isArmed()
+    {
+        return armed;
+    }
+
+    //Returns the (offset,length) pairs of a block that may have changed,
+    //adjacent dirty pages are merged.  Returns an empty list for a clean block.
+    void getDirtyRanges(int blockIndex,std::vector<std::pair<int,int> > &ranges);
+
+    //Called from the fault handler, returns false if the address is not ours
+    bool handleWriteFault(void *address);
+
+    inline int getPageSize()
+    {
+        return pageSize;
+    }
+
+protected:
+    struct Block
+    {
+        unsigned char *data;
+        int size;
+        int firstFullPageOffset;
+        int numPages;
+        int dirtyOffset;
+    };
+
+    std::vector<Block> blocks;
+    std::vector<Region> regions;
+    volatile unsigned char *dirtyPages;
+    int dirtyPagesSize;
+    int pageSize;
+    bool armed;
+
+    void protectRegions(bool writable);
+};
+
+#endif
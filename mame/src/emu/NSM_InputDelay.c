@@ -0,0 +1,117 @@
+#include "NSM_InputDelay.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+InputDelayWindow::InputDelayWindow()
+    :
+    samples(INPUT_DELAY_WINDOW),
+    numSamples(0),
+    nextSample(0)
+{
+}
+
+void InputDelayWindow::reset()
+{
+    numSamples = 0;
+    nextSample = 0;
+}
+
+void InputDelayWindow::addSample(long long transitUS)
+{
+    samples[nextSample] = transitUS;
+    nextSample = (nextSample+1)%INPUT_DELAY_WINDOW;
+    if(numSamples<INPUT_DELAY_WINDOW)
+        numSamples++;
+}
+
+int InputDelayWindow::getJitterMS(double stallProbability)
+{
+    if(!numSamples)
+        return 0;
+    sorted.assign(samples.begin(),samples.begin()+numSamples);
+    long long fastest = *min_element(sorted.begin(),sorted.end());
+
+    int index = int(ceil((1.0-stallProbability)*numSamples))-1;
+    index = max(0,min(numSamples-1,index));
+    nth_element(sorted.begin(),sorted.begin()+index,sorted.end());
+    return int((sorted[index]-fastest+999)/1000);
+}
+
+InputDelayController::InputDelayController()
+    :
+    stallProbability(0.01),
+    minMS(50),
+    lead(0),
+    framesSinceStep(0),
+    framesAbove(0)
+{
+}
+
+void InputDelayController::setTarget(double _stallProbability,int _minMS)
+{
+    stallProbability = max(0.0,min(1.0,_stallProbability));
+    minMS = max(0,_minMS);
+}
+
+int InputDelayController::getRequiredMS(InputDelayWindow &window,int lowestPingMS)
+{
+    if(window.getNumSamples()<INPUT_DELAY_MIN_SAMPLES)
+        return -1;
+    return INPUT_DELAY_MARGIN_MS + lowestPingMS/2 + window.getJitterMS(stallProbability);
+}
+
+int InputDelayController::update(int requiredMS,double frameMS)
+{
+    int minFrames = max(1,int(ceil(minMS/frameMS)));
+    int maxFrames = max(minFrames,int(ceil(INPUT_DELAY_MAX_MS/frameMS)));
+    int target = max(minFrames,min(maxFrames,int(ceil(requiredMS/frameMS))));
+
+    if(lead==0)
+    {
+        lead = target;
+        printf("INPUT DELAY STARTS AT %d FRAMES\n",lead);
+        return lead;
+    }
+
+    //Grow quickly enough to follow the network, shrink only once every
+    //peer has needed less for a while, so a ping spike doesn't make the
+    //lead bounce
+    framesSinceStep++;
+    if(target>lead)
+    {
+        framesAbove=0;
+        if(framesSinceStep>=INPUT_DELAY_STEP_FRAMES)
+        {
+            lead++;
+            framesSinceStep=0;
+            printf("INPUT DELAY UP TO %d FRAMES (PEERS NEED %d)\n",lead,target);
+        }
+    }
+    else if(target<lead)
+    {
+        framesAbove++;
+        if(framesAbove>=INPUT_DELAY_SHRINK_FRAMES && framesSinceStep>=INPUT_DELAY_STEP_FRAMES)
+        {
+            lead--;
+            framesSinceStep=0;
+            printf("INPUT DELAY DOWN TO %d FRAMES (PEERS NEED %d)\n",lead,target);
+        }
+    }
+    else
+    {
+        framesAbove=0;
+    }
+    return lead;
+}
+
+int InputDelayController::fixLead(int frames)
+{
+    lead = frames;
+    framesSinceStep = 0;
+    framesAbove = 0;
+    return lead;
+}
@@ -0,0 +1,100 @@
+#ifndef __NSM_INPUTDELAY__
+#define __NSM_INPUTDELAY__
+
+#include <vector>
+
+//Transit times each peer's window holds (about 15 seconds of input packets)
+#define INPUT_DELAY_WINDOW (1024)
+
+//Fewest transit times before a peer's window is trusted over its ping
+#define INPUT_DELAY_MIN_SAMPLES (32)
+
+//Time a receiver needs to move an input from the network to its timeline
+#define INPUT_DELAY_MARGIN_MS (20)
+
+//Longest input delay in milliseconds
+#define INPUT_DELAY_MAX_MS (600)
+
+//Frames between two one-frame changes of our lead
+#define INPUT_DELAY_STEP_FRAMES (15)
+
+//Frames every peer must ask for less than our lead before it shrinks
+#define INPUT_DELAY_SHRINK_FRAMES (180)
+
+//How long the input packets of one peer take to reach us.  The clocks of
+//the two machines aren't synchronized, so the transit times only tell how
+//much a packet was held up compared to the fastest one (the jitter).  The
+//fastest packet is assumed to take half the lowest ping.
+class InputDelayWindow
+{
+public:
+    InputDelayWindow();
+
+    void reset();
+
+    //transitUS is our clock when the packet arrived minus theirs when it
+    //was sent
+    void addSample(long long transitUS);
+
+    inline int getNumSamples() const
+    {
+        return numSamples;
+    }
+
+    //Jitter in milliseconds that only a fraction stallProbability of the
+    //packets in the window exceeded
+    int getJitterMS(double stallProbability);
+
+protected:
+    std::vector<long long> samples;
+    int numSamples;
+    int nextSample;
+
+    std::vector<long long> sorted;
+};
+
+//Picks how many frames ahead our inputs are stamped.  Every peer measures
+//how late our inputs reach it and asks for the delay it needs, the lead
+//covers the peer that needs the most and moves toward it one frame at a
+//time.  Each report carries the emulated time it is for, so whatever lead
+//a peer uses, every peer applies its inputs on the same frame.
+class InputDelayController
+{
+public:
+    InputDelayController();
+
+    //The delay is picked so that at most a fraction stallProbability of
+    //the input packets arrive too late, and is never below minMS
+    void setTarget(double stallProbability,int minMS);
+
+    inline double getStallProbability() const
+    {
+        return stallProbability;
+    }
+
+    //The delay in milliseconds a peer needs to get its inputs to us,
+    //-1 until the window has enough transit times
+    int getRequiredMS(InputDelayWindow &window,int lowestPingMS);
+
+    //Called once per frame with the most any peer needs, returns the lead
+    //in frames
+    int update(int requiredMS,double frameMS);
+
+    //Uses a lead that doesn't adapt (rollback hides the delay instead)
+    int fixLead(int frames);
+
+    inline int getLead() const
+    {
+        return lead;
+    }
+
+protected:
+    double stallProbability;
+    int minMS;
+
+    int lead;
+    int framesSinceStep;
+    int framesAbove;
+};
+
+#endif
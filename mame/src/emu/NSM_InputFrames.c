@@ -0,0 +1,389 @@
+#include "NSM_InputFrames.h"
+
+#include "GetTime.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+#define INPUT_FRAME_ATTOSECONDS_PER_SECOND (1000000000000000000LL)
+
+//Frames whose field bytes are all 0 or 1 can be sent one bit per field
+static bool isPackable(const string &frame)
+{
+    if(frame.length()<INPUT_FRAME_HEADER_SIZE || frame.length()>0xFFFF || frame[0]!=0)
+        return false;
+    for(int a=INPUT_FRAME_HEADER_SIZE; a<int(frame.length()); a++)
+    {
+        if(frame[a]!=0 && frame[a]!=1)
+            return false;
+    }
+    return true;
+}
+
+static void getFrameTime(const string &frame,int &seconds,long long &attoseconds)
+{
+    memcpy(&seconds,frame.data()+1,sizeof(int));
+    memcpy(&attoseconds,frame.data()+1+sizeof(int),sizeof(long long));
+}
+
+static void setFrameTime(string &frame,int seconds,long long attoseconds)
+{
+    memcpy(&frame[1],&seconds,sizeof(int));
+    memcpy(&frame[1+sizeof(int)],&attoseconds,sizeof(long long));
+}
+
+//Time between two frames in attoseconds, -1 if it is negative or too large
+static long long getFrameStep(const string &prev,const string &frame)
+{
+    int prevSeconds,seconds;
+    long long prevAttoseconds,attoseconds;
+    getFrameTime(prev,prevSeconds,prevAttoseconds);
+    getFrameTime(frame,seconds,attoseconds);
+    if(seconds<prevSeconds || seconds>prevSeconds+1)
+        return -1;
+    long long step = (seconds-prevSeconds)*INPUT_FRAME_ATTOSECONDS_PER_SECOND + (attoseconds-prevAttoseconds);
+    return (step<0)?-1:step;
+}
+
+//Small numbers in 3-bit groups, each followed by a continue bit
+static void writeVarUInt(RakNet::BitStream &stream,unsigned int value)
+{
+    do
+    {
+        unsigned char chunk = value&7;
+        value >>= 3;
+        stream.WriteBits(&chunk,3,true);
+        stream.Write(value!=0);
+    }
+    while(value);
+}
+
+static bool readVarUInt(RakNet::BitStream &stream,unsigned int &value)
+{
+    value=0;
+    for(int shift=0; shift<32; shift+=3)
+    {
+        unsigned char chunk=0;
+        bool more;
+        if(!stream.ReadBits(&chunk,3,true) || !stream.Read(more))
+            return false;
+        value |= (unsigned int)(chunk)<<shift;
+        if(!more)
+            return true;
+    }
+    return false;
+}
+
+static void writeFrame(RakNet::BitStream &stream,const string &frame,const string *prev,long long &lastStep)
+{
+    long long step = -1;
+    bool packable = isPackable(frame);
+    if(prev && packable && prev->length()==frame.length() && isPackable(*prev))
+    {
+        step = getFrameStep(*prev,frame);
+    }
+
+    stream.Write(step>=0);
+    if(step<0)
+    {
+        stream.Write((unsigned short)frame.length());
+        stream.Write(packable);
+        if(packable)
+        {
+            stream.WriteBits((const unsigned char*)frame.data(),INPUT_FRAME_HEADER_SIZE*8);
+            for(int a=INPUT_FRAME_HEADER_SIZE; a<int(frame.length()); a++)
+            {
+                stream.Write(frame[a]!=0);
+            }
+        }
+        else
+        {
+            stream.WriteBits((const unsigned char*)frame.data(),frame.length()*8);
+        }
+        lastStep = -1;
+        return;
+    }
+
+    //Frames are usually exactly one frame period apart
+    stream.Write(step==lastStep);
+    if(step!=lastStep)
+    {
+        stream.Write(step);
+        lastStep = step;
+    }
+
+    vector<int> changed;
+    for(int a=INPUT_FRAME_HEADER_SIZE; a<int(frame.length()); a++)
+    {
+        if(frame[a]!=(*prev)[a])
+            changed.push_back(a-INPUT_FRAME_HEADER_SIZE);
+    }
+    writeVarUInt(stream,(unsigned int)changed.size());
+    int nextIndex=0;
+    for(int a=0; a<int(changed.size()); a++)
+    {
+        writeVarUInt(stream,(unsigned int)(changed[a]-nextIndex));
+        nextIndex = changed[a]+1;
+    }
+}
+
+static bool readFrame(RakNet::BitStream &stream,string &frame,const string *prev,long long &lastStep)
+{
+    bool isDelta;
+    if(!stream.Read(isDelta))
+        return false;
+
+    if(!isDelta)
+    {
+        unsigned short length;
+        bool packable;
+        if(!stream.Read(length) || !stream.Read(packable))
+            return false;
+        frame.assign(length,0);
+        if(packable)
+        {
+            if(length<INPUT_FRAME_HEADER_SIZE || !stream.ReadBits((unsigned char*)&frame[0],INPUT_FRAME_HEADER_SIZE*8))
+                return false;
+            for(int a=INPUT_FRAME_HEADER_SIZE; a<int(length); a++)
+            {
+                bool value;
+                if(!stream.Read(value))
+                    return false;
+                frame[a] = value?1:0;
+            }
+        }
+        else if(length && !stream.ReadBits((unsigned char*)&frame[0],length*8))
+        {
+            return false;
+        }
+        lastStep = -1;
+        return true;
+    }
+
+    //The base frame has to have a time to step from
+    if(!prev || prev->length()<INPUT_FRAME_HEADER_SIZE)
+        return false;
+
+    bool sameStep;
+    if(!stream.Read(sameStep))
+        return false;
+    if(!sameStep && !stream.Read(lastStep))
+        return false;
+    if(lastStep<0)
+        return false;
+
+    frame = *prev;
+    int seconds;
+    long long attoseconds;
+    getFrameTime(frame,seconds,attoseconds);
+    attoseconds += lastStep;
+    while(attoseconds>=INPUT_FRAME_ATTOSECONDS_PER_SECOND)
+    {
+        attoseconds -= INPUT_FRAME_ATTOSECONDS_PER_SECOND;
+        seconds++;
+    }
+    setFrameTime(frame,seconds,attoseconds);
+
+    unsigned int numChanged;
+    if(!readVarUInt(stream,numChanged))
+        return false;
+    int nextIndex=0;
+    for(unsigned int a=0; a<numChanged; a++)
+    {
+        unsigned int gap;
+        if(!readVarUInt(stream,gap))
+            return false;
+        int index = INPUT_FRAME_HEADER_SIZE+nextIndex+int(gap);
+        if(index>=int(frame.length()))
+            return false;
+        frame[index] ^= 1;
+        nextIndex = index-INPUT_FRAME_HEADER_SIZE+1;
+    }
+    return true;
+}
+
+static void writeHeader(
+    RakNet::BitStream &stream,
+    unsigned char packetID,
+    const vector<pair<RakNet::RakNetGUID,unsigned int> > &acks
+    )
+{
+    stream.Write(packetID);
+    stream.Write((unsigned char)acks.size());
+    for(int a=0; a<int(acks.size()); a++)
+    {
+        stream.Write(acks[a].first);
+        stream.Write(acks[a].second);
+    }
+}
+
+static void writeFrames(RakNet::BitStream &stream,unsigned int firstSeq,const deque<string> &history,int first,int count)
+{
+    stream.Write(firstSeq);
+    stream.Write((unsigned char)count);
+    long long lastStep=-1;
+    for(int a=0; a<count; a++)
+    {
+        writeFrame(stream,history[first+a],a?&history[first+a-1]:NULL,lastStep);
+    }
+}
+
+InputFrameSender::InputFrameSender()
+    :
+    nextSeq(1)
+{
+}
+
+unsigned int InputFrameSender::push(const string &frame)
+{
+    history.push_back(frame);
+    return nextSeq++;
+}
+
+void InputFrameSender::receivedAck(const RakNet::RakNetGUID &guid,unsigned int seq,RakNet::TimeMS time)
+{
+    pair<unsigned int,RakNet::TimeMS> &ack = peerAcks[guid];
+    if(seq>ack.first)
+        ack.first = seq;
+    ack.second = time;
+}
+
+unsigned int InputFrameSender::getLowestAck()
+{
+    RakNet::TimeMS now = RakNet::GetTimeMS();
+    unsigned int lowest = nextSeq-1;
+    for(
+        map<RakNet::RakNetGUID,pair<unsigned int,RakNet::TimeMS> >::iterator it = peerAcks.begin();
+        it != peerAcks.end();
+        it++
+        )
+    {
+        if(now-it->second.second > INPUT_FRAME_ACK_TIMEOUT_MS)
+            continue;
+        if(it->second.first<lowest)
+            lowest = it->second.first;
+    }
+    return lowest;
+}
+
+void InputFrameSender::writePacket(
+    RakNet::BitStream &stream,
+    unsigned char packetID,
+    const vector<pair<RakNet::RakNetGUID,unsigned int> > &acks
+    )
+{
+    writeHeader(stream,packetID,acks);
+
+    //Resend everything someone is missing, but never less than the redundancy
+    long long newest = (long long)nextSeq-1;
+    long long oldestKept = newest-(long long)history.size()+1;
+    long long first = min(newest-INPUT_FRAME_REDUNDANCY+1,(long long)getLowestAck()+1);
+    first = max(first,max(oldestKept,newest-INPUT_FRAME_MAX_WINDOW+1));
+    writeFrames(stream,(unsigned int)first,history,int(first-oldestKept),int(newest-first+1));
+}
+
+bool InputFrameSender::writeExpiredFrame(
+    RakNet::BitStream &stream,
+    unsigned char packetID,
+    const vector<pair<RakNet::RakNetGUID,unsigned int> > &acks
+    )
+{
+    if(int(history.size())<=INPUT_FRAME_MAX_WINDOW)
+        return false;
+
+    unsigned int seq = nextSeq-(unsigned int)history.size();
+    bool missing = (seq>getLowestAck());
+    if(missing)
+    {
+        writeHeader(stream,packetID,acks);
+        writeFrames(stream,seq,history,0,1);
+    }
+    history.pop_front();
+    return missing;
+}
+
+InputFrameReceiver::InputFrameReceiver()
+    :
+    started(false),
+    failed(false),
+    lastSeq(0)
+{
+}
+
+bool InputFrameReceiver::addFrames(unsigned int firstSeq,const vector<string> &frames,vector<string> &inputs,int maxInputs)
+{
+    if(failed)
+        return false;
+    if(!started)
+    {
+        if(frames.empty())
+            return true;
+        //Anything older was part of the initial sync
+        started=true;
+        lastSeq = firstSeq-1;
+    }
+
+    for(int a=0; a<int(frames.size()); a++)
+    {
+        unsigned int seq = firstSeq+a;
+        if(seq>lastSeq)
+            pending[seq] = frames[a];
+    }
+
+    //Skipping the gap would acknowledge inputs nobody applied, so it stays
+    //open (and unacknowledged) until it is filled or we give up on the peer
+    if(!pending.empty() && pending.begin()->first!=lastSeq+1 && pending.size()>INPUT_FRAME_MAX_GAP_FRAMES)
+    {
+        printf("ERROR: LOST INPUT FRAMES %u TO %u\n",lastSeq+1,pending.begin()->first-1);
+        pending.clear();
+        failed = true;
+        return false;
+    }
+
+    //Frames that don't fit stay pending and unacknowledged, so they are
+    //still sent again until there is room
+    for(int count=0; count<maxInputs && !pending.empty() && pending.begin()->first==lastSeq+1; count++)
+    {
+        inputs.push_back(pending.begin()->second);
+        pending.erase(pending.begin());
+        lastSeq++;
+    }
+    return true;
+}
+
+bool readInputFrames(
+    RakNet::BitStream &stream,
+    const RakNet::RakNetGUID &selfGUID,
+    unsigned int &ackSeq,
+    unsigned int &firstSeq,
+    vector<string> &frames
+    )
+{
+    ackSeq=0;
+    unsigned char numAcks;
+    if(!stream.Read(numAcks))
+        return false;
+    for(int a=0; a<int(numAcks); a++)
+    {
+        RakNet::RakNetGUID guid;
+        unsigned int seq;
+        if(!stream.Read(guid) || !stream.Read(seq))
+            return false;
+        if(guid==selfGUID)
+            ackSeq = seq;
+    }
+
+    unsigned char numFrames;
+    if(!stream.Read(firstSeq) || !stream.Read(numFrames))
+        return false;
+    frames.resize(numFrames);
+    long long lastStep=-1;
+    for(int a=0; a<int(numFrames); a++)
+    {
+        if(!readFrame(stream,frames[a],a?&frames[a-1]:NULL,lastStep))
+            return false;
+    }
+    return true;
+}
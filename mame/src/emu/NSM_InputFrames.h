@@ -0,0 +1,110 @@
+#ifndef __NSM_INPUTFRAMES__
+#define __NSM_INPUTFRAMES__
+
+#include "RakNetTypes.h"
+#include "BitStream.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+//Every input packet carries at least this many of the most recent frames
+#define INPUT_FRAME_REDUNDANCY (4)
+
+//Frames that are still not acknowledged when they fall out of this window
+//are sent again on the reliable channel
+#define INPUT_FRAME_MAX_WINDOW (64)
+
+//Peers that have not acknowledged anything for this long no longer hold
+//the window open (they have probably left)
+#define INPUT_FRAME_ACK_TIMEOUT_MS (5000)
+
+//Size of the type byte and emulated time at the start of every input frame
+#define INPUT_FRAME_HEADER_SIZE (1+sizeof(int)+sizeof(long long))
+
+//Longest string a frame can carry.  Chat messages go in the same stream as
+//the inputs (so everyone applies them in the same order) and are kept
+//shorter than this.
+#define INPUT_FRAME_MAX_LENGTH (0xFFFF)
+
+//A gap in the frames that is still open once this many later frames are
+//waiting will not be filled (the sender resends a missing frame reliably
+//when it leaves the window)
+#define INPUT_FRAME_MAX_GAP_FRAMES (INPUT_FRAME_MAX_WINDOW*4)
+
+//Input frames are sent as a short run of consecutive frames.  The first
+//frame of a packet is bit-packed (one bit per field), the others only list
+//the fields that changed since the frame before them.  Packets also carry
+//the highest frame received from each peer, which lets the sender shrink
+//the run down to INPUT_FRAME_REDUNDANCY frames.
+class InputFrameSender
+{
+public:
+    InputFrameSender();
+
+    //Queues a frame, returns its sequence number
+    unsigned int push(const std::string &frame);
+
+    //time is when the ack arrived
+    void receivedAck(const RakNet::RakNetGUID &guid,unsigned int seq,RakNet::TimeMS time);
+
+    //Writes the frames that a peer may still be missing
+    void writePacket(
+        RakNet::BitStream &stream,
+        unsigned char packetID,
+        const std::vector<std::pair<RakNet::RakNetGUID,unsigned int> > &acks
+        );
+
+    //If the oldest frame is leaving the window before everyone has it,
+    //writes it alone so it can be sent reliably.
+    bool writeExpiredFrame(
+        RakNet::BitStream &stream,
+        unsigned char packetID,
+        const std::vector<std::pair<RakNet::RakNetGUID,unsigned int> > &acks
+        );
+
+protected:
+    std::deque<std::string> history;
+    unsigned int nextSeq;
+    std::map<RakNet::RakNetGUID,std::pair<unsigned int,RakNet::TimeMS> > peerAcks;
+
+    //Highest sequence number every active peer has, 0 if unknown
+    unsigned int getLowestAck();
+};
+
+class InputFrameReceiver
+{
+public:
+    InputFrameReceiver();
+
+    //Adds the frames of a packet, appends up to maxInputs of the ones that
+    //are now in order to inputs.  The rest stay pending for the next call.
+    //Frames are never skipped: returns false once a gap can't be filled any
+    //more, the peer's inputs are then lost for good.
+    bool addFrames(unsigned int firstSeq,const std::vector<std::string> &frames,std::vector<std::string> &inputs,int maxInputs);
+
+    //Highest sequence number handed out without gaps, 0 if none
+    inline unsigned int getLastSeq() const
+    {
+        return lastSeq;
+    }
+
+protected:
+    bool started;
+    bool failed;
+    unsigned int lastSeq;
+    std::map<unsigned int,std::string> pending;
+};
+
+//Reads a packet written by InputFrameSender (after the packet id).  Acks
+//addressed to selfGUID are returned in ackSeq (0 if there are none).
+bool readInputFrames(
+    RakNet::BitStream &stream,
+    const RakNet::RakNetGUID &selfGUID,
+    unsigned int &ackSeq,
+    unsigned int &firstSeq,
+    std::vector<std::string> &frames
+    );
+
+#endif
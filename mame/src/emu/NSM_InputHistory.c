@@ -0,0 +1,132 @@
+#include "NSM_InputHistory.h"
+
+#include "NSM_InputFrames.h"
+
+#include <cstring>
+
+using namespace std;
+
+InputHistory::InputHistory()
+    :
+    enabled(false)
+{
+}
+
+void InputHistory::append(int peerID,const string &input)
+{
+    if(!enabled)
+        return;
+
+    PeerHistory &history = peers[peerID];
+    int length = int(input.length());
+    int pos = int(history.data.size());
+    history.data.resize(pos+sizeof(int)+length);
+    memcpy(&history.data[pos],&length,sizeof(int));
+    if(length)
+        memcpy(&history.data[pos+sizeof(int)],input.data(),length);
+    history.numRecords++;
+}
+
+void InputHistory::trimBefore(int seconds,long long attoseconds)
+{
+    for(
+        map<int,PeerHistory>::iterator it = peers.begin();
+        it != peers.end();
+        )
+    {
+        PeerHistory &history = it->second;
+        int end = int(history.data.size());
+        int pos = history.start;
+        int dropped = 0;
+        while(pos<end)
+        {
+            int length;
+            memcpy(&length,&history.data[pos],sizeof(int));
+            const unsigned char *input = &history.data[pos+sizeof(int)];
+            if(length>=int(INPUT_FRAME_HEADER_SIZE) && input[0]==0)
+            {
+                //Reports are consumed in time order, so everything from the
+                //first new enough one on is kept
+                int reportSeconds;
+                long long reportAttoseconds;
+                memcpy(&reportSeconds,input+1,sizeof(int));
+                memcpy(&reportAttoseconds,input+1+sizeof(int),sizeof(long long));
+                if(reportSeconds>seconds || (reportSeconds==seconds && reportAttoseconds>=attoseconds))
+                    break;
+            }
+            pos += sizeof(int)+length;
+            dropped++;
+        }
+        history.start = pos;
+        history.numRecords -= dropped;
+
+        if(history.numRecords==0)
+        {
+            //Peers that left stop taking up room once their last report is old
+            map<int,PeerHistory>::iterator itold = it;
+            it++;
+            peers.erase(itold);
+            continue;
+        }
+
+        //Move the tail down once the dead space outgrows it, so the arena
+        //is reused instead of growing with the length of the session
+        if(history.start > end-history.start)
+        {
+            memmove(&history.data[0],&history.data[history.start],end-history.start);
+            history.data.resize(end-history.start);
+            history.start = 0;
+        }
+        it++;
+    }
+}
+
+int InputHistory::getNumRecords(int peerID) const
+{
+    map<int,PeerHistory>::const_iterator it = peers.find(peerID);
+    if(it==peers.end())
+        return 0;
+    return it->second.numRecords;
+}
+
+int InputHistory::getNumBytes() const
+{
+    int total=0;
+    for(
+        map<int,PeerHistory>::const_iterator it = peers.begin();
+        it != peers.end();
+        it++
+    )
+    {
+        total += int(it->second.data.size())-it->second.start;
+    }
+    return total;
+}
+
+void InputHistory::serialize(int peerID,vector<unsigned char> &out,unsigned char &checksum) const
+{
+    map<int,PeerHistory>::const_iterator it = peers.find(peerID);
+    if(it==peers.end())
+        return;
+
+    const PeerHistory &history = it->second;
+    int end = int(history.data.size());
+    if(end==history.start)
+        return;
+
+    int outPos = int(out.size());
+    out.resize(outPos+end-history.start);
+    memcpy(&out[outPos],&history.data[history.start],end-history.start);
+
+    for(int pos=history.start; pos<end; )
+    {
+        int length;
+        memcpy(&length,&history.data[pos],sizeof(int));
+        pos += sizeof(int);
+        for(int b=0; b<length; b++)
+        {
+            checksum = checksum ^ history.data[pos+b];
+        }
+        pos += length;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef __NSM_INPUTHISTORY__
+#define __NSM_INPUTHISTORY__
+
+#include <map>
+#include <string>
+#include <vector>
+
+//Without sync points the server still checkpoints this often
+#define INPUT_HISTORY_CHECKPOINT_SECONDS (10)
+
+//Reports this much older than a checkpoint are kept anyway, they may still
+//be waiting in a peer's queue when the checkpoint is taken
+#define INPUT_HISTORY_MARGIN_SECONDS (1)
+
+//The input strings each peer's emulation has already consumed, kept so a
+//late joiner can replay them on top of the last checkpoint.  Every peer's
+//strings are packed back to back in one byte arena, each one preceded by its
+//length, which is the same layout the initial sync sends them in.  Nothing is
+//recorded until the history is enabled (only the server needs it).
+class InputHistory
+{
+public:
+    InputHistory();
+
+    inline void enable()
+    {
+        enabled=true;
+    }
+
+    void append(int peerID,const std::string &input);
+
+    //Drops every report for a time before seconds/attoseconds, and anything
+    //the peer sent before the first report that is kept
+    void trimBefore(int seconds,long long attoseconds);
+
+    int getNumRecords(int peerID) const;
+
+    //Total bytes kept for every peer, including the length prefixes
+    int getNumBytes() const;
+
+    //Appends the peer's records as [length][bytes]..., xoring every input
+    //byte into checksum
+    void serialize(int peerID,std::vector<unsigned char> &out,unsigned char &checksum) const;
+
+protected:
+    struct PeerHistory
+    {
+        std::vector<unsigned char> data;
+        //Offset of the first record that was not trimmed
+        int start;
+        int numRecords;
+
+        PeerHistory()
+            :
+            start(0),
+            numRecords(0)
+        {
+        }
+    };
+
+    bool enabled;
+    std::map<int,PeerHistory> peers;
+};
+
+#endif
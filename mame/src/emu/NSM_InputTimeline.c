@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "NSM_InputTimeline.h"
+
+InputTimeline::InputTimeline()
+    :
+    wordsPerSlot(0),
+    origin(0,0),
+    period(0),
+    cachedTime(attotime::never),
+    cachedFrame(-1)
+{
+    //The bitsets are allocated once the number of inputs is known
+    for(int a=0; a<INPUT_TIMELINE_CAPACITY; a++)
+    {
+        slots[a].present = slots[a].values = slots[a].guessed = slots[a].guesses = NULL;
+    }
+    clear();
+}
+
+void InputTimeline::setNumInputs(int numInputs)
+{
+    wordsPerSlot = MAX(1,(numInputs+31)/32);
+    bits.assign(INPUT_TIMELINE_CAPACITY*wordsPerSlot*4,0);
+    for(int a=0; a<INPUT_TIMELINE_CAPACITY; a++)
+    {
+        slots[a].present = &bits[(a*4)*wordsPerSlot];
+        slots[a].values = &bits[(a*4+1)*wordsPerSlot];
+        slots[a].guessed = &bits[(a*4+2)*wordsPerSlot];
+        slots[a].guesses = &bits[(a*4+3)*wordsPerSlot];
+    }
+    clear();
+}
+
+void InputTimeline::clear()
+{
+    std::fill(bits.begin(),bits.end(),0);
+    for(int a=0; a<INPUT_TIMELINE_CAPACITY; a++)
+    {
+        slots[a].frame = -1;
+        slots[a].received = 0;
+    }
+    for(int a=0; a<INPUT_TIMELINE_MAX_PEERS; a++)
+    {
+        latestFrame[a] = previousFrame[a] = -1;
+        latestTime[a] = previousTime[a] = attotime::zero;
+    }
+    newestFrame = -1;
+    numFrames = 0;
+    mispredictedFrame = -1;
+    cachedTime = attotime::never;
+    cachedFrame = -1;
+}
+
+void InputTimeline::setGrid(const attotime &_origin,attoseconds_t _period)
+{
+    origin = _origin;
+    period = _period;
+    clear();
+}
+
+attotime InputTimeline::frameTime(INT64 frame) const
+{
+    return origin + attotime(0,period)*UINT32(frame);
+}
+
+bool InputTimeline::frameAtOrAfter(const attotime &time,INT64 &frame)
+{
+    if(!period || time<origin)
+        return false;
+    if(time==cachedTime)
+    {
+        frame = cachedFrame;
+        return true;
+    }
+
+    //Estimate with floating point, then settle on the exact frame
+    double estimate = ceil((time-origin).as_double()/ATTOSECONDS_TO_DOUBLE(period));
+    if(estimate>=4294967295.0)
+        return false;
+    INT64 candidate = INT64(estimate);
+    while(frameTime(candidate)<time)
+        candidate++;
+    while(candidate>0 && frameTime(candidate-1)>=time)
+        candidate--;
+
+    cachedTime = time;
+    cachedFrame = candidate;
+    frame = candidate;
+    return true;
+}
+
+InputTimelineSlot *InputTimeline::getSlot(const attotime &time)
+{
+    INT64 frame;
+    if(!frameAtOrAfter(time,frame))
+        return NULL;
+
+    if(bits.empty())
+        return NULL;
+
+    InputTimelineSlot *slot = &slots[frame&(INPUT_TIMELINE_CAPACITY-1)];
+    if(slot->frame==frame)
+        return slot;
+    if(slot->frame>frame)
+    {
+        //A newer frame already lives here
+        return NULL;
+    }
+
+    if(slot->frame==-1)
+        numFrames++;
+    slot->frame = frame;
+    slot->received = 0;
+    memset(slot->present,0,sizeof(UINT32)*wordsPerSlot);
+    memset(slot->values,0,sizeof(UINT32)*wordsPerSlot);
+    memset(slot->guessed,0,sizeof(UINT32)*wordsPerSlot);
+    memset(slot->guesses,0,sizeof(UINT32)*wordsPerSlot);
+    if(frame>newestFrame)
+        newestFrame = frame;
+    return slot;
+}
+
+void InputTimeline::markReceived(InputTimelineSlot *slot,int peerID,const attotime &reportTime)
+{
+    if(peerID<0 || peerID>=INPUT_TIMELINE_MAX_PEERS)
+        return;
+    slot->received |= (1U<<peerID);
+
+    //Reports from a peer come in order, remember the last two
+    if(slot->frame>latestFrame[peerID])
+    {
+        previousFrame[peerID] = latestFrame[peerID];
+        previousTime[peerID] = latestTime[peerID];
+        latestFrame[peerID] = slot->frame;
+        latestTime[peerID] = reportTime;
+    }
+}
+
+int InputTimeline::findInput(const attotime &time,int index)
+{
+    INT64 frame;
+    if(!frameAtOrAfter(time,frame))
+        return -1;
+
+    INT64 lastFrame = MIN(newestFrame,frame+INPUT_TIMELINE_CAPACITY-1);
+    for(; frame<=lastFrame; frame++)
+    {
+        InputTimelineSlot *slot = findSlot(frame);
+        if(slot && slot->hasInput(index))
+            return slot->getInput(index)?1:0;
+    }
+    return -1;
+}
+
+bool InputTimeline::hasFutureInput(int peerID,const attotime &curtime,attotime &lastReportTime)
+{
+    lastReportTime = attotime::zero;
+    if(peerID<0 || peerID>=INPUT_TIMELINE_MAX_PEERS)
+        return false;
+
+    INT64 frame = latestFrame[peerID];
+    lastReportTime = latestTime[peerID];
+    if(frame==newestFrame)
+    {
+        frame = previousFrame[peerID];
+        lastReportTime = previousTime[peerID];
+    }
+    if(frame<0)
+        return false;
+    return curtime<lastReportTime;
+}
+
+bool InputTimeline::predictInput(const attotime &time,int index)
+{
+    INT64 frame;
+    if(!frameAtOrAfter(time,frame))
+        return false;
+
+    bool value=false;
+    INT64 firstFrame = MAX(0,frame-INPUT_TIMELINE_CAPACITY+1);
+    for(INT64 a=frame; a>=firstFrame; a--)
+    {
+        InputTimelineSlot *slot = findSlot(a);
+        if(slot && slot->hasInput(index))
+        {
+            value = slot->getInput(index);
+            break;
+        }
+    }
+
+    InputTimelineSlot *slot = getSlot(time);
+    if(slot)
+    {
+        slot->guessed[index>>5] |= (1U<<(index&31));
+        if(value)
+            slot->guesses[index>>5] |= (1U<<(index&31));
+        else
+            slot->guesses[index>>5] &= ~(1U<<(index&31));
+    }
+    return value;
+}
+
+void InputTimeline::checkPredictions(InputTimelineSlot *slot)
+{
+    bool wrong=false;
+    for(int a=0; a<wordsPerSlot; a++)
+    {
+        UINT32 confirmed = slot->guessed[a]&slot->present[a];
+        if(confirmed&(slot->values[a]^slot->guesses[a]))
+            wrong=true;
+        slot->guessed[a] &= ~confirmed;
+    }
+    if(wrong && (mispredictedFrame<0 || slot->frame<mispredictedFrame))
+        mispredictedFrame = slot->frame;
+}
+
+INT64 InputTimeline::takeMisprediction()
+{
+    INT64 frame = mispredictedFrame;
+    mispredictedFrame = -1;
+    return frame;
+}
+
+void InputTimeline::clearPredictions(INT64 frame)
+{
+    for(int a=0; a<INPUT_TIMELINE_CAPACITY; a++)
+    {
+        if(slots[a].frame>=frame)
+            memset(slots[a].guessed,0,sizeof(UINT32)*wordsPerSlot);
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef __NSM_INPUTTIMELINE__
+#define __NSM_INPUTTIMELINE__
+
+#include <vector>
+
+#include "emu.h"
+
+//Number of frames of input the timeline remembers.  Must be a power of two
+//and comfortably larger than the input lead time in frames.
+#define INPUT_TIMELINE_CAPACITY (1024)
+
+//Peer ids are stored as bits in a 32-bit mask
+#define INPUT_TIMELINE_MAX_PEERS (32)
+
+//The inputs of every peer for one frame
+struct InputTimelineSlot
+{
+    INT64 frame;        //-1 when the slot is unused
+    UINT32 received;    //bit per peer that sent a report for this frame
+    UINT32 *present;    //bit per input that has a value
+    UINT32 *values;     //bit per input that is pressed
+    UINT32 *guessed;    //bit per input that was predicted (rollback mode)
+    UINT32 *guesses;    //bit per predicted input that was guessed pressed
+
+    inline bool hasInput(int index) const
+    {
+        return (present[index>>5]>>(index&31))&1;
+    }
+
+    inline bool getInput(int index) const
+    {
+        return (values[index>>5]>>(index&31))&1;
+    }
+
+    inline void setInput(int index,bool value)
+    {
+        present[index>>5] |= (1U<<(index&31));
+        if(value)
+            values[index>>5] |= (1U<<(index&31));
+        else
+            values[index>>5] &= ~(1U<<(index&31));
+    }
+
+    inline bool orInput(int index,bool value)
+    {
+        present[index>>5] |= (1U<<(index&31));
+        if(value)
+            values[index>>5] |= (1U<<(index&31));
+        return getInput(index);
+    }
+};
+
+//Fixed-capacity ring of per-frame input reports.  Reports are stamped with
+//an emulated time that lies on the frame grid (inputs are sampled once per
+//frame), so the time maps directly to a frame number and a ring slot.
+//Inputs are numbered by the caller (one index per field and sequence type).
+class InputTimeline
+{
+public:
+    InputTimeline();
+
+    //Allocates the bitsets, drops everything that was stored
+    void setNumInputs(int numInputs);
+
+    //Frame 0 starts at origin and a new frame starts every period
+    void setGrid(const attotime &origin,attoseconds_t period);
+
+    inline bool hasGrid() const
+    {
+        return period!=0;
+    }
+
+    inline attoseconds_t getPeriod() const
+    {
+        return period;
+    }
+
+    //Frame number of the first frame that starts at or after time
+    bool frameAtOrAfter(const attotime &time,INT64 &frame);
+
+    //Returns the slot for the frame that contains time, recycling the
+    //oldest slot if needed.  Returns NULL if the frame is too old to store.
+    InputTimelineSlot *getSlot(const attotime &time);
+
+    //Records that a peer sent its report for this slot
+    void markReceived(InputTimelineSlot *slot,int peerID,const attotime &reportTime);
+
+    //Looks up an input at time, falling back to the closest later frame
+    //that has it.  Returns -1 if no frame has it.
+    int findInput(const attotime &time,int index);
+
+    //True if the peer has a report for a time after curtime.  The newest
+    //frame in the timeline is ignored.  lastReportTime receives the time of
+    //the report that was checked.
+    bool hasFutureInput(int peerID,const attotime &curtime,attotime &lastReportTime);
+
+    //Guesses an input that has not arrived yet by repeating the most recent
+    //value at or before time.  The guess is remembered so that the real
+    //report can be checked against it.
+    bool predictInput(const attotime &time,int index);
+
+    //Compares the guesses stored in a slot with the inputs it has now
+    void checkPredictions(InputTimelineSlot *slot);
+
+    //Returns the earliest frame with a wrong guess and forgets it, -1 if
+    //every guess so far was right
+    INT64 takeMisprediction();
+
+    //Forgets the guesses for frame and every frame after it
+    void clearPredictions(INT64 frame);
+
+    //Number of distinct frames stored
+    inline int getNumFrames() const
+    {
+        return numFrames;
+    }
+
+protected:
+    InputTimelineSlot slots[INPUT_TIMELINE_CAPACITY];
+    std::vector<UINT32> bits;
+    int wordsPerSlot;
+
+    attotime origin;
+    attoseconds_t period;
+    INT64 newestFrame;
+    int numFrames;
+    INT64 mispredictedFrame;
+
+    //The last time that was converted to a frame (lookups come in bursts
+    //for the same time)
+    attotime cachedTime;
+    INT64 cachedFrame;
+
+    //The two most recent reports from each peer
+    INT64 latestFrame[INPUT_TIMELINE_MAX_PEERS];
+    attotime latestTime[INPUT_TIMELINE_MAX_PEERS];
+    INT64 previousFrame[INPUT_TIMELINE_MAX_PEERS];
+    attotime previousTime[INPUT_TIMELINE_MAX_PEERS];
+
+    void clear();
+
+    attotime frameTime(INT64 frame) const;
+
+    inline InputTimelineSlot *findSlot(INT64 frame)
+    {
+        InputTimelineSlot *slot = &slots[frame&(INPUT_TIMELINE_CAPACITY-1)];
+        return (slot->frame==frame)?slot:NULL;
+    }
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "NSM_Metrics.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+
+using namespace std;
+
+int netLogLevel = NETLOG_INFO;
+
+static const char *netLogLevelNames[] = { "error", "warning", "info", "debug", "trace" };
+
+int netLogLevelFromName(const char *name)
+{
+    for(int a=0; a<int(sizeof(netLogLevelNames)/sizeof(netLogLevelNames[0])); a++)
+    {
+        if(!strcmp(name,netLogLevelNames[a]))
+            return a;
+    }
+    return -1;
+}
+
+void netLogPrintf(const char *format,...)
+{
+    va_list args;
+    va_start(args,format);
+    vprintf(format,args);
+    va_end(args);
+}
+
+MetricHistogram::MetricHistogram()
+{
+    reset();
+}
+
+void MetricHistogram::reset()
+{
+    memset(buckets,0,sizeof(buckets));
+    count = 0;
+    sum = 0;
+    minValue = 0;
+    maxValue = 0;
+}
+
+int MetricHistogram::getBucket(long long value)
+{
+    if(value<METRIC_HISTOGRAM_SUB_BUCKETS)
+        return int(value);
+    //Shift until the value is in the top half of the sub buckets, the
+    //shift picks the power of two and the rest picks the bucket in it
+    int shift = 1;
+    while((value>>shift)>=METRIC_HISTOGRAM_SUB_BUCKETS)
+        shift++;
+    return METRIC_HISTOGRAM_SUB_BUCKETS + (shift-1)*(METRIC_HISTOGRAM_SUB_BUCKETS/2) + int(value>>shift) - METRIC_HISTOGRAM_SUB_BUCKETS/2;
+}
+
+long long MetricHistogram::getBucketTop(int bucket)
+{
+    if(bucket<METRIC_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    int shift = 1 + (bucket-METRIC_HISTOGRAM_SUB_BUCKETS)/(METRIC_HISTOGRAM_SUB_BUCKETS/2);
+    long long subBucket = (bucket-METRIC_HISTOGRAM_SUB_BUCKETS)%(METRIC_HISTOGRAM_SUB_BUCKETS/2) + METRIC_HISTOGRAM_SUB_BUCKETS/2;
+    return ((subBucket+1)<<shift)-1;
+}
+
+void MetricHistogram::record(long long value)
+{
+    if(value<0)
+        value = 0;
+    if(value>=(1LL<<METRIC_HISTOGRAM_MAX_BITS))
+        value = (1LL<<METRIC_HISTOGRAM_MAX_BITS)-1;
+    buckets[getBucket(value)]++;
+    if(!count || value<minValue)
+        minValue = value;
+    if(!count || value>maxValue)
+        maxValue = value;
+    count++;
+    sum += value;
+}
+
+long long MetricHistogram::getPercentile(double fraction) const
+{
+    if(!count)
+        return 0;
+    long long target = (long long)(fraction*double(count)+0.999999);
+    if(target<1)
+        target = 1;
+    long long seen = 0;
+    for(int a=0; a<METRIC_HISTOGRAM_BUCKETS; a++)
+    {
+        seen += buckets[a];
+        if(seen>=target)
+            return min(getBucketTop(a),maxValue);
+    }
+    return maxValue;
+}
+
+MetricsRegistry::MetricsRegistry()
+    :
+    exportFile(NULL),
+    exportIntervalMS(1000),
+    lastExportMS(0)
+{
+}
+
+int MetricsRegistry::addCounter(const char *name)
+{
+    counterNames.push_back(name);
+    counters.push_back(0);
+    return int(counters.size())-1;
+}
+
+int MetricsRegistry::addGauge(const char *name)
+{
+    gaugeNames.push_back(name);
+    gauges.push_back(0);
+    return int(gauges.size())-1;
+}
+
+int MetricsRegistry::addHistogram(const char *name)
+{
+    histogramNames.push_back(name);
+    histograms.push_back(MetricHistogram());
+    return int(histograms.size())-1;
+}
+
+string MetricsRegistry::toJson(const string &extraFields)
+{
+    char buf[1024];
+    string json = "{";
+    if(extraFields.length())
+        json += extraFields + ",";
+
+    json += "\"counters\":{";
+    for(int a=0; a<int(counters.size()); a++)
+    {
+        sprintf(buf,"%s\"%s\":%lld",a?",":"",counterNames[a].c_str(),counters[a]);
+        json += buf;
+    }
+
+    json += "},\"gauges\":{";
+    for(int a=0; a<int(gauges.size()); a++)
+    {
+        sprintf(buf,"%s\"%s\":%.3f",a?",":"",gaugeNames[a].c_str(),gauges[a]);
+        json += buf;
+    }
+
+    json += "},\"histograms\":{";
+    for(int a=0; a<int(histograms.size()); a++)
+    {
+        MetricHistogram &histogram = histograms[a];
+        sprintf(
+            buf,
+            "%s\"%s\":{\"count\":%lld,\"min\":%lld,\"mean\":%.3f,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld}",
+            a?",":"",
+            histogramNames[a].c_str(),
+            histogram.getCount(),
+            histogram.getMin(),
+            histogram.getMean(),
+            histogram.getPercentile(0.5),
+            histogram.getPercentile(0.9),
+            histogram.getPercentile(0.99),
+            histogram.getMax()
+        );
+        json += buf;
+        histogram.reset();
+    }
+    json += "}}";
+    return json;
+}
+
+bool MetricsRegistry::openExport(const string &filename,int intervalMS)
+{
+    closeExport();
+    exportFile = fopen(filename.c_str(),"w");
+    if(!exportFile)
+        return false;
+    exportIntervalMS = max(1,intervalMS);
+    lastExportMS = 0;
+    return true;
+}
+
+void MetricsRegistry::closeExport()
+{
+    if(!exportFile)
+        return;
+    fclose(exportFile);
+    exportFile = NULL;
+}
+
+bool MetricsRegistry::isExportDue(long long nowMS)
+{
+    if(!exportFile)
+        return false;
+    if(!lastExportMS)
+    {
+        //The first interval starts now
+        lastExportMS = nowMS;
+        return false;
+    }
+    return nowMS-lastExportMS>=exportIntervalMS;
+}
+
+void MetricsRegistry::exportLine(long long nowMS,const string &extraFields)
+{
+    if(!exportFile)
+        return;
+    lastExportMS = nowMS;
+    string line = toJson(extraFields);
+    fprintf(exportFile,"%s\n",line.c_str());
+    fflush(exportFile);
+}
@@ -0,0 +1,165 @@
+#ifndef __NSM_METRICS__
+#define __NSM_METRICS__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//How much netplay writes to the console (-netloglevel).  Errors and
+//warnings about a session going wrong stay on at the default level, what
+//happens every sync, packet or frame is debug or trace.
+enum NetLogLevel
+{
+    NETLOG_ERROR,
+    NETLOG_WARNING,
+    NETLOG_INFO,
+    NETLOG_DEBUG,
+    NETLOG_TRACE
+};
+
+extern int netLogLevel;
+
+//-1 if the name isn't a level
+int netLogLevelFromName(const char *name);
+
+void netLogPrintf(const char *format,...);
+
+//NETLOG(NETLOG_DEBUG,("SYNC AT %d\n",second)).  The arguments aren't
+//evaluated unless the level is on.
+#define NETLOG(level,args) do { if((level)<=netLogLevel) netLogPrintf args; } while(0)
+
+//Values below this are counted exactly, above it every power of two gets
+//half as many buckets, so a value is kept to within 1/16th of itself
+#define METRIC_HISTOGRAM_SUB_BUCKETS (32)
+#define METRIC_HISTOGRAM_SUB_BUCKET_BITS (5)
+
+//Largest value a histogram tells apart (larger ones count as this)
+#define METRIC_HISTOGRAM_MAX_BITS (40)
+
+#define METRIC_HISTOGRAM_BUCKETS (METRIC_HISTOGRAM_SUB_BUCKETS + (METRIC_HISTOGRAM_MAX_BITS-METRIC_HISTOGRAM_SUB_BUCKET_BITS+1)*(METRIC_HISTOGRAM_SUB_BUCKETS/2))
+
+//A distribution of non-negative integers in HDR style log-linear buckets.
+//Recording doesn't allocate or search, so it can be done every frame, and
+//the percentiles are within a bucket of the real ones.
+class MetricHistogram
+{
+public:
+    MetricHistogram();
+
+    void record(long long value);
+
+    void reset();
+
+    inline long long getCount() const
+    {
+        return count;
+    }
+
+    inline long long getMin() const
+    {
+        return count?minValue:0;
+    }
+
+    inline long long getMax() const
+    {
+        return maxValue;
+    }
+
+    inline double getMean() const
+    {
+        return count?double(sum)/double(count):0.0;
+    }
+
+    //The value at least a fraction of the samples are at or below (the
+    //top of its bucket, but never above the largest sample)
+    long long getPercentile(double fraction) const;
+
+protected:
+    long long buckets[METRIC_HISTOGRAM_BUCKETS];
+    long long count;
+    long long sum;
+    long long minValue;
+    long long maxValue;
+
+    static int getBucket(long long value);
+
+    //The largest value that goes into a bucket
+    static long long getBucketTop(int bucket);
+};
+
+//Named counters (only go up), gauges (the last value set) and histograms.
+//Each metric is registered once and then updated through the id that
+//registering it returned, so the registry can be copied with its peer.
+class MetricsRegistry
+{
+public:
+    MetricsRegistry();
+
+    int addCounter(const char *name);
+
+    int addGauge(const char *name);
+
+    int addHistogram(const char *name);
+
+    inline void add(int counter,long long amount=1)
+    {
+        counters[counter] += amount;
+    }
+
+    inline long long getCounter(int counter) const
+    {
+        return counters[counter];
+    }
+
+    inline void set(int gauge,double value)
+    {
+        gauges[gauge] = value;
+    }
+
+    inline void record(int histogram,long long value)
+    {
+        histograms[histogram].record(value);
+    }
+
+    inline const MetricHistogram &getHistogram(int histogram) const
+    {
+        return histograms[histogram];
+    }
+
+    //Writes {"counters":{...},"gauges":{...},"histograms":{...}} with
+    //extraFields (already JSON, may be empty) before them.  Histograms
+    //start over afterwards, so each line covers one interval.
+    std::string toJson(const std::string &extraFields);
+
+    //Appends a line of JSON every intervalMS to filename (a named pipe
+    //works too, for a local reader).  False if it can't be opened.
+    bool openExport(const std::string &filename,int intervalMS);
+
+    void closeExport();
+
+    inline bool isExporting() const
+    {
+        return exportFile!=NULL;
+    }
+
+    //True once the export interval passed since the last line
+    bool isExportDue(long long nowMS);
+
+    void exportLine(long long nowMS,const std::string &extraFields);
+
+protected:
+    std::vector<std::string> counterNames;
+    std::vector<long long> counters;
+    std::vector<std::string> gaugeNames;
+    std::vector<double> gauges;
+    std::vector<std::string> histogramNames;
+    std::vector<MetricHistogram> histograms;
+
+    //Opened once the peer is set up, the registry doesn't close it on its
+    //own because peers are copied around before that
+    FILE *exportFile;
+    int exportIntervalMS;
+    long long lastExportMS;
+};
+
+#endif
@@ -0,0 +1,455 @@
+#define DISABLE_EMUALLOC
+
+#include "RakPeerInterface.h"
+#include "RakNetTypes.h"
+#include "BitStream.h"
+#include "GetTime.h"
+#include "RakSleep.h"
+
+#include "NSM_Common.h"
+#include "NSM_NetworkThread.h"
+
+#include "osdcore.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+extern unsigned char GetPacketIdentifier(RakNet::Packet *p);
+extern unsigned char *GetPacketData(RakNet::Packet *p);
+extern int GetPacketSize(RakNet::Packet *p);
+
+NetworkImpairment::NetworkImpairment()
+    :
+    active(false),
+    lossPercent(0),
+    latencyMS(0),
+    jitterMS(0),
+    seed(1),
+    numDropped(0),
+    lastReleaseTime(0)
+{
+}
+
+void NetworkImpairment::configure(float _lossPercent,int _latencyMS,int _jitterMS)
+{
+    lossPercent = max(0.0f,min(100.0f,_lossPercent));
+    latencyMS = max(0,_latencyMS);
+    jitterMS = max(0,_jitterMS);
+    seed = (unsigned int)RakNet::GetTimeUS()|1;
+    active = (lossPercent>0 || latencyMS>0 || jitterMS>0);
+    if(active)
+        printf("IMPAIRING INCOMING PACKETS: %.1f%% INPUT LOSS, %d MS LATENCY, %d MS JITTER\n",lossPercent,latencyMS,jitterMS);
+}
+
+bool NetworkImpairment::hold(RakNet::Packet *p,bool droppable,RakNet::TimeUS now)
+{
+    if(droppable && lossPercent>0 && random(10000)<(unsigned int)(lossPercent*100.0f))
+    {
+        numDropped++;
+        return false;
+    }
+    HeldPacket heldPacket;
+    heldPacket.packet = p;
+    heldPacket.releaseTime = now+RakNet::TimeUS(latencyMS+random(jitterMS+1))*1000;
+    //A packet never overtakes the one before it
+    if(heldPacket.releaseTime<lastReleaseTime)
+        heldPacket.releaseTime = lastReleaseTime;
+    lastReleaseTime = heldPacket.releaseTime;
+    held.push_back(heldPacket);
+    return true;
+}
+
+RakNet::Packet *NetworkImpairment::release(RakNet::TimeUS now)
+{
+    if(held.empty() || held.front().releaseTime>now)
+        return NULL;
+    return drain();
+}
+
+RakNet::Packet *NetworkImpairment::drain()
+{
+    if(held.empty())
+        return NULL;
+    RakNet::Packet *p = held.front().packet;
+    held.pop_front();
+    return p;
+}
+
+unsigned int NetworkImpairment::random(unsigned int range)
+{
+    seed = seed*1103515245+12345;
+    return (seed>>8)%range;
+}
+
+NetworkThread::NetworkThread(RakNet::RakPeerInterface *_rakInterface,RakNet::SignaledEvent *_arrivalEvent)
+    :
+    rakInterface(_rakInterface),
+    arrivalEvent(_arrivalEvent),
+    workQueue(NULL),
+    workItem(NULL),
+    stopRequested(0),
+    numDroppedInputs(0)
+{
+    inputsReadyEvent.InitEvent();
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        slots[a] = NULL;
+    }
+}
+
+NetworkThread::~NetworkThread()
+{
+    stop();
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        delete slots[a];
+    }
+    inputsReadyEvent.CloseEvent();
+}
+
+void NetworkThread::start()
+{
+    if(workItem)
+        return;
+    selfGUID = rakInterface->GetMyGUID();
+    stopRequested = 0;
+    workQueue = osd_work_queue_alloc(WORK_QUEUE_FLAG_IO);
+    workItem = osd_work_item_queue(workQueue,threadMain,this,0);
+    printf("NETWORK THREAD STARTED\n");
+}
+
+void NetworkThread::stop()
+{
+    if(!workItem)
+        return;
+    stopRequested = 1;
+    arrivalEvent->SetEvent();
+    osd_work_item_wait(workItem,osd_ticks_per_second()*10);
+    osd_work_item_release(workItem);
+    workItem = NULL;
+    osd_work_queue_free(workQueue);
+    workQueue = NULL;
+
+    for(RakNet::Packet **p = packets.front(); p; p = packets.front())
+    {
+        rakInterface->DeallocatePacket(*p);
+        packets.pop();
+    }
+    for(RakNet::Packet *p = impairment.drain(); p; p = impairment.drain())
+    {
+        rakInterface->DeallocatePacket(p);
+    }
+    if(impairment.getNumDropped())
+        printf("NETWORK IMPAIRMENT DROPPED %u INPUT PACKETS\n",impairment.getNumDropped());
+    if(numDroppedInputs)
+        printf("NETWORK THREAD DROPPED %u INPUTS\n",numDroppedInputs);
+}
+
+RakNet::Packet *NetworkThread::receive()
+{
+    if(workItem)
+    {
+        RakNet::Packet **queued = packets.front();
+        if(!queued)
+            return NULL;
+        RakNet::Packet *p = *queued;
+        packets.pop();
+        return p;
+    }
+
+    //No thread yet, so this is the only thread that reads RakNet
+    while(true)
+    {
+        RakNet::Packet *p = nextPacket();
+        if(!p || !handleInputPacket(p))
+            return p;
+        rakInterface->DeallocatePacket(p);
+    }
+}
+
+void NetworkThread::waitForInputs(int timeoutMS)
+{
+    if(workItem)
+        inputsReadyEvent.WaitOnEvent(timeoutMS);
+    else
+        arrivalEvent->WaitOnEvent(timeoutMS);
+}
+
+void NetworkThread::retire(const RakNet::RakNetGUID &guid)
+{
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = getSlot(a);
+        if(slot && slot->guid==guid)
+        {
+            slot->retired = 1;
+            if(!workItem)
+                freeRetiredSlots();
+        }
+    }
+}
+
+void *NetworkThread::threadMain(void *param,int threadid)
+{
+    ((NetworkThread*)param)->run();
+    return NULL;
+}
+
+void NetworkThread::run()
+{
+    while(!stopRequested)
+    {
+        freeRetiredSlots();
+
+        RakNet::Packet *p = nextPacket();
+        if(!p)
+        {
+            //Woken early when a datagram with inputs arrives
+            arrivalEvent->WaitOnEvent(NETWORK_THREAD_WAIT_MS);
+            continue;
+        }
+        if(handleInputPacket(p))
+        {
+            rakInterface->DeallocatePacket(p);
+            inputsReadyEvent.SetEvent();
+            continue;
+        }
+
+        //Everything else is handled on the emulation thread, which may be
+        //busy for a while (an initial sync), so wait for room
+        bool spectatorInputs = (GetPacketIdentifier(p)==ID_SPECTATOR_INPUTS);
+        RakNet::Packet **queued;
+        while((queued = packets.beginPush())==NULL && !stopRequested)
+        {
+            RakSleep(NETWORK_THREAD_WAIT_MS);
+        }
+        if(!queued)
+        {
+            rakInterface->DeallocatePacket(p);
+            break;
+        }
+        *queued = p;
+        packets.commitPush();
+        if(spectatorInputs)
+        {
+            //A spectator's inputs come through the queue, its stall loop
+            //reads them there
+            inputsReadyEvent.SetEvent();
+        }
+    }
+}
+
+RakNet::Packet *NetworkThread::nextPacket()
+{
+    if(!impairment.isActive())
+        return rakInterface->Receive();
+
+    //Everything RakNet has goes into the impairment first
+    for(RakNet::Packet *p = rakInterface->Receive(); p; p = rakInterface->Receive())
+    {
+        unsigned char packetID = GetPacketIdentifier(p);
+        bool droppable = (packetID==ID_CLIENT_INPUT_FRAMES || packetID==ID_SERVER_INPUT_FRAMES);
+        if(!impairment.hold(p,droppable,RakNet::GetTimeUS()))
+            rakInterface->DeallocatePacket(p);
+    }
+    return impairment.release(RakNet::GetTimeUS());
+}
+
+bool NetworkThread::handleInputPacket(RakNet::Packet *p)
+{
+    unsigned char packetID = GetPacketIdentifier(p);
+    if(packetID==ID_CLIENT_INPUTS || packetID==ID_SERVER_INPUTS)
+    {
+        //A single input from a peer that doesn't send frames.  It goes into
+        //the same ring as the frames (long ones too), so every peer uses a
+        //peer's inputs in the order they were sent.  Until the peer has a
+        //ring the emulation thread keeps them, ahead of anything the ring
+        //will get.
+        NetworkPeerSlot *slot = findSlot(p->guid);
+        if(!slot)
+            return false;
+        pushInput(slot,(const char*)GetPacketData(p),GetPacketSize(p));
+        return true;
+    }
+    if(packetID!=ID_CLIENT_INPUT_FRAMES && packetID!=ID_SERVER_INPUT_FRAMES)
+        return false;
+
+    RakNet::BitStream stream(p->data,p->length,false);
+    stream.IgnoreBytes(1);
+
+    unsigned int ackSeq,firstSeq;
+    if(!readInputFrames(stream,selfGUID,ackSeq,firstSeq,decodedFrames))
+    {
+        printf("ERROR: MALFORMED INPUT FRAMES FROM %s\n",p->systemAddress.ToString());
+        return true;
+    }
+
+    NetworkPeerSlot *slot = findSlot(p->guid);
+    if(!slot)
+        return true;
+
+    if(ackSeq)
+    {
+        slot->ackTime = RakNet::GetTimeMS();
+        SPSC_BARRIER();
+        if(ackSeq>slot->ackSeq)
+            slot->ackSeq = ackSeq;
+    }
+
+    //Only the frames the ring has room for are acknowledged, the peer keeps
+    //sending the others
+    orderedFrames.clear();
+    if(!slot->receiver.addFrames(firstSeq,decodedFrames,orderedFrames,slot->inputs.space()))
+    {
+        //Playing on without those inputs would desync, the emulation thread
+        //drops the peer when RakNet reports the connection closed
+        printf("ERROR: INPUTS FROM %s ARE LOST, DISCONNECTING\n",p->systemAddress.ToString());
+        rakInterface->CloseConnection(p->systemAddress,true);
+        return true;
+    }
+    for(int a=0; a<int(orderedFrames.size()); a++)
+    {
+        pushInput(slot,orderedFrames[a].data(),int(orderedFrames[a].length()));
+    }
+    slot->lastSeq = slot->receiver.getLastSeq();
+
+    //The state hash trailer (see Common::sendInputFrame)
+    bool hasHash;
+    if(!stream.Read(hasHash))
+        return true;
+    if(hasHash)
+    {
+        NetworkHashRecord record;
+        if(!stream.Read(record.time.first) || !stream.Read(record.time.second) || !stream.Read(record.hash))
+        {
+            printf("ERROR: MALFORMED STATE HASH FROM %s\n",p->systemAddress.ToString());
+            return true;
+        }
+        NetworkHashRecord *hashRecord = slot->hashes.beginPush();
+        if(hashRecord)
+        {
+            //Hashes are sent several times, losing one doesn't matter
+            *hashRecord = record;
+            slot->hashes.commitPush();
+        }
+    }
+
+    readInputDelay(stream,slot);
+    return true;
+}
+
+void NetworkThread::readInputDelay(RakNet::BitStream &stream,NetworkPeerSlot *slot)
+{
+    //The timing trailer (see Common::sendInputFrame), older builds don't
+    //send it
+    RakNet::TimeUS sentTime;
+    int seconds;
+    long long attoseconds;
+    unsigned char peerLead,numPeers;
+    if(
+        !stream.Read(sentTime) ||
+        !stream.Read(seconds) ||
+        !stream.Read(attoseconds) ||
+        !stream.Read(peerLead) ||
+        !stream.Read(numPeers)
+    )
+        return;
+
+    NetworkTimingRecord *timing = slot->timings.beginPush();
+    if(timing)
+    {
+        timing->arrivalTime = RakNet::GetTimeUS();
+        timing->transitUS = (long long)(timing->arrivalTime-sentTime);
+        timing->seconds = seconds;
+        timing->attoseconds = attoseconds;
+        slot->timings.commitPush();
+    }
+    slot->peerLead = peerLead;
+
+    for(int a=0; a<numPeers; a++)
+    {
+        RakNet::RakNetGUID guid;
+        unsigned short delayMS;
+        short aheadMS;
+        if(!stream.Read(guid) || !stream.Read(delayMS) || !stream.Read(aheadMS))
+            return;
+        if(guid!=selfGUID)
+            continue;
+        if(delayMS!=NETWORK_DELAY_UNKNOWN)
+            slot->requestedDelayMS = delayMS;
+        slot->peerAheadMS = aheadMS;
+    }
+}
+
+NetworkPeerSlot *NetworkThread::findSlot(const RakNet::RakNetGUID &guid)
+{
+    map<RakNet::RakNetGUID,int>::iterator it = slotIndices.find(guid);
+    if(it!=slotIndices.end())
+        return slots[it->second];
+
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = slots[a];
+        if(slot && slot->active)
+            continue;
+        if(!slot)
+        {
+            //Allocated once, freed slots are reused
+            slot = new NetworkPeerSlot();
+        }
+        slot->guid = guid;
+        slot->retired = 0;
+        SPSC_BARRIER();
+        slot->active = 1;
+        slots[a] = slot;
+        slotIndices[guid] = a;
+        return slot;
+    }
+    printf("ERROR: NO ROOM FOR THE INPUTS OF %s\n",guid.ToString());
+    return NULL;
+}
+
+void NetworkThread::pushInput(NetworkPeerSlot *slot,const char *data,int length)
+{
+    NetworkInputRecord *record = slot->inputs.beginPush();
+    if(!record)
+    {
+        numDroppedInputs++;
+        printf("ERROR: DROPPED AN INPUT FROM %s\n",slot->guid.ToString());
+        return;
+    }
+    delete[] record->longData;
+    record->longData = NULL;
+    if(length>NETWORK_INPUT_RECORD_SIZE)
+        record->longData = new char[length];
+    record->length = length;
+    memcpy(record->longData?record->longData:record->data,data,length);
+    slot->inputs.commitPush();
+}
+
+void NetworkThread::freeRetiredSlots()
+{
+    for(int a=0; a<NETWORK_MAX_PEERS; a++)
+    {
+        NetworkPeerSlot *slot = slots[a];
+        if(!slot || !slot->active || !slot->retired)
+            continue;
+
+        //The emulation thread stopped reading it when it set retired
+        slotIndices.erase(slot->guid);
+        slot->inputs.reset();
+        slot->hashes.reset();
+        slot->timings.reset();
+        slot->receiver = InputFrameReceiver();
+        slot->lastSeq = 0;
+        slot->ackSeq = 0;
+        slot->ackTime = 0;
+        slot->requestedDelayMS = -1;
+        slot->peerLead = 0;
+        slot->peerAheadMS = TIME_SYNC_UNKNOWN;
+        SPSC_BARRIER();
+        slot->active = 0;
+    }
+}
@@ -0,0 +1,393 @@
+#ifndef __NSM_NETWORKTHREAD__
+#define __NSM_NETWORKTHREAD__
+
+#include "RakNetTypes.h"
+#include "SignaledEvent.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "NSM_InputFrames.h"
+#include "NSM_StateHash.h"
+#include "NSM_TimeSync.h"
+
+namespace RakNet
+{
+    class BitStream;
+    class RakPeerInterface;
+}
+
+struct _osd_work_queue;
+struct _osd_work_item;
+
+//Longest input string a ring record holds in place.  Longer chat messages
+//are handed to the emulation thread like any other packet, longer input
+//frames are copied to the heap so they stay in order.
+#define NETWORK_INPUT_RECORD_SIZE (1024)
+
+//Records in each peer's input ring, must be a power of two
+#define NETWORK_INPUT_RING_SIZE (1024)
+
+//State hashes in each peer's hash ring, must be a power of two
+#define NETWORK_HASH_RING_SIZE (16)
+
+//Records in each peer's timing ring, must be a power of two
+#define NETWORK_TIMING_RING_SIZE (64)
+
+//A requested input delay that wasn't measured yet
+#define NETWORK_DELAY_UNKNOWN (0xFFFF)
+
+//Packets waiting for the emulation thread, must be a power of two
+#define NETWORK_PACKET_RING_SIZE (4096)
+
+//Distinct peers (by GUID) the thread keeps rings for
+#define NETWORK_MAX_PEERS (32)
+
+//How long the thread sleeps when RakNet has nothing for it
+#define NETWORK_THREAD_WAIT_MS (1)
+
+//Orders the writes to a ring item before the index that publishes it
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SPSC_BARRIER() _ReadWriteBarrier()
+#else
+#define SPSC_BARRIER() __sync_synchronize()
+#endif
+
+//Fixed capacity queue between exactly one producer thread and one consumer
+//thread.  Each index is only written by its own side, so neither side
+//locks or allocates.
+template<class T,int SIZE>
+class SpscRing
+{
+public:
+    SpscRing()
+        :
+        head(0),
+        tail(0)
+    {
+    }
+
+    //Producer: the item to fill in, NULL if the ring is full
+    inline T *beginPush()
+    {
+        if(head-tail >= (unsigned int)SIZE)
+            return NULL;
+        //The consumer must be done with the item before it is reused
+        SPSC_BARRIER();
+        return &items[head&(SIZE-1)];
+    }
+
+    //Producer: publishes the item returned by beginPush()
+    inline void commitPush()
+    {
+        SPSC_BARRIER();
+        head = head+1;
+    }
+
+    //Consumer: the oldest item, NULL if the ring is empty
+    inline T *front()
+    {
+        return peek(0);
+    }
+
+    //Consumer: the item index places after the oldest one, NULL if there
+    //are not that many
+    inline T *peek(int index)
+    {
+        if(head-tail <= (unsigned int)index)
+            return NULL;
+        SPSC_BARRIER();
+        return &items[(tail+index)&(SIZE-1)];
+    }
+
+    //Producer: how many items beginPush() can still return
+    inline int space() const
+    {
+        return SIZE-int(head-tail);
+    }
+
+    //Consumer: releases the item returned by front()
+    inline void pop()
+    {
+        SPSC_BARRIER();
+        tail = tail+1;
+    }
+
+    //Only while neither side is using the ring
+    inline void reset()
+    {
+        head=tail=0;
+    }
+
+protected:
+    T items[SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+};
+
+struct NetworkInputRecord
+{
+    int length;
+
+    //Set instead of data for an input longer than data.  The producer
+    //frees it when it reuses the record.
+    char *longData;
+
+    char data[NETWORK_INPUT_RECORD_SIZE];
+
+    NetworkInputRecord()
+        :
+        length(0),
+        longData(NULL)
+    {
+    }
+
+    ~NetworkInputRecord()
+    {
+        delete[] longData;
+    }
+
+    inline const char *getData() const
+    {
+        return longData?longData:data;
+    }
+
+private:
+    NetworkInputRecord(const NetworkInputRecord &other);
+    NetworkInputRecord &operator=(const NetworkInputRecord &other);
+};
+
+struct NetworkHashRecord
+{
+    StateHashTime time;
+    unsigned long long hash;
+};
+
+//When an input packet was sent and arrived
+struct NetworkTimingRecord
+{
+    //Our clock at arrival minus the peer's when it sent the packet
+    long long transitUS;
+
+    //Our clock at arrival
+    RakNet::TimeUS arrivalTime;
+
+    //The peer's emulated time when it sent the packet
+    int seconds;
+    long long attoseconds;
+};
+
+//Everything the network thread received from one peer.  The network
+//thread fills the rings and the volatile fields, the emulation thread
+//drains the rings and reads the fields.
+struct NetworkPeerSlot
+{
+    RakNet::RakNetGUID guid;
+
+    //Set by the network thread once guid is valid
+    volatile int active;
+
+    //Set by the emulation thread when the peer is gone, the network thread
+    //then frees the slot
+    volatile int retired;
+
+    SpscRing<NetworkInputRecord,NETWORK_INPUT_RING_SIZE> inputs;
+    SpscRing<NetworkHashRecord,NETWORK_HASH_RING_SIZE> hashes;
+
+    SpscRing<NetworkTimingRecord,NETWORK_TIMING_RING_SIZE> timings;
+
+    //Newest input frame from the peer in the input ring without gaps (for
+    //our acks)
+    volatile unsigned int lastSeq;
+
+    //Newest input frame of ours the peer acknowledged, and when
+    volatile unsigned int ackSeq;
+    volatile RakNet::TimeMS ackTime;
+
+    //The input delay the peer asks us for in milliseconds, -1 until it does
+    volatile int requestedDelayMS;
+
+    //How many frames ahead the peer stamps its inputs, 0 until it says
+    volatile int peerLead;
+
+    //How far ahead of us the peer thinks it is in milliseconds,
+    //TIME_SYNC_UNKNOWN until it says
+    volatile int peerAheadMS;
+
+    //Only used by the thread that fills the rings
+    InputFrameReceiver receiver;
+
+    NetworkPeerSlot()
+        :
+        active(0),
+        retired(0),
+        lastSeq(0),
+        ackSeq(0),
+        ackTime(0),
+        requestedDelayMS(-1),
+        peerLead(0),
+        peerAheadMS(TIME_SYNC_UNKNOWN)
+    {
+    }
+};
+
+//Holds incoming packets back and drops input frames, to try netplay on a
+//bad connection (-netsimlatency, -netsimjitter, -netsimloss).  RakNet's own
+//network simulator is only compiled into debug builds.  Only the unreliable
+//input frames are dropped, RakNet already acknowledged everything else so
+//it can only be late.  Packets are never reordered.
+class NetworkImpairment
+{
+public:
+    NetworkImpairment();
+
+    void configure(float lossPercent,int latencyMS,int jitterMS);
+
+    inline bool isActive() const
+    {
+        return active;
+    }
+
+    //Takes the packet, false if it was dropped instead (the caller
+    //deallocates it then)
+    bool hold(RakNet::Packet *p,bool droppable,RakNet::TimeUS now);
+
+    //The oldest held packet once it is due, NULL if there is none
+    RakNet::Packet *release(RakNet::TimeUS now);
+
+    //The next held packet whether it is due or not, NULL if there is none
+    RakNet::Packet *drain();
+
+    inline unsigned int getNumDropped() const
+    {
+        return numDropped;
+    }
+
+protected:
+    struct HeldPacket
+    {
+        RakNet::Packet *packet;
+        RakNet::TimeUS releaseTime;
+    };
+
+    bool active;
+    float lossPercent;
+    int latencyMS;
+    int jitterMS;
+    unsigned int seed;
+    unsigned int numDropped;
+    RakNet::TimeUS lastReleaseTime;
+    std::deque<HeldPacket> held;
+
+    //0 up to (not including) range
+    unsigned int random(unsigned int range);
+};
+
+//Reads RakNet on its own thread.  Input packets are decoded there into
+//fixed size records in a ring per peer, every other packet is queued for
+//the emulation thread, which handles it in Server::update/Client::update.
+//Until start() is called the emulation thread does all of this itself
+//inside receive().
+class NetworkThread
+{
+public:
+    //arrivalEvent is signaled when a datagram with inputs comes in
+    NetworkThread(RakNet::RakPeerInterface *rakInterface,RakNet::SignaledEvent *arrivalEvent);
+
+    ~NetworkThread();
+
+    //Call before start(), packets are then impaired on their way in
+    inline void setImpairment(float lossPercent,int latencyMS,int jitterMS)
+    {
+        impairment.configure(lossPercent,latencyMS,jitterMS);
+    }
+
+    void start();
+
+    //Waits for the thread, drops the packets it queued
+    void stop();
+
+    inline bool isRunning() const
+    {
+        return workItem!=NULL;
+    }
+
+    //Emulation thread: the next packet that isn't an input frame, NULL if
+    //there is none.  The caller deallocates it.
+    RakNet::Packet *receive();
+
+    //Emulation thread: sleeps until inputs arrive or timeoutMS passes
+    void waitForInputs(int timeoutMS);
+
+    //Emulation thread: the slot at index, NULL if it isn't in use
+    inline NetworkPeerSlot *getSlot(int index)
+    {
+        NetworkPeerSlot *slot = slots[index];
+        if(!slot || !slot->active)
+            return NULL;
+        SPSC_BARRIER();
+        if(slot->retired)
+            return NULL;
+        return slot;
+    }
+
+    //Emulation thread: stop reading the peer's slot, it is freed
+    void retire(const RakNet::RakNetGUID &guid);
+
+    //Records that didn't fit in a full ring
+    inline unsigned int getNumDroppedInputs() const
+    {
+        return numDroppedInputs;
+    }
+
+protected:
+    RakNet::RakPeerInterface *rakInterface;
+    RakNet::SignaledEvent *arrivalEvent;
+    RakNet::SignaledEvent inputsReadyEvent;
+    RakNet::RakNetGUID selfGUID;
+
+    NetworkPeerSlot * volatile slots[NETWORK_MAX_PEERS];
+    SpscRing<RakNet::Packet*,NETWORK_PACKET_RING_SIZE> packets;
+
+    //Only used by the thread that reads RakNet
+    NetworkImpairment impairment;
+
+    //Producer side only
+    std::map<RakNet::RakNetGUID,int> slotIndices;
+    std::vector<std::string> decodedFrames;
+    std::vector<std::string> orderedFrames;
+
+    _osd_work_queue *workQueue;
+    _osd_work_item *workItem;
+    volatile int stopRequested;
+    volatile unsigned int numDroppedInputs;
+
+    static void *threadMain(void *param,int threadid);
+
+    void run();
+
+    //The next packet from RakNet, through the impairment if there is one
+    RakNet::Packet *nextPacket();
+
+    //Producer: decodes an input packet into its peer's rings.  Returns
+    //false if the packet isn't one (or has to go to the emulation thread).
+    bool handleInputPacket(RakNet::Packet *p);
+
+    void readInputDelay(RakNet::BitStream &stream,NetworkPeerSlot *slot);
+
+    NetworkPeerSlot *findSlot(const RakNet::RakNetGUID &guid);
+
+    void pushInput(NetworkPeerSlot *slot,const char *data,int length);
+
+    //Producer: frees the slots the emulation thread retired
+    void freeRetiredSlots();
+
+private:
+    NetworkThread(const NetworkThread &other);
+    NetworkThread &operator=(const NetworkThread &other);
+};
+
+#endif
@@ -0,0 +1,454 @@
+#include "NSM_Common.h"
+#include "NSM_Recording.h"
+
+#include "BitStream.h"
+
+#include "osdcore.h"
+
+#include <cstring>
+
+using namespace std;
+
+static bool writeValue(FILE *file,const void *data,int size)
+{
+    return fwrite(data,1,size,file)==size_t(size);
+}
+
+static bool readValue(FILE *file,void *data,int size)
+{
+    return fread(data,1,size,file)==size_t(size);
+}
+
+SessionRecorder::SessionRecorder()
+    :
+    file(NULL),
+    feed(true),
+    keyframeNeeded(true),
+    writeFailed(false),
+    workQueue(NULL),
+    currentBlock(0)
+{
+    for(int a=0; a<RECORDING_BLOCKS_IN_FLIGHT; a++)
+    {
+        blocks[a].recorder = this;
+        blocks[a].firstSeconds = 0;
+        blocks[a].firstAttoseconds = 0;
+        blocks[a].keyframe = false;
+        blocks[a].workItem = NULL;
+    }
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    close();
+}
+
+bool SessionRecorder::open(const string &_filename,const string &gameName)
+{
+    close();
+    filename = _filename;
+    file = fopen(filename.c_str(),"wb");
+    if(!file)
+    {
+        printf("ERROR: COULD NOT OPEN %s TO RECORD THE SESSION\n",filename.c_str());
+        return false;
+    }
+
+    //[magic][version][name length][name]
+    char magic[RECORDING_MAGIC_SIZE];
+    memset(magic,0,RECORDING_MAGIC_SIZE);
+    strcpy(magic,RECORDING_MAGIC);
+    int version = RECORDING_VERSION;
+    int nameLength = int(gameName.length());
+    if(
+        !writeValue(file,magic,RECORDING_MAGIC_SIZE) ||
+        !writeValue(file,&version,sizeof(int)) ||
+        !writeValue(file,&nameLength,sizeof(int)) ||
+        !writeValue(file,gameName.data(),nameLength)
+    )
+    {
+        printf("ERROR: COULD NOT WRITE TO %s\n",filename.c_str());
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+
+    writeFailed = false;
+    keyframeNeeded = true;
+    workQueue = osd_work_queue_alloc(WORK_QUEUE_FLAG_IO);
+    printf("RECORDING THE SESSION TO %s\n",filename.c_str());
+    return true;
+}
+
+void SessionRecorder::close()
+{
+    if(!file)
+        return;
+    submitBlock();
+    for(int a=0; a<RECORDING_BLOCKS_IN_FLIGHT; a++)
+    {
+        waitForBlock(blocks[a]);
+    }
+    if(workQueue)
+    {
+        osd_work_queue_free(workQueue);
+        workQueue = NULL;
+    }
+    fclose(file);
+    file = NULL;
+    printf("SESSION RECORDING %s CLOSED\n",filename.c_str());
+}
+
+void SessionRecorder::flush(
+    int seconds,
+    long long attoseconds,
+    const map<RakNet::RakNetGUID,int> &peerIDs,
+    const map<int,string> &peerNames
+)
+{
+    if(!file)
+        return;
+
+    //The same packets a spectator gets
+    RakNet::BitStream inputs;
+    if(feed.writeInputs(inputs))
+        addRecord(seconds,attoseconds,inputs.GetData(),int(inputs.GetNumberOfBytesUsed()));
+    RakNet::BitStream roster;
+    if(feed.writeRoster(roster,peerIDs,peerNames,false))
+        addRecord(seconds,attoseconds,roster.GetData(),int(roster.GetNumberOfBytesUsed()));
+
+    if(int(blocks[currentBlock].uncompressed.size())>=RECORDING_BLOCK_SIZE)
+        submitBlock();
+}
+
+void SessionRecorder::addKeyframe(int seconds,long long attoseconds,int reason,const vector<unsigned char> &checkpoint)
+{
+    if(!file || checkpoint.empty())
+        return;
+
+    //Keyframes get a block of their own
+    submitBlock();
+
+    static vector<unsigned char> record;
+    record.resize(2+checkpoint.size());
+    record[0] = ID_RECORDING_KEYFRAME;
+    record[1] = (unsigned char)reason;
+    memcpy(&record[2],&checkpoint[0],checkpoint.size());
+    addRecord(seconds,attoseconds,&record[0],int(record.size()));
+    blocks[currentBlock].keyframe = true;
+    submitBlock();
+
+    keyframeNeeded = false;
+}
+
+void SessionRecorder::addRecord(int seconds,long long attoseconds,const unsigned char *data,int size)
+{
+    Block &block = blocks[currentBlock];
+    if(block.uncompressed.empty())
+    {
+        block.firstSeconds = seconds;
+        block.firstAttoseconds = attoseconds;
+    }
+
+    //[seconds][attoseconds][size][data]
+    int pos = int(block.uncompressed.size());
+    block.uncompressed.resize(pos+RECORDING_RECORD_HEADER_SIZE+size);
+    unsigned char *ptr = &block.uncompressed[pos];
+    memcpy(ptr,&seconds,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr,&attoseconds,sizeof(long long));
+    ptr += sizeof(long long);
+    memcpy(ptr,&size,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr,data,size);
+}
+
+void SessionRecorder::submitBlock()
+{
+    Block &block = blocks[currentBlock];
+    if(block.uncompressed.empty())
+        return;
+
+    block.recorder = this;
+    block.workItem = osd_work_item_queue(workQueue,writeBlock,&block,0);
+    if(!block.workItem)
+    {
+        //No writer thread, do it here
+        writeBlock(&block,0);
+    }
+
+    //The writer thread has one thread, so blocks reach the file in order
+    currentBlock = (currentBlock+1)%RECORDING_BLOCKS_IN_FLIGHT;
+    Block &nextBlock = blocks[currentBlock];
+    waitForBlock(nextBlock);
+    nextBlock.uncompressed.clear();
+    nextBlock.keyframe = false;
+}
+
+void SessionRecorder::waitForBlock(Block &block)
+{
+    if(!block.workItem)
+        return;
+    osd_work_item_wait(block.workItem,100*osd_ticks_per_second());
+    osd_work_item_release(block.workItem);
+    block.workItem = NULL;
+}
+
+//Runs on the writer thread, only touches the block and the file
+void *SessionRecorder::writeBlock(void *param,int threadid)
+{
+    Block *block = (Block*)param;
+    SessionRecorder *recorder = block->recorder;
+    if(recorder->writeFailed)
+        return NULL;
+
+    int uncompressedSize = int(block->uncompressed.size());
+    uLongf compressedSize = compressBound(uncompressedSize);
+    block->compressed.resize(compressedSize);
+    if(compress2(&block->compressed[0],&compressedSize,&block->uncompressed[0],uncompressedSize,Z_BEST_SPEED)!=Z_OK)
+    {
+        printf("ERROR: COULD NOT COMPRESS A BLOCK OF THE SESSION RECORDING\n");
+        recorder->writeFailed = true;
+        return NULL;
+    }
+
+    //[uncompressed size][compressed size][first seconds][first attoseconds][keyframe][data]
+    int compressedSizeInt = int(compressedSize);
+    unsigned char keyframe = block->keyframe?1:0;
+    FILE *file = recorder->file;
+    if(
+        !writeValue(file,&uncompressedSize,sizeof(int)) ||
+        !writeValue(file,&compressedSizeInt,sizeof(int)) ||
+        !writeValue(file,&block->firstSeconds,sizeof(int)) ||
+        !writeValue(file,&block->firstAttoseconds,sizeof(long long)) ||
+        !writeValue(file,&keyframe,1) ||
+        !writeValue(file,&block->compressed[0],compressedSizeInt)
+    )
+    {
+        printf("ERROR: COULD NOT WRITE TO %s, THE REST OF THE SESSION IS NOT RECORDED\n",recorder->filename.c_str());
+        recorder->writeFailed = true;
+        return NULL;
+    }
+
+    if(block->keyframe)
+    {
+        //Don't hold on to a copy of the state between keyframes
+        vector<unsigned char>().swap(block->uncompressed);
+        vector<unsigned char>().swap(block->compressed);
+    }
+    return NULL;
+}
+
+SessionPlayer::SessionPlayer()
+    :
+    file(NULL),
+    nextBlock(0),
+    blockPos(0)
+{
+}
+
+SessionPlayer::~SessionPlayer()
+{
+    close();
+}
+
+void SessionPlayer::close()
+{
+    if(file)
+        fclose(file);
+    file = NULL;
+    blockIndex.clear();
+    nextBlock = 0;
+    block.clear();
+    blockPos = 0;
+    seekRecords.clear();
+}
+
+bool SessionPlayer::open(const string &filename,int seekSeconds)
+{
+    close();
+    file = fopen(filename.c_str(),"rb");
+    if(!file)
+    {
+        printf("ERROR: COULD NOT OPEN THE SESSION RECORDING %s\n",filename.c_str());
+        return false;
+    }
+
+    char magic[RECORDING_MAGIC_SIZE];
+    int version,nameLength;
+    if(
+        !readValue(file,magic,RECORDING_MAGIC_SIZE) ||
+        memcmp(magic,RECORDING_MAGIC,strlen(RECORDING_MAGIC)+1) ||
+        !readValue(file,&version,sizeof(int)) ||
+        !readValue(file,&nameLength,sizeof(int)) ||
+        nameLength<0 || nameLength>4096
+    )
+    {
+        printf("ERROR: %s IS NOT A SESSION RECORDING\n",filename.c_str());
+        return false;
+    }
+    if(version!=RECORDING_VERSION)
+    {
+        printf("ERROR: %s IS A VERSION %d RECORDING, THIS BUILD READS VERSION %d\n",filename.c_str(),version,RECORDING_VERSION);
+        return false;
+    }
+    vector<char> name(nameLength+1,0);
+    if(nameLength && !readValue(file,&name[0],nameLength))
+        return false;
+    gameName = &name[0];
+
+    //Index the blocks from their headers, nothing is decompressed yet.  A
+    //session that crashed may end in a partial block, which is left out.
+    fseek(file,0,SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file,RECORDING_MAGIC_SIZE+sizeof(int)*2+nameLength,SEEK_SET);
+    while(true)
+    {
+        BlockInfo info;
+        info.offset = ftell(file);
+        unsigned char keyframeFlag;
+        if(
+            !readValue(file,&info.uncompressedSize,sizeof(int)) ||
+            !readValue(file,&info.compressedSize,sizeof(int)) ||
+            !readValue(file,&info.firstSeconds,sizeof(int)) ||
+            !readValue(file,&info.firstAttoseconds,sizeof(long long)) ||
+            !readValue(file,&keyframeFlag,1)
+        )
+            break;
+        info.keyframe = (keyframeFlag!=0);
+        if(
+            info.compressedSize<0 ||
+            info.uncompressedSize<0 ||
+            info.offset+long(RECORDING_BLOCK_HEADER_SIZE)+info.compressedSize > fileSize
+        )
+            break;
+        blockIndex.push_back(info);
+        fseek(file,info.compressedSize,SEEK_CUR);
+    }
+
+    //The last keyframe at or before the seek time
+    int keyframeBlock=-1;
+    for(int a=0; a<int(blockIndex.size()); a++)
+    {
+        const BlockInfo &info = blockIndex[a];
+        if(!info.keyframe)
+            continue;
+        bool beforeSeek = info.firstSeconds<seekSeconds || (info.firstSeconds==seekSeconds && info.firstAttoseconds==0);
+        if(keyframeBlock<0 || beforeSeek)
+            keyframeBlock = a;
+        if(!beforeSeek)
+            break;
+    }
+    if(keyframeBlock<0)
+    {
+        printf("ERROR: %s HAS NO KEYFRAME TO START FROM\n",filename.c_str());
+        return false;
+    }
+    if(!readBlock(keyframeBlock) || !nextInBlock(keyframe) || keyframe.data.size()<2)
+    {
+        printf("ERROR: THE KEYFRAME AT %d IN %s IS DAMAGED\n",blockIndex[keyframeBlock].firstSeconds,filename.c_str());
+        return false;
+    }
+
+    //Like a late joiner, replay the inputs consumed a little before the
+    //keyframe, they may be for frames after it
+    int keepFromSeconds = keyframe.seconds-INPUT_HISTORY_MARGIN_SECONDS;
+    RecordingRecord record;
+    RecordingRecord roster;
+    roster.seconds = -1;
+    vector<RecordingRecord> inputs;
+    for(int a=0; a<keyframeBlock; a++)
+    {
+        if(blockIndex[a].keyframe)
+            continue;
+        if(!readBlock(a))
+            return false;
+        while(nextInBlock(record))
+        {
+            if(record.data.empty())
+                continue;
+            if(record.data[0]==ID_SPECTATOR_ROSTER)
+                roster = record;
+            else if(record.data[0]==ID_SPECTATOR_INPUTS && record.seconds>=keepFromSeconds)
+                inputs.push_back(record);
+        }
+    }
+    seekRecords.clear();
+    if(roster.seconds>=0)
+        seekRecords.push_back(roster);
+    seekRecords.insert(seekRecords.end(),inputs.begin(),inputs.end());
+
+    nextBlock = keyframeBlock+1;
+    block.clear();
+    blockPos = 0;
+
+    printf(
+        "OPENED THE %s SESSION RECORDING %s: %d BLOCKS, STARTING FROM THE KEYFRAME AT %d.%lld\n",
+        gameName.c_str(),
+        filename.c_str(),
+        int(blockIndex.size()),
+        keyframe.seconds,
+        keyframe.attoseconds
+        );
+    return true;
+}
+
+bool SessionPlayer::next(RecordingRecord &record)
+{
+    while(!nextInBlock(record))
+    {
+        if(nextBlock>=int(blockIndex.size()))
+            return false;
+        if(!readBlock(nextBlock++))
+            return false;
+    }
+    return true;
+}
+
+bool SessionPlayer::readBlock(int index)
+{
+    const BlockInfo &info = blockIndex[index];
+    block.clear();
+    blockPos = 0;
+    compressed.resize(info.compressedSize);
+    fseek(file,info.offset+RECORDING_BLOCK_HEADER_SIZE,SEEK_SET);
+    if(info.compressedSize && !readValue(file,&compressed[0],info.compressedSize))
+        return false;
+    block.resize(info.uncompressedSize);
+    if(!info.uncompressedSize)
+        return true;
+    uLongf uncompressedSize = info.uncompressedSize;
+    if(
+        uncompress(&block[0],&uncompressedSize,&compressed[0],info.compressedSize)!=Z_OK ||
+        int(uncompressedSize)!=info.uncompressedSize
+    )
+    {
+        printf("ERROR: BLOCK %d OF THE SESSION RECORDING IS DAMAGED\n",index);
+        block.clear();
+        return false;
+    }
+    return true;
+}
+
+bool SessionPlayer::nextInBlock(RecordingRecord &record)
+{
+    if(blockPos+int(RECORDING_RECORD_HEADER_SIZE) > int(block.size()))
+        return false;
+    const unsigned char *ptr = &block[blockPos];
+    int size;
+    memcpy(&record.seconds,ptr,sizeof(int));
+    ptr += sizeof(int);
+    memcpy(&record.attoseconds,ptr,sizeof(long long));
+    ptr += sizeof(long long);
+    memcpy(&size,ptr,sizeof(int));
+    ptr += sizeof(int);
+    if(size<0 || blockPos+int(RECORDING_RECORD_HEADER_SIZE)+size > int(block.size()))
+    {
+        printf("ERROR: A RECORD OF THE SESSION RECORDING IS DAMAGED\n");
+        blockPos = int(block.size());
+        return false;
+    }
+    record.data.assign(ptr,ptr+size);
+    blockPos += RECORDING_RECORD_HEADER_SIZE+size;
+    return true;
+}
@@ -0,0 +1,201 @@
+#ifndef __NSM_RECORDING__
+#define __NSM_RECORDING__
+
+#include "NSM_Spectator.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+struct _osd_work_queue;
+struct _osd_work_item;
+
+//Every recording starts with this (including the terminating 0)
+#define RECORDING_MAGIC "NSMREC1"
+#define RECORDING_MAGIC_SIZE (8)
+
+#define RECORDING_VERSION (1)
+
+//Records are gathered into blocks of about this many bytes, each block is
+//compressed on its own.  Keyframes always get a block to themselves, so a
+//seek can skip them without decompressing anything.
+#define RECORDING_BLOCK_SIZE (64*1024)
+
+//Blocks that may wait for the writer thread before the emulation waits
+//for it
+#define RECORDING_BLOCKS_IN_FLIGHT (4)
+
+//Every block starts with its uncompressed size, compressed size, the time
+//of its first record and whether it is a keyframe
+#define RECORDING_BLOCK_HEADER_SIZE (sizeof(int)*3+sizeof(long long)+1)
+
+//Every record starts with its emulated time and size
+#define RECORDING_RECORD_HEADER_SIZE (sizeof(int)*2+sizeof(long long))
+
+//Why a keyframe was taken.  A replay checks its state against a periodic
+//keyframe, but loads a sync keyframe (the state was replaced by one that
+//didn't come from the inputs: the initial sync or a resync).
+enum RecordingKeyframeReason
+{
+    RECORDING_KEYFRAME_PERIODIC,
+    RECORDING_KEYFRAME_SYNC
+};
+
+//One record of a recording.  data is what a spectator would be sent
+//(ID_SPECTATOR_INPUTS or ID_SPECTATOR_ROSTER), or ID_RECORDING_KEYFRAME
+//followed by the reason and a checkpoint (see Common::captureCheckpoint).
+struct RecordingRecord
+{
+    int seconds;
+    long long attoseconds;
+    std::vector<unsigned char> data;
+};
+
+//Writes a netplay session to disk as it is played: the inputs the emulation
+//consumed, the players, and keyframes of the state.  This is what a
+//spectator is sent plus the keyframes, so a replay plays back like a
+//spectator that reads a file.  Blocks are compressed and written on a
+//background thread.
+class SessionRecorder
+{
+public:
+    SessionRecorder();
+
+    ~SessionRecorder();
+
+    bool open(const std::string &filename,const std::string &gameName);
+
+    //Writes everything that is left and closes the file
+    void close();
+
+    inline void append(int peerID,const std::string &input)
+    {
+        feed.append(peerID,input);
+    }
+
+    //Records the inputs appended since the last call, and the players if
+    //they changed.  Called once per frame.
+    void flush(
+        int seconds,
+        long long attoseconds,
+        const std::map<RakNet::RakNetGUID,int> &peerIDs,
+        const std::map<int,std::string> &peerNames
+    );
+
+    //checkpoint is laid out like Common::captureCheckpoint's
+    void addKeyframe(int seconds,long long attoseconds,int reason,const std::vector<unsigned char> &checkpoint);
+
+    //A keyframe should be recorded as soon as the state can be saved
+    inline bool needsKeyframe() const
+    {
+        return keyframeNeeded;
+    }
+
+    inline void requestKeyframe()
+    {
+        keyframeNeeded=true;
+    }
+
+protected:
+    struct Block
+    {
+        SessionRecorder *recorder;
+        std::vector<unsigned char> uncompressed;
+        std::vector<unsigned char> compressed;
+        int firstSeconds;
+        long long firstAttoseconds;
+        bool keyframe;
+        _osd_work_item *workItem;
+    };
+
+    FILE *file;
+    std::string filename;
+    SpectatorFeed feed;
+    bool keyframeNeeded;
+
+    //Only touched by the writer thread once the file is open
+    bool writeFailed;
+
+    _osd_work_queue *workQueue;
+    Block blocks[RECORDING_BLOCKS_IN_FLIGHT];
+    //The block being filled, the ones after it (wrapping) are in flight
+    int currentBlock;
+
+    void addRecord(int seconds,long long attoseconds,const unsigned char *data,int size);
+
+    //Hands the current block to the writer thread and moves to the next one
+    void submitBlock();
+
+    void waitForBlock(Block &block);
+
+    static void *writeBlock(void *param,int threadid);
+};
+
+//Reads a recording back.  Blocks are decompressed as they are needed, so a
+//replay can run as fast as the emulation does.
+class SessionPlayer
+{
+public:
+    SessionPlayer();
+
+    ~SessionPlayer();
+
+    //Positions the recording at the last keyframe at or before seekSeconds
+    //(the first keyframe if there is none).  False if the file can't be
+    //read or has no keyframe to start from.
+    bool open(const std::string &filename,int seekSeconds);
+
+    void close();
+
+    inline const std::string &getGameName() const
+    {
+        return gameName;
+    }
+
+    //The keyframe the replay starts from
+    inline const RecordingRecord &getKeyframe() const
+    {
+        return keyframe;
+    }
+
+    //The players and the inputs that were consumed shortly before the
+    //keyframe, but may be for frames after it
+    inline const std::vector<RecordingRecord> &getSeekRecords() const
+    {
+        return seekRecords;
+    }
+
+    //The next record after the keyframe, false at the end of the recording
+    bool next(RecordingRecord &record);
+
+protected:
+    struct BlockInfo
+    {
+        long offset;
+        int uncompressedSize;
+        int compressedSize;
+        int firstSeconds;
+        long long firstAttoseconds;
+        bool keyframe;
+    };
+
+    FILE *file;
+    std::string gameName;
+    std::vector<BlockInfo> blockIndex;
+    int nextBlock;
+
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> block;
+    int blockPos;
+
+    RecordingRecord keyframe;
+    std::vector<RecordingRecord> seekRecords;
+
+    bool readBlock(int index);
+
+    //The next record in the current block, false when the block is done
+    bool nextInBlock(RecordingRecord &record);
+};
+
+#endif
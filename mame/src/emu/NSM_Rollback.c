@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "NSM_Rollback.h"
+
+#include "NSM_InputTimeline.h"
+#include "NSM_Metrics.h"
+
+RollbackManager netplayRollback;
+
+extern InputTimeline playerInputTimeline;
+
+//Time of the last input frame (inptport.c)
+extern attotime lastTime;
+
+//Copies the input port state that is not part of the save state.  Returns
+//the size, both buffers may be NULL to only get the size.
+extern int inputPortRollbackState(running_machine &machine,UINT8 *saveBuffer,const UINT8 *loadBuffer);
+
+static double ticksToMS(osd_ticks_t ticks)
+{
+    return double(ticks)*1000.0/double(osd_ticks_per_second());
+}
+
+RollbackManager::RollbackManager()
+    :
+    machine(NULL),
+    maxFrames(0),
+    numSlots(0),
+    stateSize(0),
+    inputStateSize(0),
+    slotSize(0),
+    capturedTime(0,0),
+    resimulating(false),
+    snapshotTicks(0),
+    maxSnapshotTicks(0),
+    numSnapshots(0),
+    restoreTicks(0),
+    maxRestoreTicks(0),
+    numRollbacks(0),
+    numFailedRollbacks(0),
+    numResimulatedFrames(0),
+    maxResimulatedFrames(0),
+    resimulateTicks(0)
+{
+}
+
+void RollbackManager::initialize(running_machine *_machine,int _maxFrames)
+{
+    machine = _machine;
+    maxFrames = MAX(1,_maxFrames);
+
+    //One extra slot for the frame we restore to, and one for the frame that
+    //is being captured
+    numSlots = maxFrames+2;
+    stateSize = machine->save().snapshot_size();
+    inputStateSize = inputPortRollbackState(*machine,NULL,NULL);
+    slotSize = stateSize+inputStateSize;
+    ring.assign(size_t(slotSize)*numSlots,0);
+    slotFrames.assign(numSlots,-1);
+    capturedTime = lastTime;
+
+    printf("ROLLBACK ENABLED: %d FRAMES, %d KB PER SNAPSHOT\n",maxFrames,int(slotSize/1024));
+}
+
+void RollbackManager::shutdown()
+{
+    if(!machine)
+        return;
+    printf("%s\n",getStatsString().c_str());
+    machine = NULL;
+    ring.clear();
+    slotFrames.clear();
+}
+
+attotime RollbackManager::getPredictionStart(const attotime &curtime,int secondsBetweenCheckpoints)
+{
+    if(!machine || !playerInputTimeline.hasGrid())
+        return curtime;
+
+    attoseconds_t period = playerInputTimeline.getPeriod();
+    if(secondsBetweenCheckpoints>0)
+    {
+        //Everything before a sync or checkpoint has to be confirmed when we get there
+        attotime nextSync(((curtime.seconds/secondsBetweenCheckpoints)+1)*secondsBetweenCheckpoints,0);
+        if(nextSync-curtime <= attotime(0,period)*ROLLBACK_SYNC_GUARD_FRAMES)
+            return curtime;
+    }
+
+    attotime window = attotime(0,period)*UINT32(maxFrames);
+    if(curtime<=window)
+        return curtime;
+    return curtime-window;
+}
+
+void RollbackManager::captureFrame()
+{
+    if(!machine || lastTime==capturedTime)
+        return;
+
+    INT64 frame;
+    if(!playerInputTimeline.frameAtOrAfter(lastTime,frame))
+        return;
+    capturedTime = lastTime;
+
+    int slot = int(frame%numSlots);
+    if(!machine->scheduler().can_save())
+    {
+        //Anonymous timers can't be restored, so we can't roll back to here
+        slotFrames[slot] = -1;
+        return;
+    }
+
+    osd_ticks_t start = osd_ticks();
+    UINT8 *data = &ring[size_t(slot)*slotSize];
+    if(machine->save().save_snapshot(data)!=STATERR_NONE)
+    {
+        slotFrames[slot] = -1;
+        return;
+    }
+    inputPortRollbackState(*machine,data+stateSize,NULL);
+    slotFrames[slot] = frame;
+
+    osd_ticks_t ticks = osd_ticks()-start;
+    snapshotTicks += ticks;
+    maxSnapshotTicks = MAX(maxSnapshotTicks,ticks);
+    numSnapshots++;
+    if(!resimulating && (numSnapshots%ROLLBACK_STATS_INTERVAL)==0)
+        NETLOG(NETLOG_DEBUG,("%s\n",getStatsString().c_str()));
+}
+
+void RollbackManager::rollbackIfNeeded()
+{
+    if(!machine)
+        return;
+
+    INT64 frame = playerInputTimeline.takeMisprediction();
+    if(frame<0)
+        return;
+
+    //The snapshot for a frame is taken right after its inputs were read, so
+    //restoring the one before the bad frame re-reads the bad frame's inputs
+    INT64 restoreFrame = frame-1;
+    int slot = int(MAX(restoreFrame,0)%numSlots);
+    if(restoreFrame<0 || slotFrames[slot]!=restoreFrame)
+    {
+        printf("ERROR: CANNOT ROLL BACK TO FRAME %d, THE STATE WILL BE WRONG UNTIL THE NEXT SYNC\n",int(restoreFrame));
+        numFailedRollbacks++;
+        return;
+    }
+
+    attotime targetTime = machine->time();
+
+    osd_ticks_t start = osd_ticks();
+    UINT8 *data = &ring[size_t(slot)*slotSize];
+    //Only rewrite what the mispredicted frames changed, the rest of the state
+    //stays clean for the dirty page tracker
+    int changedRuns;
+    machine->save().load_snapshot(data,&changedRuns);
+    NETLOG(NETLOG_TRACE,("ROLLBACK TO FRAME %d REWROTE %d STATE RUNS\n",int(restoreFrame),changedRuns));
+    inputPortRollbackState(*machine,NULL,data+stateSize);
+    playerInputTimeline.clearPredictions(frame);
+    capturedTime = lastTime;
+    osd_ticks_t ticks = osd_ticks()-start;
+    restoreTicks += ticks;
+    maxRestoreTicks = MAX(maxRestoreTicks,ticks);
+    numRollbacks++;
+
+    //Run back up to where we were.  The snapshots of the frames we pass are
+    //replaced because they were built on the wrong inputs.
+    start = osd_ticks();
+    int snapshotsBefore = numSnapshots;
+    resimulating=true;
+    while(machine->time()<targetTime)
+    {
+        machine->scheduler().timeslice();
+        captureFrame();
+    }
+    resimulating=false;
+    resimulateTicks += osd_ticks()-start;
+
+    int frames = numSnapshots-snapshotsBefore;
+    numResimulatedFrames += frames;
+    maxResimulatedFrames = MAX(maxResimulatedFrames,frames);
+}
+
+void RollbackManager::reset()
+{
+    if(!machine)
+        return;
+    std::fill(slotFrames.begin(),slotFrames.end(),-1);
+    capturedTime = lastTime;
+    playerInputTimeline.takeMisprediction();
+    playerInputTimeline.clearPredictions(0);
+}
+
+std::string RollbackManager::getStatsString()
+{
+    char buf[1024];
+    double snapshotMS = numSnapshots?ticksToMS(snapshotTicks)/numSnapshots:0.0;
+    double restoreMS = numRollbacks?ticksToMS(restoreTicks)/numRollbacks:0.0;
+    double resimulateMS = numResimulatedFrames?ticksToMS(resimulateTicks)/numResimulatedFrames:0.0;
+    double frameMS = playerInputTimeline.hasGrid()?ATTOSECONDS_TO_DOUBLE(playerInputTimeline.getPeriod())*1000.0:0.0;
+    sprintf(
+        buf,
+        "ROLLBACK STATS: %d KB STATE, SNAPSHOT %.3f ms (MAX %.3f), RESTORE %.3f ms (MAX %.3f), %d ROLLBACKS (%d FAILED), %d FRAMES RESIMULATED (MAX %d AT ONCE, %.3f ms EACH), FRAME %.3f ms",
+        int(slotSize/1024),
+        snapshotMS,
+        ticksToMS(maxSnapshotTicks),
+        restoreMS,
+        ticksToMS(maxRestoreTicks),
+        numRollbacks,
+        numFailedRollbacks,
+        numResimulatedFrames,
+        maxResimulatedFrames,
+        resimulateMS,
+        frameMS
+        );
+    return std::string(buf);
+}
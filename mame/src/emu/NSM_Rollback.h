@@ -0,0 +1,98 @@
+#ifndef __NSM_ROLLBACK__
+#define __NSM_ROLLBACK__
+
+#include <string>
+#include <vector>
+
+#include "emu.h"
+
+//How far ahead of our own inputs we schedule them in rollback mode.  Must be
+//at least one frame so the report is in the future when it is sent.
+#define ROLLBACK_INPUT_DELAY_FRAMES (1)
+
+//The barrier stops predicting this many frames before a sync or checkpoint
+//so the state that is saved only depends on confirmed inputs
+#define ROLLBACK_SYNC_GUARD_FRAMES (2)
+
+//Print the cost summary every this many snapshots
+#define ROLLBACK_STATS_INTERVAL (600)
+
+//Keeps an in-memory save state for each of the last few frames.  While the
+//barrier lets the emulation run ahead of a peer's inputs, their missing
+//inputs are predicted (see InputTimeline::predictInput).  When a report
+//arrives that does not match a prediction, the state from the frame before
+//it is restored and the frames up to the present are run again with video
+//and sound output turned off.
+class RollbackManager
+{
+public:
+    RollbackManager();
+
+    //Allocates the snapshot ring.  maxFrames is how many frames the
+    //emulation may run ahead of the slowest peer.
+    void initialize(running_machine *machine,int maxFrames);
+
+    void shutdown();
+
+    inline bool isEnabled() const
+    {
+        return machine!=NULL;
+    }
+
+    //How many frames the emulation may run ahead of the slowest peer
+    inline int getMaxFrames() const
+    {
+        return maxFrames;
+    }
+
+    inline bool isResimulating() const
+    {
+        return resimulating;
+    }
+
+    //Oldest time that still needs a report from every peer before the
+    //emulation may pass curtime.  This is curtime itself when prediction is
+    //not possible.
+    attotime getPredictionStart(const attotime &curtime,int secondsBetweenCheckpoints);
+
+    //Called after every timeslice, takes a snapshot if a new input frame
+    //started since the last one
+    void captureFrame();
+
+    //Rewinds and re-simulates if a late report contradicted a prediction.
+    //Must be called between timeslices.
+    void rollbackIfNeeded();
+
+    //Drops every snapshot, used when the state is replaced by a sync
+    void reset();
+
+    std::string getStatsString();
+
+protected:
+    running_machine *machine;
+    int maxFrames;
+    int numSlots;
+    UINT32 stateSize;
+    UINT32 inputStateSize;
+    UINT32 slotSize;
+    std::vector<UINT8> ring;
+    std::vector<INT64> slotFrames;
+    attotime capturedTime;
+    bool resimulating;
+
+    //Cost tracking, in osd ticks
+    osd_ticks_t snapshotTicks;
+    osd_ticks_t maxSnapshotTicks;
+    int numSnapshots;
+    osd_ticks_t restoreTicks;
+    osd_ticks_t maxRestoreTicks;
+    int numRollbacks;
+    int numFailedRollbacks;
+    int numResimulatedFrames;
+    int maxResimulatedFrames;
+    osd_ticks_t resimulateTicks;
+};
+
+extern RollbackManager netplayRollback;
+
+#endif
@@ -10,6 +10,7 @@
 #include "RakSleep.h"
 
 #include "NSM_Server.h"
+#include "NSM_Delta.h"
 
 #include <assert.h>
 #include <cstdio>
@@ -25,15 +26,11 @@
 #include "emuopts.h"
 
 Server *netServer=NULL;
-Server server;
-
-volatile bool memoryBlocksLocked = false;
 
 Server *createGlobalServer(string _username,unsigned short _port)
 {
     cout << "Creating server on port " << _port << endl;
-    server = Server(_username,_port);
-    netServer = &server;
+    netServer = global_alloc(Server(_username,_port));
     return netServer;
 }
 
@@ -42,6 +39,7 @@ void deleteGlobalServer()
     if(netServer)
     {
 	    netServer->shutdown();
+	    global_free(netServer);
     }
     netServer = NULL;
 }
@@ -53,14 +51,6 @@ extern unsigned char GetPacketIdentifier(RakNet::Packet *p);
 extern unsigned char *GetPacketData(RakNet::Packet *p);
 extern int GetPacketSize(RakNet::Packet *p);
 
-#define INITIAL_BUFFER_SIZE (1024*1024*32)
-unsigned char *compressedBuffer = (unsigned char*)malloc(INITIAL_BUFFER_SIZE);
-int compressedBufferSize = INITIAL_BUFFER_SIZE;
-unsigned char *syncBuffer = (unsigned char*)malloc(INITIAL_BUFFER_SIZE);
-int syncBufferSize = INITIAL_BUFFER_SIZE;
-unsigned char *uncompressedBuffer = (unsigned char*)malloc(INITIAL_BUFFER_SIZE);
-int uncompressedBufferSize = INITIAL_BUFFER_SIZE;
-
 Server::Server(string username,int _port)
     :
     Common(username),
@@ -69,6 +59,7 @@ Server::Server(string username,int _port)
     syncHappend(false)
 {
     rakInterface = RakNet::RakPeerInterface::GetInstance();
+    attachInputNotifier();
 
     /* allocate deflate state */
     strm.zalloc = Z_NULL;
@@ -76,20 +67,40 @@ Server::Server(string username,int _port)
     strm.opaque = Z_NULL;
 
     firstSync=true;
+    syncSecond=-1;
+    nextSyncJob=0;
+    pendingSyncJob=-1;
+    syncWorkQueue=NULL;
+    syncFrameMS=1000.0/60.0;
+    syncDumpCount=0;
 
     selfPeerID=1;
     peerIDs[rakInterface->GetMyGUID()] = 1;
     peerNames[1] = username;
-    peerInputs[1] = vector<string>();
+    inputHistory.enable();
 
     syncTime = getTimeSinceStartup();
 }
 
 void Server::shutdown()
 {
+    stopRecording();
+    collectSyncJob(true);
+    stopMetricsExport();
+    cancelInitialSyncs();
+    if(syncWorkQueue)
+    {
+        osd_work_queue_free(syncWorkQueue);
+        syncWorkQueue=NULL;
+    }
+
+    stopNetworkThread();
+
     // Be nice and let the server know we quit.
     rakInterface->Shutdown(300);
 
+    detachInputNotifier();
+
     // We're done with the network
     RakNet::RakPeerInterface::DestroyInstance(rakInterface);
 }
@@ -170,8 +181,6 @@ void Server::acceptPeer(RakNet::SystemAddress saToAccept,running_machine *machin
     peerIDs[guidToAccept] = assignID;
     peerNames[assignID] = candidateNames[saToAccept];
     candidateNames.erase(candidateNames.find(saToAccept));
-    if(peerInputs.find(assignID)==peerInputs.end())
-        peerInputs[assignID] = vector<string>();
 
     printf("ASSIGNING ID %d TO NEW CLIENT\n",assignID);
     memcpy(buf+1,&assignID,sizeof(int));
@@ -180,23 +189,29 @@ void Server::acceptPeer(RakNet::SystemAddress saToAccept,running_machine *machin
            buf+1+sizeof(int)+sizeof(uint64_t),
            peerNames[assignID].c_str()
            );
-    rakInterface->Send(
+    //Spectators hear about the new player from the feed
+    sendToPlayers(
         buf,
         1+sizeof(int)+sizeof(uint64_t)+strlen(peerNames[assignID].c_str())+1, //add 1 so we get the \0 at the end
         HIGH_PRIORITY,
         RELIABLE_ORDERED,
-        ORDERING_CHANNEL_SYNC,
-        RakNet::UNASSIGNED_SYSTEM_ADDRESS,
-        true
+        ORDERING_CHANNEL_SYNC
     );
 
     //Perform initial sync with player
-    initialSync(saToAccept,machine);
+    initialSync(saToAccept,machine,false);
 }
 
 void Server::removePeer(RakNet::RakNetGUID guid,running_machine *machine)
 {
     RakNet::SystemAddress sa = rakInterface->GetSystemAddressFromGuid(guid);
+    retireNetworkPeer(guid);
+
+    if(spectatorFeed.remove(guid))
+    {
+        printf("SPECTATOR %s LEFT\n",sa.ToString(true));
+        return;
+    }
 
     if(waitingForAcceptFrom.find(sa)!=waitingForAcceptFrom.end())
     {
@@ -284,6 +299,7 @@ bool Server::initializeConnection()
     {
         printf("%i. %i\n", i+1, sockets[i]->boundAddress.port);
     }
+    startNetworkThread();
     return true;
 }
 
@@ -292,6 +308,7 @@ MemoryBlock Server::createMemoryBlock(int size)
     blocks.push_back(MemoryBlock(size));
     staleBlocks.push_back(MemoryBlock(size));
     initialBlocks.push_back(MemoryBlock(size));
+    if(dirtyPages) dirtyPages->addBlock(blocks.back().data,size);
     return blocks.back();
 }
 
@@ -325,284 +342,20 @@ vector<MemoryBlock> Server::createMemoryBlock(unsigned char *ptr,int size)
     blocks.push_back(MemoryBlock(ptr,size));
     staleBlocks.push_back(MemoryBlock(size));
     initialBlocks.push_back(MemoryBlock(size));
+    if(dirtyPages) dirtyPages->addBlock(ptr,size);
     retval.push_back(blocks.back());
     return retval;
 }
 
-extern attotime globalCurtime;
-extern bool waitingForClientCatchup;
-extern attotime oldInputTime;
-
-void Server::initialSync(const RakNet::SystemAddress &sa,running_machine *machine)
-{
-    unsigned char checksum = 0;
-
-    waitingForClientCatchup=true;
-    machine->osd().pauseAudio(true);
-
-    int syncBytes;
-    {
-    RakNet::BitStream uncompressedStream;
-
-    uncompressedStream.Write(startupTime);
-
-    uncompressedStream.Write(globalCurtime);
-
-    if(getSecondsBetweenSync())
-    {
-        while(memoryBlocksLocked)
-        {
-            ;
-        }
-        memoryBlocksLocked=true;
-        cout << "IN CRITICAL SECTION\n";
-        cout << "SERVER: Sending initial snapshot\n";
-
-        int numBlocks = int(blocks.size());
-        cout << "NUMBLOCKS: " << numBlocks << endl;
-        uncompressedStream.Write(numBlocks);
-
-        // NOTE: The server must send stale data to the client for the first time
-        // So that future syncs will be accurate
-        for(int blockIndex=0; blockIndex<int(initialBlocks.size()); blockIndex++)
-        {
-            //cout << "BLOCK SIZE FOR INDEX " << blockIndex << ": " << staleBlocks[blockIndex].size << endl;
-            uncompressedStream.Write(initialBlocks[blockIndex].size);
-
-            cout << "BLOCK " << blockIndex << ": ";
-            for(int a=0; a<staleBlocks[blockIndex].size; a++)
-            {
-                checksum = checksum ^ staleBlocks[blockIndex].data[a];
-                //cout << int(staleBlocks[blockIndex].data[a]) << ' ';
-                unsigned char value = initialBlocks[blockIndex].data[a] ^ staleBlocks[blockIndex].data[a];
-                uncompressedStream.WriteBits(&value,8);
-            }
-            cout << int(checksum) << endl;
-        }
-    }
-
-    for(
-        map<int,vector< string > >::iterator it = peerInputs.begin();
-        it != peerInputs.end();
-        it++
-    )
-    {
-        uncompressedStream.Write(it->first);
-        uncompressedStream.Write(int(oldPeerInputs[it->first].size()) + int(it->second.size()));
-        for(int a=0; a<(int)it->second.size(); a++)
-        {
-            uncompressedStream.Write(int(it->second[a].length()));
-            uncompressedStream.WriteBits((const unsigned char*)it->second[a].c_str(),it->second[a].length()*8);
-
-            for(int b=0;b<it->second[a].length();b++)
-            {
-                checksum = checksum ^ it->second[a][b];
-            }
-        }
-        for(int a=0; a<int(oldPeerInputs[it->first].size()); a++)
-        {
-            uncompressedStream.Write(int(oldPeerInputs[it->first][a].length()));
-            uncompressedStream.WriteBits((const unsigned char*)oldPeerInputs[it->first][a].c_str(),oldPeerInputs[it->first][a].length()*8);
-
-            for(int b=0;b<oldPeerInputs[it->first][a].length();b++)
-            {
-                checksum = checksum ^ oldPeerInputs[it->first][a][b];
-            }
-        }
-    }
-    uncompressedStream.Write(int(-1));
-    uncompressedStream.Write(checksum);
-    cout << "CHECKSUM: " << int(checksum) << endl;
-
-    if(uncompressedBufferSize<uncompressedStream.GetNumberOfBytesUsed()+sizeof(int))
-    {
-        uncompressedBufferSize = uncompressedStream.GetNumberOfBytesUsed()+sizeof(int);
-	free(uncompressedBuffer);
-        uncompressedBuffer = (unsigned char*)malloc(uncompressedBufferSize);
-        if(!uncompressedBuffer)
-        {
-            cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-            exit(1);
-        }
-    }
-    syncBytes = uncompressedStream.GetNumberOfBytesUsed();
-    memcpy(uncompressedBuffer,uncompressedStream.GetData(),uncompressedStream.GetNumberOfBytesUsed());
-
-    int uncompressedStateSize = (int)uncompressedStream.GetNumberOfBytesUsed();
-    printf("INITIAL UNCOMPRESSED STATE SIZE: %d\n",uncompressedStateSize);
-    }
-
-    cout << "PUTTING NVRAM AT LOCATION " << syncBytes << endl;
-
-	// open the file; if it exists, call everyone to read from it
-	emu_file file(machine->options().nvram_directory(), OPEN_FLAG_READ);
-	if (file.open(machine->basename(), ".nv") == FILERR_NONE && file.size()<=1024*1024*64) //Don't bother sending huge NVRAM's
-    {
-        int nvramSize = file.size();
-        if(uncompressedBufferSize<syncBytes+sizeof(int)+nvramSize)
-        {
-            uncompressedBufferSize = syncBytes+sizeof(int)+nvramSize;
-	    free(uncompressedBuffer);
-            uncompressedBuffer = (unsigned char*)malloc(uncompressedBufferSize);
-            if(!uncompressedBuffer)
-            {
-                cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-                exit(1);
-            }
-        }
-        cout << "SENDING NVRAM OF SIZE: " << nvramSize << endl;
-        memcpy(uncompressedBuffer+syncBytes,&nvramSize,sizeof(int));
-        file.read(uncompressedBuffer+syncBytes+sizeof(int),nvramSize);
-        file.close();
-        syncBytes += sizeof(int) + nvramSize;
-    }
-	else
-	{
-	    int dummy=0;
-        memcpy(uncompressedBuffer+syncBytes,&dummy,sizeof(int));
-        syncBytes += sizeof(int);
-	}
-
-    cout << "BYTES USED: " << syncBytes << endl;
-
-    //The application should ensure that this value be at least (sourceLen 1.001) + 12.
-    //JJG: Doing more than that to account for header and provide some padding
-    //vector<unsigned char> compressedInitialSyncBuffer(
-            //sizeof(int)*2 + lzmaGetMaxCompressedSize(uncompressedStream.GetNumberOfBytesUsed()), '\0');
-
-    //JJG: Take a risk and assume the compressed size will be smaller than the uncompressed size
-    int newCompressedSize = max(1024*1024,int(sizeof(int)*2 + lzmaGetMaxCompressedSize(syncBytes)));
-    if(compressedBufferSize < newCompressedSize )
-    {
-        compressedBufferSize = newCompressedSize;
-        cout << "NEW COMPRESSED BUFFER SIZE: " << compressedBufferSize << endl;
-	free(compressedBuffer);
-        compressedBuffer = (unsigned char*)malloc(compressedBufferSize);
-        if(!compressedBuffer)
-        {
-            cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-            exit(1);
-        }
-    }
-
-    int compressedSizeLong = compressedBufferSize;
-
-    //FILE *stateptr = fopen("initialState.dat","wb");
-    //fwrite(uncompressedStream.GetData(),uncompressedStream.GetNumberOfBytesUsed(),1,stateptr);
-    //fclose(stateptr);
-
-    lzmaCompress(
-        compressedBuffer+sizeof(int)+sizeof(int),
-        compressedSizeLong,
-        uncompressedBuffer,
-        syncBytes,
-        6
-    );
-
-    int uncompressedSize = (int)syncBytes;
-    memcpy(compressedBuffer,&uncompressedSize,sizeof(int));
-
-    int compressedSize = (int)compressedSizeLong;
-    memcpy(compressedBuffer+sizeof(int),&compressedSize,sizeof(int));
-
-    printf("INITIAL UNCOMPRESSED SIZE: %d\n",uncompressedSize);
-    printf("INITIAL COMPRESSED SIZE: %d\n",compressedSize);
-
-    /*
-    rakInterface->Send(
-    	(char*)(&compressedInitialSyncBuffer[0]),
-    	compressedSize+1+sizeof(int),
-    	HIGH_PRIORITY,
-    	RELIABLE_ORDERED,
-    	ORDERING_CHANNEL_SYNC,
-    	guid,
-    	false
-           );
-    */
-
-    //
-    unsigned char *sendPtr = compressedBuffer;
-    int sizeRemaining = compressedSize+sizeof(int)+sizeof(int);
-    printf("INITIAL COMPRESSED SIZE: %dKB\n",sizeRemaining/1024);
-    int packetSize = max(256,min(1024,sizeRemaining/100));
-
-    oldInputTime.seconds = oldInputTime.attoseconds = 0;
-
-    while(sizeRemaining>packetSize)
-    {
-        RakNet::BitStream bitStreamPart(65536);
-        unsigned char header = ID_INITIAL_SYNC_PARTIAL;
-        bitStreamPart.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
-        bitStreamPart.WriteBits((const unsigned char*)sendPtr,8*packetSize);
-        sizeRemaining -= packetSize;
-        sendPtr += packetSize;
-        rakInterface->Send(
-            &bitStreamPart,
-            HIGH_PRIORITY,
-            RELIABLE_ORDERED,
-            ORDERING_CHANNEL_SYNC,
-            sa,
-            false
-        );
-        ui_update_and_render(*machine, &machine->render().ui_container());
-        machine->osd().update(false);
-        RakSleep(10);
-    }
-    {
-        RakNet::BitStream bitStreamPart(65536);
-        unsigned char header = ID_INITIAL_SYNC_COMPLETE;
-        bitStreamPart.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
-        bitStreamPart.WriteBits((const unsigned char*)sendPtr,8*sizeRemaining);
-        rakInterface->Send(
-            &bitStreamPart,
-            HIGH_PRIORITY,
-            RELIABLE_ORDERED,
-            ORDERING_CHANNEL_SYNC,
-            sa,
-            false
-        );
-        ui_update_and_render(*machine, &machine->render().ui_container());
-        machine->osd().update(false);
-        RakSleep(10);
-    }
-    //
-
-    cout << "FINISHED SENDING BLOCKS TO CLIENT\n";
-    cout << "SERVER: Done with initial snapshot\n";
-    cout << "OUT OF CRITICAL AREA\n";
-    cout.flush();
-    memoryBlocksLocked=false;
-}
-
 void Server::update(running_machine *machine)
 {
-    for(
-        map<RakNet::RakNetGUID,vector< string > >::iterator it = unknownPeerInputs.begin();
-        it != unknownPeerInputs.end();
-        )
-    {
-        cout << "GOT UNKNOWN PEER INPUT\n";
-        if(peerIDs.find(it->first)!=peerIDs.end())
-        {
-            int ID = peerIDs[it->first];
-            for(int a=0;a<it->second.size();a++)
-            {
-                peerInputs[ID].push_back(it->second[a]);
-            }
-            map<RakNet::RakNetGUID,vector< string > >::iterator itold = it;
-            it++;
-            unknownPeerInputs.erase(itold);
-        }
-        else
-        {
-            it++;
-        }
-    }
+    pollNetworkPeers();
+    pumpInitialSyncs();
 
     //cout << "SERVER TIME: " << RakNet::GetTimeMS()/1000.0f/60.0f << endl;
     //printf("Updating server\n");
     RakNet::Packet *p;
-    for (p=rakInterface->Receive(); p; rakInterface->DeallocatePacket(p), p=rakInterface->Receive())
+    for (p=receivePacket(); p; rakInterface->DeallocatePacket(p), p=receivePacket())
     {
         // We got a packet, get the identifier with our handy function
         unsigned char packetIdentifier = GetPacketIdentifier(p);
@@ -633,12 +386,25 @@ void Server::update(running_machine *machine)
             break;
 
         case ID_CLIENT_INFO:
+        {
             cout << "GOT ID_CLIENT_INFO\n";
             //This client is requesting candidacy, set their info
+            int spectator=0;
             {
                 char buf[4096];
                 strcpy(buf,(char*)(p->data+1));
-                candidateNames[p->systemAddress] = buf;
+
+                //Newer clients follow their name with the sync codecs they
+                //can decode and whether they only want to watch
+                int codecMask = SYNC_CODECS_LEGACY;
+                int maskOffset = 1+int(strlen(buf))+1;
+                if(int(p->length) >= maskOffset+int(sizeof(int)))
+                    memcpy(&codecMask,p->data+maskOffset,sizeof(int));
+                if(int(p->length) >= maskOffset+int(sizeof(int))*2)
+                    memcpy(&spectator,p->data+maskOffset+sizeof(int),sizeof(int));
+                syncCodecSelector.restrictCodecs(codecMask);
+                if(!spectator)
+                    candidateNames[p->systemAddress] = buf;
             }
 
             //Find a session index for the player
@@ -647,9 +413,11 @@ void Server::update(running_machine *machine)
                 buf[0] = ID_SETTINGS;
                 memcpy(buf+1,&secondsBetweenSync,sizeof(int));
                 strcpy(buf+1+sizeof(int),username.c_str());
+                int codecMask = syncCodecSelector.getCodecMask();
+                memcpy(buf+1+sizeof(int)+username.length()+1,&codecMask,sizeof(int));
                 rakInterface->Send(
                     buf,
-                    1+sizeof(int)+username.length()+1,
+                    1+sizeof(int)+username.length()+1+sizeof(int),
                     HIGH_PRIORITY,
                     RELIABLE_ORDERED,
                     ORDERING_CHANNEL_SYNC,
@@ -657,7 +425,12 @@ void Server::update(running_machine *machine)
                     false
                 );
             }
-            if(acceptedPeers.size()>=maxPeerID-1)
+            if(spectator)
+            {
+                //Spectators need nobody's approval and don't take a player's spot
+                admitSpectator(p,machine);
+            }
+            else if(acceptedPeers.size()>=maxPeerID-1)
             {
                 //Sorry, no room
                 rakInterface->CloseConnection(p->systemAddress,true);
@@ -683,6 +456,12 @@ void Server::update(running_machine *machine)
                 //First client, automatically accept
                 acceptPeer(p->systemAddress,machine);
             }
+        }
+        break;
+
+        case ID_SPECTATOR_RELAY_READY:
+            printf("SPECTATOR %s CAN RELAY NOW\n",p->systemAddress.ToString(true));
+            spectatorFeed.setRelay(p->guid);
             break;
 
         case ID_INCOMPATIBLE_PROTOCOL_VERSION:
@@ -726,13 +505,32 @@ void Server::update(running_machine *machine)
         break;
 
         case ID_CLIENT_INPUTS:
-            if(peerIDs.find(p->guid)==peerIDs.end() || peerInputs.find(peerIDs[p->guid])==peerInputs.end())
+            //Only inputs from a peer without a ring yet get here
+            receiveLongInput(p);
+            break;
+        case ID_RESYNC_REQUEST:
+        {
+            //[second][block count][block index]...
+            unsigned char *data = GetPacketData(p);
+            int size = GetPacketSize(p);
+            int second,numBlocks;
+            if(size<int(sizeof(int))*2)
+                break;
+            memcpy(&second,data,sizeof(int));
+            memcpy(&numBlocks,data+sizeof(int),sizeof(int));
+            if(numBlocks<0 || numBlocks>(size-int(sizeof(int))*2)/int(sizeof(int)))
             {
-                cout << __FILE__ << ":" << __LINE__ << " OOPS!!!!\n";
+                cout << "GOT A MALFORMED RESYNC REQUEST\n";
+                break;
             }
-            //cout << "GOT CLIENT INPUTS\n";
-            peerInputs[peerIDs[p->guid]].push_back(string((char*)GetPacketData(p),(int)GetPacketSize(p)));
-            break;
+            vector<int> blockIndices(numBlocks);
+            if(numBlocks)
+                memcpy(&blockIndices[0],data+sizeof(int)*2,sizeof(int)*numBlocks);
+            printf("%s IS OUT OF SYNC IN %d BLOCKS\n",p->systemAddress.ToString(true),numBlocks);
+            metrics.add(NET_COUNTER_RESYNCS);
+            sendBlocks(p->systemAddress,second,blockIndices);
+        }
+        break;
         default:
             printf("UNEXPECTED PACKET ID: %d\n",int(packetIdentifier));
             break;
@@ -741,29 +539,110 @@ void Server::update(running_machine *machine)
     }
 }
 
-void Server::sync()
+//Runs on the sync worker: compresses a staged delta and cuts it into
+//packets.  Only touches the job and the server's pipeline, which nothing
+//else uses while the job is in flight.
+static void *buildSyncPackets(void *param,int threadid)
 {
-    cout << "SERVER SYNCING\n";
-    while(memoryBlocksLocked)
+    SyncJob *job = (SyncJob*)param;
+    SyncPipeline &syncPipeline = *job->pipeline;
+    int uncompressedSize = job->uncompressedSize;
+
+    if(job->dumpFilename.length())
     {
-        ;
+        //Captured deltas are what nsmbench codecs compares the codecs on
+        FILE *dumpFile = fopen(job->dumpFilename.c_str(),"wb");
+        if(dumpFile)
+        {
+            fwrite(&job->staging[0],1,uncompressedSize,dumpFile);
+            fclose(dumpFile);
+        }
     }
-    memoryBlocksLocked=true;
+
+    SyncCodecSetting codecSetting = job->codecSetting;
+    RakNet::TimeUS compressStart = RakNet::GetTimeUS();
+    int compressedSize = syncPipeline.compress(codecSetting.codec,codecSetting.level,&job->staging[0],uncompressedSize);
+    job->compressMS = (RakNet::GetTimeUS()-compressStart)/1000.0;
+    job->compressedSize = compressedSize;
+    const unsigned char *compressedBuffer = syncPipeline.getCompressed();
+
+    int SYNC_PACKET_SIZE=1024*1024*64;
+    if(job->syncTransferSeconds)
+    {
+        int actualSyncTransferSeconds=max(1,job->syncTransferSeconds);
+        while(true)
+        {
+            SYNC_PACKET_SIZE = compressedSize/60/actualSyncTransferSeconds;
+
+            //This sends the data at 20 KB/sec minimum
+            if(SYNC_PACKET_SIZE>=350 || actualSyncTransferSeconds==1) break;
+
+            actualSyncTransferSeconds--;
+        }
+    }
+
+    //All of this sync's packets share one pooled buffer.  The queue holds
+    //slices of it, so it only goes back to the pool once the last packet
+    //was handed to RakNet.
+    int sendMessageSize = 1+RESYNC_HEADER_SIZE+min(SYNC_PACKET_SIZE,compressedSize);
+    int totalSendSizeEstimate = sendMessageSize*(compressedSize/SYNC_PACKET_SIZE + 2);
+    SyncBufferArena &arena = syncPipeline.getArena();
+    SyncBuffer *syncBuffer = arena.acquire(totalSendSizeEstimate);
+    unsigned char *sendMessage = syncBuffer->data;
+    sendMessage[0] = ID_RESYNC_PARTIAL;
+    if(compressedSize<=SYNC_PACKET_SIZE)
+        sendMessage[0] = ID_RESYNC_COMPLETE;
+    memcpy(sendMessage+1,&uncompressedSize,sizeof(int));
+    memcpy(sendMessage+1+sizeof(int),&compressedSize,sizeof(int));
+    memcpy(sendMessage+1+sizeof(int)+sizeof(int),&codecSetting.codec,sizeof(int));
+    memcpy(sendMessage+1+sizeof(int)+sizeof(int)+sizeof(int),&job->syncSecond,sizeof(int));
+    memcpy(sendMessage+1+RESYNC_HEADER_SIZE,compressedBuffer,min(SYNC_PACKET_SIZE,compressedSize) );
+
+    job->packets.push_back(SyncSlice(&arena,syncBuffer,int(sendMessage-syncBuffer->data),sendMessageSize));
+    sendMessage += sendMessageSize;
+    compressedSize -= SYNC_PACKET_SIZE;
+    int atIndex = SYNC_PACKET_SIZE;
+
+    while(compressedSize>0)
+    {
+        sendMessageSize = 1+min(SYNC_PACKET_SIZE,compressedSize);
+        sendMessage[0] = ID_RESYNC_PARTIAL;
+        if(compressedSize<=SYNC_PACKET_SIZE)
+            sendMessage[0] = ID_RESYNC_COMPLETE;
+        memcpy(sendMessage+1,compressedBuffer+atIndex,min(SYNC_PACKET_SIZE,compressedSize) );
+        compressedSize -= SYNC_PACKET_SIZE;
+        atIndex += SYNC_PACKET_SIZE;
+
+        job->packets.push_back(SyncSlice(&arena,syncBuffer,int(sendMessage-syncBuffer->data),sendMessageSize));
+        sendMessage += sendMessageSize;
+    }
+
+    if(int(sendMessage-syncBuffer->data) >= totalSendSizeEstimate)
+    {
+        cout << "INVALID SEND SIZE ESTIMATE!\n";
+        exit(1);
+    }
+    arena.release(syncBuffer);
+    return NULL;
+}
+
+void Server::sync(int second)
+{
+    NETLOG(NETLOG_DEBUG,("SERVER SYNCING\n"));
+    RakNet::TimeUS startTime = RakNet::GetTimeUS();
 
     if(!firstSync)
     {
         syncHappend = true;
     }
     syncTime = getTimeSinceStartup();
+    syncSecond = second;
 
-    int bytesSynched=0;
-    //cout << "IN CRITICAL SECTION\n";
-    //cout << "SERVER: Syncing with clients\n";
-    bool anyDirty=false;
-    unsigned char blockChecksum=0;
-    unsigned char xorChecksum=0;
-    unsigned char staleChecksum=0;
-    unsigned char *uncompressedPtr = uncompressedBuffer;
+    if(blockHashes.size()!=blocks.size())
+        blockHashes.assign(blocks.size(),0);
+
+    int numDirty=0;
+    int bytesHashed=0;
     for(int blockIndex=0; blockIndex<int(blocks.size()); blockIndex++)
     {
         MemoryBlock &block = blocks[blockIndex];
@@ -775,210 +654,222 @@ void Server::sync()
             cout << "BLOCK SIZE MISMATCH\n";
         }
 
-        bool dirty=false;
-        for(int a=0; a<block.size; a++)
-        {
-            if(block.data[a] ^ staleBlock.data[a]) dirty=true;
-        }
-        if(dirty)
-        {
-            for(int a=0; a<block.size; a++)
-            {
-                blockChecksum = blockChecksum ^ block.data[a];
-                staleChecksum = staleChecksum ^ staleBlock.data[a];
-            }
-        }
-        //dirty=true;
         if(firstSync)
         {
             memcpy(initialBlock.data,block.data,block.size);
         }
-        if(dirty && !anyDirty)
-        {
-            //First dirty block
-            anyDirty=true;
-        }
 
-        if(dirty)
+        //Refresh the stale copy (only the pages written since the last sync
+        //when dirty page tracking is on).  Only blocks that changed need a
+        //new hash.
+        bool dirty = refreshStaleBlock(blockIndex);
+
+        if(dirty || firstSync)
         {
-            bytesSynched += block.size;
-            int bytesUsed = uncompressedPtr-uncompressedBuffer;
-            while(bytesUsed+sizeof(int)+block.size >= uncompressedBufferSize)
-            {
-                uncompressedBufferSize *= 1.5;
-		free(uncompressedBuffer);
-                uncompressedBuffer = (unsigned char*)malloc(uncompressedBufferSize);
-                uncompressedPtr = uncompressedBuffer + bytesUsed;
-                if(!uncompressedBuffer)
-                {
-                    cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-                    exit(1);
-                }
-            }
-            memcpy(
-                uncompressedPtr,
-                &blockIndex,
-                sizeof(int)
-            );
-            uncompressedPtr += sizeof(int);
-            for(int a=0;a<block.size;a++)
-            {
-                *uncompressedPtr = block.data[a] ^ staleBlock.data[a];
-                uncompressedPtr++;
-            }
+            blockHashes[blockIndex] = hashBlock64(staleBlock.data,staleBlock.size);
+            numDirty++;
+            bytesHashed += block.size;
         }
-        memcpy(staleBlock.data,block.data,block.size);
     }
-    if(anyDirty && firstSync==false)
+
+    if(!firstSync)
     {
-        printf("BLOCK CHECKSUM: %d\n",int(blockChecksum));
-        printf("XOR CHECKSUM: %d\n",int(xorChecksum));
-        printf("STALE CHECKSUM: %d\n",int(staleChecksum));
-        int finishIndex = -1;
-        memcpy(
-            uncompressedPtr,
-            &finishIndex,
-            sizeof(int)
+        //[second][block count][hash]... is all an in-sync peer needs.  Our
+        //spectators get them too, relays pass them on.
+        int numBlocks = int(blocks.size());
+        RakNet::BitStream hashStream(1+sizeof(int)*2+sizeof(unsigned long long)*numBlocks);
+        unsigned char header = ID_SYNC_HASHES;
+        hashStream.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+        hashStream.WriteBits((const unsigned char*)&second,8*sizeof(int));
+        hashStream.WriteBits((const unsigned char*)&numBlocks,8*sizeof(int));
+        if(numBlocks)
+            hashStream.WriteBits((const unsigned char*)&blockHashes[0],8*sizeof(unsigned long long)*numBlocks);
+        rakInterface->Send(
+            &hashStream,
+            HIGH_PRIORITY,
+            RELIABLE_ORDERED,
+            ORDERING_CHANNEL_SYNC,
+            RakNet::UNASSIGNED_SYSTEM_ADDRESS,
+            true
         );
-        uncompressedPtr += sizeof(int);
-
-        int uncompressedSize = uncompressedPtr-uncompressedBuffer;
-        if(compressedBufferSize <= uncompressedSize*1.01 + 128)
-        {
-            compressedBufferSize = zlibGetMaxCompressedSize(uncompressedSize);
-	    free(compressedBuffer);
-            compressedBuffer = (unsigned char*)malloc(compressedBufferSize);
-            if(!compressedBuffer)
-            {
-                cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-                exit(1);
-            }
-        }
-        uLongf compressedSizeLong = compressedBufferSize;
-
-        if(compress2(
-            compressedBuffer,
-            &compressedSizeLong,
-            uncompressedBuffer,
-            uncompressedSize,
-            9
-        )!=Z_OK)
-        {
-            cout << "ERROR COMPRESSING ZLIB STREAM\n";
-            exit(1);
-        }
-        int compressedSize = (int)compressedSizeLong;
-        printf("SYNC SIZE: %d\n",compressedSize);
-
-        int SYNC_PACKET_SIZE=1024*1024*64;
-        if(syncTransferSeconds)
-        {
-            int actualSyncTransferSeconds=max(1,syncTransferSeconds);
-            while(true)
-            {
-                SYNC_PACKET_SIZE = compressedSize/60/actualSyncTransferSeconds;
+        metrics.add(NET_COUNTER_SYNC_BYTES,(long long)hashStream.GetNumberOfBytesUsed()*rakInterface->NumberOfConnections());
+        NETLOG(NETLOG_DEBUG,("SYNC HASHES: %d BYTES FOR %d BLOCKS\n",int(hashStream.GetNumberOfBytesUsed()),numBlocks));
+    }
+    if(dirtyPages && !firstSync)
+    {
+        //Start tracking after the first real sync so nvram loading happens on unprotected memory
+        dirtyPages->arm();
+    }
+    firstSync=false;
+    RakNet::TimeUS buildUS = RakNet::GetTimeUS()-startTime;
+    metrics.record(NET_HISTOGRAM_SYNC_BUILD_US,(long long)buildUS);
+    NETLOG(NETLOG_DEBUG,(
+        "SYNC AT %d: %d DIRTY BLOCKS, %d KB HASHED IN %.2f ms\n",
+        second,
+        numDirty,
+        bytesHashed/1024,
+        buildUS/1000.0
+        ));
+}
 
-		//This sends the data at 20 KB/sec minimum
-                if(SYNC_PACKET_SIZE>=350 || actualSyncTransferSeconds==1) break;
+void Server::sendBlocks(const RakNet::SystemAddress &target,int second,const vector<int> &blockIndices)
+{
+    if(second!=syncSecond)
+    {
+        //The stale blocks moved on, the peer will find out at the next sync
+        printf("IGNORING RESYNC REQUEST FOR %d, THE LAST SYNC WAS AT %d\n",second,syncSecond);
+        return;
+    }
 
-                actualSyncTransferSeconds--;
-            }
-        }
+    //Stage into the slot the previous resync's worker isn't reading
+    SyncJob &job = syncJobs[nextSyncJob];
 
-        int sendMessageSize = 1+sizeof(int)+sizeof(int)+min(SYNC_PACKET_SIZE,compressedSize);
-        int totalSendSizeEstimate = sendMessageSize*(compressedSize/SYNC_PACKET_SIZE + 2);
-        if(syncBufferSize <= totalSendSizeEstimate)
+    int uncompressedSize=0;
+    for(int a=0; a<int(blockIndices.size()); a++)
+    {
+        int blockIndex = blockIndices[a];
+        if(blockIndex<0 || blockIndex>=int(staleBlocks.size()))
         {
-            syncBufferSize = totalSendSizeEstimate*1.5;
-	    free(syncBuffer);
-            syncBuffer = (unsigned char*)malloc(totalSendSizeEstimate);
-            if(!syncBuffer)
-            {
-                cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
-                exit(1);
-            }
+            cout << "GOT A RESYNC REQUEST FOR AN INVALID BLOCK INDEX: " << blockIndex << endl;
+            continue;
         }
-        unsigned char *sendMessage = syncBuffer;
-        sendMessage[0] = ID_RESYNC_PARTIAL;
-        if(compressedSize<=SYNC_PACKET_SIZE)
-            sendMessage[0] = ID_RESYNC_COMPLETE;
-        memcpy(sendMessage+1,&uncompressedSize,sizeof(int));
-        memcpy(sendMessage+1+sizeof(int),&compressedSize,sizeof(int));
-        memcpy(sendMessage+1+sizeof(int)+sizeof(int),compressedBuffer,min(SYNC_PACKET_SIZE,compressedSize) );
+        MemoryBlock &staleBlock = staleBlocks[blockIndex];
 
-        syncPacketQueue.push_back(make_pair(sendMessage,sendMessageSize));
-        sendMessage += sendMessageSize;
-        compressedSize -= SYNC_PACKET_SIZE;
-        int atIndex = SYNC_PACKET_SIZE;
+        //Make sure there is room for the block index, the block and the terminator
+        int needed = uncompressedSize+sizeof(int)+staleBlock.size+sizeof(int);
+        if(int(job.staging.size())<needed)
+            job.staging.resize(max(needed,int(job.staging.size()*3/2)));
+        memcpy(&job.staging[uncompressedSize],&blockIndex,sizeof(int));
+        memcpy(&job.staging[uncompressedSize+sizeof(int)],staleBlock.data,staleBlock.size);
+        uncompressedSize += sizeof(int) + staleBlock.size;
+    }
+    if(int(job.staging.size())<uncompressedSize+int(sizeof(int)))
+        job.staging.resize(uncompressedSize+sizeof(int));
+    int finishIndex = -1;
+    memcpy(
+        &job.staging[uncompressedSize],
+        &finishIndex,
+        sizeof(int)
+    );
+    uncompressedSize += sizeof(int);
 
-        while(compressedSize>0)
-        {
-            sendMessageSize = 1+min(SYNC_PACKET_SIZE,compressedSize);
-            sendMessage[0] = ID_RESYNC_PARTIAL;
-            if(compressedSize<=SYNC_PACKET_SIZE)
-                sendMessage[0] = ID_RESYNC_COMPLETE;
-            memcpy(sendMessage+1,compressedBuffer+atIndex,min(SYNC_PACKET_SIZE,compressedSize) );
-            compressedSize -= SYNC_PACKET_SIZE;
-            atIndex += SYNC_PACKET_SIZE;
-
-            syncPacketQueue.push_back(make_pair(sendMessage,sendMessageSize));
-            sendMessage += sendMessageSize;
-        }
+    //Resyncs go out in order, so the previous one has to be packetized
+    //before this one is queued (it normally finished long ago)
+    collectSyncJob(true);
 
-        if(int(sendMessage-syncBuffer) >= totalSendSizeEstimate)
-        {
-            cout << "INVALID SEND SIZE ESTIMATE!\n";
-            exit(1);
-        }
+    if(!syncWorkQueue)
+    {
+        syncPipeline.getArena().prepare();
+        syncWorkQueue = osd_work_queue_alloc(0);
+    }
 
+    job.pipeline = &syncPipeline;
+    job.uncompressedSize = uncompressedSize;
+    job.target = target;
+    job.syncSecond = second;
+    job.codecSetting = syncCodecSelector.getCurrent();
+    job.syncTransferSeconds = syncTransferSeconds;
+    job.dumpFilename = "";
+    if(syncDumpPrefix.length())
+    {
+        char filename[4096];
+        sprintf(filename,"%s_sync%04d.bin",syncDumpPrefix.c_str(),syncDumpCount++);
+        job.dumpFilename = filename;
     }
-    else
+    job.packets.clear();
+    job.workItem = osd_work_item_queue(syncWorkQueue,buildSyncPackets,&job,0);
+    if(!job.workItem)
     {
-        printf("No dirty blocks found\n");
+        //No worker available, do it here
+        buildSyncPackets(&job,0);
     }
-    //if(runTimes%1==0) cout << "BYTES SYNCED: " << bytesSynched << endl;
-    //cout << "OUT OF CRITICAL AREA\n";
-    //cout.flush();
-    firstSync=false;
-    memoryBlocksLocked=false;
+    pendingSyncJob = nextSyncJob;
+    nextSyncJob = 1-nextSyncJob;
+    NETLOG(NETLOG_DEBUG,("RESYNC STAGED %d KB IN %d BLOCKS FOR %s\n",uncompressedSize/1024,int(blockIndices.size()),target.ToString(true)));
+}
+
+void Server::collectSyncJob(bool wait)
+{
+    if(pendingSyncJob<0)
+        return;
+    SyncJob &job = syncJobs[pendingSyncJob];
+    if(job.workItem)
+    {
+        if(!osd_work_item_wait(job.workItem,wait?100*osd_ticks_per_second():0))
+            return;
+        osd_work_item_release(job.workItem);
+        job.workItem = NULL;
+    }
+    pendingSyncJob = -1;
+
+    NETLOG(NETLOG_DEBUG,(
+        "RESYNC SIZE: %d (%s LEVEL %d, %.2f ms ON THE WORKER)\n",
+        job.compressedSize,
+        syncCodecName(job.codecSetting.codec),
+        job.codecSetting.level,
+        job.compressMS
+        ));
+    metrics.record(NET_HISTOGRAM_SYNC_COMPRESS_US,(long long)(job.compressMS*1000.0));
+    metrics.record(NET_HISTOGRAM_SYNC_BYTES,job.compressedSize);
+    if(job.uncompressedSize)
+        metrics.record(NET_HISTOGRAM_SYNC_COMPRESSED_PERCENT,(long long)job.compressedSize*100/job.uncompressedSize);
+    syncCodecSelector.update(
+        job.uncompressedSize,
+        job.compressedSize,
+        job.compressMS,
+        syncFrameMS*SYNC_COMPRESS_BUDGET_FRAMES,
+        getSyncTransferBudget()
+        );
+    for(list<SyncSlice>::iterator it = job.packets.begin(); it != job.packets.end(); it++)
+    {
+        syncPacketQueue.push_back(QueuedSyncPacket(job.target,*it));
+    }
+    job.packets.clear();
+}
+
+double Server::getSyncTransferBudget()
+{
+    //Only peers whose congestion control is holding us back tell us their rate
+    double slowestBPS=0;
+    for(int a=0; a<rakInterface->NumberOfConnections(); a++)
+    {
+        RakNet::RakNetStatistics stats;
+        if(!rakInterface->GetStatistics(rakInterface->GetSystemAddressFromIndex(a),&stats))
+            continue;
+        if(stats.isLimitedByCongestionControl && (slowestBPS<=0 || stats.BPSLimitByCongestionControl<slowestBPS))
+            slowestBPS = double(stats.BPSLimitByCongestionControl);
+    }
+    if(slowestBPS<=0)
+        return 0;
+    return slowestBPS*max(1,syncTransferSeconds);
 }
 
 void Server::popSyncQueue()
 {
+    collectSyncJob(false);
     if(syncPacketQueue.size())
     {
-        pair<unsigned char *,int> syncPacket = syncPacketQueue.front();
-        //printf("Sending sync message of size %d (%d packets left)\n",syncPacket.second,syncPacketQueue.size());
-        syncPacketQueue.pop_front();
+        const SyncSlice &syncPacket = syncPacketQueue.front().packet;
+        //printf("Sending sync message of size %d (%d packets left)\n",syncPacket.getSize(),syncPacketQueue.size());
 
+        //RakNet copies the packet, so the slice can go right after
         rakInterface->Send(
-            (const char*)syncPacket.first,
-            syncPacket.second,
+            (const char*)syncPacket.getData(),
+            syncPacket.getSize(),
             HIGH_PRIORITY,
             RELIABLE_ORDERED,
             ORDERING_CHANNEL_SYNC,
-            RakNet::UNASSIGNED_SYSTEM_ADDRESS,
-            true
+            syncPacketQueue.front().target,
+            false
         );
+        metrics.add(NET_COUNTER_SYNC_BYTES,syncPacket.getSize());
+        syncPacketQueue.pop_front();
     }
 }
 
 void Server::sendInputs(const string &inputString)
 {
-    peerInputs[selfPeerID].push_back(inputString);
-    char* dataToSend = (char*)malloc(inputString.length()+1);
-    dataToSend[0] = ID_SERVER_INPUTS;
-    memcpy(dataToSend+1,inputString.c_str(),inputString.length());
-    //cout << "SENDING MESSAGE WITH LENGTH: " << intSize << endl;
-    rakInterface->Send(
-		    dataToSend,
-		    (int)(inputString.length()+1),
-		    IMMEDIATE_PRIORITY,
-		    RELIABLE_ORDERED,
-		    ORDERING_CHANNEL_CLIENT_INPUTS,
-		    RakNet::UNASSIGNED_SYSTEM_ADDRESS,
-		    true
-		   );
-    free(dataToSend);
+    localInputs[selfPeerID].push_back(inputString);
+    sendInputFrame(ID_SERVER_INPUT_FRAMES,inputString);
 }
 
@@ -8,18 +8,78 @@ void deleteGlobalServer();
 
 class running_machine;
 
+struct _osd_work_queue;
+struct _osd_work_item;
+
+//The blocks one peer asked for after a sync, on their way out.  The
+//emulation thread stages the blocks, a worker compresses them and cuts them
+//into packets, and the emulation thread picks the packets up once the worker
+//is done.
+struct SyncJob
+{
+    SyncPipeline *pipeline;
+    vector<unsigned char> staging;
+    int uncompressedSize;
+    RakNet::SystemAddress target;
+    int syncSecond;
+    SyncCodecSetting codecSetting;
+    int syncTransferSeconds;
+    string dumpFilename;
+
+    //Filled in by the worker
+    list<SyncSlice> packets;
+    int compressedSize;
+    double compressMS;
+
+    _osd_work_item *workItem;
+
+    SyncJob()
+        :
+        pipeline(NULL),
+        uncompressedSize(0),
+        syncSecond(0),
+        syncTransferSeconds(0),
+        compressedSize(0),
+        compressMS(0),
+        workItem(NULL)
+    {
+    }
+};
+
+//A resync packet waiting for its turn to be sent
+struct QueuedSyncPacket
+{
+    RakNet::SystemAddress target;
+    SyncSlice packet;
+
+    QueuedSyncPacket(const RakNet::SystemAddress &_target,const SyncSlice &_packet)
+        :
+        target(_target),
+        packet(_packet)
+    {
+    }
+};
+
+//How many emulated frames a sync's compression may take before the server
+//switches to a faster codec.  It runs on a worker, so this only delays when
+//the sync starts going out.
+#define SYNC_COMPRESS_BUDGET_FRAMES (30)
+
 class Server : public Common
 {
 protected:
     //vector<Session> sessions;
 
-	vector<MemoryBlock> initialBlocks;
-
     int port;
 
 	bool firstSync;
 
-	list<pair<unsigned char *,int> > syncPacketQueue;
+	list<QueuedSyncPacket> syncPacketQueue;
+
+	//Hash of every stale block, only the blocks that changed are rehashed
+	vector<unsigned long long> blockHashes;
+	//Emulated second of the last sync, peers can only ask for its blocks
+	int syncSecond;
 
 	int syncTransferSeconds;
 
@@ -33,9 +93,19 @@ protected:
 
     bool syncHappend;
 
-public:
-    Server() {}
+    //Two jobs so the next sync can be staged while the last one is still
+    //being compressed
+    SyncJob syncJobs[2];
+    int nextSyncJob;
+    int pendingSyncJob;
+    _osd_work_queue *syncWorkQueue;
 
+    SyncCodecSelector syncCodecSelector;
+    double syncFrameMS;
+    string syncDumpPrefix;
+    int syncDumpCount;
+
+public:
 	Server(string _username,int _port);
 
     void shutdown();
@@ -50,11 +120,25 @@ public:
 
 	vector<MemoryBlock> createMemoryBlock(unsigned char* ptr,int size);
 
-	void initialSync(const RakNet::SystemAddress &sa,running_machine *machine);
-
 	void update(running_machine *machine);
 
-	void sync();
+	//Refreshes the stale blocks and broadcasts their hashes, peers whose
+	//blocks hash differently ask for them with ID_RESYNC_REQUEST
+	void sync(int second);
+
+	//Hash of the live state, blocks that are clean since the last sync
+	//reuse blockHashes
+	unsigned long long stateHash()
+	{
+		return hashLiveBlocks(blockHashes);
+	}
+
+	//Queues the stale copy of the requested blocks for one peer
+	void sendBlocks(const RakNet::SystemAddress &target,int second,const vector<int> &blockIndices);
+
+    //Moves a finished job's packets onto syncPacketQueue, optionally
+    //waiting for the worker
+    void collectSyncJob(bool wait);
 
     void popSyncQueue();
 
@@ -63,6 +147,27 @@ public:
 		syncTransferSeconds = _syncTransferSeconds;
 	}
 
+    //codec<0 lets the server pick the codec for each sync
+    void setSyncCodec(int codec,int level)
+    {
+        syncCodecSelector.configure(codec,level);
+    }
+
+    //Length of an emulated frame, compression gets SYNC_COMPRESS_BUDGET_FRAMES of them
+    void setSyncFrameTime(double ms)
+    {
+        syncFrameMS = ms;
+    }
+
+    //Writes every uncompressed sync to <prefix>_syncNNNN.bin
+    void setSyncDumpPrefix(const string &prefix)
+    {
+        syncDumpPrefix = prefix;
+    }
+
+    //Bytes the slowest peer can receive while a sync is sent, 0 if unknown
+    double getSyncTransferBudget();
+
     void sendInputs(const string &inputString);
 };
 
@@ -0,0 +1,190 @@
+#include "NSM_Common.h"
+#include "NSM_Spectator.h"
+
+#include <cstring>
+
+using namespace std;
+
+static void appendBytes(vector<unsigned char> &buffer,const void *data,int size)
+{
+    if(size<=0)
+        return;
+    int pos = int(buffer.size());
+    buffer.resize(pos+size);
+    memcpy(&buffer[pos],data,size);
+}
+
+SpectatorFeed::SpectatorFeed(bool _alwaysBatch)
+    :
+    maxSpectators(SPECTATOR_DEFAULT_SLOTS),
+    alwaysBatch(_alwaysBatch),
+    batchCount(0)
+{
+}
+
+bool SpectatorFeed::hasSpectator(const RakNet::SystemAddress &address) const
+{
+    for(int a=0; a<int(spectators.size()); a++)
+    {
+        if(spectators[a].address==address)
+            return true;
+    }
+    return false;
+}
+
+void SpectatorFeed::add(const RakNet::SystemAddress &address,const RakNet::RakNetGUID &guid)
+{
+    Spectator spectator;
+    spectator.address = address;
+    spectator.guid = guid;
+    spectator.relay = false;
+    spectators.push_back(spectator);
+}
+
+bool SpectatorFeed::remove(const RakNet::RakNetGUID &guid)
+{
+    for(int a=0; a<int(spectators.size()); a++)
+    {
+        if(spectators[a].guid==guid)
+        {
+            spectators.erase(spectators.begin()+a);
+            if(spectators.empty() && !alwaysBatch)
+            {
+                batch.clear();
+                batchCount=0;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void SpectatorFeed::setRelay(const RakNet::RakNetGUID &guid)
+{
+    for(int a=0; a<int(spectators.size()); a++)
+    {
+        if(spectators[a].guid==guid)
+            spectators[a].relay = true;
+    }
+}
+
+void SpectatorFeed::getRelays(vector<RakNet::SystemAddress> &relays) const
+{
+    relays.clear();
+    for(int a=0; a<int(spectators.size()); a++)
+    {
+        if(spectators[a].relay)
+            relays.push_back(spectators[a].address);
+    }
+}
+
+void SpectatorFeed::append(int peerID,const string &input)
+{
+    if(spectators.empty() && !alwaysBatch)
+        return;
+    int length = int(input.length());
+    appendBytes(batch,&peerID,sizeof(int));
+    appendBytes(batch,&length,sizeof(int));
+    appendBytes(batch,input.data(),length);
+    batchCount++;
+}
+
+bool SpectatorFeed::writeInputs(RakNet::BitStream &stream)
+{
+    if(!batchCount)
+        return false;
+    unsigned char header = ID_SPECTATOR_INPUTS;
+    stream.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+    stream.WriteBits((const unsigned char*)&batchCount,8*sizeof(int));
+    stream.WriteBits((const unsigned char*)&batch[0],8*int(batch.size()));
+    batch.clear();
+    batchCount=0;
+    return true;
+}
+
+bool SpectatorFeed::writeRoster(
+    RakNet::BitStream &stream,
+    const map<RakNet::RakNetGUID,int> &peerIDs,
+    const map<int,string> &peerNames,
+    bool force
+)
+{
+    vector<unsigned char> newRoster;
+    int count = int(peerIDs.size());
+    appendBytes(newRoster,&count,sizeof(int));
+    for(map<RakNet::RakNetGUID,int>::const_iterator it = peerIDs.begin(); it != peerIDs.end(); it++)
+    {
+        appendBytes(newRoster,&(it->first.g),sizeof(uint64_t));
+        appendBytes(newRoster,&(it->second),sizeof(int));
+        map<int,string>::const_iterator name = peerNames.find(it->second);
+        string nameString = (name==peerNames.end())?string():name->second;
+        appendBytes(newRoster,nameString.c_str(),int(nameString.length())+1);
+    }
+    if(!force && newRoster==roster)
+        return false;
+    roster.swap(newRoster);
+
+    unsigned char header = ID_SPECTATOR_ROSTER;
+    stream.WriteBits((const unsigned char*)&header,8*sizeof(unsigned char));
+    stream.WriteBits((const unsigned char*)&roster[0],8*int(roster.size()));
+    return true;
+}
+
+bool SpectatorFeed::readInputs(const unsigned char *data,int size,vector<pair<int,string> > &inputs)
+{
+    inputs.clear();
+    const unsigned char *end = data+size;
+    int count;
+    if(size<int(sizeof(int)))
+        return false;
+    memcpy(&count,data,sizeof(int));
+    data += sizeof(int);
+    for(int a=0; a<count; a++)
+    {
+        int peerID,length;
+        if(end-data<int(sizeof(int))*2)
+            return false;
+        memcpy(&peerID,data,sizeof(int));
+        memcpy(&length,data+sizeof(int),sizeof(int));
+        data += sizeof(int)*2;
+        if(length<0 || end-data<length)
+            return false;
+        inputs.push_back(pair<int,string>(peerID,string((const char*)data,length)));
+        data += length;
+    }
+    return true;
+}
+
+bool SpectatorFeed::readRoster(
+    const unsigned char *data,
+    int size,
+    map<RakNet::RakNetGUID,int> &peerIDs,
+    map<int,string> &peerNames
+)
+{
+    peerIDs.clear();
+    peerNames.clear();
+    const unsigned char *end = data+size;
+    int count;
+    if(size<int(sizeof(int)))
+        return false;
+    memcpy(&count,data,sizeof(int));
+    data += sizeof(int);
+    for(int a=0; a<count; a++)
+    {
+        RakNet::RakNetGUID guid;
+        int peerID;
+        if(end-data<int(sizeof(uint64_t)+sizeof(int)))
+            return false;
+        memcpy(&(guid.g),data,sizeof(uint64_t));
+        memcpy(&peerID,data+sizeof(uint64_t),sizeof(int));
+        data += sizeof(uint64_t)+sizeof(int);
+        const unsigned char *nameEnd = (const unsigned char*)memchr(data,0,end-data);
+        if(!nameEnd)
+            return false;
+        peerIDs[guid] = peerID;
+        peerNames[peerID] = string((const char*)data,nameEnd-data);
+        data = nameEnd+1;
+    }
+    return true;
+}
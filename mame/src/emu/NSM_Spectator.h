@@ -0,0 +1,116 @@
+#ifndef __NSM_SPECTATOR__
+#define __NSM_SPECTATOR__
+
+#include "RakNetTypes.h"
+#include "BitStream.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+//Spectators the server or a relay sends the game to itself, the others are
+//sent on to relays
+#define SPECTATOR_DEFAULT_SLOTS (4)
+
+//A spectator follows at most this many redirects before giving up
+#define SPECTATOR_MAX_REDIRECTS (8)
+
+//Sends the game to spectators.  A spectator gets the inputs the emulation
+//consumed (so they are confirmed, in the order they were used), the list of
+//players and the periodic sync hashes.  It sends nothing back but resync
+//requests, so the players never wait for it.  Only a fixed number of
+//spectators are served directly, the rest are sent to relays (spectators
+//that serve spectators of their own), so what the server uploads doesn't
+//grow with the audience.
+class SpectatorFeed
+{
+public:
+    //A feed that batches even without spectators (for session recordings)
+    SpectatorFeed(bool _alwaysBatch=false);
+
+    inline void setMaxSpectators(int _maxSpectators)
+    {
+        maxSpectators = _maxSpectators<0?0:_maxSpectators;
+    }
+
+    inline int getMaxSpectators() const
+    {
+        return maxSpectators;
+    }
+
+    inline int getNumSpectators() const
+    {
+        return int(spectators.size());
+    }
+
+    inline bool isFull() const
+    {
+        return int(spectators.size())>=maxSpectators;
+    }
+
+    inline const RakNet::SystemAddress &getAddress(int index) const
+    {
+        return spectators[index].address;
+    }
+
+    bool hasSpectator(const RakNet::SystemAddress &address) const;
+
+    void add(const RakNet::SystemAddress &address,const RakNet::RakNetGUID &guid);
+
+    //False if the guid isn't one of our spectators
+    bool remove(const RakNet::RakNetGUID &guid);
+
+    //The spectator took a checkpoint and can serve spectators from now on
+    void setRelay(const RakNet::RakNetGUID &guid);
+
+    //Relays that can take the spectators we have no room for
+    void getRelays(std::vector<RakNet::SystemAddress> &relays) const;
+
+    //Called with every input the emulation consumed, ignored while nobody
+    //is watching
+    void append(int peerID,const std::string &input);
+
+    //[count][peer id][length][bytes]... for everything appended since the
+    //last call, false if there was nothing
+    bool writeInputs(RakNet::BitStream &stream);
+
+    //[count][guid][peer id][name\0]... if the players changed since the last
+    //call or force is set
+    bool writeRoster(
+        RakNet::BitStream &stream,
+        const std::map<RakNet::RakNetGUID,int> &peerIDs,
+        const std::map<int,std::string> &peerNames,
+        bool force
+    );
+
+    //Parse the packets above (without their id), false if they are malformed
+    static bool readInputs(const unsigned char *data,int size,std::vector<std::pair<int,std::string> > &inputs);
+
+    static bool readRoster(
+        const unsigned char *data,
+        int size,
+        std::map<RakNet::RakNetGUID,int> &peerIDs,
+        std::map<int,std::string> &peerNames
+    );
+
+protected:
+    struct Spectator
+    {
+        RakNet::SystemAddress address;
+        RakNet::RakNetGUID guid;
+        bool relay;
+    };
+
+    std::vector<Spectator> spectators;
+    int maxSpectators;
+    bool alwaysBatch;
+
+    //The inputs waiting to go out, already laid out as the packet sends them
+    std::vector<unsigned char> batch;
+    int batchCount;
+
+    //The roster the spectators have last been sent
+    std::vector<unsigned char> roster;
+};
+
+#endif
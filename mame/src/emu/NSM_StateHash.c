@@ -0,0 +1,177 @@
+#include "NSM_StateHash.h"
+
+#include <cstdio>
+
+using namespace std;
+
+StateHashTracker::StateHashTracker()
+    :
+    outgoingTime(0,0),
+    outgoingHash(0),
+    outgoingRepeats(STATE_HASH_REPEAT),
+    numChecked(0),
+    numDesyncs(0),
+    lastCheckedTime(0,0)
+{
+}
+
+void StateHashTracker::addLocal(const StateHashTime &time,unsigned long long hash)
+{
+    //A frame we already hashed was run again (after a rollback or a sync),
+    //so everything from it on is about to be hashed again
+    while(!local.empty() && local.back().time>=time)
+    {
+        local.pop_back();
+    }
+    if(outgoingRepeats<STATE_HASH_REPEAT && outgoingTime>=time)
+        outgoingRepeats = STATE_HASH_REPEAT;
+
+    LocalHash mine;
+    mine.time = time;
+    mine.hash = hash;
+    mine.confirmed = false;
+    local.push_back(mine);
+
+    if(int(local.size())>STATE_HASH_HISTORY)
+    {
+        local.pop_front();
+        prunePending();
+    }
+}
+
+void StateHashTracker::confirm(const StateHashTime &confirmedTime)
+{
+    for(int a=0; a<int(local.size()); a++)
+    {
+        LocalHash &mine = local[a];
+        if(mine.time>confirmedTime)
+            break;
+        if(mine.confirmed)
+            continue;
+        mine.confirmed = true;
+
+        outgoingTime = mine.time;
+        outgoingHash = mine.hash;
+        outgoingRepeats = 0;
+
+        for(
+            map<int,map<StateHashTime,unsigned long long> >::iterator it = pendingRemote.begin();
+            it != pendingRemote.end();
+            it++
+        )
+        {
+            map<StateHashTime,unsigned long long>::iterator theirs = it->second.find(mine.time);
+            if(theirs==it->second.end())
+                continue;
+            compare(it->first,mine,theirs->second);
+            it->second.erase(theirs);
+        }
+    }
+}
+
+bool StateHashTracker::getOutgoing(StateHashTime &time,unsigned long long &hash)
+{
+    if(outgoingRepeats>=STATE_HASH_REPEAT)
+        return false;
+    outgoingRepeats++;
+    time = outgoingTime;
+    hash = outgoingHash;
+    return true;
+}
+
+void StateHashTracker::addRemote(int peerID,const StateHashTime &time,unsigned long long hash)
+{
+    for(int a=int(local.size())-1; a>=0; a--)
+    {
+        if(local[a].time==time)
+        {
+            if(!local[a].confirmed)
+                break;
+            compare(peerID,local[a],hash);
+            return;
+        }
+        if(local[a].time<time)
+            break;
+    }
+
+    if(int(local.size())>=STATE_HASH_HISTORY && time<local.front().time)
+    {
+        //We don't remember that frame anymore
+        return;
+    }
+
+    //We haven't got there yet (the same hash may arrive several times)
+    map<StateHashTime,unsigned long long> &pending = pendingRemote[peerID];
+    pending[time] = hash;
+    if(int(pending.size())>STATE_HASH_HISTORY)
+        pending.erase(pending.begin());
+}
+
+void StateHashTracker::compare(int peerID,const LocalHash &mine,unsigned long long theirs)
+{
+    PeerState &peer = peers[peerID];
+    if(mine.time<=peer.checkedTime)
+    {
+        //Another copy of a hash we already compared
+        return;
+    }
+    peer.checkedTime = mine.time;
+    numChecked++;
+    if(lastCheckedTime<mine.time)
+        lastCheckedTime = mine.time;
+
+    if(mine.hash!=theirs)
+    {
+        if(!peer.desynced)
+        {
+            peer.desynced=true;
+            numDesyncs++;
+            printf(
+                "STATE HASH MISMATCH WITH PEER %d AT %d.%018lld: %016llx VS %016llx\n",
+                peerID,
+                mine.time.first,
+                mine.time.second,
+                mine.hash,
+                theirs
+            );
+            printf("%s\n",getStatsString().c_str());
+        }
+    }
+    else if(peer.desynced)
+    {
+        peer.desynced=false;
+        printf("STATE HASH MATCHES PEER %d AGAIN AT %d.%018lld\n",peerID,mine.time.first,mine.time.second);
+    }
+}
+
+void StateHashTracker::prunePending()
+{
+    if(local.empty())
+        return;
+    for(
+        map<int,map<StateHashTime,unsigned long long> >::iterator it = pendingRemote.begin();
+        it != pendingRemote.end();
+        it++
+    )
+    {
+        map<StateHashTime,unsigned long long> &pending = it->second;
+        while(!pending.empty() && pending.begin()->first<local.front().time)
+        {
+            pending.erase(pending.begin());
+        }
+    }
+}
+
+string StateHashTracker::getStatsString() const
+{
+    char buf[1024];
+    double minutes = double(lastCheckedTime.first)/60.0;
+    sprintf(
+        buf,
+        "STATE HASHES: %d CHECKED, %d DESYNCS (%.2f PER EMULATED MINUTE)",
+        numChecked,
+        numDesyncs,
+        minutes>0.0?double(numDesyncs)/minutes:0.0
+    );
+    return buf;
+}
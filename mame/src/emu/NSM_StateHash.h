@@ -0,0 +1,102 @@
+#ifndef __NSM_STATEHASH__
+#define __NSM_STATEHASH__
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+
+//The state is hashed on the first frame of every window this many frames
+//long, counted from the start of each emulated second
+#define STATE_HASH_INTERVAL_FRAMES (30)
+
+//How many of our own hashes are kept for peers that are behind us
+#define STATE_HASH_HISTORY (64)
+
+//Every hash rides along on this many input packets, they are unreliable
+#define STATE_HASH_REPEAT (4)
+
+//Frames are named by their emulated time (seconds, attoseconds)
+typedef std::pair<int,long long> StateHashTime;
+
+//Compares the hash of the state that every peer had at the same frame.
+//Peers send their hashes with their input frames, so a desync is noticed a
+//fraction of a second after it happens instead of at the next sync.
+//
+//In rollback mode a frame can be run again with different inputs, so a hash
+//is only sent and compared once its frame can't be rolled back anymore.
+class StateHashTracker
+{
+public:
+    StateHashTracker();
+
+    //Records the hash of our state at a frame.  Replaces the hash of a frame
+    //that was run again.
+    void addLocal(const StateHashTime &time,unsigned long long hash);
+
+    //Our hashes up to confirmedTime are final, compares them with the
+    //peers' hashes and queues the newest one to be sent
+    void confirm(const StateHashTime &confirmedTime);
+
+    //The hash that should go out with the next input packet, false if there
+    //is none
+    bool getOutgoing(StateHashTime &time,unsigned long long &hash);
+
+    //A hash that a peer sent us
+    void addRemote(int peerID,const StateHashTime &time,unsigned long long hash);
+
+    inline int getNumChecked() const
+    {
+        return numChecked;
+    }
+
+    //Number of times a peer went from matching to not matching us
+    inline int getNumDesyncs() const
+    {
+        return numDesyncs;
+    }
+
+    std::string getStatsString() const;
+
+protected:
+    struct LocalHash
+    {
+        StateHashTime time;
+        unsigned long long hash;
+        bool confirmed;
+    };
+
+    //Oldest first
+    std::deque<LocalHash> local;
+    std::map<int,std::map<StateHashTime,unsigned long long> > pendingRemote;
+
+    struct PeerState
+    {
+        //Newest frame compared with this peer
+        StateHashTime checkedTime;
+        bool desynced;
+
+        PeerState()
+            :
+            checkedTime(-1,0),
+            desynced(false)
+        {
+        }
+    };
+    std::map<int,PeerState> peers;
+
+    StateHashTime outgoingTime;
+    unsigned long long outgoingHash;
+    int outgoingRepeats;
+
+    int numChecked;
+    int numDesyncs;
+    StateHashTime lastCheckedTime;
+
+    void compare(int peerID,const LocalHash &mine,unsigned long long theirs);
+
+    //Drops the hashes peers sent for frames we forgot
+    void prunePending();
+};
+
+#endif
@@ -0,0 +1,635 @@
+#define DISABLE_EMUALLOC
+
+#include "NSM_SyncPipeline.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "osdcore.h"
+#include "NSM_Metrics.h"
+
+#include "LzmaEnc.h"
+#include "LzmaDec.h"
+#include "lz4.h"
+
+using namespace std;
+
+//Fastest first.  The lz4 levels are accelerations, the zlib ones levels.
+static const SyncCodecSetting syncCodecLadder[] =
+{
+    { SYNC_CODEC_LZ4, 8 },
+    { SYNC_CODEC_LZ4, 1 },
+    { SYNC_CODEC_ZLIB, 1 },
+    { SYNC_CODEC_ZLIB, 6 },
+    { SYNC_CODEC_ZLIB, 9 }
+};
+#define SYNC_CODEC_LADDER_SIZE (int(sizeof(syncCodecLadder)/sizeof(syncCodecLadder[0])))
+
+//Where the adaptive selector starts
+#define SYNC_CODEC_LADDER_START (1)
+
+//Without a measurement, assume the next step costs this much more
+#define SYNC_CODEC_STEP_COST (3.0)
+
+//Without a reason to shrink the sync, only step up if the prediction leaves
+//this fraction of the budget unused
+#define SYNC_CODEC_HEADROOM (0.5)
+
+static const char *syncCodecNames[SYNC_CODEC_END] = { "zlib", "lz4" };
+static const int syncCodecDefaultLevels[SYNC_CODEC_END] = { 9, 1 };
+
+static SRes OnProgress(void *p, UInt64 inSize, UInt64 outSize)
+{
+    return SZ_OK;
+}
+static ICompressProgress g_ProgressCallback = { &OnProgress };
+
+static void * AllocForLzma(void *p, size_t size)
+{
+    void *ptr = malloc(size);
+    if(!ptr)
+    {
+        cout << "FAILED TO ALLOCATE BLOCK OF SIZE " << size/1024.0/1024.0 << " MB " << endl;
+    }
+    return ptr;
+}
+static void FreeForLzma(void *p, void *address)
+{
+    free(address);
+}
+static ISzAlloc SzAllocForLzma = { &AllocForLzma, &FreeForLzma };
+
+const char *syncCodecName(int codec)
+{
+    if(codec<0 || codec>=SYNC_CODEC_END)
+        return "unknown";
+    return syncCodecNames[codec];
+}
+
+int syncCodecFromName(const char *name)
+{
+    for(int a=0; a<SYNC_CODEC_END; a++)
+    {
+        if(!strcmp(name,syncCodecNames[a]))
+            return a;
+    }
+    return -1;
+}
+
+SyncCodecSelector::SyncCodecSelector()
+    :
+    adaptive(true),
+    codecMask(SYNC_CODECS_SUPPORTED),
+    step(SYNC_CODEC_LADDER_START),
+    msPerMB(SYNC_CODEC_LADDER_SIZE,-1.0)
+{
+    fixed.codec = SYNC_CODEC_ZLIB;
+    fixed.level = syncCodecDefaultLevels[SYNC_CODEC_ZLIB];
+}
+
+void SyncCodecSelector::configure(int codec,int level)
+{
+    adaptive = (codec<0 || codec>=SYNC_CODEC_END);
+    if(!adaptive)
+    {
+        fixed.codec = codec;
+        fixed.level = level>0?level:syncCodecDefaultLevels[codec];
+    }
+}
+
+void SyncCodecSelector::restrictCodecs(int _codecMask)
+{
+    codecMask &= _codecMask;
+    if(!adaptive && (codecMask&(1<<fixed.codec))==0)
+    {
+        cout << "A PEER CAN'T DECODE " << syncCodecName(fixed.codec) << ", USING ZLIB FOR SYNCS\n";
+        fixed.codec = SYNC_CODEC_ZLIB;
+        fixed.level = syncCodecDefaultLevels[SYNC_CODEC_ZLIB];
+    }
+    if((codecMask&(1<<syncCodecLadder[step].codec))==0)
+    {
+        int allowed = findAllowedStep(step,1);
+        if(allowed<0)
+            allowed = findAllowedStep(step,-1);
+        step = max(0,allowed);
+    }
+}
+
+int SyncCodecSelector::findAllowedStep(int from,int direction) const
+{
+    for(int a=from+direction; a>=0 && a<SYNC_CODEC_LADDER_SIZE; a+=direction)
+    {
+        if(codecMask&(1<<syncCodecLadder[a].codec))
+            return a;
+    }
+    return -1;
+}
+
+SyncCodecSetting SyncCodecSelector::getCurrent() const
+{
+    if(!adaptive)
+        return fixed;
+    return syncCodecLadder[step];
+}
+
+void SyncCodecSelector::update(int uncompressedSize,int compressedSize,double compressMS,double budgetMS,double transferBudget)
+{
+    if(!adaptive || uncompressedSize<=0)
+        return;
+
+    double mb = uncompressedSize/(1024.0*1024.0);
+    double cost = compressMS/mb;
+    msPerMB[step] = msPerMB[step]<0?cost:(msPerMB[step]*3+cost)/4;
+
+    int next = step;
+    if(compressMS>budgetMS)
+    {
+        int faster = findAllowedStep(step,-1);
+        if(faster>=0)
+            next = faster;
+    }
+    else
+    {
+        int smaller = findAllowedStep(step,1);
+        if(smaller>=0)
+        {
+            double predictedMS = msPerMB[smaller]<0?compressMS*SYNC_CODEC_STEP_COST:msPerMB[smaller]*mb;
+            bool tooBig = transferBudget>0 && compressedSize>transferBudget;
+            if(predictedMS<=budgetMS && (tooBig || predictedMS<=budgetMS*SYNC_CODEC_HEADROOM))
+                next = smaller;
+        }
+    }
+
+    if(next!=step)
+    {
+        printf(
+            "SYNC CODEC: %s LEVEL %d -> %s LEVEL %d (%.2f ms, BUDGET %.2f ms)\n",
+            syncCodecName(syncCodecLadder[step].codec),
+            syncCodecLadder[step].level,
+            syncCodecName(syncCodecLadder[next].codec),
+            syncCodecLadder[next].level,
+            compressMS,
+            budgetMS
+            );
+        step = next;
+    }
+}
+
+SyncSlice::SyncSlice()
+    :
+    arena(NULL),
+    buffer(NULL),
+    offset(0),
+    size(0)
+{
+}
+
+SyncSlice::SyncSlice(SyncBufferArena *_arena,SyncBuffer *_buffer,int _offset,int _size)
+    :
+    arena(_arena),
+    buffer(_buffer),
+    offset(_offset),
+    size(_size)
+{
+    arena->addRef(buffer);
+}
+
+SyncSlice::SyncSlice(const SyncSlice &other)
+    :
+    arena(other.arena),
+    buffer(other.buffer),
+    offset(other.offset),
+    size(other.size)
+{
+    if(buffer)
+        arena->addRef(buffer);
+}
+
+SyncSlice &SyncSlice::operator=(const SyncSlice &other)
+{
+    if(other.buffer)
+        other.arena->addRef(other.buffer);
+    if(buffer)
+        arena->release(buffer);
+    arena = other.arena;
+    buffer = other.buffer;
+    offset = other.offset;
+    size = other.size;
+    return *this;
+}
+
+SyncSlice::~SyncSlice()
+{
+    if(buffer)
+        arena->release(buffer);
+}
+
+SyncBufferArena::SyncBufferArena()
+    :
+    lock(NULL)
+{
+}
+
+SyncBufferArena::~SyncBufferArena()
+{
+    for(int a=0; a<int(buffers.size()); a++)
+    {
+        if(buffers[a]->refCount)
+        {
+            cout << "WARNING: SYNC BUFFER FREED WHILE STILL IN USE\n";
+        }
+        free(buffers[a]->data);
+        free(buffers[a]);
+    }
+    if(lock)
+        osd_lock_free(lock);
+}
+
+void SyncBufferArena::prepare()
+{
+    if(!lock)
+        lock = osd_lock_alloc();
+}
+
+SyncBuffer *SyncBufferArena::acquire(int size)
+{
+    if(lock)
+        osd_lock_acquire(lock);
+
+    //Take the smallest idle buffer that fits, or grow the largest one
+    int best=-1;
+    int largest=-1;
+    for(int a=0; a<int(idleBuffers.size()); a++)
+    {
+        int capacity = idleBuffers[a]->capacity;
+        if(capacity>=size && (best<0 || capacity<idleBuffers[best]->capacity))
+            best=a;
+        if(largest<0 || capacity>idleBuffers[largest]->capacity)
+            largest=a;
+    }
+
+    SyncBuffer *buffer;
+    if(best>=0)
+    {
+        buffer = idleBuffers[best];
+        idleBuffers.erase(idleBuffers.begin()+best);
+    }
+    else
+    {
+        if(largest>=0)
+        {
+            buffer = idleBuffers[largest];
+            idleBuffers.erase(idleBuffers.begin()+largest);
+            free(buffer->data);
+        }
+        else
+        {
+            buffer = (SyncBuffer*)malloc(sizeof(SyncBuffer));
+            if(!buffer)
+            {
+                cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
+                exit(1);
+            }
+            buffers.push_back(buffer);
+        }
+        //Leave some slack so slightly larger syncs don't reallocate again
+        buffer->capacity = size+size/2;
+        buffer->data = (unsigned char*)malloc(buffer->capacity);
+        if(!buffer->data)
+        {
+            cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
+            exit(1);
+        }
+    }
+    buffer->refCount=1;
+    if(lock)
+        osd_lock_release(lock);
+    return buffer;
+}
+
+void SyncBufferArena::addRef(SyncBuffer *buffer)
+{
+    if(lock)
+        osd_lock_acquire(lock);
+    buffer->refCount++;
+    if(lock)
+        osd_lock_release(lock);
+}
+
+void SyncBufferArena::release(SyncBuffer *buffer)
+{
+    if(lock)
+        osd_lock_acquire(lock);
+    buffer->refCount--;
+    if(buffer->refCount==0)
+    {
+        idleBuffers.push_back(buffer);
+    }
+    if(lock)
+        osd_lock_release(lock);
+}
+
+LzmaEncoder::LzmaEncoder()
+{
+    handle = LzmaEnc_Create(&SzAllocForLzma);
+    if(!handle)
+    {
+        cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
+        exit(1);
+    }
+}
+
+LzmaEncoder::~LzmaEncoder()
+{
+    LzmaEnc_Destroy(handle,&SzAllocForLzma,&SzAllocForLzma);
+}
+
+void LzmaEncoder::compress(
+    unsigned char* destBuf,
+    int &destSize,
+    const unsigned char *srcBuf,
+    int srcSize,
+    int compressionLevel
+)
+{
+    SizeT propsSize = LZMA_PROPS_SIZE;
+
+    SizeT lzmaDestSize = (SizeT)destSize - LZMA_PROPS_SIZE;
+
+    CLzmaEncProps props;
+    LzmaEncProps_Init(&props);
+    props.level = compressionLevel; //compression level
+    props.writeEndMark = 1; // 0 or 1
+
+    //A dictionary larger than the input only costs memory on both ends
+    UInt32 dictSize = 1<<12;
+    while(dictSize<UInt32(srcSize) && dictSize<LzmaEncProps_GetDictSize(&props))
+        dictSize <<= 1;
+    props.dictSize = dictSize;
+
+    int res = LzmaEnc_SetProps(handle,&props);
+    if(res == SZ_OK)
+        res = LzmaEnc_WriteProperties(handle,destBuf,&propsSize);
+    if(res == SZ_OK)
+        res = LzmaEnc_MemEncode(
+                  handle,
+                  destBuf+LZMA_PROPS_SIZE, &lzmaDestSize,
+                  srcBuf, srcSize,
+                  props.writeEndMark,
+                  &g_ProgressCallback, &SzAllocForLzma, &SzAllocForLzma);
+
+    destSize = (int)lzmaDestSize + LZMA_PROPS_SIZE;
+
+    NETLOG(NETLOG_DEBUG,("COMPRESSED %d BYTES DOWN TO %d\n",srcSize,destSize));
+
+    if(res != SZ_OK || propsSize != LZMA_PROPS_SIZE)
+    {
+        cout << "ERROR COMPRESSING DATA\n";
+        cout << res << ',' << propsSize << endl;
+        exit(1);
+    }
+}
+
+LzmaDecoder::LzmaDecoder()
+    :
+    state(NULL)
+{
+}
+
+LzmaDecoder::~LzmaDecoder()
+{
+    if(state)
+    {
+        LzmaDec_FreeProbs((CLzmaDec*)state,&SzAllocForLzma);
+        free(state);
+    }
+}
+
+void LzmaDecoder::uncompress(
+    unsigned char* destBuf,
+    int destSize,
+    const unsigned char *srcBuf,
+    int srcSize
+)
+{
+    if(srcSize < LZMA_PROPS_SIZE)
+    {
+        cout << "ERROR DECOMPRESSING DATA: ONLY " << srcSize << " BYTES\n";
+        exit(1);
+    }
+    if(!state)
+    {
+        state = malloc(sizeof(CLzmaDec));
+        if(!state)
+        {
+            cout << __FILE__ << ":" << __LINE__ << " OUT OF MEMORY\n";
+            exit(1);
+        }
+        LzmaDec_Construct((CLzmaDec*)state);
+    }
+    CLzmaDec *dec = (CLzmaDec*)state;
+
+    SizeT lzmaSrcSize = (SizeT)srcSize - LZMA_PROPS_SIZE;
+
+    NETLOG(NETLOG_DEBUG,("DECOMPRESSING %d\n",srcSize));
+
+    //Same as LzmaDecode, but the tables are only reallocated when the
+    //properties need a different amount
+    ELzmaStatus finishStatus = LZMA_STATUS_NOT_SPECIFIED;
+    int res = LzmaDec_AllocateProbs(dec,srcBuf,LZMA_PROPS_SIZE,&SzAllocForLzma);
+    if(res == SZ_OK)
+    {
+        dec->dic = destBuf;
+        dec->dicBufSize = destSize;
+        LzmaDec_Init(dec);
+        res = LzmaDec_DecodeToDic(
+                  dec, destSize,
+                  srcBuf+LZMA_PROPS_SIZE, &lzmaSrcSize,
+                  LZMA_FINISH_END, &finishStatus);
+        NETLOG(NETLOG_DEBUG,("DECOMPRESSED %d BYTES DOWN TO %d\n",srcSize,int(dec->dicPos)));
+        dec->dic = NULL;
+    }
+
+    if(res != SZ_OK || finishStatus != LZMA_STATUS_FINISHED_WITH_MARK)
+    {
+        cout << "ERROR DECOMPRESSING DATA\n";
+        cout << res << ',' << finishStatus << endl;
+        exit(1);
+    }
+}
+
+LzmaEncoderPool::LzmaEncoderPool()
+    :
+    lock(NULL)
+{
+}
+
+LzmaEncoderPool::~LzmaEncoderPool()
+{
+    for(int a=0; a<int(encoders.size()); a++)
+    {
+        delete encoders[a];
+    }
+    if(lock)
+        osd_lock_free(lock);
+}
+
+void LzmaEncoderPool::prepare()
+{
+    if(!lock)
+        lock = osd_lock_alloc();
+}
+
+LzmaEncoder *LzmaEncoderPool::acquire()
+{
+    osd_lock_acquire(lock);
+    LzmaEncoder *encoder;
+    if(idleEncoders.empty())
+    {
+        encoder = new LzmaEncoder();
+        encoders.push_back(encoder);
+    }
+    else
+    {
+        encoder = idleEncoders.back();
+        idleEncoders.pop_back();
+    }
+    osd_lock_release(lock);
+    return encoder;
+}
+
+void LzmaEncoderPool::release(LzmaEncoder *encoder)
+{
+    osd_lock_acquire(lock);
+    idleEncoders.push_back(encoder);
+    osd_lock_release(lock);
+}
+
+SyncPipeline::SyncPipeline()
+    :
+    deflateReady(false),
+    deflateLevel(0),
+    inflateReady(false),
+    receivedSize(0)
+{
+}
+
+SyncPipeline::~SyncPipeline()
+{
+    if(deflateReady)
+        deflateEnd(&deflateStream);
+    if(inflateReady)
+        inflateEnd(&inflateStream);
+}
+
+unsigned char *SyncPipeline::reserveUncompressed(int size)
+{
+    if(int(uncompressed.size())<size)
+    {
+        uncompressed.resize(max(size,int(uncompressed.size()*3/2)));
+    }
+    return &uncompressed[0];
+}
+
+int SyncPipeline::compress(int codec,int level,const unsigned char *src,int srcSize)
+{
+    if(codec==SYNC_CODEC_LZ4)
+    {
+        if(lz4State.empty())
+            lz4State.resize(LZ4_STATE_SIZE/sizeof(unsigned int));
+        int bound = lz4_compress_bound(srcSize);
+        if(int(compressed.size())<bound)
+            compressed.resize(bound);
+        return lz4_compress(&lz4State[0],src,srcSize,&compressed[0],bound,level);
+    }
+
+    if(!deflateReady)
+    {
+        deflateStream.zalloc = Z_NULL;
+        deflateStream.zfree = Z_NULL;
+        deflateStream.opaque = Z_NULL;
+        if(deflateInit(&deflateStream,level)!=Z_OK)
+        {
+            cout << "ERROR INITIALIZING ZLIB STREAM\n";
+            exit(1);
+        }
+        deflateReady=true;
+        deflateLevel=level;
+    }
+    else
+    {
+        deflateReset(&deflateStream);
+        if(deflateLevel!=level)
+        {
+            //Nothing is buffered right after a reset, so this only swaps the parameters
+            deflateParams(&deflateStream,level,Z_DEFAULT_STRATEGY);
+            deflateLevel=level;
+        }
+    }
+
+    int bound = int(deflateBound(&deflateStream,srcSize));
+    if(int(compressed.size())<bound)
+        compressed.resize(bound);
+
+    deflateStream.next_in = (Bytef*)src;
+    deflateStream.avail_in = srcSize;
+    deflateStream.next_out = &compressed[0];
+    deflateStream.avail_out = bound;
+    if(deflate(&deflateStream,Z_FINISH)!=Z_STREAM_END)
+    {
+        cout << "ERROR COMPRESSING ZLIB STREAM\n";
+        exit(1);
+    }
+    return int(deflateStream.total_out);
+}
+
+bool SyncPipeline::uncompress(int codec,const unsigned char *src,int srcSize,int uncompressedSize)
+{
+    if(codec==SYNC_CODEC_LZ4)
+    {
+        reserveUncompressed(uncompressedSize+1);
+        return lz4_decompress(src,srcSize,&uncompressed[0],uncompressedSize)==uncompressedSize;
+    }
+    if(codec!=SYNC_CODEC_ZLIB)
+        return false;
+
+    if(!inflateReady)
+    {
+        inflateStream.zalloc = Z_NULL;
+        inflateStream.zfree = Z_NULL;
+        inflateStream.opaque = Z_NULL;
+        inflateStream.next_in = Z_NULL;
+        inflateStream.avail_in = 0;
+        if(inflateInit(&inflateStream)!=Z_OK)
+        {
+            cout << "ERROR INITIALIZING ZLIB STREAM\n";
+            exit(1);
+        }
+        inflateReady=true;
+    }
+    else
+    {
+        inflateReset(&inflateStream);
+    }
+
+    reserveUncompressed(uncompressedSize+1);
+    inflateStream.next_in = (Bytef*)src;
+    inflateStream.avail_in = srcSize;
+    inflateStream.next_out = &uncompressed[0];
+    inflateStream.avail_out = uncompressedSize;
+    return inflate(&inflateStream,Z_FINISH)==Z_STREAM_END && int(inflateStream.total_out)==uncompressedSize;
+}
+
+void SyncPipeline::appendReceived(const unsigned char *data,int size)
+{
+    if(int(received.size())<receivedSize+size)
+    {
+        //resize keeps the packets we already have
+        received.resize(max(receivedSize+size,int(received.size()*3/2)));
+    }
+    memcpy(&received[receivedSize],data,size);
+    receivedSize += size;
+}
@@ -0,0 +1,306 @@
+#ifndef __NSM_SYNCPIPELINE__
+#define __NSM_SYNCPIPELINE__
+
+#include <cstddef>
+#include <vector>
+
+#include "zlib.h"
+
+struct _osd_lock;
+
+//Codecs the periodic syncs can be compressed with.  The codec is named in
+//every sync's header, so the server can switch between syncs.
+enum SyncCodecType
+{
+    SYNC_CODEC_ZLIB,
+    SYNC_CODEC_LZ4,
+    SYNC_CODEC_END
+};
+
+//Every codec this build can decode, sent to the server in ID_CLIENT_INFO
+#define SYNC_CODECS_SUPPORTED ((1<<SYNC_CODEC_ZLIB)|(1<<SYNC_CODEC_LZ4))
+
+//Peers that don't send a codec mask only know zlib
+#define SYNC_CODECS_LEGACY (1<<SYNC_CODEC_ZLIB)
+
+const char *syncCodecName(int codec);
+
+//Returns -1 for "auto" or a name that isn't a codec
+int syncCodecFromName(const char *name);
+
+struct SyncCodecSetting
+{
+    int codec;
+    //zlib: 1-9, higher is smaller.  lz4: acceleration, higher is faster.
+    int level;
+};
+
+//Picks the codec and level for the next sync.  In adaptive mode it walks a
+//ladder from fastest to smallest output: it steps down when compressing
+//took longer than the emulation thread can spare, and up when the next step
+//is expected to fit (always when the output is too big for the slowest
+//peer to receive before the next sync, otherwise only with headroom).
+class SyncCodecSelector
+{
+public:
+    SyncCodecSelector();
+
+    //codec<0 adapts, otherwise codec is always used at level (0 picks the
+    //codec's default level)
+    void configure(int codec,int level);
+
+    //Only use codecs in codecMask, called with what each peer can decode
+    void restrictCodecs(int codecMask);
+
+    inline int getCodecMask() const
+    {
+        return codecMask;
+    }
+
+    SyncCodecSetting getCurrent() const;
+
+    //Feeds back one sync.  budgetMS is how long compression may block the
+    //emulation thread, transferBudget is how many bytes the slowest peer can
+    //receive before the next sync (0 if that isn't known).
+    void update(int uncompressedSize,int compressedSize,double compressMS,double budgetMS,double transferBudget);
+
+protected:
+    bool adaptive;
+    SyncCodecSetting fixed;
+    int codecMask;
+    int step;
+    //Measured cost of each ladder step, negative until it was tried
+    std::vector<double> msPerMB;
+
+    int findAllowedStep(int from,int direction) const;
+};
+
+class SyncBufferArena;
+
+//Memory handed out by a SyncBufferArena.  It goes back to the arena (not the
+//heap) when the last slice that points into it is gone.
+struct SyncBuffer
+{
+    unsigned char *data;
+    int capacity;
+    int refCount;
+};
+
+//A reference counted view of part of a SyncBuffer.  Sync packets wait in the
+//send queue as slices, so they stay valid even if another sync starts
+//building packets before the queue drains.
+class SyncSlice
+{
+public:
+    SyncSlice();
+
+    //Takes its own reference on buffer
+    SyncSlice(SyncBufferArena *arena,SyncBuffer *buffer,int offset,int size);
+
+    SyncSlice(const SyncSlice &other);
+
+    SyncSlice &operator=(const SyncSlice &other);
+
+    ~SyncSlice();
+
+    inline const unsigned char *getData() const
+    {
+        return buffer->data+offset;
+    }
+
+    inline int getSize() const
+    {
+        return size;
+    }
+
+protected:
+    SyncBufferArena *arena;
+    SyncBuffer *buffer;
+    int offset;
+    int size;
+};
+
+//Pools the buffers that sync packets are built in, so a sync every few
+//seconds reuses the same memory.  Until prepare() is called it is only safe
+//on one thread; after it, packets may be built on a worker while the
+//emulation thread sends and releases older ones.
+class SyncBufferArena
+{
+public:
+    SyncBufferArena();
+
+    ~SyncBufferArena();
+
+    //Must be called on the emulation thread before a worker uses the arena
+    void prepare();
+
+    //Returns an idle buffer with room for size bytes, holding one reference
+    SyncBuffer *acquire(int size);
+
+    void addRef(SyncBuffer *buffer);
+
+    void release(SyncBuffer *buffer);
+
+protected:
+    _osd_lock *lock;
+    std::vector<SyncBuffer*> buffers;
+    std::vector<SyncBuffer*> idleBuffers;
+
+private:
+    //The buffers belong to one arena
+    SyncBufferArena(const SyncBufferArena &other);
+    SyncBufferArena &operator=(const SyncBufferArena &other);
+};
+
+//An LZMA encoder that keeps its match finder between calls.  It is only
+//reallocated when the dictionary size changes.
+class LzmaEncoder
+{
+public:
+    LzmaEncoder();
+
+    ~LzmaEncoder();
+
+    //destSize is the room in destBuf on the way in, the compressed size on
+    //the way out
+    void compress(unsigned char *destBuf,int &destSize,const unsigned char *srcBuf,int srcSize,int compressionLevel);
+
+protected:
+    void *handle;
+
+private:
+    LzmaEncoder(const LzmaEncoder &other);
+    LzmaEncoder &operator=(const LzmaEncoder &other);
+};
+
+//An LZMA decoder that keeps its probability tables between calls
+class LzmaDecoder
+{
+public:
+    LzmaDecoder();
+
+    ~LzmaDecoder();
+
+    void uncompress(unsigned char *destBuf,int destSize,const unsigned char *srcBuf,int srcSize);
+
+protected:
+    void *state;
+
+private:
+    LzmaDecoder(const LzmaDecoder &other);
+    LzmaDecoder &operator=(const LzmaDecoder &other);
+};
+
+//Encoders shared by the initial sync's compression workers.  It grows to
+//the number of workers that compress at the same time.
+class LzmaEncoderPool
+{
+public:
+    LzmaEncoderPool();
+
+    ~LzmaEncoderPool();
+
+    //Must be called on the emulation thread before workers acquire encoders
+    void prepare();
+
+    LzmaEncoder *acquire();
+
+    void release(LzmaEncoder *encoder);
+
+protected:
+    _osd_lock *lock;
+    std::vector<LzmaEncoder*> encoders;
+    std::vector<LzmaEncoder*> idleEncoders;
+
+private:
+    LzmaEncoderPool(const LzmaEncoderPool &other);
+    LzmaEncoderPool &operator=(const LzmaEncoderPool &other);
+};
+
+//Everything the syncs reuse from one run to the next: the zlib streams, the
+//scratch buffers, the packet arena and the LZMA codecs.  Nothing is
+//allocated until it is first used.
+class SyncPipeline
+{
+public:
+    SyncPipeline();
+
+    ~SyncPipeline();
+
+    //Grows the uncompressed scratch to at least size bytes, keeping what is
+    //already in it.  The returned pointer is only valid until the next call.
+    unsigned char *reserveUncompressed(int size);
+
+    inline unsigned char *getUncompressed()
+    {
+        return uncompressed.empty()?NULL:&uncompressed[0];
+    }
+
+    //Compresses src into the compressed scratch, returns the compressed size
+    int compress(int codec,int level,const unsigned char *src,int srcSize);
+
+    inline const unsigned char *getCompressed()
+    {
+        return compressed.empty()?NULL:&compressed[0];
+    }
+
+    //Decompresses src into the uncompressed scratch, false if the codec is
+    //unknown, the data is corrupt or it isn't exactly uncompressedSize bytes
+    bool uncompress(int codec,const unsigned char *src,int srcSize,int uncompressedSize);
+
+    //Sync packets are appended here until the last one arrives
+    void appendReceived(const unsigned char *data,int size);
+
+    inline unsigned char *getReceived()
+    {
+        return received.empty()?NULL:&received[0];
+    }
+
+    inline int getReceivedSize()
+    {
+        return receivedSize;
+    }
+
+    inline void clearReceived()
+    {
+        receivedSize=0;
+    }
+
+    inline SyncBufferArena &getArena()
+    {
+        return arena;
+    }
+
+    inline LzmaEncoderPool &getLzmaEncoders()
+    {
+        return lzmaEncoders;
+    }
+
+    inline LzmaDecoder &getLzmaDecoder()
+    {
+        return lzmaDecoder;
+    }
+
+protected:
+    bool deflateReady;
+    int deflateLevel;
+    z_stream deflateStream;
+    bool inflateReady;
+    z_stream inflateStream;
+    std::vector<unsigned int> lz4State;
+
+    std::vector<unsigned char> uncompressed;
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> received;
+    int receivedSize;
+
+    SyncBufferArena arena;
+    LzmaEncoderPool lzmaEncoders;
+    LzmaDecoder lzmaDecoder;
+
+private:
+    SyncPipeline(const SyncPipeline &other);
+    SyncPipeline &operator=(const SyncPipeline &other);
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "NSM_TimeSync.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+TimeSyncController::TimeSyncController()
+    :
+    aheadMS(0.0),
+    measured(false),
+    speedPercent(100)
+{
+}
+
+void TimeSyncController::update(const vector<double> &peerAheadMS)
+{
+    if(peerAheadMS.empty())
+    {
+        speedPercent = 100;
+        return;
+    }
+
+    //Level with the average peer, not the slowest one
+    double total=0.0;
+    for(int a=0; a<int(peerAheadMS.size()); a++)
+    {
+        total += peerAheadMS[a];
+    }
+    double frameAheadMS = total/peerAheadMS.size();
+
+    if(!measured)
+    {
+        measured = true;
+        aheadMS = frameAheadMS;
+    }
+    else
+    {
+        aheadMS += (frameAheadMS-aheadMS)*TIME_SYNC_SMOOTHING;
+    }
+
+    int newSpeedPercent = 100;
+    if(fabs(aheadMS) > TIME_SYNC_DEADBAND_MS)
+    {
+        double correction = aheadMS*TIME_SYNC_MAX_CORRECTION/TIME_SYNC_FULL_CORRECTION_MS;
+        correction = max(-double(TIME_SYNC_MAX_CORRECTION),min(double(TIME_SYNC_MAX_CORRECTION),correction));
+        //Ahead means slower
+        newSpeedPercent = 100 - int(floor(correction+0.5));
+    }
+    if(newSpeedPercent!=speedPercent)
+    {
+        printf("TIME SYNC: %.1f MS AHEAD OF THE PEERS, RUNNING AT %d%%\n",aheadMS,newSpeedPercent);
+        speedPercent = newSpeedPercent;
+    }
+}
+
+StallMeter::StallMeter()
+{
+    latest.timeUS = 0;
+    latest.count = 0;
+    latest.stallUS = 0;
+}
+
+void StallMeter::sample(long long nowUS,int totalCount,long long totalUS)
+{
+    latest.timeUS = nowUS;
+    latest.count = totalCount;
+    latest.stallUS = totalUS;
+
+    if(snapshots.empty() || nowUS-snapshots.back().timeUS >= 1000000)
+        snapshots.push_back(latest);
+    while(snapshots.size()>1 && nowUS-snapshots[1].timeUS >= STALL_METER_SECONDS*1000000LL)
+    {
+        snapshots.pop_front();
+    }
+}
+
+double StallMeter::getPerMinute(double amount) const
+{
+    if(snapshots.empty())
+        return 0.0;
+    long long elapsedUS = latest.timeUS-snapshots.front().timeUS;
+    if(elapsedUS < 1000000)
+        return 0.0;
+    return amount*60000000.0/elapsedUS;
+}
+
+double StallMeter::getStallsPerMinute() const
+{
+    if(snapshots.empty())
+        return 0.0;
+    return getPerMinute(latest.count-snapshots.front().count);
+}
+
+double StallMeter::getStallSecondsPerMinute() const
+{
+    if(snapshots.empty())
+        return 0.0;
+    return getPerMinute((latest.stallUS-snapshots.front().stallUS)/1000000.0);
+}
@@ -0,0 +1,99 @@
+#ifndef __NSM_TIMESYNC__
+#define __NSM_TIMESYNC__
+
+#include <deque>
+#include <vector>
+
+//An offset nobody measured yet (fits in the short it is sent as)
+#define TIME_SYNC_UNKNOWN (-32768)
+
+//Milliseconds of emulated time we may be ahead of or behind the others
+//before our speed is nudged
+#define TIME_SYNC_DEADBAND_MS (4)
+
+//Milliseconds ahead or behind that get the largest nudge
+#define TIME_SYNC_FULL_CORRECTION_MS (50)
+
+//Largest nudge, in percent of the normal speed
+#define TIME_SYNC_MAX_CORRECTION (2)
+
+//This far behind we stop throttling until we catch up
+#define TIME_SYNC_CATCHUP_MS (100)
+
+//Weight of each new frame's measurement in the running average
+#define TIME_SYNC_SMOOTHING (0.05)
+
+//A peer's time is moved forward by at most this much real time since its
+//last packet (it may be stalled)
+#define TIME_SYNC_MAX_EXTRAPOLATION_MS (100)
+
+//Stall rates are measured over this many seconds
+#define STALL_METER_SECONDS (60)
+
+//Keeps the peers' emulated times level.  Every peer works out how far
+//ahead of each other peer it is (the peers tell each other what they
+//measured, which cancels out most of a lopsided ping) and runs a percent or
+//two faster or slower until it is even with them, instead of running
+//ahead and stalling on their inputs.
+class TimeSyncController
+{
+public:
+    TimeSyncController();
+
+    //Called once per frame with how many milliseconds we are ahead of
+    //each peer (negative when behind)
+    void update(const std::vector<double> &peerAheadMS);
+
+    inline double getAheadMS() const
+    {
+        return aheadMS;
+    }
+
+    //The speed the throttle should run at, in percent of normal
+    inline int getSpeedPercent() const
+    {
+        return speedPercent;
+    }
+
+    //False while we are so far behind that we should run flat out
+    inline bool shouldThrottle() const
+    {
+        return aheadMS > -TIME_SYNC_CATCHUP_MS;
+    }
+
+protected:
+    double aheadMS;
+    bool measured;
+    int speedPercent;
+};
+
+//How often and how long the input barrier stalled over the last minute
+class StallMeter
+{
+public:
+    StallMeter();
+
+    //Called with the running totals, remembers one snapshot per second
+    void sample(long long nowUS,int totalCount,long long totalUS);
+
+    double getStallsPerMinute() const;
+
+    double getStallSecondsPerMinute() const;
+
+protected:
+    struct Snapshot
+    {
+        long long timeUS;
+        int count;
+        long long stallUS;
+    };
+
+    //Oldest first
+    std::deque<Snapshot> snapshots;
+    Snapshot latest;
+
+    //Scales what happened since the oldest snapshot to a minute
+    double getPerMinute(double amount) const;
+};
+
+#endif
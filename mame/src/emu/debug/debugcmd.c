@@ -142,6 +142,8 @@ static void execute_trace(running_machine &machine, int ref, int params, const c
 static void execute_traceover(running_machine &machine, int ref, int params, const char **param);
 static void execute_traceflush(running_machine &machine, int ref, int params, const char **param);
 static void execute_history(running_machine &machine, int ref, int params, const char **param);
+static void execute_schedstats(running_machine &machine, int ref, int params, const char **param);
+static void execute_statebench(running_machine &machine, int ref, int params, const char **param);
 static void execute_snap(running_machine &machine, int ref, int params, const char **param);
 static void execute_source(running_machine &machine, int ref, int params, const char **param);
 static void execute_map(running_machine &machine, int ref, int params, const char **param);
@@ -357,6 +359,9 @@ void debug_command_init(running_machine &machine)
 
 	debug_console_register_command(machine, "history",   CMDFLAG_NONE, 0, 0, 2, execute_history);
 
+	debug_console_register_command(machine, "schedstats",CMDFLAG_NONE, 0, 0, 1, execute_schedstats);
+	debug_console_register_command(machine, "statebench",CMDFLAG_NONE, 0, 0, 1, execute_statebench);
+
 	debug_console_register_command(machine, "snap",      CMDFLAG_NONE, 0, 0, 1, execute_snap);
 
 	debug_console_register_command(machine, "source",    CMDFLAG_NONE, 0, 1, 1, execute_source);
@@ -2479,6 +2484,50 @@ static void execute_history(running_machine &machine, int ref, int params, const
 }
 
 
+/*-------------------------------------------------
+    execute_schedstats - execute the schedstats
+    command
+-------------------------------------------------*/
+
+static void execute_schedstats(running_machine &machine, int ref, int params, const char *param[])
+{
+	/* validate parameters */
+	if (params > 0 && strcmp(param[0], "reset") != 0)
+	{
+		debug_console_printf(machine, "Unknown option '%s', expected 'reset'\n", param[0]);
+		return;
+	}
+
+	astring report;
+	debug_console_printf(machine, "%s", machine.scheduler().stats_report(report));
+
+	/* start over once they are printed */
+	if (params > 0)
+	{
+		machine.scheduler().reset_stats();
+		debug_console_printf(machine, "Scheduler statistics reset\n");
+	}
+}
+
+
+/*-------------------------------------------------
+    execute_statebench - execute the statebench
+    command
+-------------------------------------------------*/
+
+static void execute_statebench(running_machine &machine, int ref, int params, const char *param[])
+{
+	UINT64 count = 100;
+
+	/* validate parameters */
+	if (!debug_command_parameter_number(machine, param[0], &count))
+		return;
+
+	astring report;
+	debug_console_printf(machine, "%s", machine.save().benchmark_snapshots((int)count, report));
+}
+
+
 /*-------------------------------------------------
     execute_snap - execute the snapshot command
 -------------------------------------------------*/
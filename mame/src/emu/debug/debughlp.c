@@ -135,6 +135,8 @@ static const help_item static_help_list[] =
 		"  trace {<filename>|OFF}[,<cpu>[,<action>]] -- trace the given CPU to a file (defaults to active CPU)\n"
 		"  traceover {<filename>|OFF}[,<cpu>[,<action>]] -- trace the given CPU to a file, but skip subroutines (defaults to active CPU)\n"
 		"  traceflush -- flushes all open trace files\n"
+		"  schedstats [reset] -- shows how the scheduler ran each CPU and timer, and optionally starts over\n"
+		"  statebench [<count>=100] -- times capturing and restoring the machine state in memory\n"
 	},
 	{
 		"breakpoints",
@@ -781,6 +783,45 @@ static const help_item static_help_list[] =
 		"\n"
 		"Flushes all open trace files.\n"
 	},
+	{
+		"schedstats",
+		"\n"
+		"  schedstats [reset]\n"
+		"\n"
+		"Shows what the scheduler did since the machine started or the statistics were last reset: how "
+		"many timeslices ran and how often the interleave was boosted, and for each CPU the cycles it "
+		"was asked to run against the cycles it ran, the cycles it spent suspended, how often it "
+		"aborted its timeslice and the host time it took. Timer callbacks follow, the most expensive "
+		"first. With reset, the statistics start over after they are shown. The same report is "
+		"printed on exit with -schedstats.\n"
+		"\n"
+		"Examples:\n"
+		"\n"
+		"schedstats\n"
+		"  Shows the scheduler statistics so far.\n"
+		"\n"
+		"schedstats reset\n"
+		"  Shows them, then starts counting again from the current time.\n"
+	},
+	{
+		"statebench",
+		"\n"
+		"  statebench [<count>=100]\n"
+		"\n"
+		"Captures the machine state into memory and restores it again <count> times, and shows how long "
+		"each took on average and at best: once copying everything, and once copying only what differs "
+		"from the other side. The machine ends up where it was, but restoring drops anonymous timers, so "
+		"the command refuses to run while any are pending. The same report is printed on exit with "
+		"-statebench <count>.\n"
+		"\n"
+		"Examples:\n"
+		"\n"
+		"statebench\n"
+		"  Times 100 captures and restores of the current state.\n"
+		"\n"
+		"statebench 10000\n"
+		"  Times 10000 of each, for steadier numbers.\n"
+	},
 	{
 		"bpset",
 		"\n"
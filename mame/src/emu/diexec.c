@@ -75,12 +75,16 @@ device_execute_interface::device_execute_interface(const machine_config &mconfig
 	: device_interface(device),
 	  m_cothread(cothread_entry_delegate(FUNC(device_execute_interface::run_thread_wrapper), this)),
 	  m_disabled(false),
+	  m_independent(false),
 	  m_vblank_interrupt(NULL),
 	  m_vblank_interrupts_per_frame(0),
 	  m_vblank_interrupt_screen(NULL),
 	  m_timed_interrupt(NULL),
 	  m_timed_interrupt_period(attotime::zero),
 	  m_nextexec(NULL),
+	  m_parallel_index(0),
+	  m_parallel_turn(false),
+	  m_parallel_ran(false),
 	  m_driver_irq(0),
 	  m_timedint_timer(NULL),
 	  m_iloops(0),
@@ -99,7 +103,14 @@ device_execute_interface::device_execute_interface(const machine_config &mconfig
 	  m_divisor(0),
 	  m_divshift(0),
 	  m_cycles_per_second(0),
-	  m_attoseconds_per_cycle(0)
+	  m_attoseconds_per_cycle(0),
+	  m_stat_timeslices(0),
+	  m_stat_cycles_requested(0),
+	  m_stat_cycles_executed(0),
+	  m_stat_cycles_suspended(0),
+	  m_stat_aborts(0),
+	  m_stat_waits(0),
+	  m_stat_ticks(0)
 {
 	memset(&m_localtime, 0, sizeof(m_localtime));
 
@@ -131,6 +142,25 @@ void device_execute_interface::static_set_disable(device_t &device)
 }
 
 
+//-------------------------------------------------
+//  static_set_independent - configuration helper
+//  to let a device run on its own thread while
+//  other independent devices run; the driver
+//  promises the device only talks to the others
+//  through the scheduler (timers, synchronize,
+//  input lines and latches read at timeslice
+//  boundaries)
+//-------------------------------------------------
+
+void device_execute_interface::static_set_independent(device_t &device)
+{
+	device_execute_interface *exec;
+	if (!device.dev_interface(exec))
+		throw emu_fatalerror("MCFG_DEVICE_INDEPENDENT called on device '%s' with no execute interface", device.tag());
+	exec->m_independent = true;
+}
+
+
 //-------------------------------------------------
 //  static_set_vblank_int - configuration helper
 //  to set up VBLANK interrupts on the device
@@ -234,6 +264,8 @@ void device_execute_interface::abort_timeslice()
 	if (m_icountptr != NULL)
 	{
 		int delta = *m_icountptr;
+		if (delta > 0)
+			m_stat_aborts++;
 		m_cycles_stolen += delta;
 		m_cycles_running -= delta;
 		*m_icountptr -= delta;
@@ -259,6 +291,10 @@ void device_execute_interface::set_irq_callback(device_irq_callback callback)
 void device_execute_interface::suspend(UINT32 reason, bool eatcycles)
 {
 if (TEMPLOG) printf("suspend %s (%X)\n", device().tag(), reason);
+	// the suspend state is shared with whichever device last changed it, this
+	// one included, so keep every change in group order
+	device().machine().scheduler().serialize();
+
 	// set the suspend reason and eat cycles flag
 	m_nextsuspend |= reason;
 	m_nexteatcycles = eatcycles;
@@ -276,6 +312,10 @@ if (TEMPLOG) printf("suspend %s (%X)\n", device().tag(), reason);
 void device_execute_interface::resume(UINT32 reason)
 {
 if (TEMPLOG) printf("resume %s (%X)\n", device().tag(), reason);
+	// the suspend state is shared with whichever device last changed it, this
+	// one included, so keep every change in group order
+	device().machine().scheduler().serialize();
+
 	// clear the suspend reason and eat cycles flag
 	m_nextsuspend &= ~reason;
 
@@ -293,6 +333,9 @@ void device_execute_interface::spin_until_time(attotime duration)
 {
 	static int timetrig = 0;
 
+	// the trigger numbers are shared between devices
+	device().machine().scheduler().serialize();
+
 	// suspend until the given trigger fires
 	suspend_until_trigger(TRIGGER_SUSPENDTIME + timetrig, true);
 
@@ -323,6 +366,9 @@ void device_execute_interface::suspend_until_trigger(int trigid, bool eatcycles)
 
 void device_execute_interface::trigger(int trigid)
 {
+	// the trigger state is shared like the suspend state
+	device().machine().scheduler().serialize();
+
 	// if we're executing, for an immediate abort
 	abort_timeslice();
 
@@ -863,6 +909,9 @@ void device_execute_interface::device_input::set_state_synced(int state, int vec
 if (TEMPLOG) printf("setline(%s,%d,%d,%d)\n", m_device->tag(), m_linenum, state, (vector == USE_STORED_VECTOR) ? 0 : vector);
 	assert(state == ASSERT_LINE || state == HOLD_LINE || state == CLEAR_LINE || state == PULSE_LINE);
 
+	// the event queue belongs to the device whose line this is
+	m_execute->device().machine().scheduler().serialize();
+
 	// treat PULSE_LINE as ASSERT+CLEAR
 	if (state == PULSE_LINE)
 	{
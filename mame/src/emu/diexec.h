@@ -115,6 +115,9 @@ enum
 #define MCFG_DEVICE_DISABLE() \
 	device_execute_interface::static_set_disable(*device); \
 
+#define MCFG_DEVICE_INDEPENDENT() \
+	device_execute_interface::static_set_independent(*device); \
+
 #define MCFG_DEVICE_VBLANK_INT(_tag, _func) \
 	device_execute_interface::static_set_vblank_int(*device, _func, _tag); \
 
@@ -152,6 +155,7 @@ public:
 
 	// configuration access
 	bool disabled() const { return m_disabled; }
+	bool independent() const { return m_independent; }
 	UINT64 clocks_to_cycles(UINT64 clocks) const { return execute_clocks_to_cycles(clocks); }
 	UINT64 cycles_to_clocks(UINT64 cycles) const { return execute_cycles_to_clocks(cycles); }
 	UINT32 min_cycles() const { return execute_min_cycles(); }
@@ -163,6 +167,7 @@ public:
 
 	// static inline configuration helpers
 	static void static_set_disable(device_t &device);
+	static void static_set_independent(device_t &device);
 	static void static_set_vblank_int(device_t &device, device_interrupt_func function, const char *tag, int rate = 0);
 	static void static_set_periodic_int(device_t &device, device_interrupt_func function, attotime rate);
 
@@ -275,6 +280,7 @@ protected:
 
 	// configuration
 	bool					m_disabled;					// disabled from executing?
+	bool					m_independent;				// may run in parallel with other independent devices?
 	device_interrupt_func	m_vblank_interrupt;			// for interrupts tied to VBLANK
 	int 					m_vblank_interrupts_per_frame;	// usually 1
 	const char *			m_vblank_interrupt_screen;	// the screen that causes the VBLANK interrupt
@@ -284,6 +290,11 @@ protected:
 	// execution lists
 	device_execute_interface *m_nextexec;				// pointer to the next device to execute, in order
 
+	// parallel execution state, only valid during a parallel timeslice
+	int						m_parallel_index;			// position in the parallel group
+	bool					m_parallel_turn;			// true once earlier devices in the group are done
+	bool					m_parallel_ran;				// true if the device ran at least one cycle
+
 	// input states and IRQ callbacks
 	device_irq_callback		m_driver_irq;				// driver-specific IRQ callback
 	device_input			m_input[MAX_INPUT_LINES];	// data about inputs
@@ -316,6 +327,15 @@ protected:
 	UINT32					m_cycles_per_second;		// cycles per second, adjusted for multipliers
 	attoseconds_t			m_attoseconds_per_cycle;	// attoseconds per adjusted clock cycle
 
+	// scheduler statistics, see device_scheduler::stats_report
+	UINT64					m_stat_timeslices;			// timeslices the device ran in
+	UINT64					m_stat_cycles_requested;	// cycles the scheduler asked it to run
+	UINT64					m_stat_cycles_executed;		// cycles it actually ran
+	UINT64					m_stat_cycles_suspended;	// cycles that passed while it was suspended
+	UINT64					m_stat_aborts;				// abort_timeslice calls that cut its slice short
+	UINT64					m_stat_waits;				// times it waited for its turn in a parallel slice
+	osd_ticks_t				m_stat_ticks;				// host time spent running it
+
 private:
 	// callbacks
 	static void static_timed_trigger_callback(running_machine &machine, void *ptr, int param);
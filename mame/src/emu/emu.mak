@@ -86,6 +86,20 @@ EMUOBJS = \
 	$(EMUOBJ)/mconfig.o \
 	$(EMUOBJ)/memory.o \
 	$(EMUOBJ)/NSM_Common.o \
+	$(EMUOBJ)/NSM_Delta.o \
+	$(EMUOBJ)/NSM_DirtyPages.o \
+	$(EMUOBJ)/NSM_InputDelay.o \
+	$(EMUOBJ)/NSM_InputFrames.o \
+	$(EMUOBJ)/NSM_InputHistory.o \
+	$(EMUOBJ)/NSM_InputTimeline.o \
+	$(EMUOBJ)/NSM_Metrics.o \
+	$(EMUOBJ)/NSM_NetworkThread.o \
+	$(EMUOBJ)/NSM_Recording.o \
+	$(EMUOBJ)/NSM_Rollback.o \
+	$(EMUOBJ)/NSM_Spectator.o \
+	$(EMUOBJ)/NSM_StateHash.o \
+	$(EMUOBJ)/NSM_SyncPipeline.o \
+	$(EMUOBJ)/NSM_TimeSync.o \
 	$(EMUOBJ)/NSM_Client.o \
 	$(EMUOBJ)/NSM_Server.o \
 	$(EMUOBJ)/output.o \
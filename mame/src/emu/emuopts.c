@@ -105,6 +105,7 @@ const options_entry emu_options::s_option_entries[] =
 	{ OPTION_SLEEP,                                      "1",         OPTION_BOOLEAN,    "enable sleeping, which gives time back to other applications when idle" },
 	{ OPTION_SPEED "(0.01-100)",                         "1.0",       OPTION_FLOAT,      "controls the speed of gameplay, relative to realtime; smaller numbers are slower" },
 	{ OPTION_REFRESHSPEED ";rs",                         "0",         OPTION_BOOLEAN,    "automatically adjusts the speed of gameplay to keep the refresh rate lower than the screen" },
+	{ OPTION_PARALLELCPU,                                "1",         OPTION_BOOLEAN,    "run devices the driver marks independent on separate threads" },
 
 	// rotation options
 	{ NULL,                                              NULL,        OPTION_HEADER,     "CORE ROTATION OPTIONS" },
@@ -181,6 +182,8 @@ const options_entry emu_options::s_option_entries[] =
 	{ OPTION_DEBUG ";d",                                 "0",         OPTION_BOOLEAN,    "enable/disable debugger" },
 	{ OPTION_DEBUGSCRIPT,                                NULL,        OPTION_STRING,     "script for debugger" },
 	{ OPTION_DEBUG_INTERNAL ";di",                       "0",         OPTION_BOOLEAN,    "use the internal debugger for debugging" },
+	{ OPTION_SCHEDSTATS,                                 "0",         OPTION_BOOLEAN,    "print per-device and per-timer scheduler statistics on exit" },
+	{ OPTION_STATEBENCH,                                 "0",         OPTION_INTEGER,    "on exit, time capturing and restoring the state in memory this many times" },
 
 	// misc options
 	{ NULL,                                              NULL,        OPTION_HEADER,     "CORE MISC OPTIONS" },
@@ -201,6 +204,27 @@ const options_entry emu_options::s_option_entries[] =
 	{ "selfport",               "5805",         OPTION_INTEGER,    "local port for other peers to connect to" },
 	{ "secondsbetweensync",               "30",         OPTION_INTEGER,    "Number of seconds to wait between syncs" },
 	{ "synctransferseconds",               "10",         OPTION_INTEGER,    "Number of seconds to spend transfering the sync" },
+	{ "synccodec",               "auto",         OPTION_STRING,    "Codec for syncs (auto, zlib or lz4), auto picks one from the compression time and bandwidth" },
+	{ "synccodeclevel",               "0",         OPTION_INTEGER,    "Level for a fixed sync codec (zlib: 1-9, lz4: acceleration), 0 for the default" },
+	{ "syncdump",               "0",         OPTION_BOOLEAN,    "Write every uncompressed sync to <game>_syncNNNN.bin (for nsmbench codecs)" },
+	{ "dirtypagetracking",               "0",         OPTION_BOOLEAN,    "Only scan memory pages written since the last sync (uses page protection)" },
+	{ "rollback",               "0",         OPTION_BOOLEAN,    "Predict late inputs and roll back instead of delaying inputs by the ping" },
+	{ "rollbackframes",               "8",         OPTION_INTEGER,    "Number of frames rollback may run ahead of the slowest peer" },
+	{ "inputstallprobability",               "0.01",         OPTION_FLOAT,    "Fraction of input packets a peer may get too late, the input delay adapts to it" },
+	{ "mininputdelay",               "50",         OPTION_INTEGER,    "Shortest input delay in milliseconds" },
+	{ "spectate",               "0",         OPTION_BOOLEAN,    "Watch the game instead of playing (with -client)" },
+	{ "relay",               "0",         OPTION_BOOLEAN,    "Spectate and pass the game on to other spectators (with -client)" },
+	{ "spectatorslots",               "4",         OPTION_INTEGER,    "Spectators the server or a relay sends the game to, the rest go to relays" },
+	{ "netrecord",               "",         OPTION_STRING,    "Record the netplay session to this file" },
+	{ "netreplay",               "",         OPTION_STRING,    "Play back a recorded netplay session instead of connecting (fastest with -nothrottle)" },
+	{ "netreplayseek",               "0",         OPTION_INTEGER,    "Start the replay from the last keyframe at or before this emulated second" },
+	{ "netbot",               "0",         OPTION_INTEGER,    "Play with scripted inputs from this seed instead of the controls (for soak tests), 0 to disable" },
+	{ "netsimloss",               "0",         OPTION_FLOAT,    "Percent of incoming input packets to drop (network impairment for testing)" },
+	{ "netsimlatency",               "0",         OPTION_INTEGER,    "Milliseconds to hold every incoming packet (network impairment for testing)" },
+	{ "netsimjitter",               "0",         OPTION_INTEGER,    "Up to this many extra milliseconds to hold every incoming packet (network impairment for testing)" },
+	{ "netloglevel",               "info",         OPTION_STRING,    "How much netplay writes to the console: error, warning, info, debug or trace" },
+	{ "netmetrics",               "",         OPTION_STRING,    "Append netplay metrics to this file (or named pipe) as a line of JSON every interval" },
+	{ "netmetricsinterval",               "1000",         OPTION_INTEGER,    "Milliseconds between lines of netplay metrics" },
 
 	{ NULL }
 };
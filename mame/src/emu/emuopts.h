@@ -117,6 +117,7 @@ enum
 #define OPTION_SLEEP				"sleep"
 #define OPTION_SPEED				"speed"
 #define OPTION_REFRESHSPEED			"refreshspeed"
+#define OPTION_PARALLELCPU			"parallelcpu"
 
 // core rotation options
 #define OPTION_ROTATE				"rotate"
@@ -185,6 +186,8 @@ enum
 #define OPTION_DEBUG				"debug"
 #define OPTION_DEBUG_INTERNAL		"debug_internal"
 #define OPTION_DEBUGSCRIPT			"debugscript"
+#define OPTION_SCHEDSTATS			"schedstats"
+#define OPTION_STATEBENCH			"statebench"
 
 // core misc options
 #define OPTION_BIOS					"bios"
@@ -203,6 +206,27 @@ enum
 #define OPTION_SELFPORT                "selfport"
 #define OPTION_SECONDSBETWEENSYNC      "secondsbetweensync"
 #define OPTION_SYNCTRANSFERSECONDS     "synctransferseconds"
+#define OPTION_SYNCCODEC               "synccodec"
+#define OPTION_SYNCCODECLEVEL          "synccodeclevel"
+#define OPTION_SYNCDUMP                "syncdump"
+#define OPTION_DIRTYPAGETRACKING       "dirtypagetracking"
+#define OPTION_ROLLBACK                "rollback"
+#define OPTION_ROLLBACKFRAMES          "rollbackframes"
+#define OPTION_INPUTSTALLPROBABILITY   "inputstallprobability"
+#define OPTION_MININPUTDELAY           "mininputdelay"
+#define OPTION_SPECTATE                "spectate"
+#define OPTION_RELAY                   "relay"
+#define OPTION_SPECTATORSLOTS          "spectatorslots"
+#define OPTION_NETRECORD               "netrecord"
+#define OPTION_NETREPLAY               "netreplay"
+#define OPTION_NETREPLAYSEEK           "netreplayseek"
+#define OPTION_NETBOT                  "netbot"
+#define OPTION_NETSIMLOSS              "netsimloss"
+#define OPTION_NETSIMLATENCY           "netsimlatency"
+#define OPTION_NETSIMJITTER            "netsimjitter"
+#define OPTION_NETLOGLEVEL             "netloglevel"
+#define OPTION_NETMETRICS              "netmetrics"
+#define OPTION_NETMETRICSINTERVAL      "netmetricsinterval"
 
 #define OPTION_CONFIRM_QUIT			"confirm_quit"
 
@@ -279,6 +303,7 @@ public:
 	bool sleep() const { return bool_value(OPTION_SLEEP); }
 	float speed() const { return float_value(OPTION_SPEED); }
 	bool refresh_speed() const { return bool_value(OPTION_REFRESHSPEED); }
+	bool parallel_cpu() const { return bool_value(OPTION_PARALLELCPU); }
 
 	// core rotation options
 	bool rotate() const { return bool_value(OPTION_ROTATE); }
@@ -344,6 +369,8 @@ public:
 	bool debug() const { return bool_value(OPTION_DEBUG); }
 	bool debug_internal() const { return bool_value(OPTION_DEBUG_INTERNAL); }
 	const char *debug_script() const { return value(OPTION_DEBUGSCRIPT); }
+	bool sched_stats() const { return bool_value(OPTION_SCHEDSTATS); }
+	int state_bench() const { return int_value(OPTION_STATEBENCH); }
 	bool update_in_pause() const { return bool_value(OPTION_UPDATEINPAUSE); }
 
 	// core misc options
@@ -365,6 +392,27 @@ public:
 	bool upnp() const { return bool_value(OPTION_UPNP); }
 	int secondsBetweenSync() const { return int_value(OPTION_SECONDSBETWEENSYNC); }
 	int syncTransferSeconds() const { return int_value(OPTION_SYNCTRANSFERSECONDS); }
+	const char *syncCodec() const { return value(OPTION_SYNCCODEC); }
+	int syncCodecLevel() const { return int_value(OPTION_SYNCCODECLEVEL); }
+	bool syncDump() const { return bool_value(OPTION_SYNCDUMP); }
+	bool dirtyPageTracking() const { return bool_value(OPTION_DIRTYPAGETRACKING); }
+	bool rollback() const { return bool_value(OPTION_ROLLBACK); }
+	int rollbackFrames() const { return int_value(OPTION_ROLLBACKFRAMES); }
+	float inputStallProbability() const { return float_value(OPTION_INPUTSTALLPROBABILITY); }
+	int minInputDelay() const { return int_value(OPTION_MININPUTDELAY); }
+	bool spectate() const { return bool_value(OPTION_SPECTATE); }
+	bool relay() const { return bool_value(OPTION_RELAY); }
+	int spectatorSlots() const { return int_value(OPTION_SPECTATORSLOTS); }
+	const char *netRecord() const { return value(OPTION_NETRECORD); }
+	const char *netReplay() const { return value(OPTION_NETREPLAY); }
+	int netReplaySeek() const { return int_value(OPTION_NETREPLAYSEEK); }
+	int netBot() const { return int_value(OPTION_NETBOT); }
+	float netSimLoss() const { return float_value(OPTION_NETSIMLOSS); }
+	int netSimLatency() const { return int_value(OPTION_NETSIMLATENCY); }
+	int netSimJitter() const { return int_value(OPTION_NETSIMJITTER); }
+	const char *netLogLevel() const { return value(OPTION_NETLOGLEVEL); }
+	const char *netMetrics() const { return value(OPTION_NETMETRICS); }
+	int netMetricsInterval() const { return int_value(OPTION_NETMETRICSINTERVAL); }
 
 	// device-specific options
 	const char *device_option(device_image_interface &image);
@@ -97,6 +97,8 @@
 
 #include "NSM_Server.h"
 #include "NSM_Client.h"
+#include "NSM_InputTimeline.h"
+#include "NSM_Rollback.h"
 
 #include "emu.h"
 #include "emuopts.h"
@@ -226,6 +228,7 @@ struct _input_field_state
 	UINT8						last;				/* were we pressed last time? */
 	UINT8						joydir;				/* digital joystick direction index */
 	char *						name;				/* overridden name */
+	int							timelineindex;		/* index of this field in the netplay input timeline */
 };
 
 
@@ -1352,6 +1355,7 @@ void input_type_set_seq(running_machine &machine, int type, int player, input_se
 
 extern Server *netServer;
 extern Client *netClient;
+extern InputTimeline playerInputTimeline;
 
 int input_type_pressed(running_machine &machine, int type, int player)
 {
@@ -1973,6 +1977,7 @@ static void init_port_state(running_machine &machine)
 	input_port_private *portdata = machine.input_port_data;
 	input_field_config *field;
 	input_port_config *port;
+	int numfields = 0;
 
 	/* allocate live structures to mirror the configuration */
 	for (port = machine.m_portlist.first(); port != NULL; port = port->next())
@@ -2000,6 +2005,7 @@ static void init_port_state(running_machine &machine)
 			/* allocate a new input_field_info structure */
 			fieldstate = auto_alloc_clear(machine, input_field_state);
 			((input_field_config *)field)->state = fieldstate;
+			fieldstate->timelineindex = numfields++;
 
 			/* fill in the basic values */
 			for (seqtype = 0; seqtype < ARRAY_LENGTH(fieldstate->seq); seqtype++)
@@ -2059,6 +2065,9 @@ static void init_port_state(running_machine &machine)
 		}
 	}
 
+	/* every field gets one timeline input per sequence type */
+	playerInputTimeline.setNumInputs(numfields * SEQ_TYPE_TOTAL);
+
 	/* handle autoselection of devices */
 	init_autoselect_devices(machine, IPT_PADDLE,      IPT_PADDLE_V,     0,              OPTION_PADDLE_DEVICE,     "paddle");
 	init_autoselect_devices(machine, IPT_AD_STICK_X,  IPT_AD_STICK_Y,   IPT_AD_STICK_Z, OPTION_ADSTICK_DEVICE,    "analog joystick");
@@ -2419,13 +2428,19 @@ static void input_port_update_hook(running_machine &machine, const input_port_co
 }
 
 
-std::map< attotime, std::map< pair<const input_field_config *,int> ,char> > playerInput;
-std::map< attotime, unsigned int > playerInputReceived;
+InputTimeline playerInputTimeline;
+vector< pair<int,string> > pendingInputReports;
 std::map<const input_field_config *,const input_field_config *> playerInputFieldMap[MAX_PLAYERS];
 extern attotime mostRecentReport;
 extern attotime mostRecentSentReport;
 attotime zeroInputMinTime(0,0);
 
+//Index of a field/sequence type pair in playerInputTimeline
+int playerInputIndex(const input_field_config *field,int seqtype)
+{
+    return field->state->timelineindex*SEQ_TYPE_TOTAL + seqtype;
+}
+
 /*-------------------------------------------------
     frame_update - core logic for per-frame input
     port updating
@@ -2442,6 +2457,13 @@ void deserializePlayerInputFromBuffer(running_machine &machine,int peerID,const
         return;
     }
 
+    if(!playerInputTimeline.hasGrid())
+    {
+        //We don't know the frame rate yet, hold on to this until we do
+        pendingInputReports.push_back(pair<int,string>(peerID,string(buf,len)));
+        return;
+    }
+
     //printf("Got input from %d\n",peerID);
 
 	attotime futureInputTime;
@@ -2467,15 +2489,13 @@ void deserializePlayerInputFromBuffer(running_machine &machine,int peerID,const
 	    }
 	}
 
-	if(playerInput.find(futureInputTime)==playerInput.end())
-	{
-	    playerInput[futureInputTime] = std::map< pair<const input_field_config *,int> ,char>();
-	}
-	if(playerInputReceived.find(futureInputTime)==playerInputReceived.end())
+	InputTimelineSlot *slot = playerInputTimeline.getSlot(futureInputTime);
+	if(!slot)
 	{
-	    playerInputReceived[futureInputTime] = 0;
+	    printf("ERROR: INPUT REPORT FROM PEER %d IS TOO OLD TO STORE\n",peerID);
+	    return;
 	}
-	playerInputReceived[futureInputTime] |= (1<<peerID);
+	playerInputTimeline.markReceived(slot,peerID,futureInputTime);
 
 	const input_port_config *port;
 
@@ -2517,21 +2537,22 @@ void deserializePlayerInputFromBuffer(running_machine &machine,int peerID,const
                 if(newfield)
                 {
                     //cout << "Des: " << field << " -> " << newfield << endl;
-                    if(playerInput[futureInputTime].find(pair<const input_field_config *,int>(newfield,SEQ_TYPE_STANDARD))!= playerInput[futureInputTime].end())
+                    int index = playerInputIndex(newfield,SEQ_TYPE_STANDARD);
+                    if(slot->hasInput(index))
                     {
                         //cout << "Input collision\n";
-                        if(playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_STANDARD)] != buf[bufPos])
+                        if(slot->getInput(index) != (buf[bufPos]!=0))
                             printf("ERROR: INPUT COLLISION: %d (%d)\n",newfield->type,field->type);
-                        playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_STANDARD)] |= buf[bufPos++];
+                        slot->orInput(index,buf[bufPos++]!=0);
                     }
                     else
                     {
-                        playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_STANDARD)] = buf[bufPos++];
+                        slot->setInput(index,buf[bufPos++]!=0);
                     }
                     if (field->state->analog != NULL)
                     {
-                        playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_INCREMENT)] = buf[bufPos++];
-                        playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_DECREMENT)] = buf[bufPos++];
+                        slot->setInput(playerInputIndex(newfield,SEQ_TYPE_INCREMENT),buf[bufPos++]!=0);
+                        slot->setInput(playerInputIndex(newfield,SEQ_TYPE_DECREMENT),buf[bufPos++]!=0);
                     }
                 }
                 else
@@ -2552,6 +2573,9 @@ void deserializePlayerInputFromBuffer(running_machine &machine,int peerID,const
         printf("BUFPOS != LEN: %d %d\n",bufPos,len);
     }
 
+    //If we already ran this frame on guessed inputs, see if we guessed right
+    playerInputTimeline.checkPredictions(slot);
+
     //cout << "Finished Deserializing input from peer " << peerID << endl;
     //cout.flush();
 }
@@ -2675,39 +2699,138 @@ void initializeInputMap(running_machine &machine)
 attoseconds_t attosecondsBetweenInputs=0;
 attotime lastTime(0,0);
 
+static void rollback_state_item(UINT8 *&saveBuffer,const UINT8 *&loadBuffer,int &size,void *value,int valueSize)
+{
+    if(saveBuffer)
+    {
+        memcpy(saveBuffer,value,valueSize);
+        saveBuffer += valueSize;
+    }
+    if(loadBuffer)
+    {
+        memcpy(value,loadBuffer,valueSize);
+        loadBuffer += valueSize;
+    }
+    size += valueSize;
+}
+
+#define ROLLBACK_STATE_ITEM(_val) rollback_state_item(saveBuffer,loadBuffer,size,&(_val),sizeof(_val))
+
+//Copies the live input state that isn't registered for save states, so a
+//rollback snapshot can rewind it too.  Returns the size of the state, both
+//buffers may be NULL to only get the size.
+int inputPortRollbackState(running_machine &machine,UINT8 *saveBuffer,const UINT8 *loadBuffer)
+{
+	input_port_private *portdata = machine.input_port_data;
+	const input_port_config *port;
+	int size=0;
+
+	for (port = machine.m_portlist.first(); port != NULL; port = port->next())
+	{
+		const input_field_config *field;
+		device_field_info *device_field;
+
+		ROLLBACK_STATE_ITEM(port->state->digital);
+		ROLLBACK_STATE_ITEM(port->state->vblank);
+		ROLLBACK_STATE_ITEM(port->state->outputvalue);
+		for (field = port->first_field(); field != NULL; field = field->next())
+		{
+			ROLLBACK_STATE_ITEM(field->state->value);
+			ROLLBACK_STATE_ITEM(field->state->impulse);
+			ROLLBACK_STATE_ITEM(field->state->last);
+			if (field->state->analog != NULL)
+			{
+				ROLLBACK_STATE_ITEM(field->state->analog->accum);
+				ROLLBACK_STATE_ITEM(field->state->analog->previous);
+				ROLLBACK_STATE_ITEM(field->state->analog->previousanalog);
+			}
+		}
+		for (device_field = port->state->writedevicelist; device_field != NULL; device_field = device_field->next)
+			ROLLBACK_STATE_ITEM(device_field->oldval);
+	}
+
+	for (int player = 0; player < MAX_PLAYERS; player++)
+		for (int joyindex = 0; joyindex < DIGITAL_JOYSTICKS_PER_PLAYER; joyindex++)
+		{
+			digital_joystick_state *joystick = &portdata->joystick_info[player][joyindex];
+			ROLLBACK_STATE_ITEM(joystick->current);
+			ROLLBACK_STATE_ITEM(joystick->current4way);
+			ROLLBACK_STATE_ITEM(joystick->previous);
+		}
+
+	ROLLBACK_STATE_ITEM(portdata->last_frame_time);
+	ROLLBACK_STATE_ITEM(portdata->last_delta_nsec);
+	ROLLBACK_STATE_ITEM(lastTime);
+	return size;
+}
+
+//Hashes the state on the first frame of every STATE_HASH_INTERVAL_FRAMES
+//window.  The hash is sent with our input frames once the rollback can't
+//rewind its frame anymore.
+static void update_state_hash(running_machine &machine,const attotime &previousTime,const attotime &curtime)
+{
+    Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+    attoseconds_t interval = attosecondsBetweenInputs*STATE_HASH_INTERVAL_FRAMES;
+    if(curtime.seconds!=previousTime.seconds || curtime.attoseconds/interval!=previousTime.attoseconds/interval)
+    {
+        netCommon->recordStateHash(curtime.seconds,curtime.attoseconds,machine.save().state_hash());
+    }
+
+    attotime confirmedTime = curtime;
+    if(netplayRollback.isEnabled())
+    {
+        attotime window = attotime(0,attosecondsBetweenInputs)*UINT32(netplayRollback.getMaxFrames()+1);
+        if(curtime<=window)
+            return;
+        confirmedTime = curtime-window;
+    }
+    netCommon->confirmStateHashes(confirmedTime.seconds,confirmedTime.attoseconds);
+}
+
+//Scripted presses for soak runs (-netbot).  Each input is held or released
+//for an eighth of a second at a time, picked by a hash of the seed, our peer
+//and the time, so the same seed plays the same way.
+static bool net_bot_pressed(int botSeed,int peerID,int inputIndex,const attotime &inputTime)
+{
+    UINT32 hash = UINT32(botSeed)*0x9E3779B1;
+    hash ^= UINT32(peerID)*0x85EBCA77;
+    hash ^= UINT32(inputIndex)*0xC2B2AE3D;
+    hash ^= UINT32(inputTime.seconds*8 + int(inputTime.attoseconds/(ATTOSECONDS_PER_SECOND/8)))*0x27D4EB2F;
+    hash ^= hash>>15;
+    hash *= 0x2C1B3C6D;
+    hash ^= hash>>12;
+    return (hash&3)==0;
+}
+
+//One of our inputs as the player (or the bot) has it pressed
+static bool net_seq_pressed(running_machine &machine,const input_field_config *field,const input_field_config *newfield,input_seq_type seqtype,int botSeed,int peerID,const attotime &inputTime)
+{
+    if(botSeed)
+        return net_bot_pressed(botSeed,peerID,playerInputIndex(newfield,seqtype),inputTime);
+    return machine.input().seq_pressed_raw(input_field_seq(field,seqtype));
+}
+
 static void frame_update(running_machine &machine)
 {
     //printf("INPUT PORT START\n");
 
-    if(netServer)
+    if(netServer && !netplayRollback.isResimulating())
     {
         //This line is here because it needs to run at about 60hz
         netServer->popSyncQueue();
     }
-    if(playerInputFieldMap[1].size()==0)
+    if((netServer || netClient) && !netplayRollback.isResimulating())
     {
-        initializeInputMap(machine);
+        //Once per frame, so spectators get a packet per frame and not one
+        //per input
+        Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+        netCommon->flushSpectatorFeed();
+        netCommon->recordFrame(machine.time().seconds,machine.time().attoseconds);
+        netCommon->countFrame();
     }
-
-    if(playerInput.size()>20000)
-    {
-        cout << "CLEANING UP PLAYER INPUT BUFFER\n";
-        std::map< attotime, std::map< pair<const input_field_config *,int> ,char> >::iterator it = playerInput.begin();
-        for(int a=0;a<10000;a++)
-        {
-            it++;
-        }
-        playerInput.erase(playerInput.begin(),it);
-    }
-    if(playerInputReceived.size()>20000)
+    if(playerInputFieldMap[1].size()==0)
     {
-        cout << "CLEANING UP PLAYER INPUT RECEIVED BUFFER\n";
-        std::map< attotime, unsigned int >::iterator it = playerInputReceived.begin();
-        for(int a=0;a<10000;a++)
-        {
-            it++;
-        }
-        playerInputReceived.erase(playerInputReceived.begin(),it);
+        initializeInputMap(machine);
     }
 
 	input_port_private *portdata = machine.input_port_data;
@@ -2719,13 +2842,25 @@ static void frame_update(running_machine &machine)
 
     if(lastTime.attoseconds!=0 && curtime.attoseconds>lastTime.attoseconds)
     {
-        if(attosecondsBetweenInputs==0) attosecondsBetweenInputs = curtime.attoseconds-lastTime.attoseconds;
+        if(attosecondsBetweenInputs==0)
+        {
+            attosecondsBetweenInputs = curtime.attoseconds-lastTime.attoseconds;
+
+            //Now that the frame rate is known, inputs can be stored by frame
+            playerInputTimeline.setGrid(lastTime,attosecondsBetweenInputs);
+            for(int a=0;a<(int)pendingInputReports.size();a++)
+            {
+                deserializePlayerInputFromBuffer(machine,pendingInputReports[a].first,pendingInputReports[a].second.data(),pendingInputReports[a].second.length());
+            }
+            pendingInputReports.clear();
+        }
         else if(attosecondsBetweenInputs != (curtime.attoseconds-lastTime.attoseconds))
         {
             cout << "ERROR: INPUT SPACING IS VARIABLE!\n";
             exit(1);
         }
     }
+	attotime previousTime = lastTime;
 	lastTime = curtime;
 
 	//cout << "Getting inputs at: " << curtime.seconds << '.' << curtime.attoseconds << endl;
@@ -2735,28 +2870,39 @@ static void frame_update(running_machine &machine)
         peerID = netServer->getSelfPeerID();
     if(netClient)
         peerID = netClient->getSelfPeerID();
-    if( (netServer || netClient) && peerID==0)
+    //Spectators have no ID, they only play back the players' inputs
+    bool spectating = (netClient && netClient->isSpectating());
+    int botSeed = (netServer || netClient)?machine.options().netBot():0;
+    if( (netServer || netClient) && peerID==0 && !spectating)
     {
-        printf("DON'T HAVE AN ID YET\n");
+        NETLOG(NETLOG_DEBUG,("DON'T HAVE AN ID YET\n"));
         //Not sure what to do if you don't hae an ID yet...
         return;
     }
 
-	int delayFromPing=50;
-	if(netClient)
-	{
-	    delayFromPing = max(delayFromPing,min(600,20+netClient->getLargestPing()/2));
-	}
-	if(netServer)
-	{
-	    delayFromPing = max(delayFromPing,min(600,20+netServer->getLargestPing()/2));
-	}
-	//if(options_get_int(mame_options(), OPTION_FIXED_LATENCY))
-	//delayFromPing = 200;
-	attoseconds_t attosecondsToLead = ATTOSECONDS_PER_MILLISECOND*delayFromPing;
+    if((netServer || netClient) && attosecondsBetweenInputs && !spectating)
+    {
+        update_state_hash(machine,previousTime,curtime);
+    }
+    if((netServer || netClient) && !spectating)
+    {
+        Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+        netCommon->updateTimeSync(curtime.seconds,curtime.attoseconds);
+    }
+
+	//Our inputs are stamped this far ahead so they reach every peer in time
+	attoseconds_t attosecondsToLead = ATTOSECONDS_PER_MILLISECOND*50;
 	if(attosecondsBetweenInputs)
 	{
-	    attosecondsToLead = (((ATTOSECONDS_PER_MILLISECOND*delayFromPing)+(attosecondsBetweenInputs-1))/attosecondsBetweenInputs)*attosecondsBetweenInputs;
+	    int leadFrames = int((attosecondsToLead+(attosecondsBetweenInputs-1))/attosecondsBetweenInputs);
+	    if((netServer || netClient) && !spectating)
+	    {
+	        Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+	        //Late inputs are fixed by rolling back, so don't hide the delay
+	        int fixedLead = netplayRollback.isEnabled()?ROLLBACK_INPUT_DELAY_FRAMES:0;
+	        leadFrames = netCommon->updateInputLead(ATTOSECONDS_TO_DOUBLE(attosecondsBetweenInputs)*1000.0,fixedLead);
+	    }
+	    attosecondsToLead = attosecondsBetweenInputs*leadFrames;
 	}
 	if(futureInputTime.attoseconds >= (ATTOSECONDS_PER_SECOND - attosecondsToLead ))
 	{
@@ -2780,18 +2926,11 @@ static void frame_update(running_machine &machine)
     */
 
     bool processRawInput=false;
+    InputTimelineSlot *futureSlot=NULL;
     if(mostRecentSentReport<futureInputTime)
     {
         processRawInput=true;
-	if(playerInput.find(futureInputTime)==playerInput.end())
-	{
-            playerInput[futureInputTime] = std::map< pair<const input_field_config *,int> ,char>();
-	}
-	if(playerInputReceived.find(futureInputTime)==playerInputReceived.end())
-	{
-	    playerInputReceived[futureInputTime] = 0;
-	}
-        //playerInputReceived[futureInputTime] |= (1 << peerID);
+        futureSlot = playerInputTimeline.getSlot(futureInputTime);
     }
     else
     {
@@ -2804,6 +2943,10 @@ static void frame_update(running_machine &machine)
     {
         processRawInput=true;
     }
+    if(spectating)
+    {
+        processRawInput=false;
+    }
 
 	render_target *mouse_target;
 	INT32 mouse_target_x;
@@ -2882,7 +3025,7 @@ g_profiler.start(PROFILER_INPUT);
 		    if((netServer && field->player==0) || (netClient && field->player==0))
 		    {
 		        const input_field_config *newfield = NULL;
-		        if(netClient)
+		        if(netClient && peerID>0)
 		        {
 		            std::map<const input_field_config *,const input_field_config *>::iterator it = playerInputFieldMap[peerID-1].find(field);
 		            if(it != playerInputFieldMap[peerID-1].end())
@@ -2911,7 +3054,7 @@ g_profiler.start(PROFILER_INPUT);
                     if(netClient && zeroInputMinTime>=curtime)
                     {
                         //Just create a dummy report
-                        //Note that are aren't setting playerInput, this is because we need to use our own inputs as appropriate
+                        //Note that are aren't setting playerInputTimeline, this is because we need to use our own inputs as appropriate
                         //cout << "Ser: " << newfield << ',' << field << endl;
                         sendBuf[sendBufLength++] = 0;
                         if (field->state->analog != NULL)
@@ -2933,26 +3076,26 @@ g_profiler.start(PROFILER_INPUT);
                     {
                         //cout << "Ser: " << newfield << ',' << field << endl;
                     if(
-                       playerInput[futureInputTime].find(pair<const input_field_config *,int>(newfield,SEQ_TYPE_STANDARD)) !=
-                       playerInput[futureInputTime].end()
+                       futureSlot &&
+                       futureSlot->hasInput(playerInputIndex(newfield,SEQ_TYPE_STANDARD))
                        )
                     {
-                        cout << "Overwriting existing input!\n";
-                        sendBuf[sendBufLength++] = (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_STANDARD));
-                        playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_STANDARD)] |= (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_STANDARD));
+                        NETLOG(NETLOG_DEBUG,("Overwriting existing input!\n"));
+                        sendBuf[sendBufLength++] = (char)net_seq_pressed(machine,field,newfield,SEQ_TYPE_STANDARD,botSeed,peerID,futureInputTime);
+                        futureSlot->orInput(playerInputIndex(newfield,SEQ_TYPE_STANDARD),net_seq_pressed(machine,field,newfield,SEQ_TYPE_STANDARD,botSeed,peerID,futureInputTime));
                         if (newfield->state->analog != NULL)
                         {
-                            sendBuf[sendBufLength++] = playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_INCREMENT)] |= (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_INCREMENT));
-                            sendBuf[sendBufLength++] = playerInput[futureInputTime][pair<const input_field_config *,int>(newfield,SEQ_TYPE_DECREMENT)] |= (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_DECREMENT));
+                            sendBuf[sendBufLength++] = (char)futureSlot->orInput(playerInputIndex(newfield,SEQ_TYPE_INCREMENT),net_seq_pressed(machine,field,newfield,SEQ_TYPE_INCREMENT,botSeed,peerID,futureInputTime));
+                            sendBuf[sendBufLength++] = (char)futureSlot->orInput(playerInputIndex(newfield,SEQ_TYPE_DECREMENT),net_seq_pressed(machine,field,newfield,SEQ_TYPE_DECREMENT,botSeed,peerID,futureInputTime));
                         }
                     }
                     else
                     {
-                        sendBuf[sendBufLength++] = (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_STANDARD));
+                        sendBuf[sendBufLength++] = (char)net_seq_pressed(machine,field,newfield,SEQ_TYPE_STANDARD,botSeed,peerID,futureInputTime);
                         if (newfield->state->analog != NULL)
                         {
-                            sendBuf[sendBufLength++] = (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_INCREMENT));
-                            sendBuf[sendBufLength++] = (char)machine.input().seq_pressed_raw(input_field_seq(field,SEQ_TYPE_DECREMENT));
+                            sendBuf[sendBufLength++] = (char)net_seq_pressed(machine,field,newfield,SEQ_TYPE_INCREMENT,botSeed,peerID,futureInputTime);
+                            sendBuf[sendBufLength++] = (char)net_seq_pressed(machine,field,newfield,SEQ_TYPE_DECREMENT,botSeed,peerID,futureInputTime);
                         }
                     }
 		        }
@@ -51,6 +51,8 @@
 
 #include "NSM_Server.h"
 #include "NSM_Client.h"
+#include "NSM_InputTimeline.h"
+#include "NSM_Rollback.h"
 
 #include "emu.h"
 #include "emuopts.h"
@@ -1740,13 +1742,15 @@ input_code input_manager::code_from_token(const char *_token)
 //  of switch inputs is "pressed"
 //-------------------------------------------------
 
-extern std::map< attotime, std::map< pair<const input_field_config *,int> ,char> > playerInput;
+extern InputTimeline playerInputTimeline;
+extern int playerInputIndex(const input_field_config *field,int seqtype);
 
 extern Client *netClient;
 extern Server *netServer;
 
 void processNetworkBuffer(running_machine *machine,Common *netCommon,const string &buffer,int peerID);
 bool hasFutureInputToProcess(running_machine *machine,attotime curtime);
+extern int inputStallPeerID;
 bool inputSequenceFrozen=false;
 
 attotime lastMissedTime(0,0);
@@ -1757,8 +1761,6 @@ bool input_manager::seq_pressed(const input_field_config* field, int seqtypeint)
     if(!netClient && !netServer)
         return seq_pressed_raw(input_field_seq(field,seqtype));
 
-    pair<const input_field_config *,int> fieldTypePair(field,seqtypeint);
-
 	attotime curtime = machine().time();
 
     if(netServer || netClient)
@@ -1801,33 +1803,39 @@ bool input_manager::seq_pressed(const input_field_config* field, int seqtypeint)
 
             netServer->update(&(machine()));
 
+            bool stalled=false;
             while(hasFutureInputToProcess(&(machine()),curtime)==false)
             {
+                if(!stalled)
+                {
+                    stalled=true;
+                    netServer->beginInputStall(inputStallPeerID);
+                }
                 //cout << "STUCK IN INPUT SEQUENCE\n";
                 ui_update_and_render(machine(), &(machine().render().ui_container()));
                 machine().osd().update(false);
 
                 netServer->update(&(machine()));
+                bool gotInput=false;
                 {
-                    string buffer = netServer->popSelfInputBuffer();
+                    const string &buffer = netServer->popSelfInputBuffer();
+                    gotInput |= !buffer.empty();
                     processNetworkBuffer(&(machine()),netServer,buffer,netServer->getSelfPeerID());
                 }
                 for(int a=0; a<netServer->getNumOtherPeers(); a++)
                 {
                     if(netServer->getOtherPeerID(a))
                     {
-                        string buffer = netServer->popInputBuffer(a);
+                        const string &buffer = netServer->popInputBuffer(a);
+                        gotInput |= !buffer.empty();
                         processNetworkBuffer(&(machine()),netServer,buffer,netServer->getOtherPeerID(a));
                     }
                 }
 
+                if(!gotInput)
                 {
                     //cout << "Waiting for packet\n";
-#ifdef _WIN32
-                    Sleep(0);
-#else
-                    usleep(0);
-#endif
+                    netServer->waitForInputs(inputStallPeerID);
                 }
             }
 
@@ -1841,8 +1849,14 @@ bool input_manager::seq_pressed(const input_field_config* field, int seqtypeint)
             }
 
             //printf("IN CLIENT LOOP\n");
+            bool stalled=false;
             while(hasFutureInputToProcess(&(machine()),curtime)==false)
             {
+                if(!stalled)
+                {
+                    stalled=true;
+                    netClient->beginInputStall(inputStallPeerID);
+                }
                 //cout << "UPDATING NETCLIENT\n";
 
                 // draw the user interface
@@ -1856,86 +1870,49 @@ bool input_manager::seq_pressed(const input_field_config* field, int seqtypeint)
                     printf("CONNECTION LOST\n");
                     exit(1);
                 }
+                bool gotInput=false;
                 {
-                    string buffer = netClient->popSelfInputBuffer();
+                    const string &buffer = netClient->popSelfInputBuffer();
+                    gotInput |= !buffer.empty();
                     processNetworkBuffer(&(machine()),netClient,buffer,netClient->getSelfPeerID());
                 }
                 for(int a=0; a<netClient->getNumOtherPeers(); a++)
                 {
                     if(netClient->getOtherPeerID(a))
                     {
-                        string buffer = netClient->popInputBuffer(a);
+                        const string &buffer = netClient->popInputBuffer(a);
+                        gotInput |= !buffer.empty();
                         processNetworkBuffer(&(machine()),netClient,buffer,netClient->getOtherPeerID(a));
                     }
                 }
 
+                if(!gotInput)
                 {
                     //cout << "Waiting for packet\n";
-#ifdef _WIN32
-                    Sleep(0);
-#else
-                    usleep(0);
-#endif
+                    netClient->waitForInputs(inputStallPeerID);
                 }
             }
         }
     }
 
-	std::map< attotime, std::map< pair<const input_field_config *,int>, char> >::reverse_iterator it = playerInput.rbegin();
-    std::map< attotime, std::map< pair<const input_field_config *,int>, char> >::reverse_iterator itold = playerInput.rbegin();
-
-    int mostRecentFutureValue=2;
-
-	while(true)
-	{
-	    if(it==playerInput.rend())
-	    {
-	        if(curtime.seconds)
-                std::cout << "ERROR: COULDN'T FIND INPUT FOR TIME" << curtime.seconds << '.' << curtime.attoseconds << '\n';
-            mostRecentFutureValue=0;
-			return mostRecentFutureValue;
-	    }
-	    //std::cout << "Checking at " << it->first.seconds << '.' << it->first.attoseconds << std::endl;
-	    if(it->first<curtime)
-	    {
-	        if(it==itold)
-	        {
-                if(curtime.seconds)
-                    std::cout << "ERROR: COULDN'T FIND INPUT FOR TIME" << curtime.seconds << '.' << curtime.attoseconds << '\n';
-                mostRecentFutureValue=0;
-	            return mostRecentFutureValue>0;
-	        }
-            //std::cout << "COULDN'T FIND EXACT INPUT FOR TIME " << curtime.seconds << '.' << curtime.attoseconds
-            //<< ". USING " << itold->first.seconds << '.' << itold->first.attoseconds
-            //<< ". (" << it->first.seconds << '.' << it->first.attoseconds << ")"
-            //<< std::endl;
-	        if(mostRecentFutureValue==2)
-	        {
-	            if(curtime.seconds && curtime>lastMissedTime)
-	            {
-	                lastMissedTime = curtime;
-                    std::cout << "ERROR: COULDN'T FIND INPUT FOR TIME" << curtime.seconds << '.' << curtime.attoseconds << '\n';
-                    std::cout << field << ' ' << int(field->player) << ' ' << field->type << ' ' << field->category << endl;
-	            }
-	            mostRecentFutureValue=0;
-	        }
-	        return mostRecentFutureValue>0;
-	    }
-	    else if(it->first==curtime && it->second.find(fieldTypePair) != it->second.end())
+    //Use the report for this frame, or the closest later one that has this input
+    int value = playerInputTimeline.findInput(curtime,playerInputIndex(field,seqtypeint));
+    if(value<0 && netplayRollback.isEnabled())
+    {
+        //The barrier let us run ahead of this peer, guess and fix it up later
+        return playerInputTimeline.predictInput(curtime,playerInputIndex(field,seqtypeint));
+    }
+    if(value<0)
+    {
+        if(curtime.seconds && curtime>lastMissedTime)
         {
-            return it->second[fieldTypePair];
+            lastMissedTime = curtime;
+            std::cout << "ERROR: COULDN'T FIND INPUT FOR TIME" << curtime.seconds << '.' << curtime.attoseconds << '\n';
+            std::cout << field << ' ' << int(field->player) << ' ' << field->type << ' ' << field->category << endl;
         }
-	    else if(it->second.find(fieldTypePair) != it->second.end())
-	    {
-	        mostRecentFutureValue = it->second[fieldTypePair];
-	    }
-
-	    itold = it;
-	    it++;
-	}
-	printf("ERROR GETTING INPUT SEQUENCE\n");
-	exit(1);
-	//return input_seq_pressed_raw(machine,seq);
+        return false;
+    }
+    return value>0;
 }
 
 bool input_manager::seq_pressed_raw(const input_seq &seq)
@@ -133,6 +133,8 @@ extern "C"
 
 #include "NSM_Server.h"
 #include "NSM_Client.h"
+#include "NSM_InputTimeline.h"
+#include "NSM_Rollback.h"
 
 #include "emu.h"
 #include "emuopts.h"
@@ -413,8 +415,7 @@ device_t &running_machine::add_dynamic_device(device_t &owner, device_type type,
 
 extern Server *netServer;
 extern Client *netClient;
-extern std::map< attotime, std::map<const input_seq*,char> > playerInput;
-extern std::map< attotime, unsigned int > playerInputReceived;
+extern InputTimeline playerInputTimeline;
 attotime mostRecentReport(0,0);
 attotime mostRecentSentReport(0,0);
 extern list< ChatLog > chatLogs;
@@ -427,6 +428,10 @@ extern attotime zeroInputMinTime;
 
 attotime lastTimePassed(0,0);
 
+//The peer whose input hasFutureInputToProcess was missing the last time it
+//returned false, the input barrier charges the wait to this peer.
+int inputStallPeerID=0;
+
 bool hasFutureInputToProcess(running_machine *machine,attotime curtime)
 {
     //Bump up the time to MAKE SURE we have everyone's input
@@ -456,7 +461,7 @@ bool hasFutureInputToProcess(running_machine *machine,attotime curtime)
 
     static time_t realtime = time(NULL);
     bool printDebug=false;
-    if(printDebug || realtime != time(NULL))
+    if(netLogLevel>=NETLOG_TRACE && realtime != time(NULL))
     {
         printDebug=true;
         cout << "Checking for input at time         " << curtime.seconds << '.' << curtime.attoseconds << endl;
@@ -467,6 +472,12 @@ bool hasFutureInputToProcess(running_machine *machine,attotime curtime)
     if(netServer) peerIDs = netServer->getPeerIDs();
     if(netClient) peerIDs = netClient->getPeerIDs();
 
+    //The server's checkpoints must not depend on a guess either
+    int checkpointSeconds=0;
+    if(netServer) checkpointSeconds = netServer->getCheckpointSeconds();
+    if(netClient) checkpointSeconds = netClient->getCheckpointSeconds();
+    attotime predictionStart = netplayRollback.getPredictionStart(curtime,checkpointSeconds);
+
     for(int a=0; a<(int)peerIDs.size(); a++)
     {
         if(curtime.seconds<1)
@@ -484,71 +495,40 @@ bool hasFutureInputToProcess(running_machine *machine,attotime curtime)
         }
         }
 
-        if(playerInputReceived.size()<=2)
+        if(playerInputTimeline.getNumFrames()<=2)
         {
             if(printDebug)
                 cout << "Peer " << peerIDs[a] << " has not enough inputs!\n";
-#ifdef _WIN32
-            Sleep(0);
-#else
-            usleep(0);
-#endif
+            inputStallPeerID = peerIDs[a];
             return false;
         }
 
-        std::map< attotime, unsigned int >::reverse_iterator it = playerInputReceived.rbegin();
-        it++;
-        while(true)
+        //Reports from a peer are ordered, so only their latest one matters.
+        //With rollback we only need reports up to the oldest frame we may
+        //still predict.
+        attotime reportTime;
+        if(playerInputTimeline.hasFutureInput(peerIDs[a],predictionStart,reportTime)==false)
         {
-            if(it==playerInputReceived.rend())
+            if(reportTime==attotime::zero)
             {
                 if(printDebug)
                     cout << "Peer " << peerIDs[a] << " has no valid inputs!\n";
                 //if there are no packets, we are still waiting for this guy to send something
-#ifdef _WIN32
-                Sleep(0);
-#else
-                usleep(0);
-#endif
-                return false;
             }
-            if(it->first<=curtime && (it->second&(1<<peerIDs[a])))
+            else
             {
                 if(printDebug)
                 {
-                    cout << "Peer " << peerIDs[a] << " has only old input at time: " << it->first.seconds << '.' << it->first.attoseconds << "!\n";
+                    cout << "Peer " << peerIDs[a] << " has only old input at time: " << reportTime.seconds << '.' << reportTime.attoseconds << "!\n";
                 }
-                oldInputTime = it->first;
-#ifdef _WIN32
-                Sleep(0);
-#else
-                usleep(0);
-#endif
+                oldInputTime = reportTime;
                 //These packets are too old, we need something newer
-                return false;
-                /*
-                if(it==itold)
-                {
-                    //All of the packets are too old, we need something newer
-                    return false;
-                }
-                if(itold->second&(1<<peerIDs[a]))
-                {
-                    //We have a packet in the future from this guy, he's good
-                    break;
-                }
-                */
             }
-            else if(it->second&(1<<peerIDs[a]))
-            {
-                if(printDebug)
-                    cout << "Peer " << peerIDs[a] << " has input at time: " << it->first.seconds << '.' << it->first.attoseconds << "!\n";
-                //We have a report from the future and we know packets are ordered, we're good
-                break;
-            }
-
-            it++;
+            inputStallPeerID = peerIDs[a];
+            return false;
         }
+        if(printDebug)
+            cout << "Peer " << peerIDs[a] << " has input at time: " << reportTime.seconds << '.' << reportTime.attoseconds << "!\n";
     }
 
     //Every peer is OK, we are good to go!
@@ -633,17 +613,53 @@ int running_machine::run(bool firstrun)
             add_logerror_callback(logfile_callback);
         }
 
-        //Set up client/server as appropriate
-        if(options().client())
+        int logLevel = netLogLevelFromName(options().netLogLevel());
+        if(logLevel<0)
+            printf("UNKNOWN NET LOG LEVEL %s, USING INFO\n",options().netLogLevel());
+        else
+            netLogLevel = logLevel;
+
+        //Set up client/server as appropriate, a replay is a client that
+        //reads a recording
+        bool netReplay = (options().netReplay()[0]!=0);
+        if(options().client() || netReplay)
         {
             deleteGlobalClient();
             createGlobalClient(options().username());
+            if(options().dirtyPageTracking())
+                netClient->enableDirtyPageTracking();
+            netClient->setInputDelayTarget(options().inputStallProbability(),options().minInputDelay());
+            if(!netReplay && (options().spectate() || options().relay()))
+                netClient->setSpectator(options().relay());
+            netClient->setSpectatorSlots(options().spectatorSlots());
+            netClient->setNetworkImpairment(options().netSimLoss(),options().netSimLatency(),options().netSimJitter());
         }
         else if(options().server())
         {
             deleteGlobalServer();
             createGlobalServer(options().username(),(unsigned short)options().port());
             netServer->setSyncTransferTime(options().syncTransferSeconds());
+            int syncCodec = syncCodecFromName(options().syncCodec());
+            if(syncCodec<0 && strcmp(options().syncCodec(),"auto"))
+                printf("UNKNOWN SYNC CODEC %s, PICKING ONE AUTOMATICALLY\n",options().syncCodec());
+            netServer->setSyncCodec(syncCodec,options().syncCodecLevel());
+            if(options().syncDump())
+                netServer->setSyncDumpPrefix(basename());
+            if(options().dirtyPageTracking())
+                netServer->enableDirtyPageTracking();
+            netServer->setInputDelayTarget(options().inputStallProbability(),options().minInputDelay());
+            netServer->setSpectatorSlots(options().spectatorSlots());
+            netServer->setNetworkImpairment(options().netSimLoss(),options().netSimLatency(),options().netSimJitter());
+        }
+        if(options().netRecord()[0] && (netServer || (netClient && !netReplay)))
+        {
+            Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+            netCommon->startRecording(options().netRecord(),basename());
+        }
+        if(options().netMetrics()[0] && (netServer || netClient))
+        {
+            Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+            netCommon->startMetricsExport(options().netMetrics(),options().netMetricsInterval());
         }
 
         //Try to use upnp to forward ports
@@ -743,6 +759,8 @@ int running_machine::run(bool firstrun)
             //else //JJG: Even if save state support isn't complete, we should try to sync what we can.
             {
                 netServer->setSecondsBetweenSync(options().secondsBetweenSync());
+                if(primary_screen)
+                    netServer->setSyncFrameTime(primary_screen->frame_period().as_double()*1000.0);
             }
         }
         if(netClient)
@@ -764,7 +782,7 @@ int running_machine::run(bool firstrun)
             {
                 return MAMERR_NETWORK;
             }
-            netServer->sync();
+            netServer->sync(0);
         }
 
 
@@ -779,12 +797,20 @@ int running_machine::run(bool firstrun)
             //handle_load(machine);
             //if(netClient->getSecondsBetweenSync())
                 //doPreSave(this);
-            bool retval = netClient->initializeConnection(
+            bool retval;
+            if(netReplay)
+            {
+                retval = netClient->openReplay(options().netReplay(),options().netReplaySeek(),this);
+            }
+            else
+            {
+                retval = netClient->initializeConnection(
                               (unsigned short)options().selfport(),
                               options().hostname(),
                               (unsigned short)options().port(),
                               this
                           );
+            }
             printf("LOADED CLIENT\n");
             cout << "RAND/TIME AT INITIAL SYNC: " << m_rand_seed << ' ' << m_base_time << endl;
             if(!retval)
@@ -822,9 +848,23 @@ int running_machine::run(bool firstrun)
                 //if(!netClient->update(this)) exit(1);
                 //netClient->revert(this);
             }
+            //Start from the server's checkpoint instead of replaying every input since it started
+            netClient->loadCheckpoint(this);
         }
         //doPostLoad(this);
 
+        if((netServer || netClient) && options().rollback())
+        {
+            if((system().flags & GAME_SUPPORTS_SAVE) == 0)
+            {
+                ui_popup_time(10, "This game does not have complete save state support, rollback is disabled.");
+            }
+            else
+            {
+                netplayRollback.initialize(this,options().rollbackFrames());
+            }
+        }
+
 
         // run the CPUs until a reset or exit
         m_hard_reset_pending = false;
@@ -837,7 +877,10 @@ int running_machine::run(bool firstrun)
 
             // execute CPUs if not paused
             if (!m_paused)
+            {
                 m_scheduler.timeslice();
+                netplayRollback.captureFrame();
+            }
 
             // otherwise, just pump video updates through
             else
@@ -857,7 +900,7 @@ int running_machine::run(bool firstrun)
                    )
                 {
                     lastSyncSecond = timeNow.seconds;
-                    printf("SERVER SYNC AT TIME: %d\n",int(::time(NULL)));
+                    NETLOG(NETLOG_DEBUG,("SERVER SYNC AT TIME: %d\n",int(::time(NULL))));
                     if (!m_scheduler.can_save())
                     {
                         printf("ANONYMOUS TIMER! COULD NOT DO FULL SYNC\n");
@@ -865,11 +908,27 @@ int running_machine::run(bool firstrun)
                     else
                     {
                         m_save.doPreSave();
-                        netServer->sync();
-                        cout << "RAND/TIME AT SYNC: " << m_rand_seed << ' ' << m_base_time << endl;
+                        netServer->sync(timeNow.seconds);
+                        NETLOG(NETLOG_DEBUG,("RAND/TIME AT SYNC: %u %d\n",m_rand_seed,int(m_base_time)));
                         m_save.doPostLoad();
                     }
                 }
+                static int lastCheckpointSecond = 0;
+                Common *checkpointer = netServer;
+                if(netClient && netClient->isRelay())
+                    checkpointer = netClient;
+                if(
+                   checkpointer &&
+                   lastCheckpointSecond != timeNow.seconds &&
+                   timeNow.attoseconds==0 &&
+                   (timeNow.seconds%checkpointer->getCheckpointSeconds())==0
+                   )
+                {
+                    //Late joiners (and a relay's spectators) start here,
+                    //older inputs are dropped
+                    lastCheckpointSecond = timeNow.seconds;
+                    checkpointer->captureCheckpoint(this);
+                }
                 if(
                    netClient &&
                    timeNow.attoseconds==0 &&
@@ -887,12 +946,39 @@ int running_machine::run(bool firstrun)
                     {
                         //The client should update sync check just in case the server didn't have an anon timer
                         m_save.doPreSave();
-                        netClient->updateSyncCheck();
-                        cout << "RAND/TIME AT SYNC: " << m_rand_seed << ' ' << m_base_time << endl;
+                        netClient->updateSyncCheck(timeNow.seconds);
+                        NETLOG(NETLOG_DEBUG,("RAND/TIME AT SYNC: %u %d\n",m_rand_seed,int(m_base_time)));
                         m_save.doPostLoad();
                     }
                 }
 
+                Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+                static int lastKeyframeSecond = -1;
+                if(netCommon && netCommon->isRecording())
+                {
+                    if(netCommon->needsRecordingKeyframe())
+                    {
+                        //The state didn't come from the inputs (recording
+                        //started or we resynced), a replay loads it
+                        netCommon->recordKeyframe(this,RECORDING_KEYFRAME_SYNC);
+                    }
+                    else if(
+                        lastKeyframeSecond != timeNow.seconds &&
+                        timeNow.attoseconds==0 &&
+                        (timeNow.seconds%netCommon->getCheckpointSeconds())==0
+                        )
+                    {
+                        //Replays are checked against these, and seek to them
+                        lastKeyframeSecond = timeNow.seconds;
+                        netCommon->recordKeyframe(this,RECORDING_KEYFRAME_PERIODIC);
+                    }
+                }
+                if(netClient && netClient->isReplaying())
+                {
+                    //Same place the keyframes are recorded
+                    netClient->applyReplayKeyframe(this);
+                }
+
                 static clock_t lastSyncTime=clock();
                 if(netServer || netClient)
                 {
@@ -902,8 +988,14 @@ int running_machine::run(bool firstrun)
                     {
                         netServer->update(this);
 
+                        bool stalled=false;
                         while(hasFutureInputToProcess(this,time())==false)
                         {
+                            if(!stalled)
+                            {
+                                stalled=true;
+                                netServer->beginInputStall(inputStallPeerID);
+                            }
                             if(waitingForClientCatchup)
                             {
                                 ui_update_and_render(*this, &render().ui_container());
@@ -911,19 +1003,30 @@ int running_machine::run(bool firstrun)
                             }
 
                             netServer->update(this);
+                            bool gotInput=false;
                             {
-                                string buffer = netServer->popSelfInputBuffer();
+                                const string &buffer = netServer->popSelfInputBuffer();
+                                gotInput |= !buffer.empty();
                                 processNetworkBuffer(this,netServer,buffer,netServer->getSelfPeerID());
                             }
                             for(int a=0; a<netServer->getNumOtherPeers(); a++)
                             {
                                 if(netServer->getOtherPeerID(a))
                                 {
-                                    string buffer = netServer->popInputBuffer(a);
+                                    const string &buffer = netServer->popInputBuffer(a);
+                                    gotInput |= !buffer.empty();
                                     processNetworkBuffer(this,netServer,buffer,netServer->getOtherPeerID(a));
                                 }
                             }
+
+                            if(!gotInput)
+                            {
+                                //Nothing new came in, sleep until RakNet hands us a packet
+                                netServer->waitForInputs(inputStallPeerID);
+                            }
                         }
+                        if(stalled)
+                            netServer->endInputStall();
 
                     }
                     if(netClient)
@@ -936,12 +1039,21 @@ int running_machine::run(bool firstrun)
                             {
                                 printf("ANONYMOUS TIMER! THIS COULD BE BAD (BUT HOPEFULLY ISN'T)\n");
                             }
-                            cout << "GOT SYNC FROM SERVER\n";
-                            cout << "RAND/TIME AT SYNC: " << m_rand_seed << ' ' << m_base_time << endl;
+                            //The server's state replaced ours, older snapshots are useless now
+                            netplayRollback.reset();
+                            netClient->requestRecordingKeyframe();
+                            NETLOG(NETLOG_DEBUG,("GOT SYNC FROM SERVER\n"));
+                            NETLOG(NETLOG_DEBUG,("RAND/TIME AT SYNC: %u %d\n",m_rand_seed,int(m_base_time)));
                         }
 
+                        bool stalled=false;
                         while(hasFutureInputToProcess(this,time())==false)
                         {
+                            if(!stalled)
+                            {
+                                stalled=true;
+                                netClient->beginInputStall(inputStallPeerID);
+                            }
                             if(waitingForClientCatchup)
                             {
                                 ui_update_and_render(*this, &render().ui_container());
@@ -953,43 +1065,72 @@ int running_machine::run(bool firstrun)
                             survivedAndGotSync.first = netClient->update(this);
                             if(survivedAndGotSync.first==false)
                             {
-                                error = MAMERR_NETWORK;
+                                //The end of a replay is the end of the session
+                                error = netClient->isReplaying()?MAMERR_NONE:MAMERR_NETWORK;
                                 m_exit_pending = true;
                                 break;
                             }
+                            bool gotInput=false;
                             {
-                                string buffer = netClient->popSelfInputBuffer();
+                                const string &buffer = netClient->popSelfInputBuffer();
+                                gotInput |= !buffer.empty();
                                 processNetworkBuffer(this,netClient,buffer,netClient->getSelfPeerID());
                             }
                             for(int a=0; a<netClient->getNumOtherPeers(); a++)
                             {
                                 if(netClient->getOtherPeerID(a))
                                 {
-                                    string buffer = netClient->popInputBuffer(a);
+                                    const string &buffer = netClient->popInputBuffer(a);
+                                    gotInput |= !buffer.empty();
                                     processNetworkBuffer(this,netClient,buffer,netClient->getOtherPeerID(a));
                                 }
                             }
 
+                            if(!gotInput)
                             {
                                 //cout << "Waiting for packet\n";
-#ifdef _WIN32
-                                Sleep(0);
-#else
-                                usleep(0);
-#endif
+                                netClient->waitForInputs(inputStallPeerID);
                             }
                         }
+                        if(stalled)
+                            netClient->endInputStall();
                     }
+
+                    //Fix any frames that were run on a wrong guess
+                    if(!m_paused)
+                        netplayRollback.rollbackIfNeeded();
                 }
             }
 
             // handle save/load
             if (m_saveload_schedule != SLS_NONE)
+            {
                 handle_saveload();
+                netplayRollback.reset();
+            }
 
 			g_profiler.stop();
         }
 
+        if(netServer || netClient)
+        {
+            //Soak runs (src/tools/nsmsoak.c) read this from the log
+            Common *netCommon = netServer?(Common*)netServer:(Common*)netClient;
+            printf("NETPLAY SUMMARY: %s\n",netCommon->getSummaryString().c_str());
+        }
+        // tuning MCFG_QUANTUM_TIME and perfect interleave starts from these
+        if (options().sched_stats())
+        {
+            astring report;
+            mame_printf_info("%s", m_scheduler.stats_report(report));
+        }
+        if (options().state_bench() > 0)
+        {
+            astring report;
+            mame_printf_info("%s", m_save.benchmark_snapshots(options().state_bench(), report));
+        }
+
+        netplayRollback.shutdown();
         deleteGlobalClient();
         deleteGlobalServer();
 
@@ -1326,6 +1467,9 @@ void running_machine::current_datetime(system_time &systime)
 
 UINT32 running_machine::rand()
 {
+    // the seed is shared between devices
+    m_scheduler.serialize();
+
     m_rand_seed = 1664525 * m_rand_seed + 1013904223;
 
     // return rotated by 16 bits; the low bits have a short period
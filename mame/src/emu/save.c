@@ -40,11 +40,20 @@
     Save state file format:
 
     00..07  'MAMESAVE'
-    08      Format version (this is format 2)
+    08      Format version (this is format 3)
     09      Flags
     0A..1B  Game name padded with \0
     1C..1F  Signature
-    20..end Save game data (compressed)
+    20..23  Size of the save game data, uncompressed
+    24..27  Size of a chunk of it (the last one may be shorter)
+    28..    Compressed size of each chunk, 0 if it is stored as is
+    ..end   The chunks, each one a zlib stream of its own
+
+    The chunks are compressed and decompressed in parallel. Format 2
+    files, where the data after 0x20 is a single zlib stream, can still
+    be loaded.
+
+    Sizes are little-endian.
 
     Data is always written as native-endian.
     Data is converted from the endiannness it was written upon load.
@@ -53,6 +62,7 @@
 
 #include "NSM_Server.h"
 #include "NSM_Client.h"
+#include "NSM_Delta.h"
 
 extern Server *netServer;
 extern Client *netClient;
@@ -76,8 +86,10 @@ extern Client *netClient;
 //  CONSTANTS
 //**************************************************************************
 
-const int SAVE_VERSION		= 2;
+const int SAVE_VERSION		= 3;
+const int SAVE_VERSION_STREAM = 2;			// one zlib stream for all the data
 const int HEADER_SIZE		= 32;
+const UINT32 CHUNK_SIZE		= 256 * 1024;	// save game data per chunk
 
 // Available flags
 enum
@@ -87,6 +99,22 @@ enum
 
 
 
+//**************************************************************************
+//  TYPE DEFINITIONS
+//**************************************************************************
+
+struct save_manager::save_chunk
+{
+	const UINT8 *		m_source;				// data to compress or decompress
+	UINT32				m_source_size;			// bytes of it
+	UINT8 *				m_dest;					// where the result goes
+	UINT32				m_dest_size;			// room there, then the result's size
+	bool				m_stored;				// true if the chunk is not compressed
+	bool				m_ok;					// true once it worked
+};
+
+
+
 //**************************************************************************
 //  GLOBAL VARIABLES
 //**************************************************************************
@@ -105,6 +133,10 @@ save_manager::save_manager(running_machine &machine)
 	: m_machine(machine),
 	  m_reg_allowed(true),
 	  m_illegal_regs(0),
+	  m_snapshot_runs(NULL),
+	  m_snapshot_run_count(0),
+	  m_snapshot_size(0),
+	  m_chunk_queue(NULL),
 	  m_entry_list(machine.respool()),
 	  m_presave_list(machine.respool()),
 	  m_postload_list(machine.respool())
@@ -112,6 +144,17 @@ save_manager::save_manager(running_machine &machine)
 }
 
 
+//-------------------------------------------------
+//  ~save_manager - destructor
+//-------------------------------------------------
+
+save_manager::~save_manager()
+{
+	if (m_chunk_queue != NULL)
+		osd_work_queue_free(m_chunk_queue);
+}
+
+
 //-------------------------------------------------
 //  allow_registration - allow/disallow
 //  registrations to happen
@@ -122,7 +165,10 @@ void save_manager::allow_registration(bool allowed)
 	// allow/deny registration
 	m_reg_allowed = allowed;
 	if (!allowed)
+	{
 		dump_registry();
+		build_snapshot_layout();
+	}
 }
 
 
@@ -279,13 +325,12 @@ save_error save_manager::read_file(emu_file &file)
 	if (m_illegal_regs > 0)
 		return STATERR_ILLEGAL_REGISTRATIONS;
 
-	// read the header and turn on compression for the rest of the file
+	// read the header
 	file.compress(FCOMPRESS_NONE);
 	file.seek(0, SEEK_SET);
 	UINT8 header[HEADER_SIZE];
 	if (file.read(header, sizeof(header)) != sizeof(header))
 		return STATERR_READ_ERROR;
-	file.compress(FCOMPRESS_MEDIUM);
 
 	// verify the header and report an error if it doesn't match
 	UINT32 sig = signature();
@@ -295,18 +340,43 @@ save_error save_manager::read_file(emu_file &file)
 	// determine whether or not to flip the data when done
 	bool flip = NATIVE_ENDIAN_VALUE_LE_BE((header[9] & SS_MSB_FIRST) != 0, (header[9] & SS_MSB_FIRST) == 0);
 
-	// read all the data, flipping if necessary
-	for (state_entry *entry = m_entry_list.first(); entry != NULL; entry = entry->next())
+	// the file layer may write straight into the entries, so stop tracking netplay pages
+	if(netServer) netServer->invalidateDirtyPages();
+	if(netClient) netClient->invalidateDirtyPages();
+
+	// older files are one zlib stream, read straight into the entries
+	if (header[8] == SAVE_VERSION_STREAM)
 	{
-		UINT32 totalsize = entry->m_typesize * entry->m_typecount;
-		if (file.read(entry->m_data, totalsize) != totalsize)
-			return STATERR_READ_ERROR;
+		file.compress(FCOMPRESS_MEDIUM);
+		for (state_entry *entry = m_entry_list.first(); entry != NULL; entry = entry->next())
+		{
+			UINT32 totalsize = entry->m_typesize * entry->m_typecount;
+			if (file.read(entry->m_data, totalsize) != totalsize)
+				return STATERR_READ_ERROR;
+		}
+	}
 
-		// handle flipping
-		if (flip)
-			entry->flip_data();
+	// newer ones decompress in parallel and are then copied in like a snapshot
+	else
+	{
+		UINT8 *data = global_alloc_array(UINT8, MAX(m_snapshot_size, 1));
+		save_error error = read_chunks(file, data);
+		if (error == STATERR_NONE)
+			for (int runnum = 0; runnum < m_snapshot_run_count; runnum++)
+			{
+				const snapshot_run &run = m_snapshot_runs[runnum];
+				memcpy(run.m_data, data + run.m_offset, run.m_size);
+			}
+		global_free(data);
+		if (error != STATERR_NONE)
+			return error;
 	}
 
+	// handle flipping
+	if (flip)
+		for (state_entry *entry = m_entry_list.first(); entry != NULL; entry = entry->next())
+			entry->flip_data();
+
 	// call the post-load functions
 	for (state_callback *func = m_postload_list.first(); func != NULL; func = func->next())
 		func->m_func();
@@ -321,7 +391,7 @@ save_error save_manager::read_file(emu_file &file)
 
 void save_manager::doPreSave()
 {
-	printf("DOING PRE SAVE\n");
+	NETLOG(NETLOG_DEBUG,("DOING PRE SAVE\n"));
 
 	// call the pre-save functions
 	for (state_callback *func = m_presave_list.first(); func != NULL; func = func->next())
@@ -343,28 +413,421 @@ save_error save_manager::write_file(emu_file &file)
 	UINT32 sig = signature();
 	*(UINT32 *)&header[0x1c] = LITTLE_ENDIANIZE_INT32(sig);
 
-	// write the header and turn on compression for the rest of the file
+	// write the header; the chunks are compressed on their own
 	file.compress(FCOMPRESS_NONE);
 	file.seek(0, SEEK_SET);
 	if (file.write(header, sizeof(header)) != sizeof(header))
 		return STATERR_WRITE_ERROR;
-	file.compress(FCOMPRESS_MEDIUM);
+
+	// gather the data like a snapshot (this calls the pre-save functions), then
+	// compress and write it
+	UINT8 *data = global_alloc_array(UINT8, MAX(m_snapshot_size, 1));
+	save_error error = save_snapshot(data);
+	if (error == STATERR_NONE)
+		error = write_chunks(file, data);
+	global_free(data);
+	return error;
+}
+
+
+//-------------------------------------------------
+//  write_chunks - compress the save game data in
+//  chunks, in parallel, and write them out
+//-------------------------------------------------
+
+save_error save_manager::write_chunks(emu_file &file, const UINT8 *data)
+{
+	int count = (m_snapshot_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	UINT32 bound = compressBound(CHUNK_SIZE);
+	save_chunk *chunks = global_alloc_array_clear(save_chunk, MAX(count, 1));
+	UINT8 *compressed = global_alloc_array(UINT8, MAX(count, 1) * bound);
+
+	for (int chunknum = 0; chunknum < count; chunknum++)
+	{
+		save_chunk &chunk = chunks[chunknum];
+		chunk.m_source = data + chunknum * CHUNK_SIZE;
+		chunk.m_source_size = MIN(CHUNK_SIZE, m_snapshot_size - chunknum * CHUNK_SIZE);
+		chunk.m_dest = compressed + chunknum * bound;
+		chunk.m_dest_size = bound;
+	}
+	run_chunks(compress_chunk, chunks, count);
+
+	// the sizes come first, so a reader can fetch every chunk before decompressing any
+	save_error error = STATERR_NONE;
+	UINT32 sizes[2] = { LITTLE_ENDIANIZE_INT32(m_snapshot_size), LITTLE_ENDIANIZE_INT32(CHUNK_SIZE) };
+	if (file.write(sizes, sizeof(sizes)) != sizeof(sizes))
+		error = STATERR_WRITE_ERROR;
+	for (int chunknum = 0; chunknum < count && error == STATERR_NONE; chunknum++)
+	{
+		UINT32 size = LITTLE_ENDIANIZE_INT32(chunks[chunknum].m_stored ? 0 : chunks[chunknum].m_dest_size);
+		if (file.write(&size, sizeof(size)) != sizeof(size))
+			error = STATERR_WRITE_ERROR;
+	}
+	for (int chunknum = 0; chunknum < count && error == STATERR_NONE; chunknum++)
+	{
+		const save_chunk &chunk = chunks[chunknum];
+		const UINT8 *source = chunk.m_stored ? chunk.m_source : chunk.m_dest;
+		UINT32 size = chunk.m_stored ? chunk.m_source_size : chunk.m_dest_size;
+		if (file.write(source, size) != size)
+			error = STATERR_WRITE_ERROR;
+	}
+
+	global_free(compressed);
+	global_free(chunks);
+	return error;
+}
+
+
+//-------------------------------------------------
+//  read_chunks - read the chunks of save game
+//  data and decompress them in parallel
+//-------------------------------------------------
+
+save_error save_manager::read_chunks(emu_file &file, UINT8 *data)
+{
+	// the signature matched, so the size can only be off in a damaged file
+	UINT32 sizes[2];
+	if (file.read(sizes, sizeof(sizes)) != sizeof(sizes))
+		return STATERR_READ_ERROR;
+	UINT32 datasize = LITTLE_ENDIANIZE_INT32(sizes[0]);
+	UINT32 chunksize = LITTLE_ENDIANIZE_INT32(sizes[1]);
+	if (datasize != m_snapshot_size || (datasize > 0 && chunksize == 0))
+		return STATERR_READ_ERROR;
+	if (datasize == 0)
+		return STATERR_NONE;
+
+	int count = (datasize + chunksize - 1) / chunksize;
+	UINT32 *table = global_alloc_array(UINT32, count);
+	save_chunk *chunks = global_alloc_array_clear(save_chunk, count);
+	UINT8 *compressed = NULL;
+	save_error error = STATERR_NONE;
+
+	// work out where each chunk is, and read them all at once
+	UINT32 total = 0;
+	if (file.read(table, count * sizeof(table[0])) != count * sizeof(table[0]))
+		error = STATERR_READ_ERROR;
+	for (int chunknum = 0; chunknum < count && error == STATERR_NONE; chunknum++)
+	{
+		save_chunk &chunk = chunks[chunknum];
+		chunk.m_dest = data + chunknum * chunksize;
+		chunk.m_dest_size = MIN(chunksize, datasize - chunknum * chunksize);
+		chunk.m_source_size = LITTLE_ENDIANIZE_INT32(table[chunknum]);
+		chunk.m_stored = (chunk.m_source_size == 0);
+		if (chunk.m_stored)
+			chunk.m_source_size = chunk.m_dest_size;
+		else if (chunk.m_source_size > compressBound(chunk.m_dest_size))
+			error = STATERR_READ_ERROR;
+		total += chunk.m_source_size;
+	}
+	if (error == STATERR_NONE)
+	{
+		compressed = global_alloc_array(UINT8, total);
+		if (file.read(compressed, total) != total)
+			error = STATERR_READ_ERROR;
+	}
+
+	// then decompress them in parallel
+	if (error == STATERR_NONE)
+	{
+		UINT32 offset = 0;
+		for (int chunknum = 0; chunknum < count; chunknum++)
+		{
+			chunks[chunknum].m_source = compressed + offset;
+			offset += chunks[chunknum].m_source_size;
+		}
+		run_chunks(decompress_chunk, chunks, count);
+		for (int chunknum = 0; chunknum < count; chunknum++)
+			if (!chunks[chunknum].m_ok)
+				error = STATERR_READ_ERROR;
+	}
+
+	if (compressed != NULL)
+		global_free(compressed);
+	global_free(chunks);
+	global_free(table);
+	return error;
+}
+
+
+//-------------------------------------------------
+//  run_chunks - call back for every chunk on the
+//  work queue, and wait until all are done
+//-------------------------------------------------
+
+void save_manager::run_chunks(osd_work_callback callback, save_chunk *chunks, int count)
+{
+	if (count == 0)
+		return;
+
+	// the threads are started the first time a state is saved or loaded
+	if (m_chunk_queue == NULL)
+		m_chunk_queue = osd_work_queue_alloc(WORK_QUEUE_FLAG_MULTI);
+
+	// this thread helps out while it waits; the buffers must outlive every item
+	if (m_chunk_queue != NULL)
+	{
+		osd_work_item_queue_multiple(m_chunk_queue, callback, count, chunks, sizeof(chunks[0]), WORK_ITEM_FLAG_AUTO_RELEASE);
+		while (!osd_work_queue_wait(m_chunk_queue, osd_ticks_per_second()))
+			;
+	}
+	else
+		for (int chunknum = 0; chunknum < count; chunknum++)
+			(*callback)(&chunks[chunknum], 0);
+}
+
+
+//-------------------------------------------------
+//  compress_chunk - work queue callback that
+//  compresses one chunk, or stores it as is if
+//  that doesn't make it smaller
+//-------------------------------------------------
+
+void *save_manager::compress_chunk(void *param, int threadid)
+{
+	save_chunk &chunk = *reinterpret_cast<save_chunk *>(param);
+	uLongf size = chunk.m_dest_size;
+	chunk.m_stored = (compress2(chunk.m_dest, &size, chunk.m_source, chunk.m_source_size, FCOMPRESS_MEDIUM) != Z_OK || size >= chunk.m_source_size);
+	chunk.m_dest_size = size;
+	chunk.m_ok = true;
+	return NULL;
+}
+
+
+//-------------------------------------------------
+//  decompress_chunk - work queue callback that
+//  decompresses one chunk
+//-------------------------------------------------
+
+void *save_manager::decompress_chunk(void *param, int threadid)
+{
+	save_chunk &chunk = *reinterpret_cast<save_chunk *>(param);
+	if (chunk.m_stored)
+	{
+		memcpy(chunk.m_dest, chunk.m_source, chunk.m_dest_size);
+		chunk.m_ok = true;
+		return NULL;
+	}
+
+	uLongf size = chunk.m_dest_size;
+	chunk.m_ok = (uncompress(chunk.m_dest, &size, chunk.m_source, chunk.m_source_size) == Z_OK && size == chunk.m_dest_size);
+	return NULL;
+}
+
+
+//-------------------------------------------------
+//  build_snapshot_layout - work out where each
+//  entry goes in a snapshot, and which entries
+//  can be copied together
+//-------------------------------------------------
+
+void save_manager::build_snapshot_layout()
+{
+	if (m_snapshot_runs != NULL)
+		auto_free(machine(), m_snapshot_runs);
+	m_snapshot_runs = NULL;
+	m_snapshot_run_count = 0;
+	m_snapshot_size = 0;
+	if (m_entry_list.count() == 0)
+		return;
+
+	// entries are in name order; the ones that also follow each other in memory
+	// (the members of a struct, say) join the run before them
+	m_snapshot_runs = auto_alloc_array(machine(), snapshot_run, m_entry_list.count());
+	snapshot_run *run = NULL;
+	for (state_entry *entry = m_entry_list.first(); entry != NULL; entry = entry->next())
+	{
+		UINT32 totalsize = entry->m_typesize * entry->m_typecount;
+		entry->m_offset = m_snapshot_size;
+		m_snapshot_size += totalsize;
+
+		if (run != NULL && run->m_data + run->m_size == entry->m_data)
+			run->m_size += totalsize;
+		else
+		{
+			run = &m_snapshot_runs[m_snapshot_run_count++];
+			run->m_data = (UINT8 *)entry->m_data;
+			run->m_offset = entry->m_offset;
+			run->m_size = totalsize;
+		}
+	}
+}
+
+
+//-------------------------------------------------
+//  save_snapshot - copy the state into memory;
+//  data must hold snapshot_size() bytes
+//-------------------------------------------------
+
+save_error save_manager::save_snapshot(UINT8 *data, int *changed)
+{
+	// if we have illegal registrations, return an error
+	if (m_illegal_regs > 0)
+		return STATERR_ILLEGAL_REGISTRATIONS;
 
 	// call the pre-save functions
 	for (state_callback *func = m_presave_list.first(); func != NULL; func = func->next())
 		func->m_func();
 
-	// then write all the data
-	for (state_entry *entry = m_entry_list.first(); entry != NULL; entry = entry->next())
+	// then copy all the data
+	if (changed == NULL)
 	{
-		UINT32 totalsize = entry->m_typesize * entry->m_typecount;
-		if (file.write(entry->m_data, totalsize) != totalsize)
-			return STATERR_WRITE_ERROR;
+		for (int runnum = 0; runnum < m_snapshot_run_count; runnum++)
+		{
+			const snapshot_run &run = m_snapshot_runs[runnum];
+			memcpy(data + run.m_offset, run.m_data, run.m_size);
+		}
+	}
+
+	// or only what changed since data was last saved into
+	else
+	{
+		*changed = 0;
+		for (int runnum = 0; runnum < m_snapshot_run_count; runnum++)
+		{
+			const snapshot_run &run = m_snapshot_runs[runnum];
+			if (memcmp(data + run.m_offset, run.m_data, run.m_size) != 0)
+			{
+				memcpy(data + run.m_offset, run.m_data, run.m_size);
+				(*changed)++;
+			}
+		}
 	}
 	return STATERR_NONE;
 }
 
 
+//-------------------------------------------------
+//  load_snapshot - restore a state that was
+//  copied by save_snapshot
+//-------------------------------------------------
+
+save_error save_manager::load_snapshot(const UINT8 *data, int *changed)
+{
+	// if we have illegal registrations, return an error
+	if (m_illegal_regs > 0)
+		return STATERR_ILLEGAL_REGISTRATIONS;
+
+	// copy all the data back
+	if (changed == NULL)
+	{
+		for (int runnum = 0; runnum < m_snapshot_run_count; runnum++)
+		{
+			const snapshot_run &run = m_snapshot_runs[runnum];
+			memcpy(run.m_data, data + run.m_offset, run.m_size);
+		}
+	}
+
+	// or only what differs; memory that isn't written stays clean for the
+	// netplay dirty page tracker and in the host's caches
+	else
+	{
+		*changed = 0;
+		for (int runnum = 0; runnum < m_snapshot_run_count; runnum++)
+		{
+			const snapshot_run &run = m_snapshot_runs[runnum];
+			if (memcmp(run.m_data, data + run.m_offset, run.m_size) != 0)
+			{
+				memcpy(run.m_data, data + run.m_offset, run.m_size);
+				(*changed)++;
+			}
+		}
+	}
+
+	// call the post-load functions
+	for (state_callback *func = m_postload_list.first(); func != NULL; func = func->next())
+		func->m_func();
+
+	return STATERR_NONE;
+}
+
+
+//-------------------------------------------------
+//  benchmark_snapshots - time capturing and
+//  restoring the current state count times each
+//-------------------------------------------------
+
+const char *save_manager::benchmark_snapshots(int count, astring &string)
+{
+	string.printf("State snapshots: %d entries in %d runs, %d bytes\n", m_entry_list.count(), m_snapshot_run_count, m_snapshot_size);
+
+	// restoring throws away anonymous timers, so they must not be pending
+	if (!machine().scheduler().can_save())
+		return string.cat("  not measured: anonymous timers are pending, try again later\n");
+	if (count <= 0 || m_snapshot_size == 0)
+		return string;
+
+	state_snapshot full(*this);
+	state_snapshot tracked(*this, true);
+	double us_per_tick = 1000000.0 / (double)osd_ticks_per_second();
+	static const char *const names[] = { "save", "load", "save, changes only", "load, changes only" };
+	osd_ticks_t total[ARRAY_LENGTH(names)] = { 0 };
+	osd_ticks_t best[ARRAY_LENGTH(names)] = { 0 };
+
+	// each pass saves into and loads the same state, so the machine doesn't move
+	for (int pass = 0; pass < count; pass++)
+		for (int test = 0; test < ARRAY_LENGTH(names); test++)
+		{
+			osd_ticks_t start = osd_ticks();
+			save_error error;
+			switch (test)
+			{
+				default:
+				case 0:	error = full.save();		break;
+				case 1:	error = full.load();		break;
+				case 2:	error = tracked.save();		break;
+				case 3:	error = tracked.load();		break;
+			}
+			osd_ticks_t ticks = osd_ticks() - start;
+			if (error != STATERR_NONE)
+				return string.cat("  not measured: the state has illegal registrations\n");
+
+			total[test] += ticks;
+			if (pass == 0 || ticks < best[test])
+				best[test] = ticks;
+		}
+
+	for (int test = 0; test < ARRAY_LENGTH(names); test++)
+		string.catprintf("  %-20s %10.2f us average, %10.2f us best\n", names[test],
+				(double)total[test] * us_per_tick / (double)count, (double)best[test] * us_per_tick);
+	string.cat("  nothing runs between passes, so changes only is the cost of comparing an unchanged state\n");
+	return string;
+}
+
+
+//-------------------------------------------------
+//  state_hash - hash every registered entry so
+//  netplay peers can compare their states
+//-------------------------------------------------
+
+UINT64 save_manager::state_hash()
+{
+	// the registered data is only current after the pre-save functions ran
+	for (state_callback *func = m_presave_list.first(); func != NULL; func = func->next())
+		func->m_func();
+
+	// the netplay blocks cover every entry; the ones that weren't written
+	// since the last sync keep the hash it computed
+	UINT64 hash = 0;
+	if (netServer != NULL)
+		hash = netServer->stateHash();
+	else if (netClient != NULL)
+		hash = netClient->stateHash();
+
+	// otherwise fold in each entry's hash; the multiply makes the result depend on order
+	else
+		for (state_entry *entry = m_entry_list.first(); entry != NULL; entry = entry->next())
+		{
+			UINT32 totalsize = entry->m_typesize * entry->m_typecount;
+			hash = (hash ^ hashBlock64((const unsigned char *)entry->m_data, totalsize)) * U64(0x9e3779b97f4a7c15);
+		}
+
+	// leave the machine as a save followed by a load of the same state would,
+	// so hashing (also while a rollback resimulates) has no side effects of its own
+	doPostLoad();
+	return hash;
+}
+
+
 //-------------------------------------------------
 //  signature - compute the signature, which
 //  is a CRC over the structure of the data
@@ -417,8 +880,8 @@ save_error save_manager::validate_header(const UINT8 *header, const char *gamena
 		return STATERR_INVALID_HEADER;
 	}
 
-	// check save state version
-	if (header[8] != SAVE_VERSION)
+	// check save state version; single stream files from before chunks are fine too
+	if (header[8] != SAVE_VERSION && header[8] != SAVE_VERSION_STREAM)
 	{
 		if (errormsg != NULL)
 			(*errormsg)("%sWrong version in save file (version %d, expected %d)", error_prefix, header[8], SAVE_VERSION);
@@ -448,6 +911,60 @@ save_error save_manager::validate_header(const UINT8 *header, const char *gamena
 }
 
 
+//-------------------------------------------------
+//  state_snapshot - constructor
+//-------------------------------------------------
+
+state_snapshot::state_snapshot(save_manager &manager, bool track_changes)
+	: m_manager(manager),
+	  m_data(NULL),
+	  m_size(manager.snapshot_size()),
+	  m_track_changes(track_changes),
+	  m_valid(false),
+	  m_changed(0)
+{
+	// changes are found against what the arena holds, so start it out zeroed
+	if (m_size > 0)
+		m_data = global_alloc_array_clear(UINT8, m_size);
+}
+
+
+//-------------------------------------------------
+//  ~state_snapshot - destructor
+//-------------------------------------------------
+
+state_snapshot::~state_snapshot()
+{
+	if (m_data != NULL)
+		global_free(m_data);
+}
+
+
+//-------------------------------------------------
+//  save - capture the current state
+//-------------------------------------------------
+
+save_error state_snapshot::save()
+{
+	save_error error = m_manager.save_snapshot(m_data, m_track_changes ? &m_changed : NULL);
+	if (error == STATERR_NONE)
+		m_valid = true;
+	return error;
+}
+
+
+//-------------------------------------------------
+//  load - go back to the captured state
+//-------------------------------------------------
+
+save_error state_snapshot::load()
+{
+	if (!m_valid)
+		return STATERR_READ_ERROR;
+	return m_manager.load_snapshot(m_data, m_track_changes ? &m_changed : NULL);
+}
+
+
 //-------------------------------------------------
 //  state_callback - constructor
 //-------------------------------------------------
@@ -127,6 +127,7 @@ class save_manager
 public:
 	// construction/destruction
 	save_manager(running_machine &machine);
+	~save_manager();
 
 	// getters
 	running_machine &machine() const { return m_machine; }
@@ -185,16 +186,34 @@ public:
 
     void doPreSave();
     void doPostLoad();
-    
+
+	// in-memory snapshots (no header, native byte order); the layout is fixed
+	// when registration closes, and if changed is given only the stretches
+	// that differ from the other side are copied, and counted there
+	UINT32 snapshot_size() const { return m_snapshot_size; }
+	save_error save_snapshot(UINT8 *data, int *changed = NULL);
+	save_error load_snapshot(const UINT8 *data, int *changed = NULL);
+	const char *benchmark_snapshots(int count, astring &string);
+	UINT64 state_hash();
+
 	// file processing
 	static save_error check_file(running_machine &machine, emu_file &file, const char *gamename, void (CLIB_DECL *errormsg)(const char *fmt, ...));
 	save_error write_file(emu_file &file);
 	save_error read_file(emu_file &file);
 
 private:
+	// one piece of a save state file, compressed or decompressed on its own
+	struct save_chunk;
+
 	// internal helpers
 	UINT32 signature() const;
 	void dump_registry() const;
+	void build_snapshot_layout();
+	save_error write_chunks(emu_file &file, const UINT8 *data);
+	save_error read_chunks(emu_file &file, UINT8 *data);
+	void run_chunks(osd_work_callback callback, save_chunk *chunks, int count);
+	static void *compress_chunk(void *param, int threadid);
+	static void *decompress_chunk(void *param, int threadid);
 	static save_error validate_header(const UINT8 *header, const char *gamename, UINT32 signature, void (CLIB_DECL *errormsg)(const char *fmt, ...), const char *error_prefix);
 
 	// state callback item
@@ -233,11 +252,26 @@ private:
 		UINT32				m_offset;				// offset within the final structure
 	};
 
+	// a stretch of registered memory that goes to one place in a snapshot;
+	// entries that follow each other in memory share one
+	struct snapshot_run
+	{
+		UINT8 *				m_data;					// first byte in memory
+		UINT32				m_offset;				// offset within the snapshot
+		UINT32				m_size;					// number of bytes
+	};
+
 	// internal state
 	running_machine &		m_machine;				// reference to our machine
 	bool					m_reg_allowed;			// are registrations allowed?
 	int						m_illegal_regs;			// number of illegal registrations
 
+	snapshot_run *			m_snapshot_runs;		// snapshot layout, in entry order
+	int						m_snapshot_run_count;	// number of runs
+	UINT32					m_snapshot_size;		// bytes in a snapshot
+
+	osd_work_queue *		m_chunk_queue;			// compresses save state chunks in parallel
+
 	simple_list<state_entry> m_entry_list;			// list of reigstered entries
 	simple_list<state_callback> m_presave_list;		// list of pre-save functions
 	simple_list<state_callback> m_postload_list;	// list of post-load functions
@@ -246,6 +280,41 @@ private:
 };
 
 
+// ======================> state_snapshot
+
+// the whole machine state in one block of memory, allocated up front, so
+// rewind, rollback and test harnesses can capture and restore it cheaply
+class state_snapshot
+{
+	// we don't support deep copying
+	DISABLE_COPYING(state_snapshot);
+
+public:
+	// construction/destruction; allocate once registration is closed
+	state_snapshot(save_manager &manager, bool track_changes = false);
+	~state_snapshot();
+
+	// getters
+	bool valid() const { return m_valid; }
+	UINT32 size() const { return m_size; }
+	const UINT8 *data() const { return m_data; }
+	int changed() const { return m_changed; }
+
+	// capture the current state, or go back to the captured one
+	save_error save();
+	save_error load();
+
+private:
+	// internal state
+	save_manager &			m_manager;				// the state we capture
+	UINT8 *					m_data;					// the arena
+	UINT32					m_size;					// bytes in the arena
+	bool					m_track_changes;		// only copy what changed?
+	bool					m_valid;				// true once something was captured
+	int						m_changed;				// stretches the last save or load copied, if tracking
+};
+
+
 // template specializations to enumerate the fundamental atomic types you are allowed to save
 ALLOW_SAVE_TYPE(bool);
 ALLOW_SAVE_TYPE(INT8);
@@ -38,6 +38,7 @@
 ***************************************************************************/
 
 #include "emu.h"
+#include "emuopts.h"
 #include "profiler.h"
 #include "debugger.h"
 
@@ -64,6 +65,22 @@ enum
     TRIGGER_SUSPENDTIME = -4000
 };
 
+// thread-local storage for the device each thread is running
+#ifdef _MSC_VER
+#define SCHEDULER_THREAD_LOCAL __declspec(thread)
+#else
+#define SCHEDULER_THREAD_LOCAL __thread
+#endif
+
+
+
+//**************************************************************************
+//  GLOBAL VARIABLES
+//**************************************************************************
+
+// the device this thread is running during a parallel timeslice
+static SCHEDULER_THREAD_LOCAL device_execute_interface *s_parallel_executing;
+
 
 
 //**************************************************************************
@@ -77,7 +94,9 @@ enum
 emu_timer::emu_timer()
 	: m_machine(NULL),
 	  m_next(NULL),
-	  m_prev(NULL),
+	  m_heap_index(-1),
+	  m_heap_expire(attotime::never),
+	  m_heap_sequence(0),
 	  m_param(0),
 	  m_ptr(NULL),
 	  m_enabled(false),
@@ -86,7 +105,8 @@ emu_timer::emu_timer()
 	  m_start(attotime::zero),
 	  m_expire(attotime::never),
 	  m_device(NULL),
-	  m_id(0)
+	  m_id(0),
+	  m_stats(NULL)
 {
 }
 
@@ -110,7 +130,6 @@ emu_timer &emu_timer::init(running_machine &machine, timer_expired_delegate call
 	// ensure the entire timer state is clean
 	m_machine = &machine;
 	m_next = NULL;
-	m_prev = NULL;
 	m_callback = callback;
 	m_param = 0;
 	m_ptr = ptr;
@@ -121,12 +140,13 @@ emu_timer &emu_timer::init(running_machine &machine, timer_expired_delegate call
 	m_expire = attotime::never;
 	m_device = NULL;
 	m_id = 0;
+	m_stats = NULL;
 
 	// if we're not temporary, register ourselves with the save state system
 	if (!m_temporary)
 		register_save();
 
-	// insert into the list
+	// insert into the queue
 	machine.scheduler().timer_list_insert(*this);
 	return *this;
 }
@@ -142,7 +162,6 @@ emu_timer &emu_timer::init(device_t &device, device_timer_id id, void *ptr, bool
 	// ensure the entire timer state is clean
 	m_machine = &device.machine();
 	m_next = NULL;
-	m_prev = NULL;
 	m_callback = timer_expired_delegate();
 	m_param = 0;
 	m_ptr = ptr;
@@ -153,12 +172,13 @@ emu_timer &emu_timer::init(device_t &device, device_timer_id id, void *ptr, bool
 	m_expire = attotime::never;
 	m_device = &device;
 	m_id = id;
+	m_stats = NULL;
 
 	// if we're not temporary, register ourselves with the save state system
 	if (!m_temporary)
 		register_save();
 
-	// insert into the list
+	// insert into the queue
 	machine().scheduler().timer_list_insert(*this);
 	return *this;
 }
@@ -171,7 +191,7 @@ emu_timer &emu_timer::init(device_t &device, device_timer_id id, void *ptr, bool
 
 emu_timer &emu_timer::release()
 {
-	// unhook us from the global list
+	// unhook us from the scheduler's queue
 	machine().scheduler().timer_list_remove(*this);
 	return *this;
 }
@@ -183,6 +203,9 @@ emu_timer &emu_timer::release()
 
 bool emu_timer::enable(bool enable)
 {
+	// the queue is shared between devices
+	machine().scheduler().serialize();
+
 	// reschedule only if the state has changed
 	bool old = m_enabled;
 	if (old != enable)
@@ -190,8 +213,7 @@ bool emu_timer::enable(bool enable)
 		// set the enable flag
 		m_enabled = enable;
 
-		// remove the timer and insert back into the list
-		machine().scheduler().timer_list_remove(*this);
+		// move the timer to its new place in the queue
 		machine().scheduler().timer_list_insert(*this);
 	}
 	return old;
@@ -206,8 +228,11 @@ bool emu_timer::enable(bool enable)
 
 void emu_timer::adjust(attotime start_delay, INT32 param, attotime period)
 {
-	// if this is the callback timer, mark it modified
+	// the queue is shared between devices
 	device_scheduler &scheduler = machine().scheduler();
+	scheduler.serialize();
+
+	// if this is the callback timer, mark it modified
 	if (scheduler.m_callback_timer == this)
 		scheduler.m_callback_timer_modified = true;
 
@@ -224,8 +249,7 @@ void emu_timer::adjust(attotime start_delay, INT32 param, attotime period)
 	m_expire = m_start + start_delay;
 	m_period = period;
 
-	// remove and re-insert the timer in its new order
-	scheduler.timer_list_remove(*this);
+	// move the timer to its new place in the queue
 	scheduler.timer_list_insert(*this);
 
 	// if this was inserted as the head, abort the current timeslice and resync
@@ -264,6 +288,7 @@ attotime emu_timer::remaining() const
 void emu_timer::register_save()
 {
 	// determine our instance number and name
+	device_scheduler &scheduler = machine().scheduler();
 	int index = 0;
 	astring name;
 
@@ -271,18 +296,24 @@ void emu_timer::register_save()
 	if (m_device == NULL)
 	{
 		name = m_callback.name();
-		for (emu_timer *curtimer = machine().scheduler().first_timer(); curtimer != NULL; curtimer = curtimer->next())
+		for (int timernum = 0; timernum < scheduler.m_timer_heap.count(); timernum++)
+		{
+			emu_timer *curtimer = scheduler.m_timer_heap.item(timernum);
 			if (!curtimer->m_temporary && curtimer->m_device == NULL && strcmp(curtimer->m_callback.name(), m_callback.name()) == 0)
 				index++;
+		}
 	}
 
 	// for device timers, it is an index based on the device and timer ID
 	else
 	{
 		name.printf("%s/%d", m_device->tag(), m_id);
-		for (emu_timer *curtimer = machine().scheduler().first_timer(); curtimer != NULL; curtimer = curtimer->next())
+		for (int timernum = 0; timernum < scheduler.m_timer_heap.count(); timernum++)
+		{
+			emu_timer *curtimer = scheduler.m_timer_heap.item(timernum);
 			if (!curtimer->m_temporary && curtimer->m_device != NULL && curtimer->m_device == m_device && curtimer->m_id == m_id)
 				index++;
+		}
 	}
 
 	// save the bits
@@ -305,10 +336,8 @@ void emu_timer::schedule_next_period()
 	m_start = m_expire;
 	m_expire += m_period;
 
-	// remove and re-insert us
-	device_scheduler &scheduler = machine().scheduler();
-	scheduler.timer_list_remove(*this);
-	scheduler.timer_list_insert(*this);
+	// move us to our new place in the queue
+	machine().scheduler().timer_list_insert(*this);
 }
 
 
@@ -342,18 +371,31 @@ device_scheduler::device_scheduler(running_machine &machine) :
 	m_execute_list(NULL),
 	m_basetime(attotime::zero),
 	m_cothread(co_active()),
-	m_timer_list(NULL),
 	m_timer_allocator(machine.respool()),
 	m_callback_timer(NULL),
 	m_callback_timer_modified(false),
 	m_callback_timer_expire_time(attotime::zero),
+	m_parallel_queue(NULL),
+	m_parallel_slice(false),
+	m_parallel_target(attotime::zero),
+	m_parallel_reached(attotime::zero),
+	m_parallel_count(0),
+	m_stats_enabled(machine.options().sched_stats() || machine.options().debug()),
+	m_stats_start(attotime::zero),
+	m_stats_timeslices(0),
+	m_stats_boosted(0),
+	m_stats_parallel(0),
+	m_stats_boosts(0),
+	m_stats_quanta_added(0),
+	m_stats_quanta_extended(0),
+	m_stats_smallest_quantum(ATTOSECONDS_PER_SECOND),
+	m_timer_stats(machine.respool()),
 	m_quantum_list(machine.respool()),
 	m_quantum_allocator(machine.respool()),
 	m_quantum_minimum(ATTOSECONDS_IN_NSEC(1) / 1000)
 {
 	// append a single never-expiring timer so there is always one in the list
-	m_timer_list = &m_timer_allocator.alloc()->init(machine, timer_expired_delegate(), NULL, true);
-	m_timer_list->adjust(attotime::never);
+	m_timer_allocator.alloc()->init(machine, timer_expired_delegate(), NULL, true).adjust(attotime::never);
 
 	// register global states
 	machine.save().save_item(NAME(m_basetime));
@@ -368,9 +410,13 @@ device_scheduler::device_scheduler(running_machine &machine) :
 
 device_scheduler::~device_scheduler()
 {
+	// stop the worker threads
+	if (m_parallel_queue != NULL)
+		osd_work_queue_free(m_parallel_queue);
+
 	// remove all timers
-	while (m_timer_list != NULL)
-		m_timer_allocator.reclaim(m_timer_list->release());
+	while (first_timer() != NULL)
+		m_timer_allocator.reclaim(first_timer()->release());
 }
 
 
@@ -386,7 +432,8 @@ attotime device_scheduler::time() const
 
 	// if we're executing as a particular CPU, use its local time as a base
 	// otherwise, return the global base time
-	return (m_executing_device != NULL) ? m_executing_device->local_time() : m_basetime;
+	device_execute_interface *executing = currently_executing();
+	return (executing != NULL) ? executing->local_time() : m_basetime;
 }
 
 
@@ -398,13 +445,16 @@ attotime device_scheduler::time() const
 bool device_scheduler::can_save() const
 {
 	// if any live temporary timers exit, fail
-	for (emu_timer *timer = m_timer_list; timer != NULL; timer = timer->next())
+	for (int timernum = 0; timernum < m_timer_heap.count(); timernum++)
+	{
+		emu_timer *timer = m_timer_heap.item(timernum);
 		if (timer->m_temporary && timer->expire() != attotime::never)
 		{
 			logerror("Failed save state attempt due to anonymous timers:\n");
 			dump_timers();
 			return false;
 		}
+	}
 
 	// otherwise, we're good
 	return true;
@@ -428,14 +478,14 @@ void device_scheduler::timeslice()
 	execute_timers();
 
 	// loop until we hit the next timer
-	while (m_basetime < m_timer_list->m_expire)
+	while (m_basetime < first_timer()->m_expire)
 	{
         // by default, assume our target is the end of the next quantum
 		attotime target = m_basetime + attotime(0, m_quantum_list.first()->m_actual);
 
         // however, if the next timer is going to fire before then, override
-		if (m_timer_list->m_expire < target)
-			target = m_timer_list->m_expire;
+		if (first_timer()->m_expire < target)
+			target = first_timer()->m_expire;
 
         LOG(("------------------\n"));
 		LOG(("cpu_timeslice: target = %s\n", target.as_string()));
@@ -454,66 +504,33 @@ void device_scheduler::timeslice()
         if (suspendchanged != 0)
             rebuild_execute_list();
 
-        // loop over non-suspended CPUs
-        for (device_execute_interface *exec = m_execute_list; exec != NULL; exec = exec->m_nextexec)
+        // count the slice, and how the interleave shaped it
+        if (m_stats_enabled)
         {
-            // only process if our target is later than the CPU's current time (coarse check)
-            if (target.seconds >= exec->m_localtime.seconds)
+            m_stats_timeslices++;
+            if (m_quantum_list.first()->m_expire != attotime::never)
+                m_stats_boosted++;
+            m_stats_smallest_quantum = MIN(m_stats_smallest_quantum, m_quantum_list.first()->m_actual);
+        }
+
+        // independent devices may all run in parallel up to the same target
+        if (can_execute_parallel(call_debugger))
+        {
+            if (m_stats_enabled)
+                m_stats_parallel++;
+            target = execute_parallel(target);
+        }
+
+        // otherwise loop over non-suspended CPUs
+        else
+        {
+            for (device_execute_interface *exec = m_execute_list; exec != NULL; exec = exec->m_nextexec)
             {
-                // compute how many attoseconds to execute this CPU
-                attoseconds_t delta = target.attoseconds - exec->m_localtime.attoseconds;
-                if (delta < 0 && target.seconds > exec->m_localtime.seconds)
-                    delta += ATTOSECONDS_PER_SECOND;
-				assert(delta == (target - exec->m_localtime).as_attoseconds());
-
-                // if we have enough for at least 1 cycle, do the math
-                if (delta >= exec->m_attoseconds_per_cycle)
+                // if the new local CPU time is less than our target, move the target up, but not before the base
+                if (execute_device(*exec, target, call_debugger) && exec->m_localtime < target)
                 {
-                    // compute how many cycles we want to execute
-                    int ran = exec->m_cycles_running = divu_64x32((UINT64)delta >> exec->m_divshift, exec->m_divisor);
-                    LOG(("  cpu '%s': %d cycles\n", exec->device().tag(), exec->m_cycles_running));
-
-                    // if we're not suspended, actually execute
-                    if (exec->m_suspend == 0)
-                    {
-                        g_profiler.start(exec->m_profiler);
-
-                        // note that this global variable cycles_stolen can be modified
-                        // via the call to cpu_execute
-                        exec->m_cycles_stolen = 0;
-                        m_executing_device = exec;
-                        *exec->m_icountptr = exec->m_cycles_running;
-                        if (!call_debugger)
-							exec->run();
-                        else
-                        {
-                            debugger_start_cpu_hook(&exec->device(), target);
-							exec->run();
-                            debugger_stop_cpu_hook(&exec->device());
-                        }
-
-                        // adjust for any cycles we took back
-                        assert(ran >= *exec->m_icountptr);
-                        ran -= *exec->m_icountptr;
-                        assert(ran >= exec->m_cycles_stolen);
-                        ran -= exec->m_cycles_stolen;
-                        g_profiler.stop();
-                    }
-
-                    // account for these cycles
-                    exec->m_totalcycles += ran;
-
-                    // update the local time for this CPU
-					exec->m_localtime += attotime(0, exec->m_attoseconds_per_cycle * ran);
-					LOG(("         %d ran, %d total, time = %s\n", ran, (INT32)exec->m_totalcycles, exec->m_localtime.as_string()));
-
-					// if the new local CPU time is less than our target, move the target up, but not before the base
-					if (exec->m_localtime < target)
-                    {
-						assert(exec->m_localtime < target);
-						target = max(exec->m_localtime, m_basetime);
-                        LOG(("         (new target)\n"));
-                    }
+                    target = max(exec->m_localtime, m_basetime);
+                    LOG(("         (new target)\n"));
                 }
             }
         }
@@ -525,6 +542,286 @@ void device_scheduler::timeslice()
 }
 
 
+//-------------------------------------------------
+//  execute_device - execute one device up to the
+//  target time; return true if it had time for
+//  at least one cycle
+//-------------------------------------------------
+
+bool device_scheduler::execute_device(device_execute_interface &exec, attotime target, bool call_debugger)
+{
+    // only process if our target is later than the CPU's current time (coarse check)
+    if (target.seconds < exec.m_localtime.seconds)
+        return false;
+
+    // compute how many attoseconds to execute this CPU
+    attoseconds_t delta = target.attoseconds - exec.m_localtime.attoseconds;
+    if (delta < 0 && target.seconds > exec.m_localtime.seconds)
+        delta += ATTOSECONDS_PER_SECOND;
+	assert(delta == (target - exec.m_localtime).as_attoseconds());
+
+    // if we don't have enough for at least 1 cycle, we're done
+    if (delta < exec.m_attoseconds_per_cycle)
+        return false;
+
+    // compute how many cycles we want to execute
+    int ran = exec.m_cycles_running = divu_64x32((UINT64)delta >> exec.m_divshift, exec.m_divisor);
+    LOG(("  cpu '%s': %d cycles\n", exec.device().tag(), exec.m_cycles_running));
+
+    // if we're not suspended, actually execute
+    if (exec.m_suspend == 0)
+    {
+        g_profiler.start(exec.m_profiler);
+        int requested = ran;
+        osd_ticks_t start = m_stats_enabled ? osd_ticks() : 0;
+
+        // note that this global variable cycles_stolen can be modified
+        // via the call to cpu_execute
+        exec.m_cycles_stolen = 0;
+        if (!m_parallel_slice)
+            m_executing_device = &exec;
+        *exec.m_icountptr = exec.m_cycles_running;
+        if (!call_debugger)
+			exec.run();
+        else
+        {
+            debugger_start_cpu_hook(&exec.device(), target);
+			exec.run();
+            debugger_stop_cpu_hook(&exec.device());
+        }
+
+        // adjust for any cycles we took back
+        assert(ran >= *exec.m_icountptr);
+        ran -= *exec.m_icountptr;
+        assert(ran >= exec.m_cycles_stolen);
+        ran -= exec.m_cycles_stolen;
+
+        // compare what the device ran with what it was asked to
+        if (m_stats_enabled)
+        {
+            exec.m_stat_ticks += osd_ticks() - start;
+            exec.m_stat_timeslices++;
+            exec.m_stat_cycles_requested += requested;
+            exec.m_stat_cycles_executed += ran;
+        }
+        g_profiler.stop();
+    }
+
+    // a suspended device stalls for the whole slice
+    else if (m_stats_enabled)
+        exec.m_stat_cycles_suspended += ran;
+
+    // account for these cycles
+    exec.m_totalcycles += ran;
+
+    // update the local time for this CPU
+	exec.m_localtime += attotime(0, exec.m_attoseconds_per_cycle * ran);
+	LOG(("         %d ran, %d total, time = %s\n", ran, (INT32)exec.m_totalcycles, exec.m_localtime.as_string()));
+    return true;
+}
+
+
+//-------------------------------------------------
+//  can_execute_parallel - return true if every
+//  device that runs this timeslice is independent,
+//  and gather them into the parallel group
+//-------------------------------------------------
+
+bool device_scheduler::can_execute_parallel(bool call_debugger)
+{
+	// the debugger and the profiler follow one device at a time
+	if (call_debugger || g_profiler.enabled())
+		return false;
+
+	// while the interleave is boosted the devices need to see each other often
+	if (m_quantum_list.first()->m_expire != attotime::never)
+		return false;
+
+	// suspended devices only eat cycles, they can't get in the way
+	m_parallel_count = 0;
+	for (device_execute_interface *exec = m_execute_list; exec != NULL; exec = exec->m_nextexec)
+		if (exec->m_suspend == 0)
+		{
+			if (!exec->m_independent || m_parallel_count == MAX_PARALLEL_DEVICES)
+				return false;
+			m_parallel_group[m_parallel_count++] = exec;
+		}
+	return (m_parallel_count >= 2);
+}
+
+
+//-------------------------------------------------
+//  execute_parallel - run the parallel group and
+//  the suspended devices up to the target, and
+//  return the time they all reached
+//
+//  Anything that touches state shared between
+//  devices waits until the devices before it in
+//  the group are done, so it happens in the same
+//  order on any number of threads. From then on,
+//  a device stops where the earliest of them
+//  stopped, like the serial loop lowers the target.
+//-------------------------------------------------
+
+attotime device_scheduler::execute_parallel(attotime target)
+{
+	// start the worker threads the first time they are needed
+	if (m_parallel_queue == NULL && machine().options().parallel_cpu())
+		m_parallel_queue = osd_work_queue_alloc(WORK_QUEUE_FLAG_MULTI | WORK_QUEUE_FLAG_HIGH_FREQ);
+
+	// suspended devices only eat cycles, so they go first on this thread; if one
+	// stops short, the group runs to where it stopped, but not before the base
+	for (device_execute_interface *exec = m_execute_list; exec != NULL; exec = exec->m_nextexec)
+		if (exec->m_suspend != 0 && execute_device(*exec, target, false) && exec->m_localtime < target)
+			target = max(exec->m_localtime, m_basetime);
+
+	// reset the group
+	m_parallel_target = target;
+	m_parallel_reached = target;
+	for (int index = 0; index < m_parallel_count; index++)
+	{
+		device_execute_interface &exec = *m_parallel_group[index];
+		exec.m_parallel_index = index;
+		exec.m_parallel_turn = (index == 0);
+		exec.m_parallel_ran = false;
+	}
+	m_parallel_slice = true;
+
+	// queue the group in order; the queue hands items out first in, first out
+	// and this thread helps while it waits, so a device only ever waits for one
+	// that already started (or, with no worker threads, already finished)
+	if (m_parallel_queue != NULL)
+	{
+		for (int index = 0; index < m_parallel_count; index++)
+			m_parallel_item[index] = osd_work_item_queue(m_parallel_queue, parallel_worker, &m_parallel_group[index], 0);
+
+		// the timeslice cannot go on while any device is still running
+		while (!osd_work_queue_wait(m_parallel_queue, osd_ticks_per_second()))
+			;
+		for (int index = 0; index < m_parallel_count; index++)
+			osd_work_item_release(m_parallel_item[index]);
+	}
+
+	// without workers, running the devices in order gives the same result
+	else
+		for (int index = 0; index < m_parallel_count; index++)
+			execute_parallel_device(*m_parallel_group[index]);
+	m_parallel_slice = false;
+
+	// the slice ends where the earliest device stopped
+	return m_parallel_reached;
+}
+
+
+//-------------------------------------------------
+//  execute_parallel_device - run one device of the
+//  parallel group on the current thread
+//-------------------------------------------------
+
+void device_scheduler::execute_parallel_device(device_execute_interface &exec)
+{
+	s_parallel_executing = &exec;
+	exec.m_parallel_ran = execute_device(exec, m_parallel_target, false);
+
+	// finish in group order, so that once this item is done every earlier one is too
+	if (!exec.m_parallel_turn)
+		wait_for_earlier_devices(exec);
+	s_parallel_executing = NULL;
+
+	// if we stopped short of where the earlier devices did, the slice ends here, but not before the base
+	if (exec.m_parallel_ran && exec.m_localtime < m_parallel_reached)
+	{
+		m_parallel_reached = max(exec.m_localtime, m_basetime);
+		LOG(("         (new target)\n"));
+	}
+}
+
+
+//-------------------------------------------------
+//  parallel_worker - work queue callback that runs
+//  one device of the parallel group
+//-------------------------------------------------
+
+void *device_scheduler::parallel_worker(void *param, int threadid)
+{
+	device_execute_interface &exec = **reinterpret_cast<device_execute_interface **>(param);
+	exec.device().machine().scheduler().execute_parallel_device(exec);
+	return NULL;
+}
+
+
+//-------------------------------------------------
+//  wait_for_parallel_turn - block the device this
+//  thread runs until every device before it in
+//  the group is done, and end its slice where
+//  the earliest of them stopped
+//-------------------------------------------------
+
+void device_scheduler::wait_for_parallel_turn()
+{
+	// the suspended devices run before the group, and each device waits only once
+	device_execute_interface *exec = s_parallel_executing;
+	if (exec == NULL || exec->m_parallel_turn)
+		return;
+
+	wait_for_earlier_devices(*exec);
+
+	// the serial loop would only have run this device up to where an earlier
+	// one stopped; give back the cycles past that, or all of them if the
+	// device already got there
+	if (m_parallel_reached < m_parallel_target)
+	{
+		attotime now = exec->local_time();
+		int cycles = (now < m_parallel_reached) ? (int)MIN(exec->attotime_to_cycles(m_parallel_reached - now), (UINT64)*exec->m_icountptr) : 0;
+		int delta = *exec->m_icountptr - cycles;
+		if (delta > 0)
+		{
+			exec->m_cycles_stolen += delta;
+			exec->m_cycles_running -= delta;
+			*exec->m_icountptr -= delta;
+		}
+	}
+}
+
+
+//-------------------------------------------------
+//  wait_for_earlier_devices - block until every
+//  device before this one in the group is done
+//-------------------------------------------------
+
+void device_scheduler::wait_for_earlier_devices(device_execute_interface &exec)
+{
+	exec.m_parallel_turn = true;
+
+	// without worker threads the earlier devices already ran on this thread
+	if (m_parallel_queue == NULL)
+		return;
+
+	// devices finish in group order, so the one just before is the only one to wait
+	// for; it is also the only thread waiting on that item
+	osd_work_item *previous = m_parallel_item[exec.m_parallel_index - 1];
+	if (osd_work_item_wait(previous, 0))
+		return;
+	while (!osd_work_item_wait(previous, osd_ticks_per_second()))
+		;
+
+	// only this thread touches the device's statistics
+	if (m_stats_enabled)
+		exec.m_stat_waits++;
+}
+
+
+//-------------------------------------------------
+//  parallel_executing - return the device this
+//  thread runs during a parallel timeslice
+//-------------------------------------------------
+
+device_execute_interface *device_scheduler::parallel_executing()
+{
+	return s_parallel_executing;
+}
+
+
 //-------------------------------------------------
 //  abort_timeslice - abort execution for the
 //  current timeslice
@@ -532,8 +829,9 @@ void device_scheduler::timeslice()
 
 void device_scheduler::abort_timeslice()
 {
-	if (m_executing_device != NULL)
-		m_executing_device->abort_timeslice();
+	device_execute_interface *executing = currently_executing();
+	if (executing != NULL)
+		executing->abort_timeslice();
 }
 
 
@@ -543,6 +841,9 @@ void device_scheduler::abort_timeslice()
 
 void device_scheduler::trigger(int trigid, attotime after)
 {
+	// triggers reach every device
+	serialize();
+
 	// ensure we have a list of executing devices
 	if (m_execute_list == NULL)
 		rebuild_execute_list();
@@ -568,6 +869,9 @@ void device_scheduler::boost_interleave(attotime timeslice_time, attotime boost_
 	// ignore timeslices > 1 second
 	if (timeslice_time.seconds > 0)
 		return;
+	serialize();
+	if (m_stats_enabled)
+		m_stats_boosts++;
 	add_scheduling_quantum(timeslice_time, boost_duration);
 }
 
@@ -579,6 +883,7 @@ void device_scheduler::boost_interleave(attotime timeslice_time, attotime boost_
 
 emu_timer *device_scheduler::timer_alloc(timer_expired_delegate callback, void *ptr)
 {
+	serialize();
 	return &m_timer_allocator.alloc()->init(machine(), callback, ptr, false);
 }
 
@@ -591,6 +896,7 @@ emu_timer *device_scheduler::timer_alloc(timer_expired_delegate callback, void *
 
 void device_scheduler::timer_set(attotime duration, timer_expired_delegate callback, int param, void *ptr)
 {
+	serialize();
 	m_timer_allocator.alloc()->init(machine(), callback, ptr, true).adjust(duration, param);
 }
 
@@ -603,6 +909,7 @@ void device_scheduler::timer_set(attotime duration, timer_expired_delegate callb
 
 void device_scheduler::timer_pulse(attotime period, timer_expired_delegate callback, int param, void *ptr)
 {
+	serialize();
 	m_timer_allocator.alloc()->init(machine(), callback, ptr, false).adjust(period, param, period);
 }
 
@@ -614,6 +921,7 @@ void device_scheduler::timer_pulse(attotime period, timer_expired_delegate callb
 
 emu_timer *device_scheduler::timer_alloc(device_t &device, device_timer_id id, void *ptr)
 {
+	serialize();
 	return &m_timer_allocator.alloc()->init(device, id, ptr, false);
 }
 
@@ -626,6 +934,7 @@ emu_timer *device_scheduler::timer_alloc(device_t &device, device_timer_id id, v
 
 void device_scheduler::timer_set(attotime duration, device_t &device, device_timer_id id, int param, void *ptr)
 {
+	serialize();
 	m_timer_allocator.alloc()->init(device, id, ptr, true).adjust(duration, param);
 }
 
@@ -671,11 +980,11 @@ void device_scheduler::presave()
 
 void device_scheduler::postload()
 {
-	// remove all timers and make a private list of permanent ones
+	// remove all timers in the order they were queued and make a private list of permanent ones
 	simple_list<emu_timer> private_list;
-	while (m_timer_list != NULL)
+	while (first_timer() != NULL)
 	{
-		emu_timer &timer = *m_timer_list;
+		emu_timer &timer = *first_timer();
 
 		// temporary timers go away entirely (except our special never-expiring one)
 		if (timer.m_temporary && timer.expire() != attotime::never)
@@ -686,7 +995,8 @@ void device_scheduler::postload()
 			private_list.append(timer_list_remove(timer));
 	}
 
-	// now re-insert them; this effectively re-sorts them by time
+	// now re-insert them; this re-sorts them by their loaded times, keeping
+	// the previous order between equal ones
 	emu_timer *timer;
 	while ((timer = private_list.detach_head()) != NULL)
 		timer_list_insert(*timer);
@@ -811,8 +1121,9 @@ void device_scheduler::rebuild_execute_list()
 
 
 //-------------------------------------------------
-//  timer_list_insert - insert a new timer into
-//  the list at the appropriate location
+//  timer_list_insert - insert a timer into the
+//  queue at the appropriate location, or move it
+//  there if it is already queued
 //-------------------------------------------------
 
 emu_timer &device_scheduler::timer_list_insert(emu_timer &timer)
@@ -820,55 +1131,20 @@ emu_timer &device_scheduler::timer_list_insert(emu_timer &timer)
 	// disabled timers sort to the end
 	attotime expire = timer.m_enabled ? timer.m_expire : attotime::never;
 
-	// loop over the timer list
-	emu_timer *prevtimer = NULL;
-	for (emu_timer *curtimer = m_timer_list; curtimer != NULL; prevtimer = curtimer, curtimer = curtimer->next())
-	{
-		// if the current list entry expires after us, we should be inserted before it
-		if (curtimer->m_expire > expire)
-		{
-			// link the new guy in before the current list entry
-			timer.m_prev = curtimer->m_prev;
-			timer.m_next = curtimer;
-
-			if (curtimer->m_prev != NULL)
-				curtimer->m_prev->m_next = &timer;
-			else
-				m_timer_list = &timer;
-
-			curtimer->m_prev = &timer;
-			return timer;
-		}
-	}
-
-	// need to insert after the last one
-	if (prevtimer != NULL)
-		prevtimer->m_next = &timer;
-	else
-		m_timer_list = &timer;
-
-	timer.m_prev = prevtimer;
-	timer.m_next = NULL;
+	// equal times stay in the order they were inserted
+	m_timer_heap.insert(timer, expire);
 	return timer;
 }
 
 
 //-------------------------------------------------
 //  timer_list_remove - remove a timer from the
-//  linked list
+//  queue
 //-------------------------------------------------
 
 emu_timer &device_scheduler::timer_list_remove(emu_timer &timer)
 {
-	// remove it from the list
-	if (timer.m_prev != NULL)
-		timer.m_prev->m_next = timer.m_next;
-	else
-		m_timer_list = timer.m_next;
-
-	if (timer.m_next != NULL)
-		timer.m_next->m_prev = timer.m_prev;
-
+	m_timer_heap.remove(timer);
 	return timer;
 }
 
@@ -884,13 +1160,13 @@ void device_scheduler::execute_timers()
 	while (m_basetime >= m_quantum_list.first()->m_expire)
 		m_quantum_allocator.reclaim(m_quantum_list.detach_head());
 
-	LOG(("timer_set_global_time: new=%s head->expire=%s\n", m_basetime.as_string(), m_timer_list->m_expire.as_string()));
+	LOG(("timer_set_global_time: new=%s head->expire=%s\n", m_basetime.as_string(), first_timer()->m_expire.as_string()));
 
 	// now process any timers that are overdue
-	while (m_timer_list->m_expire <= m_basetime)
+	while (first_timer()->m_expire <= m_basetime)
 	{
 		// if this is a one-shot timer, disable it now
-		emu_timer &timer = *m_timer_list;
+		emu_timer &timer = *first_timer();
 		bool was_enabled = timer.m_enabled;
 		if (timer.m_period == attotime::zero || timer.m_period == attotime::never)
 			timer.m_enabled = false;
@@ -904,12 +1180,19 @@ void device_scheduler::execute_timers()
 		if (was_enabled)
 		{
 			g_profiler.start(PROFILER_TIMER_CALLBACK);
+			emu_timer_stats *stats = m_stats_enabled ? &timer_stats(timer) : NULL;
+			osd_ticks_t start = (stats != NULL) ? osd_ticks() : 0;
 
 			if (timer.m_device != NULL)
 				timer.m_device->timer_expired(timer, timer.m_id, timer.m_param, timer.m_ptr);
 			else if (!timer.m_callback.isnull())
 				timer.m_callback(timer.m_ptr, timer.m_param);
 
+			if (stats != NULL)
+			{
+				stats->m_fired++;
+				stats->m_ticks += osd_ticks() - start;
+			}
 			g_profiler.stop();
 		}
 
@@ -931,6 +1214,38 @@ void device_scheduler::execute_timers()
 }
 
 
+//-------------------------------------------------
+//  timer_stats - return the statistics a timer's
+//  callback is counted in, adding them the first
+//  time it fires
+//-------------------------------------------------
+
+emu_timer_stats &device_scheduler::timer_stats(emu_timer &timer)
+{
+	// a timer only looks its callback up once
+	if (timer.m_stats != NULL)
+		return *timer.m_stats;
+
+	// device timers go by device and ID, the rest by callback name
+	const char *name = (timer.m_device != NULL) ? NULL : timer.m_callback.name();
+	emu_timer_stats *stats;
+	for (stats = m_timer_stats.first(); stats != NULL; stats = stats->next())
+		if (stats->m_device == timer.m_device && stats->m_id == timer.m_id &&
+			(stats->m_name == name || (stats->m_name != NULL && name != NULL && strcmp(stats->m_name, name) == 0)))
+			break;
+
+	if (stats == NULL)
+	{
+		stats = &m_timer_stats.append(*auto_alloc_clear(machine(), emu_timer_stats));
+		stats->m_device = timer.m_device;
+		stats->m_id = timer.m_id;
+		stats->m_name = name;
+	}
+	timer.m_stats = stats;
+	return *stats;
+}
+
+
 //-------------------------------------------------
 //  add_scheduling_quantum - add a scheduling
 //  quantum; the smallest active one is the one
@@ -961,7 +1276,10 @@ void device_scheduler::add_scheduling_quantum(attotime quantum, attotime duratio
 
 	// if we found an exact match, just take the maximum expiry time
 	if (insert_after != NULL && insert_after->m_requested == quantum.attoseconds)
+	{
 		insert_after->m_expire = max(insert_after->m_expire, expire);
+		m_stats_quanta_extended++;
+	}
 
 	// otherwise, allocate a new quantum and insert it after the one we picked
 	else
@@ -971,6 +1289,7 @@ void device_scheduler::add_scheduling_quantum(attotime quantum, attotime duratio
 		quant.m_actual = MAX(quantum.attoseconds, m_quantum_minimum);
 		quant.m_expire = expire;
 		m_quantum_list.insert_after(quant, insert_after);
+		m_stats_quanta_added++;
 	}
 }
 
@@ -983,9 +1302,114 @@ void device_scheduler::dump_timers() const
 {
 	logerror("=============================================\n");
 	logerror("Timer Dump: Time = %15s\n", time().as_string());
-	for (emu_timer *timer = first_timer(); timer != NULL; timer = timer->next())
-		timer->dump();
+	for (int timernum = 0; timernum < m_timer_heap.count(); timernum++)
+		m_timer_heap.item(timernum)->dump();
 	logerror("=============================================\n");
 }
 
 
+//-------------------------------------------------
+//  reset_stats - start the statistics over from
+//  the current time
+//-------------------------------------------------
+
+void device_scheduler::reset_stats()
+{
+	m_stats_start = m_basetime;
+	m_stats_timeslices = 0;
+	m_stats_boosted = 0;
+	m_stats_parallel = 0;
+	m_stats_boosts = 0;
+	m_stats_quanta_added = 0;
+	m_stats_quanta_extended = 0;
+	m_stats_smallest_quantum = ATTOSECONDS_PER_SECOND;
+
+	device_execute_interface *exec = NULL;
+	for (bool gotone = machine().devicelist().first(exec); gotone; gotone = exec->next(exec))
+	{
+		exec->m_stat_timeslices = 0;
+		exec->m_stat_cycles_requested = 0;
+		exec->m_stat_cycles_executed = 0;
+		exec->m_stat_cycles_suspended = 0;
+		exec->m_stat_aborts = 0;
+		exec->m_stat_waits = 0;
+		exec->m_stat_ticks = 0;
+	}
+
+	// timers keep pointing at their entries, so those stay
+	for (emu_timer_stats *stats = m_timer_stats.first(); stats != NULL; stats = stats->next())
+	{
+		stats->m_fired = 0;
+		stats->m_ticks = 0;
+	}
+}
+
+
+//-------------------------------------------------
+//  stats_report - describe what the scheduler
+//  did since the statistics started, to tune
+//  the interleave of a driver
+//-------------------------------------------------
+
+const char *device_scheduler::stats_report(astring &string) const
+{
+	attotime elapsed = m_basetime - m_stats_start;
+	double seconds = elapsed.as_double();
+	double ms_per_tick = 1000.0 / (double)osd_ticks_per_second();
+
+	string.printf("Scheduler statistics over %s emulated seconds\n", elapsed.as_string(6));
+	if (!m_stats_enabled)
+		return string.cat("  (not collected; run with -schedstats or -debug)\n");
+
+	string.catprintf("  %" I64FMT "u timeslices (%.0f per second), %" I64FMT "u with a boosted interleave, %" I64FMT "u run in parallel\n",
+			m_stats_timeslices, (seconds > 0) ? (double)m_stats_timeslices / seconds : 0.0, m_stats_boosted, m_stats_parallel);
+	string.catprintf("  %" I64FMT "u boost_interleave calls, %" I64FMT "u quanta added, %" I64FMT "u extended",
+			m_stats_boosts, m_stats_quanta_added, m_stats_quanta_extended);
+	if (m_stats_timeslices > 0)
+		string.catprintf(", shortest quantum %.3f us (%.0f Hz)", (double)m_stats_smallest_quantum / (double)ATTOSECONDS_PER_MICROSECOND, ATTOSECONDS_TO_HZ(m_stats_smallest_quantum));
+	string.cat("\n\n");
+
+	// what each device was asked to run, what it ran, and what it lost to suspension and aborts
+	string.catprintf("%-20s %10s %14s %14s %6s %14s %8s %8s %10s\n",
+			"Device", "Slices", "Asked", "Ran", "Ran%", "Suspended", "Aborts", "Waits", "Host ms");
+	device_execute_interface *exec = NULL;
+	for (bool gotone = machine().devicelist().first(exec); gotone; gotone = exec->next(exec))
+		string.catprintf("%-20s %10" I64FMT "u %14" I64FMT "u %14" I64FMT "u %5.1f%% %14" I64FMT "u %8" I64FMT "u %8" I64FMT "u %10.1f\n",
+				exec->device().tag(), exec->m_stat_timeslices, exec->m_stat_cycles_requested, exec->m_stat_cycles_executed,
+				(exec->m_stat_cycles_requested > 0) ? 100.0 * (double)exec->m_stat_cycles_executed / (double)exec->m_stat_cycles_requested : 0.0,
+				exec->m_stat_cycles_suspended, exec->m_stat_aborts, exec->m_stat_waits, (double)exec->m_stat_ticks * ms_per_tick);
+
+	// timer callbacks, the most expensive first
+	int count = m_timer_stats.count();
+	if (count == 0)
+		return string;
+	const emu_timer_stats **sorted = global_alloc_array(const emu_timer_stats *, count);
+	int sortednum = 0;
+	for (const emu_timer_stats *stats = m_timer_stats.first(); stats != NULL; stats = stats->next())
+	{
+		int index;
+		for (index = sortednum++; index > 0 && sorted[index - 1]->m_ticks < stats->m_ticks; index--)
+			sorted[index] = sorted[index - 1];
+		sorted[index] = stats;
+	}
+
+	string.catprintf("\n%-40s %10s %10s %10s\n", "Timer", "Fired", "Host ms", "us/call");
+	for (int index = 0; index < count; index++)
+	{
+		const emu_timer_stats &stats = *sorted[index];
+		if (stats.m_fired == 0)
+			continue;
+
+		astring name;
+		if (stats.m_device != NULL)
+			name.printf("%s timer %d", stats.m_device->tag(), stats.m_id);
+		else
+			name.cpy((stats.m_name != NULL) ? stats.m_name : "(no callback)");
+		string.catprintf("%-40s %10" I64FMT "u %10.1f %10.2f\n", name.cstr(), stats.m_fired, (double)stats.m_ticks * ms_per_tick,
+				(double)stats.m_ticks * ms_per_tick * 1000.0 / (double)stats.m_fired);
+	}
+	global_free(sorted);
+	return string;
+}
+
+
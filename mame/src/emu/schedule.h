@@ -64,6 +64,9 @@
 
 #define TIMER_CALLBACK(name)			void name(running_machine &machine, void *ptr, int param)
 
+// most independent devices that run in parallel in one timeslice
+#define MAX_PARALLEL_DEVICES			(16)
+
 
 
 //**************************************************************************
@@ -77,6 +80,25 @@ typedef delegate<void (void *, INT32)> timer_expired_delegate;
 typedef void (*timer_expired_func)(running_machine &machine, void *ptr, INT32 param);
 
 
+// ======================> emu_timer_stats
+
+// statistics for the timers that share a callback (or a device and id)
+class emu_timer_stats
+{
+	friend class simple_list<emu_timer_stats>;
+
+public:
+	emu_timer_stats *next() const { return m_next; }
+
+	emu_timer_stats *		m_next;
+	device_t *				m_device;		// for device timers, the device
+	device_timer_id			m_id;			// for device timers, the ID of the timer
+	const char *			m_name;			// for the rest, the name of the callback
+	UINT64					m_fired;		// number of callbacks made
+	osd_ticks_t				m_ticks;		// host time spent in them
+};
+
+
 // ======================> emu_timer
 
 class emu_timer
@@ -85,6 +107,7 @@ class emu_timer
 	friend class simple_list<emu_timer>;
 	friend class fixed_allocator<emu_timer>;
 	friend class resource_pool_object<emu_timer>;
+	friend class timer_heap<emu_timer>;
 
 	// construction/destruction
 	emu_timer();
@@ -126,8 +149,10 @@ private:
 
 	// internal state
 	running_machine *	m_machine;		// reference to the owning machine
-	emu_timer *			m_next;			// next timer in order in the list
-	emu_timer *			m_prev;			// previous timer in order in the list
+	emu_timer *			m_next;			// next timer in the allocator's free list
+	int					m_heap_index;	// position in the scheduler's queue, -1 if not queued
+	attotime			m_heap_expire;	// time the timer is queued for
+	UINT64				m_heap_sequence;	// order it was queued in, among equal times
 	timer_expired_delegate m_callback;	// callback function
 	INT32				m_param;		// integer parameter
 	void *				m_ptr;			// pointer parameter
@@ -138,6 +163,7 @@ private:
 	attotime			m_expire;		// time when the timer will expire
 	device_t *			m_device;		// for device timers, a pointer to the device
 	device_timer_id		m_id;			// for device timers, the ID of the timer
+	emu_timer_stats *	m_stats;		// statistics for this timer's callback, once it fired
 };
 
 
@@ -156,10 +182,14 @@ public:
 	// getters
 	running_machine &machine() const { return m_machine; }
 	attotime time() const;
-	emu_timer *first_timer() const { return m_timer_list; }
-	device_execute_interface *currently_executing() const { return m_executing_device; }
+	emu_timer *first_timer() const { return m_timer_heap.first(); }
+	device_execute_interface *currently_executing() const { return m_parallel_slice ? parallel_executing() : m_executing_device; }
 	bool can_save() const;
 
+	// parallel execution; anything that touches state shared between devices
+	// calls this first, and waits for the devices before it to finish their slice
+	void serialize() { if (m_parallel_slice) wait_for_parallel_turn(); }
+
 	// execution
 	void timeslice();
 	void abort_timeslice();
@@ -186,6 +216,11 @@ public:
 	// debugging
 	void dump_timers() const;
 
+	// statistics
+	bool stats_enabled() const { return m_stats_enabled; }
+	void reset_stats();
+	const char *stats_report(astring &string) const;
+
 	// for emergencies only!
 	void eat_all_cycles();
 
@@ -199,11 +234,22 @@ private:
 	void compute_perfect_interleave();
 	void rebuild_execute_list();
 	void add_scheduling_quantum(attotime quantum, attotime duration);
+	bool execute_device(device_execute_interface &exec, attotime target, bool call_debugger);
+
+	// parallel execution helpers
+	bool can_execute_parallel(bool call_debugger);
+	attotime execute_parallel(attotime target);
+	void execute_parallel_device(device_execute_interface &exec);
+	void wait_for_parallel_turn();
+	void wait_for_earlier_devices(device_execute_interface &exec);
+	static void *parallel_worker(void *param, int threadid);
+	static device_execute_interface *parallel_executing();
 
 	// timer helpers
 	emu_timer &timer_list_insert(emu_timer &timer);
 	emu_timer &timer_list_remove(emu_timer &timer);
 	void execute_timers();
+	emu_timer_stats &timer_stats(emu_timer &timer);
 
 	// internal state
 	running_machine &			m_machine;					// reference to our machine
@@ -212,8 +258,8 @@ private:
 	attotime					m_basetime;					// global basetime; everything moves forward from here
 	cothread					m_cothread;					// core scheduler thread
 
-	// list of active timers
-	emu_timer *					m_timer_list;				// head of the active list
+	// queue of all timers, the next one to expire first
+	timer_heap<emu_timer>		m_timer_heap;				// ordered queue of timers
 	fixed_allocator<emu_timer>	m_timer_allocator;			// allocator for timers
 
 	// other internal states
@@ -221,6 +267,27 @@ private:
 	bool						m_callback_timer_modified;	// true if the current callback timer was modified
 	attotime					m_callback_timer_expire_time; // the original expiration time
 
+	// parallel execution of independent devices
+	osd_work_queue *			m_parallel_queue;			// worker threads, NULL to run the group on this thread
+	bool						m_parallel_slice;			// true while the group is running
+	attotime					m_parallel_target;			// time every device in the group runs to
+	attotime					m_parallel_reached;			// earliest time a finished device of the group stopped at
+	int							m_parallel_count;			// number of devices in the group
+	device_execute_interface *	m_parallel_group[MAX_PARALLEL_DEVICES]; // the group, in execute list order
+	osd_work_item *				m_parallel_item[MAX_PARALLEL_DEVICES]; // work item running each device of the group
+
+	// statistics, kept when -schedstats or the debugger is on
+	bool						m_stats_enabled;			// true if we collect statistics
+	attotime					m_stats_start;				// time the statistics started
+	UINT64						m_stats_timeslices;			// timeslices run
+	UINT64						m_stats_boosted;			// timeslices run with a boosted interleave
+	UINT64						m_stats_parallel;			// timeslices whose devices ran in parallel
+	UINT64						m_stats_boosts;				// boost_interleave calls
+	UINT64						m_stats_quanta_added;		// scheduling quanta added
+	UINT64						m_stats_quanta_extended;	// requests that extended an existing quantum
+	attoseconds_t				m_stats_smallest_quantum;	// shortest quantum any timeslice used
+	simple_list<emu_timer_stats> m_timer_stats;				// statistics per timer callback
+
 	// scheduling quanta
 	class quantum_slot
 	{
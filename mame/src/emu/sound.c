@@ -37,6 +37,8 @@
 
 ***************************************************************************/
 
+#include "NSM_Rollback.h"
+
 #include "emu.h"
 #include "emuopts.h"
 #include "osdepend.h"
@@ -1036,7 +1038,8 @@ void sound_manager::update()
 	// play the result
 	if (finalmix_offset > 0)
 	{
-		if (!m_nosound_mode)
+		// frames that are run again after a rollback were already heard
+		if (!m_nosound_mode && !netplayRollback.isResimulating())
 			machine().osd().update_audio_stream(finalmix, finalmix_offset / 2);
 		machine().video().add_sound_to_recording(finalmix, finalmix_offset / 2);
 		if (m_wavfile != NULL)
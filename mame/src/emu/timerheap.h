@@ -0,0 +1,171 @@
+/***************************************************************************
+
+    timerheap.h
+
+    Priority queue of timers ordered by expiration time.
+
+****************************************************************************
+
+    Timers are kept in a binary min-heap keyed on an attotime, so
+    inserting, re-adjusting and removing one is O(log n) in the number
+    of live timers instead of a walk of a sorted list.
+
+    Timers with the same expiration time come out in the order they
+    were queued, exactly like inserting each one after every entry of a
+    sorted list that doesn't expire later than it. Each queued item
+    carries a sequence number for this.
+
+    The item type provides three members the heap owns:
+
+        int         m_heap_index;       // -1 when not queued
+        attotime    m_heap_expire;      // time it is queued for
+        UINT64      m_heap_sequence;    // breaks ties between equal times
+
+    This file only depends on attotime.h, so tools can use it.
+
+***************************************************************************/
+
+#pragma once
+
+#ifndef __TIMERHEAP_H__
+#define __TIMERHEAP_H__
+
+
+//**************************************************************************
+//  TYPE DEFINITIONS
+//**************************************************************************
+
+// ======================> timer_heap
+
+template<class _ItemType>
+class timer_heap
+{
+public:
+	// construction/destruction
+	timer_heap()
+		: m_heap(NULL),
+		  m_count(0),
+		  m_allocated(0),
+		  m_sequence(0) { }
+
+	~timer_heap() { if (m_heap != NULL) free(m_heap); }
+
+	// getters
+	int count() const { return m_count; }
+	_ItemType *first() const { return (m_count > 0) ? m_heap[0] : NULL; }
+	_ItemType *item(int index) const { return m_heap[index]; }
+	bool contains(const _ItemType &item) const { return item.m_heap_index >= 0; }
+
+	// queue an item for the given time, or move it if it is already queued
+	void insert(_ItemType &item, attotime expire)
+	{
+		item.m_heap_expire = expire;
+		item.m_heap_sequence = m_sequence++;
+
+		// an item that moves gets the newest sequence, so it can only go
+		// down among equal times; the sift that applies does the work
+		if (item.m_heap_index >= 0)
+		{
+			sift_up(item.m_heap_index);
+			sift_down(item.m_heap_index);
+			return;
+		}
+
+		if (m_count == m_allocated)
+			expand();
+		m_heap[m_count] = &item;
+		item.m_heap_index = m_count++;
+		sift_up(item.m_heap_index);
+	}
+
+	// dequeue an item, if it is queued
+	void remove(_ItemType &item)
+	{
+		int index = item.m_heap_index;
+		if (index < 0)
+			return;
+		item.m_heap_index = -1;
+
+		// move the last item into the hole and restore the order around it
+		if (--m_count == index)
+			return;
+		_ItemType *moved = m_heap[m_count];
+		m_heap[index] = moved;
+		sift_up(index);
+		sift_down(moved->m_heap_index);
+	}
+
+private:
+	// true if a fires before b
+	static bool earlier(const _ItemType &a, const _ItemType &b)
+	{
+		if (a.m_heap_expire != b.m_heap_expire)
+			return a.m_heap_expire < b.m_heap_expire;
+		return a.m_heap_sequence < b.m_heap_sequence;
+	}
+
+	// move the item at index towards the root until its parent is earlier
+	void sift_up(int index)
+	{
+		_ItemType *item = m_heap[index];
+		while (index > 0)
+		{
+			int parent = (index - 1) / 2;
+			if (!earlier(*item, *m_heap[parent]))
+				break;
+			m_heap[index] = m_heap[parent];
+			m_heap[index]->m_heap_index = index;
+			index = parent;
+		}
+		m_heap[index] = item;
+		item->m_heap_index = index;
+	}
+
+	// move the item at index towards the leaves until its children are later
+	void sift_down(int index)
+	{
+		_ItemType *item = m_heap[index];
+		while (true)
+		{
+			int child = index * 2 + 1;
+			if (child >= m_count)
+				break;
+			if (child + 1 < m_count && earlier(*m_heap[child + 1], *m_heap[child]))
+				child++;
+			if (!earlier(*m_heap[child], *item))
+				break;
+			m_heap[index] = m_heap[child];
+			m_heap[index]->m_heap_index = index;
+			index = child;
+		}
+		m_heap[index] = item;
+		item->m_heap_index = index;
+	}
+
+	// double the storage; timers are allocated for the life of the
+	// machine, so it never shrinks
+	void expand()
+	{
+		int allocated = (m_allocated == 0) ? 64 : m_allocated * 2;
+		_ItemType **heap = (_ItemType **)malloc(allocated * sizeof(*heap));
+		if (m_count > 0)
+			memcpy(heap, m_heap, m_count * sizeof(*heap));
+		if (m_heap != NULL)
+			free(m_heap);
+		m_heap = heap;
+		m_allocated = allocated;
+	}
+
+	// we don't support deep copying
+	timer_heap(const timer_heap &);
+	timer_heap &operator=(const timer_heap &);
+
+	// internal state
+	_ItemType **		m_heap;			// items, each one earlier than its two children
+	int					m_count;		// number of queued items
+	int					m_allocated;	// number of items m_heap has room for
+	UINT64				m_sequence;		// sequence number for the next item queued
+};
+
+
+#endif	// __TIMERHEAP_H__
@@ -381,6 +381,9 @@ extern Server *netServer;
 
 list< ChatLog > chatLogs;
 vector<char> chatString;
+
+//Chat is sent in the input stream, so it has to fit in an input frame
+#define CHAT_MAX_LENGTH (256)
 int chatEnabled=false;
 int statsVisible=true;
 
@@ -454,7 +457,7 @@ void ui_update_and_render(running_machine &machine, render_container *container)
 	  ui_draw_text_box(container,"This could take several minutes depending on your connection and rom chosen...",JUSTIFY_CENTER,0.5f,0.6f,MAKE_ARGB(255,0,0,128));
 	  ui_draw_text_box(container,"Once the initial sync is complete, you may just hear game audio for a few minutes, please be patient",JUSTIFY_CENTER,0.5f,0.7f,MAKE_ARGB(255,0,0,128));
 	  char buf[4096];
-	  sprintf(buf,"%0.2f%% Complete (Could be over 100 for large roms)...",float(initialSyncPercentComplete)/10.0f);
+	  sprintf(buf,"%0.2f%% Complete...",float(initialSyncPercentComplete)/10.0f);
 	  ui_draw_text_box(container,buf,JUSTIFY_CENTER,0.5f,0.8f,MAKE_ARGB(255,0,0,128));
 	}
 
@@ -1739,7 +1742,7 @@ static UINT32 handler_ingame(running_machine &machine, render_container *contain
 					{
 						chatString.pop_back();
 					}
-					else
+					else if(chatString.size()<CHAT_MAX_LENGTH)
 					{
 						chatString.push_back(event.ch);
 					}
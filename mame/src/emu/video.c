@@ -39,6 +39,7 @@
 
 #include "NSM_Server.h"
 #include "NSM_Client.h"
+#include "NSM_Rollback.h"
 
 extern Client *netClient;
 extern Server *netServer;
@@ -255,6 +256,20 @@ void video_manager::frame_update(bool debug)
 		skipped_it = false;
 	}
 
+	// frames that are run again after a rollback are never shown
+	if (netplayRollback.isResimulating())
+	{
+		machine().call_notifiers(MACHINE_NOTIFY_FRAME);
+		if (phase == MACHINE_PHASE_RUNNING && machine().primary_screen != NULL)
+		{
+			g_profiler.start(PROFILER_VIDEO);
+			for (screen_device *screen = machine().first_screen(); screen != NULL; screen = screen->next_screen())
+				screen->screen_eof();
+			g_profiler.stop();
+		}
+		return;
+	}
+
 	// draw the user interface
 	ui_update_and_render(machine(), &machine().render().ui_container());
 
@@ -264,8 +279,10 @@ void video_manager::frame_update(bool debug)
 	// if we're throttling, synchronize before rendering
 	attotime current_time = machine().time();
 
-	//Don't throttle if you are a network client
-	if (!netClient && !debug && !skipped_it && effective_throttle())
+	// network peers throttle too (nudged to stay level with each other), unless
+	// they fell so far behind that they need to run flat out to catch up
+	Common *netCommon = netServer ? (Common *)netServer : (Common *)netClient;
+	if ((netCommon == NULL || netCommon->shouldThrottle()) && !debug && !skipped_it && effective_throttle())
 		update_throttle(current_time);
 
 	// ask the OSD to update
@@ -775,6 +792,15 @@ void video_manager::update_throttle(attotime emutime)
 		osd_ticks_t ticks_per_second = osd_ticks_per_second();
 		attoseconds_t attoseconds_per_tick = ATTOSECONDS_PER_SECOND / ticks_per_second;
 
+		// network peers run a percent or two fast or slow to stay level with each other;
+		// real time is counted faster or slower instead of rescaling emutime, so changing
+		// the nudge doesn't make the emulated time jump
+		if (netServer || netClient)
+		{
+			Common *netCommon = netServer ? (Common *)netServer : (Common *)netClient;
+			attoseconds_per_tick = attoseconds_per_tick * netCommon->getSpeedPercent() / 100;
+		}
+
 		// if we're paused, emutime will not advance; instead, we subtract a fixed
 	    // amount of time (1/60th of a second) from the emulated time that was passed in,
 	    // and explicitly reset our tracked real and emulated timers to that value ...
@@ -19,6 +19,7 @@ OBJDIRS += \
 	$(LIBOBJ)/formats \
 	$(LIBOBJ)/zlib \
 	$(LIBOBJ)/p7zip \
+	$(LIBOBJ)/lz4 \
 	$(LIBOBJ)/miniupnpc-1.4.20100609 \
 	$(LIBOBJ)/RakNet \
 	$(LIBOBJ)/softfloat \
@@ -311,6 +312,19 @@ $(LIBOBJ)/p7zip/%.o: $(LIBSRC)/p7zip/%.c | $(OSPREBUILD)
 	@echo Compiling $<...
 	$(CC) $(CDEFS) $(CCOMFLAGS) $(CONLYFLAGS) -c $< -o $@
 
+#-------------------------------------------------
+# lz4 library objects
+#-------------------------------------------------
+
+LZ4OBJS = \
+	$(LIBOBJ)/lz4/lz4.o
+
+$(OBJ)/liblz4.a: $(LZ4OBJS)
+
+$(LIBOBJ)/lz4/%.o: $(LIBSRC)/lz4/%.c | $(OSPREBUILD)
+	@echo Compiling $<...
+	$(CC) $(CDEFS) $(CCOMFLAGS) $(CONLYFLAGS) -c $< -o $@
+
 #-------------------------------------------------
 # SoftFloat library objects
 #-------------------------------------------------
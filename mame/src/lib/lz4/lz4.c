@@ -0,0 +1,278 @@
+/* lz4.c -- a small, self-contained LZ4 block codec
+ *
+ * A block is a list of sequences.  Each one starts with a token byte whose
+ * high nibble is the literal length and low nibble the match length minus
+ * four (15 means more length bytes follow, each adding up to 255), then the
+ * literals, then a little-endian 16 bit offset back into the output.  The
+ * last sequence only has literals, and the format requires the last 5
+ * bytes to be literals and the last match to start 12 bytes before the end.
+ */
+
+#include <string.h>
+
+#include "lz4.h"
+
+#define MINMATCH		4
+#define LASTLITERALS	5
+#define MFLIMIT			12
+#define MAX_DISTANCE	65535
+#define HASH_LOG		12
+#define SKIP_TRIGGER	6
+
+typedef unsigned char lz4_byte;
+typedef unsigned int lz4_u32;
+
+static lz4_u32 read32(const lz4_byte *p)
+{
+	lz4_u32 value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static int equal64(const lz4_byte *a, const lz4_byte *b)
+{
+	return memcmp(a, b, 8) == 0;
+}
+
+static lz4_u32 hash_sequence(lz4_u32 sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static lz4_byte *write_length(lz4_byte *op, int length)
+{
+	for ( ; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = (lz4_byte)length;
+	return op;
+}
+
+int lz4_compress_bound(int srcSize)
+{
+	return LZ4_COMPRESS_BOUND(srcSize);
+}
+
+int lz4_compress(void *state, const void *src, int srcSize, void *dst, int dstCapacity, int acceleration)
+{
+	lz4_u32 *table = (lz4_u32 *)state;
+	const lz4_byte *base = (const lz4_byte *)src;
+	const lz4_byte *ip = base;
+	const lz4_byte *anchor = base;
+	const lz4_byte *iend = base + srcSize;
+	const lz4_byte *mflimit = iend - MFLIMIT;
+	const lz4_byte *matchlimit = iend - LASTLITERALS;
+	lz4_byte *op = (lz4_byte *)dst;
+	lz4_byte *token;
+	const lz4_byte *match;
+	int lastRun;
+
+	if (srcSize < 0 || dstCapacity < lz4_compress_bound(srcSize))
+		return 0;
+	if (acceleration < 1)
+		acceleration = 1;
+
+	/* every entry points at position 0 until it is written, which the
+	   match check below rejects like any other stale entry */
+	memset(table, 0, LZ4_STATE_SIZE);
+
+	if (srcSize < MFLIMIT + 1)
+		goto last_literals;
+
+	table[hash_sequence(read32(ip))] = 0;
+	ip++;
+
+	for (;;)
+	{
+		/* find a match, stepping faster the longer nothing is found */
+		{
+			const lz4_byte *forwardIp = ip;
+			unsigned int searchCount = (unsigned int)acceleration << SKIP_TRIGGER;
+			do
+			{
+				lz4_u32 h = hash_sequence(read32(forwardIp));
+				ip = forwardIp;
+				forwardIp += searchCount++ >> SKIP_TRIGGER;
+				if (forwardIp > mflimit)
+					goto last_literals;
+				match = base + table[h];
+				table[h] = (lz4_u32)(ip - base);
+			} while (ip - match > MAX_DISTANCE || match == ip || read32(match) != read32(ip));
+		}
+
+		/* extend backwards over literals that also match */
+		while (ip > anchor && match > base && ip[-1] == match[-1])
+		{
+			ip--;
+			match--;
+		}
+
+		/* literals */
+		{
+			int litLength = (int)(ip - anchor);
+			token = op++;
+			if (litLength >= 15)
+			{
+				*token = 15 << 4;
+				op = write_length(op, litLength - 15);
+			}
+			else
+				*token = (lz4_byte)(litLength << 4);
+			memcpy(op, anchor, litLength);
+			op += litLength;
+		}
+
+		for (;;)
+		{
+			/* offset */
+			{
+				int offset = (int)(ip - match);
+				op[0] = (lz4_byte)offset;
+				op[1] = (lz4_byte)(offset >> 8);
+				op += 2;
+			}
+
+			/* match length, compared eight bytes at a time first */
+			{
+				const lz4_byte *start;
+				int matchLength;
+				ip += MINMATCH;
+				match += MINMATCH;
+				start = ip;
+				while (ip + 8 <= matchlimit && equal64(ip, match))
+				{
+					ip += 8;
+					match += 8;
+				}
+				while (ip < matchlimit && *ip == *match)
+				{
+					ip++;
+					match++;
+				}
+				matchLength = (int)(ip - start);
+				if (matchLength >= 15)
+				{
+					*token += 15;
+					op = write_length(op, matchLength - 15);
+				}
+				else
+					*token += (lz4_byte)matchLength;
+			}
+
+			anchor = ip;
+			if (ip > mflimit)
+				goto last_literals;
+
+			table[hash_sequence(read32(ip - 2))] = (lz4_u32)(ip - 2 - base);
+
+			/* if the next position matches too, chain it without literals */
+			{
+				lz4_u32 h = hash_sequence(read32(ip));
+				match = base + table[h];
+				table[h] = (lz4_u32)(ip - base);
+				if (ip - match > MAX_DISTANCE || match == ip || read32(match) != read32(ip))
+					break;
+			}
+			token = op++;
+			*token = 0;
+		}
+
+		ip++;
+	}
+
+last_literals:
+	lastRun = (int)(iend - anchor);
+	if (lastRun >= 15)
+	{
+		*op++ = 15 << 4;
+		op = write_length(op, lastRun - 15);
+	}
+	else
+		*op++ = (lz4_byte)(lastRun << 4);
+	memcpy(op, anchor, lastRun);
+	op += lastRun;
+
+	return (int)(op - (lz4_byte *)dst);
+}
+
+int lz4_decompress(const void *src, int srcSize, void *dst, int dstCapacity)
+{
+	const lz4_byte *ip = (const lz4_byte *)src;
+	const lz4_byte *iend = ip + srcSize;
+	lz4_byte *ostart = (lz4_byte *)dst;
+	lz4_byte *op = ostart;
+	lz4_byte *oend = ostart + dstCapacity;
+
+	for (;;)
+	{
+		unsigned int token;
+		size_t length;
+		size_t offset;
+		const lz4_byte *match;
+		lz4_byte *mend;
+
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+
+		/* literals */
+		length = token >> 4;
+		if (length == 15)
+		{
+			unsigned int s;
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				s = *ip++;
+				length += s;
+			} while (s == 255);
+		}
+		if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - ostart))
+			return -1;
+
+		length = token & 15;
+		if (length == 15)
+		{
+			unsigned int s;
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				s = *ip++;
+				length += s;
+			} while (s == 255);
+		}
+		length += MINMATCH;
+		if (length > (size_t)(oend - op))
+			return -1;
+
+		/* overlapping matches repeat the last offset bytes, copy them in
+		   chunks that double each time so long runs stay fast */
+		match = op - offset;
+		mend = op + length;
+		while (op < mend)
+		{
+			size_t chunk = (size_t)(op - match);
+			if (chunk > (size_t)(mend - op))
+				chunk = (size_t)(mend - op);
+			memcpy(op, match, chunk);
+			op += chunk;
+		}
+	}
+
+	return (int)(op - ostart);
+}
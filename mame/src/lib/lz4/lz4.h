@@ -0,0 +1,38 @@
+/* lz4.h -- a small, self-contained LZ4 block codec
+ *
+ * Reads and writes the LZ4 block format (no frame header), so blocks are
+ * interchangeable with the reference implementation.  The compressor is a
+ * single-pass greedy matcher over a 4096 entry hash table; the decoder
+ * checks every length and offset against the buffers it was given.
+ */
+
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bytes of scratch the compressor needs, callers keep it between calls */
+#define LZ4_STATE_SIZE		(4096 * 4)
+
+/* Largest block lz4_compress can produce from srcSize bytes */
+#define LZ4_COMPRESS_BOUND(srcSize)	((srcSize) + (srcSize) / 255 + 16)
+
+int lz4_compress_bound(int srcSize);
+
+/* Compresses src into dst and returns the compressed size, or 0 if
+ * dstCapacity is smaller than lz4_compress_bound(srcSize).  acceleration 1
+ * finds the most matches, larger values skip ahead faster through data
+ * that does not compress. */
+int lz4_compress(void *state, const void *src, int srcSize, void *dst, int dstCapacity, int acceleration);
+
+/* Decompresses a whole block, returns the decompressed size or -1 if the
+ * block is malformed or does not fit in dstCapacity. */
+int lz4_decompress(const void *src, int srcSize, void *dst, int dstCapacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LZ4_H__ */
@@ -0,0 +1,300 @@
+/***************************************************************************
+
+    nsmbench.c
+
+    Micro-benchmarks for the netplay (NSM) sync kernels.
+
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "osdcore.h"
+#include "NSM_Delta.h"
+#include "NSM_SyncPipeline.h"
+
+#define BENCH_BYTES_PER_RUN		(256 * 1024 * 1024)
+#define BENCH_TOTAL_STATE		(64 * 1024 * 1024)
+#define BENCH_CODEC_BYTES		(256 * 1024 * 1024)
+
+
+
+/***************************************************************************
+    XOR DELTA BENCHMARK
+***************************************************************************/
+
+/*-------------------------------------------------
+    dirty_lines - modify every Nth line of the
+    live buffer so the stale copy is out of date
+-------------------------------------------------*/
+
+static void dirty_lines(unsigned char *live, int size, int every, UINT32 &seed)
+{
+	if (every == 0)
+		return;
+	for (int offs = 0; offs < size; offs += XOR_DELTA_LINE_SIZE * every)
+	{
+		seed = seed * 1103515245 + 12345;
+		live[offs + (seed >> 16) % XOR_DELTA_LINE_SIZE] ^= (seed >> 8) | 1;
+	}
+}
+
+
+/*-------------------------------------------------
+    bench_xor_delta - measure one kernel at one
+    block size and dirty ratio, return GB/s
+-------------------------------------------------*/
+
+static double bench_xor_delta(XorDeltaKernelType kernel, int blocksize, int every)
+{
+	int numblocks = BENCH_TOTAL_STATE / blocksize;
+	unsigned char *live = (unsigned char *)malloc(BENCH_TOTAL_STATE);
+	unsigned char *stale = (unsigned char *)malloc(BENCH_TOTAL_STATE);
+	unsigned char *delta = (unsigned char *)malloc(blocksize + XOR_DELTA_LINE_SIZE);
+	UINT32 seed = 1;
+
+	for (int offs = 0; offs < BENCH_TOTAL_STATE; offs++)
+		live[offs] = stale[offs] = (unsigned char)(offs * 7);
+
+	// one warm-up pass, then enough passes to touch BENCH_BYTES_PER_RUN bytes
+	int passes = BENCH_BYTES_PER_RUN / BENCH_TOTAL_STATE;
+	osd_ticks_t elapsed = 0;
+	unsigned char checksum = 0;
+	for (int pass = -1; pass < passes; pass++)
+	{
+		dirty_lines(live, BENCH_TOTAL_STATE, every, seed);
+		osd_ticks_t start = osd_ticks();
+		for (int block = 0; block < numblocks; block++)
+			xorDeltaAndUpdateWithKernel(kernel, live + block * blocksize, stale + block * blocksize, delta, blocksize, &checksum);
+		if (pass >= 0)
+			elapsed += osd_ticks() - start;
+	}
+
+	free(delta);
+	free(stale);
+	free(live);
+
+	double seconds = (double)elapsed / (double)osd_ticks_per_second();
+	return ((double)passes * BENCH_TOTAL_STATE / (1024.0 * 1024.0 * 1024.0)) / seconds;
+}
+
+
+/*-------------------------------------------------
+    bench_block_hash - measure hashBlock64 at one
+    block size, return GB/s
+-------------------------------------------------*/
+
+static double bench_block_hash(int blocksize)
+{
+	int numblocks = BENCH_TOTAL_STATE / blocksize;
+	unsigned char *state = (unsigned char *)malloc(BENCH_TOTAL_STATE);
+
+	for (int offs = 0; offs < BENCH_TOTAL_STATE; offs++)
+		state[offs] = (unsigned char)(offs * 7);
+
+	int passes = BENCH_BYTES_PER_RUN / BENCH_TOTAL_STATE;
+	osd_ticks_t elapsed = 0;
+	unsigned long long hash = 0;
+	for (int pass = -1; pass < passes; pass++)
+	{
+		osd_ticks_t start = osd_ticks();
+		for (int block = 0; block < numblocks; block++)
+			hash += hashBlock64(state + block * blocksize, blocksize);
+		if (pass >= 0)
+			elapsed += osd_ticks() - start;
+	}
+
+	free(state);
+
+	// keep the hashes alive so the loop is not optimized away
+	if (hash == 0)
+		printf("(zero hash)\n");
+
+	double seconds = (double)elapsed / (double)osd_ticks_per_second();
+	return ((double)passes * BENCH_TOTAL_STATE / (1024.0 * 1024.0 * 1024.0)) / seconds;
+}
+
+
+/*-------------------------------------------------
+    run_xor_delta_bench - print a table of GB/s
+    per kernel, block size and dirty ratio
+-------------------------------------------------*/
+
+static void run_xor_delta_bench(void)
+{
+	static const int blocksizes[] = { 256, 4096, 65536, 1024 * 1024 };
+	static const struct { int every; const char *name; } ratios[] =
+	{
+		{ 0, "clean" },
+		{ 64, "1/64 lines" },
+		{ 1, "all lines" }
+	};
+
+	printf("XOR delta (GB/s of live state scanned, best kernel: %s)\n", xorDeltaKernelName(xorDeltaBestKernel()));
+	printf("%-8s %-12s", "kernel", "dirty");
+	for (int size = 0; size < ARRAY_LENGTH(blocksizes); size++)
+		printf(" %9dB", blocksizes[size]);
+	printf("\n");
+
+	for (int kernel = XOR_DELTA_KERNEL_SCALAR; kernel < XOR_DELTA_KERNEL_END; kernel++)
+	{
+		if (!xorDeltaKernelSupported((XorDeltaKernelType)kernel))
+			continue;
+		for (int ratio = 0; ratio < ARRAY_LENGTH(ratios); ratio++)
+		{
+			printf("%-8s %-12s", xorDeltaKernelName((XorDeltaKernelType)kernel), ratios[ratio].name);
+			for (int size = 0; size < ARRAY_LENGTH(blocksizes); size++)
+				printf(" %10.2f", bench_xor_delta((XorDeltaKernelType)kernel, blocksizes[size], ratios[ratio].every));
+			printf("\n");
+		}
+	}
+
+	// what a sync costs per block that changed, on the server and the clients
+	printf("%-8s %-12s", "xxh64", "hash");
+	for (int size = 0; size < ARRAY_LENGTH(blocksizes); size++)
+		printf(" %10.2f", bench_block_hash(blocksizes[size]));
+	printf("\n");
+}
+
+
+
+/***************************************************************************
+    SYNC CODEC BENCHMARK
+***************************************************************************/
+
+static const SyncCodecSetting bench_codecs[] =
+{
+	{ SYNC_CODEC_LZ4, 8 },
+	{ SYNC_CODEC_LZ4, 4 },
+	{ SYNC_CODEC_LZ4, 1 },
+	{ SYNC_CODEC_ZLIB, 1 },
+	{ SYNC_CODEC_ZLIB, 6 },
+	{ SYNC_CODEC_ZLIB, 9 }
+};
+
+
+/*-------------------------------------------------
+    load_delta - read a sync captured with
+    -syncdump, or build a synthetic one
+-------------------------------------------------*/
+
+static bool load_delta(const char *filename, std::vector<unsigned char> &delta)
+{
+	if (filename == NULL)
+	{
+		// sparse changes over 8MB, roughly what a sync of a busy driver looks like
+		UINT32 seed = 1;
+		delta.assign(8 * 1024 * 1024, 0);
+		dirty_lines(&delta[0], (int)delta.size(), 16, seed);
+		return true;
+	}
+
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	delta.resize(size);
+	bool success = (size > 0 && fread(&delta[0], 1, size, file) == (size_t)size);
+	fclose(file);
+	return success;
+}
+
+
+/*-------------------------------------------------
+    bench_codec - measure one codec and level on
+    one delta, print ratio and MB/s both ways
+-------------------------------------------------*/
+
+static void bench_codec(SyncPipeline &pipeline, const SyncCodecSetting &setting, const std::vector<unsigned char> &delta)
+{
+	int size = (int)delta.size();
+	int passes = MAX(1, BENCH_CODEC_BYTES / size / ((setting.codec == SYNC_CODEC_ZLIB) ? 8 : 1));
+	osd_ticks_t compressticks = 0, decompressticks = 0;
+	int compressedsize = 0;
+	bool valid = true;
+
+	for (int pass = -1; pass < passes; pass++)
+	{
+		osd_ticks_t start = osd_ticks();
+		compressedsize = pipeline.compress(setting.codec, setting.level, &delta[0], size);
+		osd_ticks_t middle = osd_ticks();
+		std::vector<unsigned char> compressed(pipeline.getCompressed(), pipeline.getCompressed() + compressedsize);
+		osd_ticks_t copied = osd_ticks();
+		valid = valid && pipeline.uncompress(setting.codec, &compressed[0], compressedsize, size);
+		osd_ticks_t end = osd_ticks();
+		if (pass >= 0)
+		{
+			compressticks += middle - start;
+			decompressticks += end - copied;
+		}
+	}
+	valid = valid && memcmp(pipeline.getUncompressed(), &delta[0], size) == 0;
+
+	double megabytes = (double)passes * size / (1024.0 * 1024.0);
+	double tps = (double)osd_ticks_per_second();
+	printf("%-6s %3d %9d %7.2f%% %10.1f %10.1f %8.2f%s\n",
+			syncCodecName(setting.codec), setting.level, compressedsize,
+			100.0 * compressedsize / size,
+			megabytes / (compressticks / tps), megabytes / (decompressticks / tps),
+			1000.0 * compressticks / tps / passes,
+			valid ? "" : "  MISMATCH");
+}
+
+
+/*-------------------------------------------------
+    run_codec_bench - compare the sync codecs on
+    each captured delta
+-------------------------------------------------*/
+
+static int run_codec_bench(int numfiles, char **filenames)
+{
+	SyncPipeline pipeline;
+
+	for (int file = 0; file < MAX(numfiles, 1); file++)
+	{
+		const char *filename = (numfiles > 0) ? filenames[file] : NULL;
+		std::vector<unsigned char> delta;
+		if (!load_delta(filename, delta))
+		{
+			fprintf(stderr, "Unable to read %s\n", filename);
+			return 1;
+		}
+
+		printf("Sync codecs on %s (%d bytes)\n", (filename != NULL) ? filename : "synthetic delta", (int)delta.size());
+		printf("%-6s %3s %9s %8s %10s %10s %8s\n", "codec", "lvl", "bytes", "ratio", "comp MB/s", "decomp MB/s", "ms/sync");
+		for (int codec = 0; codec < ARRAY_LENGTH(bench_codecs); codec++)
+			bench_codec(pipeline, bench_codecs[codec], delta);
+		printf("\n");
+	}
+	return 0;
+}
+
+
+
+/***************************************************************************
+    MAIN
+***************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	const char *which = (argc > 1) ? argv[1] : "all";
+
+	if (strcmp(which, "all") == 0)
+	{
+		run_xor_delta_bench();
+		return run_codec_bench(0, NULL);
+	}
+	else if (strcmp(which, "xordelta") == 0)
+		run_xor_delta_bench();
+	else if (strcmp(which, "codecs") == 0)
+		return run_codec_bench(argc - 2, argv + 2);
+	else
+	{
+		fprintf(stderr, "Usage: %s [all|xordelta|codecs [<game>_syncNNNN.bin...]]\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
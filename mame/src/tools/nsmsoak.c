@@ -0,0 +1,439 @@
+/***************************************************************************
+
+    nsmsoak.c
+
+    Soak test for netplay (NSM): runs a server and clients of the
+    emulator on loopback with scripted inputs and an impaired network,
+    then reports how each session went.
+
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "osdcore.h"
+
+#ifdef _WIN32
+#define popen	_popen
+#define pclose	_pclose
+#endif
+
+#define SOAK_MAX_CLIENTS		(15)
+#define SOAK_SUMMARY_TAG		"NETPLAY SUMMARY: "
+#define SOAK_STARTED_TAG		"NETWORK THREAD STARTED"
+#define SOAK_START_TIMEOUT		(60)
+#define SOAK_LOG_TAIL_LINES		(10)
+
+
+
+/***************************************************************************
+    TYPE DEFINITIONS
+***************************************************************************/
+
+struct soak_options
+{
+	const char *	mame;
+	const char *	logdir;
+	const char *	extra;
+	int				clients;
+	int				seconds;
+	int				port;
+	int				stagger;
+	int				latency;
+	int				jitter;
+	float			loss;
+	bool			rollback;
+};
+
+struct soak_summary
+{
+	bool			started;
+	bool			valid;
+	double			frames;
+	double			fps;
+	double			stalls;
+	double			stallseconds;
+	double			syncbytes;
+	double			resyncs;
+	double			desyncs;
+	double			hashes;
+	double			droppedinputs;
+};
+
+
+
+/***************************************************************************
+    RUNNING THE PEERS
+***************************************************************************/
+
+/*-------------------------------------------------
+    peer_log_name - the file a peer's output
+    goes to, peer 0 is the server
+-------------------------------------------------*/
+
+static std::string peer_log_name(const soak_options &opts, const char *driver, int peer)
+{
+	char name[256];
+	sprintf(name, "%s_peer%d.log", driver, peer);
+	return std::string(opts.logdir) + PATH_SEPARATOR + name;
+}
+
+
+/*-------------------------------------------------
+    peer_command - the command line that runs
+    one peer, with its output in its log
+-------------------------------------------------*/
+
+static std::string peer_command(const soak_options &opts, const char *driver, int peer)
+{
+	char args[1024];
+	std::string command = std::string("\"") + opts.mame + "\" " + driver;
+
+	if (peer == 0)
+		sprintf(args, " -server -port %d", opts.port);
+	else
+		sprintf(args, " -client -hostname 127.0.0.1 -port %d -selfport %d", opts.port, opts.port + peer);
+	command += args;
+
+	// every peer plays with its own seed, the same one every run
+	sprintf(args, " -username soak%d -netbot %d -seconds_to_run %d -netsimlatency %d -netsimjitter %d -netsimloss %f",
+			peer, peer + 1, opts.seconds, opts.latency, opts.jitter, opts.loss);
+	command += args;
+	command += " -video none -nosound -skip_gameinfo -snapshot_directory \"" + std::string(opts.logdir) + "\"";
+	if (opts.rollback)
+		command += " -rollback";
+	if (opts.extra != NULL)
+		command += std::string(" ") + opts.extra;
+
+	command += " > \"" + peer_log_name(opts, driver, peer) + "\" 2>&1";
+	return command;
+}
+
+
+/*-------------------------------------------------
+    log_contains - true if a line of a peer's log
+    contains tag
+-------------------------------------------------*/
+
+static bool log_contains(const std::string &logname, const char *tag)
+{
+	FILE *file = fopen(logname.c_str(), "r");
+	if (file == NULL)
+		return false;
+
+	char line[4096];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), file) != NULL)
+		found = (strstr(line, tag) != NULL);
+	fclose(file);
+	return found;
+}
+
+
+/*-------------------------------------------------
+    print_log_tail - copy the last lines of a
+    peer's log to stderr
+-------------------------------------------------*/
+
+static void print_log_tail(const std::string &logname)
+{
+	FILE *file = fopen(logname.c_str(), "r");
+	if (file == NULL)
+	{
+		fprintf(stderr, "  (no log at %s)\n", logname.c_str());
+		return;
+	}
+
+	std::vector<std::string> lines;
+	char line[4096];
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		lines.push_back(line);
+		if (lines.size() > SOAK_LOG_TAIL_LINES)
+			lines.erase(lines.begin());
+	}
+	fclose(file);
+
+	for (int index = 0; index < (int)lines.size(); index++)
+		fprintf(stderr, "  | %s", lines[index].c_str());
+}
+
+
+/*-------------------------------------------------
+    wait_for_start - wait until a peer says its
+    session started, false if it doesn't in time
+-------------------------------------------------*/
+
+static bool wait_for_start(const soak_options &opts, const char *driver, int peer)
+{
+	std::string logname = peer_log_name(opts, driver, peer);
+	for (int second = 0; second < SOAK_START_TIMEOUT; second++)
+	{
+		if (log_contains(logname, SOAK_STARTED_TAG))
+			return true;
+		osd_sleep(osd_ticks_per_second());
+	}
+
+	fprintf(stderr, "%s: peer %d did not start its session within %d s, not starting the rest; its log ends with:\n",
+			driver, peer, SOAK_START_TIMEOUT);
+	print_log_tail(logname);
+	return false;
+}
+
+
+/*-------------------------------------------------
+    run_session - run the server and clients of
+    one driver and wait for all of them, false
+    if a peer never got its session going
+-------------------------------------------------*/
+
+static bool run_session(const soak_options &opts, const char *driver)
+{
+	std::vector<FILE *> peers;
+	bool started = true;
+
+	for (int peer = 0; peer <= opts.clients; peer++)
+	{
+		// the server has to be listening, and each client has to finish its
+		// initial sync before the next one joins
+		if (peer > 0)
+		{
+			osd_sleep(osd_ticks_per_second() * opts.stagger);
+			if (!wait_for_start(opts, driver, peer - 1))
+			{
+				started = false;
+				break;
+			}
+		}
+
+		std::string command = peer_command(opts, driver, peer);
+		FILE *pipe = popen(command.c_str(), "r");
+		if (pipe == NULL)
+		{
+			fprintf(stderr, "%s: unable to run %s\n", driver, command.c_str());
+			started = false;
+			break;
+		}
+		peers.push_back(pipe);
+	}
+
+	// the output goes to the logs, so this only waits for the peers to exit
+	for (int peer = 0; peer < (int)peers.size(); peer++)
+	{
+		int status = pclose(peers[peer]);
+		if (status != 0)
+			fprintf(stderr, "%s: peer %d exited with status %d\n", driver, peer, status);
+	}
+	return started;
+}
+
+
+
+/***************************************************************************
+    READING THE RESULTS
+***************************************************************************/
+
+/*-------------------------------------------------
+    summary_value - the number after key= in a
+    summary line, 0 if it isn't there
+-------------------------------------------------*/
+
+static double summary_value(const char *line, const char *key)
+{
+	std::string pattern = std::string(" ") + key + "=";
+	const char *found = strstr(line, pattern.c_str());
+	if (found == NULL)
+		return 0;
+	return atof(found + pattern.length());
+}
+
+
+/*-------------------------------------------------
+    read_summary - find the last summary line in
+    a peer's log
+-------------------------------------------------*/
+
+static soak_summary read_summary(const std::string &logname)
+{
+	soak_summary summary;
+	memset(&summary, 0, sizeof(summary));
+
+	FILE *file = fopen(logname.c_str(), "r");
+	if (file == NULL)
+		return summary;
+
+	char line[4096];
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (strstr(line, SOAK_STARTED_TAG) != NULL)
+			summary.started = true;
+
+		const char *found = strstr(line, SOAK_SUMMARY_TAG);
+		if (found == NULL)
+			continue;
+
+		// keep the leading space so every key can be matched the same way
+		const char *values = found + strlen(SOAK_SUMMARY_TAG) - 1;
+		summary.valid = true;
+		summary.frames = summary_value(values, "frames");
+		summary.fps = summary_value(values, "fps");
+		summary.stalls = summary_value(values, "stalls");
+		summary.stallseconds = summary_value(values, "stallseconds");
+		summary.syncbytes = summary_value(values, "syncbytes");
+		summary.resyncs = summary_value(values, "resyncs");
+		summary.desyncs = summary_value(values, "desyncs");
+		summary.hashes = summary_value(values, "hashes");
+		summary.droppedinputs = summary_value(values, "droppedinputs");
+	}
+	fclose(file);
+	return summary;
+}
+
+
+/*-------------------------------------------------
+    report_session - print a table of one
+    driver's peers, return true if the session
+    ran and stayed in sync
+-------------------------------------------------*/
+
+static bool report_session(const soak_options &opts, const char *driver)
+{
+	bool passed = true;
+	bool desynced = false;
+
+	printf("%s: server + %d client(s), %d s, %d ms latency, %d ms jitter, %.1f%% loss%s\n",
+			driver, opts.clients, opts.seconds, opts.latency, opts.jitter, opts.loss,
+			opts.rollback ? ", rollback" : "");
+	printf("%-8s %8s %7s %7s %8s %9s %7s %7s %7s %7s\n",
+			"peer", "frames", "fps", "stalls", "stall s", "sync KB", "resyncs", "desyncs", "hashes", "dropped");
+
+	for (int peer = 0; peer <= opts.clients; peer++)
+	{
+		char name[32];
+		if (peer == 0)
+			strcpy(name, "server");
+		else
+			sprintf(name, "client%d", peer);
+
+		std::string logname = peer_log_name(opts, driver, peer);
+		soak_summary summary = read_summary(logname);
+		if (!summary.valid)
+		{
+			printf("%-8s %s, see %s\n", name, summary.started ? "no summary" : "exited before the session started", logname.c_str());
+			if (!summary.started)
+			{
+				fprintf(stderr, "%s: %s exited before its session started; its log ends with:\n", driver, name);
+				print_log_tail(logname);
+			}
+			passed = false;
+			continue;
+		}
+
+		printf("%-8s %8.0f %7.2f %7.0f %8.2f %9.1f %7.0f %7.0f %7.0f %7.0f\n",
+				name, summary.frames, summary.fps, summary.stalls, summary.stallseconds,
+				summary.syncbytes / 1024.0, summary.resyncs, summary.desyncs, summary.hashes,
+				summary.droppedinputs);
+		if (summary.desyncs > 0 || summary.resyncs > 0)
+			desynced = true;
+	}
+
+	printf("%s: %s\n\n", driver, !passed ? "FAILED" : desynced ? "DESYNCED" : "OK");
+	return passed && !desynced;
+}
+
+
+
+/***************************************************************************
+    MAIN
+***************************************************************************/
+
+/*-------------------------------------------------
+    usage - print the options
+-------------------------------------------------*/
+
+static int usage(const char *argv0)
+{
+	fprintf(stderr,
+			"Usage: %s [options] <driver> [<driver>...]\n"
+			"  -mame <path>       emulator to run (default mame)\n"
+			"  -clients <n>       clients that join the server (default 1)\n"
+			"  -seconds <n>       emulated seconds to run each session (default 60)\n"
+			"  -latency <ms>      added to every packet a peer receives (default 0)\n"
+			"  -jitter <ms>       up to this much more (default 0)\n"
+			"  -loss <percent>    input packets each peer drops (default 0)\n"
+			"  -rollback          play with rollback instead of input delay\n"
+			"  -port <n>          server port, clients use the ones after it (default 5805)\n"
+			"  -stagger <s>       real seconds between starting peers (default 3)\n"
+			"  -logs <dir>        where the peers' logs go (default .)\n"
+			"  -args \"<options>\"  more options for every peer\n",
+			argv0);
+	return 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	soak_options opts;
+	opts.mame = "mame";
+	opts.logdir = ".";
+	opts.extra = NULL;
+	opts.clients = 1;
+	opts.seconds = 60;
+	opts.port = 5805;
+	opts.stagger = 3;
+	opts.latency = 0;
+	opts.jitter = 0;
+	opts.loss = 0;
+	opts.rollback = false;
+
+	std::vector<const char *> drivers;
+	for (int arg = 1; arg < argc; arg++)
+	{
+		const char *value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+		if (strcmp(argv[arg], "-rollback") == 0)
+			opts.rollback = true;
+		else if (argv[arg][0] != '-')
+			drivers.push_back(argv[arg]);
+		else if (value == NULL)
+			return usage(argv[0]);
+		else
+		{
+			if (strcmp(argv[arg], "-mame") == 0)
+				opts.mame = value;
+			else if (strcmp(argv[arg], "-clients") == 0)
+				opts.clients = atoi(value);
+			else if (strcmp(argv[arg], "-seconds") == 0)
+				opts.seconds = atoi(value);
+			else if (strcmp(argv[arg], "-latency") == 0)
+				opts.latency = atoi(value);
+			else if (strcmp(argv[arg], "-jitter") == 0)
+				opts.jitter = atoi(value);
+			else if (strcmp(argv[arg], "-loss") == 0)
+				opts.loss = (float)atof(value);
+			else if (strcmp(argv[arg], "-port") == 0)
+				opts.port = atoi(value);
+			else if (strcmp(argv[arg], "-stagger") == 0)
+				opts.stagger = atoi(value);
+			else if (strcmp(argv[arg], "-logs") == 0)
+				opts.logdir = value;
+			else if (strcmp(argv[arg], "-args") == 0)
+				opts.extra = value;
+			else
+				return usage(argv[0]);
+			arg++;
+		}
+	}
+	if (drivers.empty() || opts.clients < 1 || opts.clients > SOAK_MAX_CLIENTS || opts.seconds < 1)
+		return usage(argv[0]);
+
+	int failures = 0;
+	for (int driver = 0; driver < (int)drivers.size(); driver++)
+	{
+		bool started = run_session(opts, drivers[driver]);
+		if (!report_session(opts, drivers[driver]) || !started)
+			failures++;
+	}
+	return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,311 @@
+/***************************************************************************
+
+    schedbench.c
+
+    Micro-benchmarks for the core scheduler.
+
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "osdcore.h"
+#include "eminline.h"
+#include "attotime.h"
+#include "timerheap.h"
+
+// timer events each run processes
+#define BENCH_TIMER_EVENTS		(500000)
+
+// out of every 16 events, how many adjust a random timer, start a
+// one-shot or disable a timer; the rest are timers firing
+#define BENCH_ADJUST_WEIGHT		(8)
+#define BENCH_ONESHOT_WEIGHT	(2)
+#define BENCH_DISABLE_WEIGHT	(1)
+
+
+
+/***************************************************************************
+    TYPE DEFINITIONS
+***************************************************************************/
+
+// a timer that both queues can hold, so they run the same workload
+struct bench_timer
+{
+	bench_timer()
+		: m_id(0),
+		  m_enabled(false),
+		  m_temporary(false),
+		  m_next(NULL),
+		  m_prev(NULL),
+		  m_heap_index(-1),
+		  m_heap_sequence(0) { }
+
+	int					m_id;
+	bool				m_enabled;
+	bool				m_temporary;
+	attotime			m_expire;
+	attotime			m_period;
+
+	// sorted list links
+	bench_timer *		m_next;
+	bench_timer *		m_prev;
+
+	// owned by timer_heap
+	int					m_heap_index;
+	attotime			m_heap_expire;
+	UINT64				m_heap_sequence;
+};
+
+
+// the scheduler's timer list before it became a heap, for comparison
+class bench_sorted_list
+{
+public:
+	bench_sorted_list() : m_head(NULL) { }
+
+	bench_timer *first() const { return m_head; }
+
+	void insert(bench_timer &timer, attotime expire)
+	{
+		bench_timer *prevtimer = NULL;
+		for (bench_timer *curtimer = m_head; curtimer != NULL; prevtimer = curtimer, curtimer = curtimer->m_next)
+			if (curtimer->m_expire > expire)
+			{
+				timer.m_prev = curtimer->m_prev;
+				timer.m_next = curtimer;
+				if (curtimer->m_prev != NULL)
+					curtimer->m_prev->m_next = &timer;
+				else
+					m_head = &timer;
+				curtimer->m_prev = &timer;
+				return;
+			}
+
+		if (prevtimer != NULL)
+			prevtimer->m_next = &timer;
+		else
+			m_head = &timer;
+		timer.m_prev = prevtimer;
+		timer.m_next = NULL;
+	}
+
+	void remove(bench_timer &timer)
+	{
+		if (timer.m_prev != NULL)
+			timer.m_prev->m_next = timer.m_next;
+		else
+			m_head = timer.m_next;
+		if (timer.m_next != NULL)
+			timer.m_next->m_prev = timer.m_prev;
+	}
+
+private:
+	bench_timer *		m_head;
+};
+
+
+// the heap, with the list's interface
+class bench_heap
+{
+public:
+	bench_timer *first() const { return m_heap.first(); }
+	void insert(bench_timer &timer, attotime expire) { m_heap.insert(timer, expire); }
+	void remove(bench_timer &timer) { m_heap.remove(timer); }
+
+private:
+	timer_heap<bench_timer> m_heap;
+};
+
+
+// what a run did, to check both queues fired the same timers in the same order
+struct bench_result
+{
+	double				seconds;
+	UINT32				fired;
+	UINT32				checksum;
+};
+
+
+
+/***************************************************************************
+    TIMER WORKLOAD
+***************************************************************************/
+
+/*-------------------------------------------------
+    bench_random - the workload's random numbers,
+    the same for every queue
+-------------------------------------------------*/
+
+static UINT32 bench_random(UINT32 &seed)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+
+/*-------------------------------------------------
+    requeue - move a timer to where its state
+    puts it, like the scheduler does
+-------------------------------------------------*/
+
+template<class _QueueType>
+static void requeue(_QueueType &queue, bench_timer &timer)
+{
+	queue.remove(timer);
+	queue.insert(timer, timer.m_enabled ? timer.m_expire : attotime::never);
+}
+
+
+/*-------------------------------------------------
+    run_timers - drive numtimers periodic timers
+    through a queue the way the scheduler drives
+    its timers: fire the earliest, re-adjust
+    random ones (scanline and sound timers), and
+    add one-shots (synchronize)
+-------------------------------------------------*/
+
+template<class _QueueType>
+static bench_result run_timers(int numtimers)
+{
+	// one-shots come and go, so leave room for as many of them as there are timers
+	int numslots = numtimers * 2;
+	bench_timer *timers = new bench_timer[numslots + 1];
+	_QueueType queue;
+	UINT32 seed = 1;
+	bench_result result = bench_result();
+
+	// a timer that never fires keeps the queue from running dry
+	bench_timer &never = timers[numslots];
+	never.m_id = numslots;
+	never.m_enabled = true;
+	never.m_expire = attotime::never;
+	queue.insert(never, attotime::never);
+
+	// periods between 15 kHz (scanlines) and 60 Hz (frames)
+	for (int timernum = 0; timernum < numslots; timernum++)
+	{
+		bench_timer &timer = timers[timernum];
+		timer.m_id = timernum;
+		timer.m_temporary = (timernum >= numtimers);
+		timer.m_expire = attotime::never;
+		if (timer.m_temporary)
+			continue;
+		timer.m_enabled = true;
+		timer.m_period = attotime(0, HZ_TO_ATTOSECONDS(60 + bench_random(seed) % 15000));
+		timer.m_expire = timer.m_period;
+		queue.insert(timer, timer.m_expire);
+	}
+
+	attotime now = attotime::zero;
+	int nextoneshot = numtimers;
+	osd_ticks_t start = osd_ticks();
+	for (int event = 0; event < BENCH_TIMER_EVENTS; event++)
+	{
+		UINT32 choice = bench_random(seed) % 16;
+
+		// re-adjust a random timer somewhere into its next period
+		if (choice < BENCH_ADJUST_WEIGHT)
+		{
+			bench_timer &timer = timers[bench_random(seed) % numtimers];
+			timer.m_enabled = true;
+			timer.m_expire = now + attotime(0, timer.m_period.attoseconds / 16 * (bench_random(seed) % 16 + 1));
+			requeue(queue, timer);
+		}
+
+		// start a one-shot in a recycled slot
+		else if (choice < BENCH_ADJUST_WEIGHT + BENCH_ONESHOT_WEIGHT)
+		{
+			bench_timer &timer = timers[nextoneshot];
+			nextoneshot = (nextoneshot + 1 < numslots) ? nextoneshot + 1 : numtimers;
+			if (timer.m_expire != attotime::never)
+				queue.remove(timer);
+			timer.m_enabled = true;
+			timer.m_expire = now + attotime(0, ATTOSECONDS_IN_USEC(bench_random(seed) % 64));
+			queue.insert(timer, timer.m_expire);
+		}
+
+		// disable a random timer
+		else if (choice < BENCH_ADJUST_WEIGHT + BENCH_ONESHOT_WEIGHT + BENCH_DISABLE_WEIGHT)
+		{
+			bench_timer &timer = timers[bench_random(seed) % numtimers];
+			timer.m_enabled = false;
+			requeue(queue, timer);
+		}
+
+		// fire the earliest timer
+		else
+		{
+			bench_timer &timer = *queue.first();
+			if (timer.m_expire == attotime::never)
+				continue;
+			now = timer.m_expire;
+			result.fired++;
+			result.checksum = result.checksum * 31 + timer.m_id;
+
+			// one-shots go away, periodic timers move to their next period
+			if (timer.m_temporary)
+			{
+				timer.m_enabled = false;
+				timer.m_expire = attotime::never;
+				queue.remove(timer);
+			}
+			else
+			{
+				timer.m_expire += timer.m_period;
+				requeue(queue, timer);
+			}
+		}
+	}
+	result.seconds = (double)(osd_ticks() - start) / (double)osd_ticks_per_second();
+
+	delete[] timers;
+	return result;
+}
+
+
+/*-------------------------------------------------
+    run_timer_bench - compare the heap with the
+    sorted list at increasing numbers of timers
+-------------------------------------------------*/
+
+static int run_timer_bench(void)
+{
+	static const int counts[] = { 16, 64, 256, 1024, 4096 };
+	int mismatches = 0;
+
+	printf("Timer queue: %d events, %d/16 adjusts, %d/16 one-shots, %d/16 disables\n",
+			BENCH_TIMER_EVENTS, BENCH_ADJUST_WEIGHT, BENCH_ONESHOT_WEIGHT, BENCH_DISABLE_WEIGHT);
+	printf("%8s %14s %14s %9s %s\n", "timers", "list Mevents/s", "heap Mevents/s", "speedup", "order");
+	for (int countnum = 0; countnum < ARRAY_LENGTH(counts); countnum++)
+	{
+		bench_result list = run_timers<bench_sorted_list>(counts[countnum]);
+		bench_result heap = run_timers<bench_heap>(counts[countnum]);
+		bool same = (list.fired == heap.fired && list.checksum == heap.checksum);
+		if (!same)
+			mismatches++;
+
+		printf("%8d %14.2f %14.2f %8.1fx %s\n", counts[countnum],
+				BENCH_TIMER_EVENTS / list.seconds / 1e6, BENCH_TIMER_EVENTS / heap.seconds / 1e6,
+				list.seconds / heap.seconds, same ? "same" : "DIFFERENT");
+	}
+	printf("\n");
+	return (mismatches > 0) ? 1 : 0;
+}
+
+
+
+/***************************************************************************
+    MAIN
+***************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	const char *which = (argc > 1) ? argv[1] : "all";
+
+	if (strcmp(which, "all") == 0 || strcmp(which, "timers") == 0)
+		return run_timer_bench();
+
+	fprintf(stderr, "Usage: %s [all|timers]\n", argv[0]);
+	return 1;
+}
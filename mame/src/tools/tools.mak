@@ -61,6 +61,9 @@ TOOLS += \
 	srcclean$(EXE) \
 	src2html$(EXE) \
 	split$(EXE) \
+	nsmbench$(EXE) \
+	nsmsoak$(EXE) \
+	schedbench$(EXE) \
 
 
 
@@ -192,3 +195,46 @@ SPLITOBJS = \
 split$(EXE): $(SPLITOBJS) $(LIBUTIL) $(LIBOCORE) $(ZLIB) $(EXPAT)
 	@echo Linking $@...
 	$(LD) $(LDFLAGS) $^ $(LIBS) -o $@
+
+
+
+#-------------------------------------------------
+# nsmbench
+#-------------------------------------------------
+
+NSMBENCHOBJS = \
+	$(TOOLSOBJ)/nsmbench.o \
+	$(EMUOBJ)/NSM_Delta.o \
+	$(EMUOBJ)/NSM_Metrics.o \
+	$(EMUOBJ)/NSM_SyncPipeline.o \
+
+nsmbench$(EXE): $(NSMBENCHOBJS) $(LIBUTIL) $(LIBOCORE) $(ZLIB) $(P7ZIP) $(LZ4) $(EXPAT)
+	@echo Linking $@...
+	$(LD) $(LDFLAGS) $^ $(LIBS) -o $@
+
+
+
+#-------------------------------------------------
+# nsmsoak
+#-------------------------------------------------
+
+NSMSOAKOBJS = \
+	$(TOOLSOBJ)/nsmsoak.o \
+
+nsmsoak$(EXE): $(NSMSOAKOBJS) $(LIBUTIL) $(LIBOCORE) $(ZLIB) $(EXPAT)
+	@echo Linking $@...
+	$(LD) $(LDFLAGS) $^ $(LIBS) -o $@
+
+
+
+#-------------------------------------------------
+# schedbench
+#-------------------------------------------------
+
+SCHEDBENCHOBJS = \
+	$(TOOLSOBJ)/schedbench.o \
+	$(EMUOBJ)/attotime.o \
+
+schedbench$(EXE): $(SCHEDBENCHOBJS) $(LIBUTIL) $(LIBOCORE) $(ZLIB) $(EXPAT)
+	@echo Linking $@...
+	$(LD) $(LDFLAGS) $^ $(LIBS) -o $@